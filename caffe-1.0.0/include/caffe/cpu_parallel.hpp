@@ -0,0 +1,458 @@
+#ifndef CAFFE_CPU_PARALLEL_HPP_
+#define CAFFE_CPU_PARALLEL_HPP_
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/solver.hpp"
+#include "caffe/solver_factory.hpp"
+#include "caffe/util/format.hpp"
+
+namespace caffe {
+
+// Parameter and gradient buffers of all CPU solver replicas, laid out in a
+// single allocation. In multi-process mode the allocation is a POSIX shared
+// memory segment so every process sees every replica's gradients, which is
+// what the allreduce below reads from. Each replica owns one data and one
+// diff slot of size() elements; the net's learnable blobs are pointed into
+// them by Configure. Replicas synchronize through a spinning barrier in the
+// same allocation, which gives up with an error when another replica has
+// failed instead of blocking forever.
+template<typename Dtype>
+class CPUParams {
+ public:
+  /**
+   * Creates the buffers if create is true, otherwise attaches to the segment
+   * created by another process. An empty shm_name selects private memory,
+   * which is only usable by threads of this process.
+   */
+  CPUParams(size_t size, int count, const string& shm_name, bool create)
+    : size_(size), stride_(Align(size)), count_(count), shm_name_(shm_name),
+      owner_(create), linked_(!shm_name.empty()), base_(NULL), header_(NULL),
+      buffers_(NULL) {
+    CHECK_GT(count_, 0);
+    bytes_ = Align(sizeof(Header)) +
+        2 * count_ * stride_ * sizeof(Dtype);  // NOLINT(runtime/sizeof)
+    if (shm_name_.empty()) {
+      CHECK(create) << "Private CPUParams cannot be attached to";
+      base_ = mmap(NULL, bytes_, PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    } else {
+      int fd = shm_open(shm_name_.c_str(),
+          create ? (O_CREAT | O_EXCL | O_RDWR) : O_RDWR, 0600);
+      CHECK_GE(fd, 0) << "shm_open " << shm_name_ << ": " << strerror(errno);
+      if (create) {
+        CHECK_EQ(ftruncate(fd, bytes_), 0) << strerror(errno);
+      }
+      base_ = mmap(NULL, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      close(fd);
+    }
+    CHECK(base_ != MAP_FAILED) << "mmap of " << bytes_ << " bytes failed";
+    header_ = static_cast<Header*>(base_);
+    buffers_ = reinterpret_cast<Dtype*>(
+        static_cast<char*>(base_) + Align(sizeof(Header)));
+    if (create) {
+      // Shared memory starts zeroed, so this only matters for reuse.
+      memset(header_, 0, sizeof(Header));
+    }
+  }
+  virtual ~CPUParams() {
+    munmap(base_, bytes_);
+    Unlink();
+  }
+
+  /**
+   * Removes the shared memory name. The creator calls this as soon as every
+   * replica has attached, so a crash afterwards leaks nothing.
+   */
+  void Unlink() {
+    if (owner_ && linked_) {
+      shm_unlink(shm_name_.c_str());
+      linked_ = false;
+    }
+  }
+
+  /**
+   * Sets the check Wait runs periodically while blocked; returning false
+   * means a replica died, and the wait then fails instead of hanging.
+   */
+  void set_liveness_check(const boost::function<bool()>& alive) {
+    alive_ = alive;
+  }
+
+  inline size_t size() const { return size_; }
+  inline int count() const { return count_; }
+  inline Dtype* data(int rank) const {
+    return buffers_ + 2 * rank * stride_;
+  }
+  inline Dtype* diff(int rank) const {
+    return buffers_ + (2 * rank + 1) * stride_;
+  }
+
+  /**
+   * Blocks until all replicas have reached the barrier. Fails if any replica
+   * failed while waiting, or the liveness check reports a dead one.
+   */
+  void Wait() {
+    const int generation =
+        __atomic_load_n(&header_->generation, __ATOMIC_ACQUIRE);
+    if (__atomic_add_fetch(&header_->arrived, 1, __ATOMIC_ACQ_REL) ==
+        count_) {
+      // Last to arrive: reset the count before releasing the others.
+      __atomic_store_n(&header_->arrived, 0, __ATOMIC_RELAXED);
+      __atomic_store_n(&header_->generation, generation + 1,
+          __ATOMIC_RELEASE);
+      return;
+    }
+    for (int polls = 0; ; ++polls) {
+      if (Released(generation)) {
+        return;
+      }
+      if (polls < 100) {
+        continue;
+      }
+      if (polls < 1000) {
+        sched_yield();
+        continue;
+      }
+      CHECK(!__atomic_load_n(&header_->aborted, __ATOMIC_ACQUIRE))
+          << "Another replica failed";
+      // Every ~10 ms; a replica that exits right after the final barrier
+      // is not a failure, hence the second look at the generation.
+      if (polls % 200 == 0 && alive_ && !alive_() && !Released(generation)) {
+        __atomic_store_n(&header_->aborted, 1, __ATOMIC_RELEASE);
+        Unlink();
+        LOG(FATAL) << "A replica exited before training finished";
+      }
+      usleep(50);
+    }
+  }
+
+  /// @brief Number of learnable parameters of a solver's net.
+  static size_t ParamSize(const Solver<Dtype>& solver) {
+    const vector<Blob<Dtype>*>& blobs = solver.net()->learnable_params();
+    size_t size = 0;
+    for (int i = 0; i < blobs.size(); ++i) {
+      size += blobs[i]->count();
+    }
+    return size;
+  }
+
+  /**
+   * Moves the learnable parameters of the given replica into its slots,
+   * keeping their current values.
+   */
+  void Configure(Solver<Dtype>* solver, int rank) const {
+    CHECK_EQ(ParamSize(*solver), size_);
+    const vector<Blob<Dtype>*>& blobs = solver->net()->learnable_params();
+    Dtype* data = this->data(rank);
+    Dtype* diff = this->diff(rank);
+    for (int i = 0; i < blobs.size(); ++i) {
+      const int count = blobs[i]->count();
+      std::copy(blobs[i]->cpu_data(), blobs[i]->cpu_data() + count, data);
+      std::fill(diff, diff + count, Dtype(0));
+      blobs[i]->data()->set_cpu_data(data);
+      blobs[i]->diff()->set_cpu_data(diff);
+      data += count;
+      diff += count;
+    }
+  }
+
+  /**
+   * Averages the gradients of all replicas in place. Each rank reduces and
+   * writes back one contiguous segment, so the work and memory traffic are
+   * spread evenly, as in the reduce-scatter/all-gather halves of a ring
+   * allreduce. Must be called by all ranks.
+   */
+  void AllReduce(int rank) {
+    Wait();  // all gradients are ready
+    const size_t begin = size_ * rank / count_;
+    const size_t end = size_ * (rank + 1) / count_;
+    const Dtype scale = Dtype(1) / count_;
+    Dtype* sum = diff(0);
+    for (int r = 1; r < count_; ++r) {
+      const Dtype* other = diff(r);
+      for (size_t i = begin; i < end; ++i) {
+        sum[i] += other[i];
+      }
+    }
+    for (size_t i = begin; i < end; ++i) {
+      sum[i] *= scale;
+    }
+    for (int r = 1; r < count_; ++r) {
+      std::copy(sum + begin, sum + end, diff(r) + begin);
+    }
+    Wait();  // every segment has been written back
+  }
+
+  /// @brief Copies the parameters of rank 0 to all other replicas.
+  void Broadcast(int rank) {
+    Wait();
+    if (rank != 0) {
+      std::copy(data(0), data(0) + size_, data(rank));
+    }
+    Wait();
+  }
+
+ protected:
+  struct Header {
+    int arrived;     // Replicas waiting at the barrier
+    int generation;  // Barriers completed so far
+    int aborted;     // Set once a replica has been found dead
+  };
+
+  bool Released(int generation) const {
+    return __atomic_load_n(&header_->generation, __ATOMIC_ACQUIRE) !=
+        generation;
+  }
+
+  // Keep every slot on its own cache lines.
+  static size_t Align(size_t n) {
+    const size_t line = 64;
+    return (n + line - 1) / line * line;
+  }
+
+  const size_t size_;           // Parameters per replica
+  const size_t stride_;         // Elements between consecutive slots
+  const int count_;             // Number of replicas
+  const string shm_name_;       // Empty for private memory
+  const bool owner_;            // Whether this instance created the buffers
+  bool linked_;                 // Whether shm_name_ still has to be unlinked
+  boost::function<bool()> alive_;
+  size_t bytes_;
+  void* base_;
+  Header* header_;
+  Dtype* buffers_;
+
+DISABLE_COPY_AND_ASSIGN(CPUParams);
+};
+
+/**
+ * @brief CPU data-parallel training: N solver replicas, each consuming its
+ *        own share of the data (see Caffe::solver_rank), whose gradients are
+ *        averaged through CPUParams before every update.
+ *
+ * Replicas are either threads of this process (Run) or forked local
+ * processes sharing a POSIX shared memory segment (RunProcesses). Every
+ * replica applies the same averaged gradient, so the weights stay identical
+ * without being exchanged after the initial broadcast.
+ */
+template<typename Dtype>
+class CPUParallel : public Solver<Dtype>::Callback {
+ public:
+  CPUParallel(shared_ptr<Solver<Dtype> > solver,
+      shared_ptr<CPUParams<Dtype> > params, int rank)
+    : solver_(solver), params_(params), rank_(rank) {
+    params_->Configure(solver_.get(), rank_);
+    solver_->add_callback(this);
+  }
+
+  /**
+   * Single process, multi-thread. The calling thread runs rank 0; every
+   * replica creates its solver from param only after its rank and the
+   * solver count are set, so data layers shard from the first batch.
+   */
+  static void Run(const SolverParameter& param, int threads,
+      const char* restore) {
+    CHECK_GT(threads, 0);
+    Caffe::set_mode(Caffe::CPU);
+    Caffe::set_solver_count(threads);
+    Caffe::set_solver_rank(0);
+    Caffe::set_multiprocess(false);
+    shared_ptr<Solver<Dtype> > root(
+        SolverRegistry<Dtype>::CreateSolver(param));
+    shared_ptr<CPUParams<Dtype> > params(new CPUParams<Dtype>(
+        CPUParams<Dtype>::ParamSize(*root), threads, "", true));
+    CPUParallel<Dtype> parallel(root, params, 0);
+    boost::thread_group workers;
+    for (int rank = 1; rank < threads; ++rank) {
+      workers.create_thread(boost::bind(&CPUParallel<Dtype>::ThreadEntry,
+          param, params, rank, threads, restore));
+    }
+    if (restore) {
+      root->Restore(restore);
+    }
+    params->Broadcast(0);
+    root->Solve();
+    workers.join_all();
+  }
+
+  /**
+   * Multi-process on one host. Forks count - 1 children; the calling
+   * process becomes rank 0 and returns once all replicas have finished.
+   * Solvers are only created after the fork, so no data prefetch threads
+   * are duplicated. If any replica dies, the others fail at their next
+   * barrier instead of waiting for it forever.
+   */
+  static void RunProcesses(const SolverParameter& param, int count,
+      const char* restore) {
+    CHECK_GT(count, 0);
+    const string shm_name = "/caffe_cpu_params_" + format_int(getpid());
+    const pid_t root_pid = getpid();
+    vector<pid_t> children;
+    vector<int> pipes;
+    int rank = 0;
+    for (int r = 1; r < count; ++r) {
+      int fds[2];
+      CHECK_EQ(pipe(fds), 0) << strerror(errno);
+      pid_t pid = fork();
+      CHECK_GE(pid, 0) << "fork: " << strerror(errno);
+      if (pid == 0) {
+        rank = r;
+        for (int i = 0; i < pipes.size(); ++i) {
+          close(pipes[i]);
+        }
+        close(fds[1]);
+        pipes.assign(1, fds[0]);
+        break;
+      }
+      close(fds[0]);
+      children.push_back(pid);
+      pipes.push_back(fds[1]);
+    }
+    Peers peers(rank == 0 ? children : vector<pid_t>(),
+        rank == 0 ? 0 : root_pid);
+    Caffe::set_mode(Caffe::CPU);
+    Caffe::set_solver_count(count);
+    Caffe::set_solver_rank(rank);
+    Caffe::set_multiprocess(true);
+    shared_ptr<Solver<Dtype> > solver(
+        SolverRegistry<Dtype>::CreateSolver(param));
+    if (restore) {
+      solver->Restore(restore);
+    }
+    uint64_t size = CPUParams<Dtype>::ParamSize(*solver);
+    shared_ptr<CPUParams<Dtype> > params;
+    if (rank == 0) {
+      // Create the segment, then let the children attach to it.
+      params.reset(new CPUParams<Dtype>(size, count, shm_name, true));
+      for (int i = 0; i < pipes.size(); ++i) {
+        CHECK_EQ(write(pipes[i], &size, sizeof(size)), sizeof(size));
+        close(pipes[i]);
+      }
+    } else {
+      uint64_t root_size = 0;
+      CHECK_EQ(read(pipes[0], &root_size, sizeof(root_size)),
+          sizeof(root_size)) << "rank 0 exited before creating the buffers";
+      close(pipes[0]);
+      CHECK_EQ(root_size, size) << "replicas disagree on the parameter size";
+      params.reset(new CPUParams<Dtype>(size, count, shm_name, false));
+    }
+    params->set_liveness_check(boost::bind(&Peers::Alive, &peers));
+    params->Wait();  // every replica has attached
+    params->Unlink();
+    {
+      CPUParallel<Dtype> parallel(solver, params, rank);
+      params->Broadcast(rank);
+      solver->Step(solver->param().max_iter() - solver->iter());
+      if (rank == 0 && solver->param().snapshot_after_train()) {
+        solver->Snapshot();
+      }
+      params->Wait();
+    }
+    if (rank != 0) {
+      params.reset();
+      solver.reset();
+      _exit(0);
+    }
+    peers.Join();
+  }
+
+ protected:
+  // The other processes of RunProcesses, as seen by one of them: rank 0
+  // watches its children, the others watch rank 0.
+  class Peers {
+   public:
+    Peers(const vector<pid_t>& children, pid_t parent)
+      : children_(children), status_(children.size(), -1), parent_(parent) {}
+
+    // False once a child has exited or rank 0 has gone away.
+    bool Alive() {
+      if (parent_ != 0) {
+        return getppid() == parent_;
+      }
+      bool alive = true;
+      for (int i = 0; i < children_.size(); ++i) {
+        if (status_[i] < 0 && !Reap(i, WNOHANG)) {
+          continue;
+        }
+        alive = false;
+      }
+      return alive;
+    }
+
+    // Waits for all children and fails unless they all exited cleanly.
+    void Join() {
+      for (int i = 0; i < children_.size(); ++i) {
+        if (status_[i] < 0) {
+          CHECK(Reap(i, 0));
+        }
+        CHECK(WIFEXITED(status_[i]) && WEXITSTATUS(status_[i]) == 0)
+            << "replica " << i + 1 << " failed";
+      }
+    }
+
+   private:
+    bool Reap(int i, int options) {
+      int status = 0;
+      pid_t pid = waitpid(children_[i], &status, options);
+      CHECK_GE(pid, 0) << "waitpid: " << strerror(errno);
+      if (pid == 0) {
+        return false;
+      }
+      status_[i] = status;
+      return true;
+    }
+
+    const vector<pid_t> children_;
+    vector<int> status_;  // -1 until the child has been reaped
+    const pid_t parent_;  // 0 on rank 0
+  };
+
+  void on_start() {}
+  void on_gradients_ready() { params_->AllReduce(rank_); }
+
+  static void ThreadEntry(SolverParameter param,
+      shared_ptr<CPUParams<Dtype> > params, int rank, int count,
+      const char* restore) {
+    Caffe::set_mode(Caffe::CPU);
+    Caffe::set_solver_count(count);
+    Caffe::set_solver_rank(rank);
+    Caffe::set_multiprocess(false);
+    shared_ptr<Solver<Dtype> > solver(
+        SolverRegistry<Dtype>::CreateSolver(param));
+    if (restore) {
+      solver->Restore(restore);
+    }
+    CPUParallel<Dtype> parallel(solver, params, rank);
+    params->Broadcast(rank);
+    solver->Step(param.max_iter() - solver->iter());
+  }
+
+  shared_ptr<Solver<Dtype> > solver_;
+  shared_ptr<CPUParams<Dtype> > params_;
+  const int rank_;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_CPU_PARALLEL_HPP_
@@ -0,0 +1,326 @@
+#ifndef CAFFE_FAST_DATA_TRANSFORMER_HPP_
+#define CAFFE_FAST_DATA_TRANSFORMER_HPP_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#ifdef USE_OPENCV
+#include <opencv2/core/core.hpp>
+#endif  // USE_OPENCV
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/data_transformer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/io.hpp"
+#include "caffe/util/jpeg_crop_decoder.hpp"
+
+namespace caffe {
+
+// One output row of caffe_cpu_transform_image. kStep is the source pixel
+// stride when known at compile time (1 planar, 3 interleaved BGR), or 0 to
+// use step. The branches are hoisted out of the loops so that each loop is
+// a straight uint8 -> Dtype convert, subtract, multiply the compiler can
+// vectorize.
+template <typename Dtype, int kStep>
+inline void caffe_transform_row(const int n, const uint8_t* src,
+    const int step, const Dtype* mean, const Dtype mean_value,
+    const Dtype scale, const bool mirror, Dtype* out) {
+  const int s = kStep > 0 ? kStep : step;
+  if (mean != NULL) {
+    if (mirror) {
+      for (int w = 0; w < n; ++w) {
+        out[n - 1 - w] = (static_cast<Dtype>(src[w * s]) - mean[w]) * scale;
+      }
+    } else {
+      for (int w = 0; w < n; ++w) {
+        out[w] = (static_cast<Dtype>(src[w * s]) - mean[w]) * scale;
+      }
+    }
+  } else {
+    if (mirror) {
+      for (int w = 0; w < n; ++w) {
+        out[n - 1 - w] = (static_cast<Dtype>(src[w * s]) - mean_value) * scale;
+      }
+    } else {
+      for (int w = 0; w < n; ++w) {
+        out[w] = (static_cast<Dtype>(src[w * s]) - mean_value) * scale;
+      }
+    }
+  }
+}
+
+/**
+ * @brief Fused crop / uint8 -> Dtype / mean subtraction / scale / mirror of
+ *        one image into a channels x height x width output, in a single pass
+ *        per output row.
+ *
+ * @param src the source pixel at the crop origin of channel 0
+ * @param src_step, src_row_stride, src_channel_stride element strides
+ *        between horizontally adjacent pixels, rows and channels of src:
+ *        (1, W, H * W) for a planar Datum, (C, C * W, 1) for an
+ *        interleaved cv::Mat
+ * @param mean NULL, or the mean at the crop origin of channel 0, with the
+ *        given row and channel strides
+ * @param mean_values used when mean is NULL: NULL for no mean, or one value
+ *        per channel
+ *
+ * Every output is (pixel - mean) * scale exactly as in DataTransformer, so
+ * results are bit-identical to it.
+ */
+template <typename Dtype>
+void caffe_cpu_transform_image(const int channels, const int height,
+    const int width, const uint8_t* src, const int src_step,
+    const int src_row_stride, const int src_channel_stride,
+    const Dtype* mean, const int mean_row_stride,
+    const int mean_channel_stride, const Dtype* mean_values,
+    const Dtype scale, const bool mirror, Dtype* out) {
+  for (int c = 0; c < channels; ++c) {
+    const Dtype mean_value = mean_values != NULL ? mean_values[c] : Dtype(0);
+    for (int h = 0; h < height; ++h) {
+      const uint8_t* s = src + c * src_channel_stride + h * src_row_stride;
+      const Dtype* m = mean != NULL ?
+          mean + c * mean_channel_stride + h * mean_row_stride : NULL;
+      Dtype* o = out + (c * height + h) * width;
+      if (src_step == 1) {
+        caffe_transform_row<Dtype, 1>(width, s, 1, m, mean_value, scale,
+            mirror, o);
+      } else if (src_step == 3) {
+        caffe_transform_row<Dtype, 3>(width, s, 3, m, mean_value, scale,
+            mirror, o);
+      } else {
+        caffe_transform_row<Dtype, 0>(width, s, src_step, m, mean_value,
+            scale, mirror, o);
+      }
+    }
+  }
+}
+
+/**
+ * @brief DataTransformer with fused, vectorizable transforms of uint8
+ *        Datums and cv::Mats (see caffe_cpu_transform_image), and, when
+ *        built with USE_LIBJPEG_TURBO, decoding of encoded JPEG Datums
+ *        straight into the crop window.
+ *
+ * Random crops and mirrors are drawn in the same order as DataTransformer,
+ * so with the same seed both produce the same outputs. Float Datums and
+ * Blob inputs use the DataTransformer implementation.
+ */
+template <typename Dtype>
+class FastDataTransformer : public DataTransformer<Dtype> {
+ public:
+  FastDataTransformer(const TransformationParameter& param, Phase phase)
+      : DataTransformer<Dtype>(param, phase) {}
+
+  using DataTransformer<Dtype>::Transform;
+  using DataTransformer<Dtype>::InferBlobShape;
+
+  void Transform(const Datum& datum, Blob<Dtype>* transformed_blob) {
+    if (datum.encoded()) {
+      CHECK(!(this->param_.force_color() && this->param_.force_gray()))
+          << "cannot set both force_color and force_gray";
+#ifdef USE_LIBJPEG_TURBO
+      if (TransformJPEG(datum, transformed_blob)) {
+        return;
+      }
+#endif  // USE_LIBJPEG_TURBO
+#ifdef USE_OPENCV
+      cv::Mat cv_img;
+      if (this->param_.force_color() || this->param_.force_gray()) {
+        cv_img = DecodeDatumToCVMat(datum, this->param_.force_color());
+      } else {
+        cv_img = DecodeDatumToCVMatNative(datum);
+      }
+      Transform(cv_img, transformed_blob);
+      return;
+#else
+      LOG(FATAL) << "Encoded datum requires OpenCV; compile with USE_OPENCV.";
+#endif  // USE_OPENCV
+    }
+    if (datum.data().empty()) {
+      DataTransformer<Dtype>::Transform(datum, transformed_blob);
+      return;
+    }
+    const int datum_channels = datum.channels();
+    const int datum_height = datum.height();
+    const int datum_width = datum.width();
+    int h_off, w_off, height, width;
+    bool mirror;
+    SampleWindow(datum_channels, datum_height, datum_width, transformed_blob,
+        &h_off, &w_off, &height, &width, &mirror);
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(datum.data().data());
+    Apply(datum_channels, datum_height, datum_width, h_off, w_off, height,
+        width, mirror, src + h_off * datum_width + w_off, 1, datum_width,
+        datum_height * datum_width, transformed_blob->mutable_cpu_data());
+  }
+
+  void Transform(const vector<Datum>& datum_vector,
+      Blob<Dtype>* transformed_blob) {
+    const int datum_num = datum_vector.size();
+    CHECK_GT(datum_num, 0) << "There is no datum to add";
+    CHECK_LE(datum_num, transformed_blob->num())
+        << "The size of datum_vector must be no greater than "
+        << "transformed_blob->num()";
+    Blob<Dtype> uni_blob(1, transformed_blob->channels(),
+        transformed_blob->height(), transformed_blob->width());
+    for (int item_id = 0; item_id < datum_num; ++item_id) {
+      uni_blob.set_cpu_data(transformed_blob->mutable_cpu_data() +
+          transformed_blob->offset(item_id));
+      Transform(datum_vector[item_id], &uni_blob);
+    }
+  }
+
+#ifdef USE_OPENCV
+  void Transform(const cv::Mat& cv_img, Blob<Dtype>* transformed_blob) {
+    CHECK(cv_img.depth() == CV_8U) << "Image data type must be unsigned byte";
+    const int img_channels = cv_img.channels();
+    const int img_height = cv_img.rows;
+    const int img_width = cv_img.cols;
+    int h_off, w_off, height, width;
+    bool mirror;
+    SampleWindow(img_channels, img_height, img_width, transformed_blob,
+        &h_off, &w_off, &height, &width, &mirror);
+    const int row_stride = cv_img.step1();
+    Apply(img_channels, img_height, img_width, h_off, w_off, height, width,
+        mirror, cv_img.ptr<uint8_t>(h_off) + w_off * img_channels,
+        img_channels, row_stride, 1, transformed_blob->mutable_cpu_data());
+  }
+
+  void Transform(const vector<cv::Mat>& mat_vector,
+      Blob<Dtype>* transformed_blob) {
+    const int mat_num = mat_vector.size();
+    CHECK_GT(mat_num, 0) << "There is no MAT to add";
+    CHECK_EQ(mat_num, transformed_blob->num())
+        << "The size of mat_vector must be equals to transformed_blob->num()";
+    Blob<Dtype> uni_blob(1, transformed_blob->channels(),
+        transformed_blob->height(), transformed_blob->width());
+    for (int item_id = 0; item_id < mat_num; ++item_id) {
+      uni_blob.set_cpu_data(transformed_blob->mutable_cpu_data() +
+          transformed_blob->offset(item_id));
+      Transform(mat_vector[item_id], &uni_blob);
+    }
+  }
+#endif  // USE_OPENCV
+
+  /// @brief As DataTransformer, but reads only the header of JPEG Datums.
+  vector<int> InferBlobShape(const Datum& datum) {
+#ifdef USE_LIBJPEG_TURBO
+    if (datum.encoded() && jpeg_.ReadHeader(datum.data(), ColorMode())) {
+      const int crop_size = this->param_.crop_size();
+      CHECK_GE(jpeg_.height(), crop_size);
+      CHECK_GE(jpeg_.width(), crop_size);
+      vector<int> shape(4);
+      shape[0] = 1;
+      shape[1] = jpeg_.channels();
+      shape[2] = crop_size ? crop_size : jpeg_.height();
+      shape[3] = crop_size ? crop_size : jpeg_.width();
+      return shape;
+    }
+#endif  // USE_LIBJPEG_TURBO
+    return DataTransformer<Dtype>::InferBlobShape(datum);
+  }
+
+ protected:
+  /// Checks the output shape and draws the crop window and mirror as
+  /// DataTransformer does.
+  void SampleWindow(const int channels, const int img_height,
+      const int img_width, Blob<Dtype>* transformed_blob, int* h_off,
+      int* w_off, int* height, int* width, bool* mirror) {
+    const int crop_size = this->param_.crop_size();
+    *height = transformed_blob->height();
+    *width = transformed_blob->width();
+    CHECK_EQ(transformed_blob->channels(), channels);
+    CHECK_GE(transformed_blob->num(), 1);
+    CHECK_LE(*height, img_height);
+    CHECK_LE(*width, img_width);
+    *mirror = this->param_.mirror() && this->Rand(2);
+    *h_off = 0;
+    *w_off = 0;
+    if (crop_size) {
+      CHECK_EQ(crop_size, *height);
+      CHECK_EQ(crop_size, *width);
+      if (this->phase_ == TRAIN) {
+        *h_off = this->Rand(img_height - crop_size + 1);
+        *w_off = this->Rand(img_width - crop_size + 1);
+      } else {
+        *h_off = (img_height - crop_size) / 2;
+        *w_off = (img_width - crop_size) / 2;
+      }
+    } else {
+      CHECK_EQ(img_height, *height);
+      CHECK_EQ(img_width, *width);
+    }
+  }
+
+  /// Runs caffe_cpu_transform_image with the mean file or mean values.
+  void Apply(const int channels, const int img_height, const int img_width,
+      const int h_off, const int w_off, const int height, const int width,
+      const bool mirror, const uint8_t* src, const int src_step,
+      const int src_row_stride, const int src_channel_stride, Dtype* out) {
+    const Dtype* mean = NULL;
+    const Dtype* mean_values = NULL;
+    if (this->param_.has_mean_file()) {
+      CHECK_EQ(channels, this->data_mean_.channels());
+      CHECK_EQ(img_height, this->data_mean_.height());
+      CHECK_EQ(img_width, this->data_mean_.width());
+      mean = this->data_mean_.cpu_data() + h_off * img_width + w_off;
+    } else if (!this->mean_values_.empty()) {
+      CHECK(this->mean_values_.size() == 1 ||
+            this->mean_values_.size() == channels)
+          << "Specify either 1 mean_value or as many as channels: "
+          << channels;
+      if (this->mean_values_.size() == channels) {
+        channel_means_ = this->mean_values_;
+      } else {
+        channel_means_.assign(channels, this->mean_values_[0]);
+      }
+      mean_values = &channel_means_[0];
+    }
+    caffe_cpu_transform_image(channels, height, width, src, src_step,
+        src_row_stride, src_channel_stride, mean, img_width,
+        img_height * img_width, mean_values, Dtype(this->param_.scale()),
+        mirror, out);
+  }
+
+#ifdef USE_LIBJPEG_TURBO
+  int ColorMode() const {
+    if (this->param_.force_color()) {
+      return 1;
+    }
+    return this->param_.force_gray() ? 0 : -1;
+  }
+
+  /// Decodes only the crop window of a JPEG Datum; false if it is not a
+  /// JPEG libjpeg-turbo can decode.
+  bool TransformJPEG(const Datum& datum, Blob<Dtype>* transformed_blob) {
+    if (!jpeg_.ReadHeader(datum.data(), ColorMode())) {
+      return false;
+    }
+    const int channels = jpeg_.channels();
+    const int img_height = jpeg_.height();
+    const int img_width = jpeg_.width();
+    int h_off, w_off, height, width;
+    bool mirror;
+    SampleWindow(channels, img_height, img_width, transformed_blob, &h_off,
+        &w_off, &height, &width, &mirror);
+    pixels_.resize(height * width * channels);
+    if (!jpeg_.DecodeCrop(h_off, w_off, height, width, &pixels_[0])) {
+      return false;
+    }
+    Apply(channels, img_height, img_width, h_off, w_off, height, width,
+        mirror, &pixels_[0], channels, width * channels, 1,
+        transformed_blob->mutable_cpu_data());
+    return true;
+  }
+
+  JPEGCropDecoder jpeg_;
+  vector<uint8_t> pixels_;
+#endif  // USE_LIBJPEG_TURBO
+  vector<Dtype> channel_means_;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_FAST_DATA_TRANSFORMER_HPP_
@@ -41,6 +41,7 @@
 
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "caffe/common.hpp"
@@ -124,6 +125,38 @@ class LayerRegisterer {
 };
 
 
+/**
+ * @brief Replaces the creator of a registered layer type on behalf of owner
+ *        (the name of the Enable* function doing it) and returns the creator
+ *        it replaced, so the new one can fall back to it.
+ *
+ * Only one owner may replace a type: a second would silently undo the
+ * first, so it fails a CHECK instead. Replacing again for the same owner
+ * changes nothing.
+ */
+template <typename Dtype>
+typename LayerRegistry<Dtype>::Creator ReplaceLayerCreator(const string& type,
+    typename LayerRegistry<Dtype>::Creator creator, const string& owner) {
+  typedef typename LayerRegistry<Dtype>::Creator Creator;
+  // type -> (owner, creator it replaced)
+  static std::map<string, std::pair<string, Creator> > replaced;
+  typename LayerRegistry<Dtype>::CreatorRegistry& registry =
+      LayerRegistry<Dtype>::Registry();
+  CHECK_EQ(registry.count(type), 1) << "Layer type " << type
+                                    << " is not registered";
+  typename std::map<string, std::pair<string, Creator> >::iterator it =
+      replaced.find(type);
+  if (it != replaced.end()) {
+    CHECK_EQ(it->second.first, owner) << "Layer type " << type
+        << " was already replaced by " << it->second.first
+        << ", which cannot be combined with " << owner;
+    return it->second.second;
+  }
+  replaced[type] = std::make_pair(owner, registry[type]);
+  registry[type] = creator;
+  return replaced[type].second;
+}
+
 #define REGISTER_LAYER_CREATOR(type, creator)                                  \
   static LayerRegisterer<float> g_creator_f_##type(#type, creator<float>);     \
   static LayerRegisterer<double> g_creator_d_##type(#type, creator<double>)    \
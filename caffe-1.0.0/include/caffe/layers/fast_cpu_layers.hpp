@@ -0,0 +1,188 @@
+#ifndef CAFFE_FAST_CPU_LAYERS_HPP_
+#define CAFFE_FAST_CPU_LAYERS_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/fast_cpu_kernels.hpp"
+
+#include "caffe/layers/lrn_layer.hpp"
+#include "caffe/layers/pooling_layer.hpp"
+#include "caffe/layers/softmax_layer.hpp"
+
+namespace caffe {
+
+/**
+ * @brief PoolingLayer with the vectorized caffe_cpu_pool_forward kernel.
+ *
+ * MAX pooling in the TEST phase with a single top skips the argmax mask;
+ * should Backward still be requested (e.g. force_backward), the reference
+ * forward is re-run first to produce it. STOCHASTIC pooling and MAX
+ * pooling with a mask top use the reference implementation.
+ */
+template <typename Dtype>
+class FastPoolingLayer : public PoolingLayer<Dtype> {
+ public:
+  explicit FastPoolingLayer(const LayerParameter& param)
+      : PoolingLayer<Dtype>(param), mask_valid_(false) {}
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    const PoolingParameter_PoolMethod method =
+        this->layer_param_.pooling_param().pool();
+    const bool is_max = method == PoolingParameter_PoolMethod_MAX;
+    if (method == PoolingParameter_PoolMethod_STOCHASTIC ||
+        (is_max && (this->phase_ != TEST || top.size() > 1))) {
+      PoolingLayer<Dtype>::Forward_cpu(bottom, top);
+      mask_valid_ = true;
+      return;
+    }
+    caffe_cpu_pool_forward(is_max, bottom[0]->num() * this->channels_,
+        this->height_, this->width_, this->pooled_height_,
+        this->pooled_width_, this->kernel_h_, this->kernel_w_,
+        this->stride_h_, this->stride_w_, this->pad_h_, this->pad_w_,
+        bottom[0]->cpu_data(), top[0]->mutable_cpu_data());
+    mask_valid_ = !is_max;
+  }
+
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+    if (!mask_valid_) {
+      PoolingLayer<Dtype>::Forward_cpu(bottom, top);
+      mask_valid_ = true;
+    }
+    PoolingLayer<Dtype>::Backward_cpu(top, propagate_down, bottom);
+  }
+
+  bool mask_valid_;
+};
+
+/**
+ * @brief LRNLayer whose ACROSS_CHANNELS forward uses the sliding-window
+ *        caffe_cpu_lrn_cross_channel_forward kernel. The scale_ blob needed
+ *        by Backward is only written outside the TEST phase.
+ */
+template <typename Dtype>
+class FastLRNLayer : public LRNLayer<Dtype> {
+ public:
+  explicit FastLRNLayer(const LayerParameter& param)
+      : LRNLayer<Dtype>(param), scale_valid_(false) {}
+
+ protected:
+  virtual void CrossChannelForward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    const bool need_scale = this->phase_ != TEST;
+    caffe_cpu_lrn_cross_channel_forward(this->num_, this->channels_,
+        this->height_ * this->width_, this->size_, this->alpha_, this->beta_,
+        this->k_, bottom[0]->cpu_data(), top[0]->mutable_cpu_data(),
+        need_scale ? this->scale_.mutable_cpu_data() : NULL);
+    scale_valid_ = need_scale;
+  }
+
+  virtual void CrossChannelBackward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+    if (!scale_valid_) {
+      caffe_cpu_lrn_cross_channel_forward(this->num_, this->channels_,
+          this->height_ * this->width_, this->size_, this->alpha_,
+          this->beta_, this->k_, bottom[0]->cpu_data(),
+          top[0]->mutable_cpu_data(), this->scale_.mutable_cpu_data());
+      scale_valid_ = true;
+    }
+    LRNLayer<Dtype>::CrossChannelBackward_cpu(top, propagate_down, bottom);
+  }
+
+  bool scale_valid_;
+};
+
+/**
+ * @brief SoftmaxLayer with the fused caffe_cpu_softmax_forward kernel.
+ *        Backward only reads top, so it is shared with the reference layer.
+ */
+template <typename Dtype>
+class FastSoftmaxLayer : public SoftmaxLayer<Dtype> {
+ public:
+  explicit FastSoftmaxLayer(const LayerParameter& param)
+      : SoftmaxLayer<Dtype>(param) {}
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    caffe_cpu_softmax_forward(this->outer_num_,
+        bottom[0]->shape(this->softmax_axis_), this->inner_num_,
+        bottom[0]->cpu_data(), top[0]->mutable_cpu_data());
+  }
+};
+
+// Creators installed by EnableFastCPULayers. Layers that ask for another
+// engine, or that are created in GPU mode, go to the original creator.
+template <typename Dtype>
+class FastCPULayerCreators {
+ public:
+  typedef typename LayerRegistry<Dtype>::Creator Creator;
+
+  static Creator& original_pooling() {
+    static Creator creator = NULL;
+    return creator;
+  }
+  static Creator& original_lrn() {
+    static Creator creator = NULL;
+    return creator;
+  }
+  static Creator& original_softmax() {
+    static Creator creator = NULL;
+    return creator;
+  }
+
+  static bool UseFast(int engine) {
+    // The engine enums of all three layers share these values.
+    return engine == PoolingParameter_Engine_CAFFE ||
+        (engine == PoolingParameter_Engine_DEFAULT &&
+         Caffe::mode() == Caffe::CPU);
+  }
+
+  static shared_ptr<Layer<Dtype> > Pooling(const LayerParameter& param) {
+    if (UseFast(param.pooling_param().engine())) {
+      return shared_ptr<Layer<Dtype> >(new FastPoolingLayer<Dtype>(param));
+    }
+    return original_pooling()(param);
+  }
+  static shared_ptr<Layer<Dtype> > LRN(const LayerParameter& param) {
+    if (UseFast(param.lrn_param().engine())) {
+      return shared_ptr<Layer<Dtype> >(new FastLRNLayer<Dtype>(param));
+    }
+    return original_lrn()(param);
+  }
+  static shared_ptr<Layer<Dtype> > Softmax(const LayerParameter& param) {
+    if (UseFast(param.softmax_param().engine())) {
+      return shared_ptr<Layer<Dtype> >(new FastSoftmaxLayer<Dtype>(param));
+    }
+    return original_softmax()(param);
+  }
+
+  static void Install() {
+    const string owner = "EnableFastCPULayers";
+    original_pooling() = ReplaceLayerCreator<Dtype>("Pooling",
+        &FastCPULayerCreators<Dtype>::Pooling, owner);
+    original_lrn() = ReplaceLayerCreator<Dtype>("LRN",
+        &FastCPULayerCreators<Dtype>::LRN, owner);
+    original_softmax() = ReplaceLayerCreator<Dtype>("Softmax",
+        &FastCPULayerCreators<Dtype>::Softmax, owner);
+  }
+};
+
+/**
+ * @brief Makes the Pooling, LRN and Softmax layer types create the fast CPU
+ *        variants above for every Net constructed afterwards. Idempotent.
+ */
+template <typename Dtype>
+void EnableFastCPULayers() {
+  FastCPULayerCreators<Dtype>::Install();
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_FAST_CPU_LAYERS_HPP_
@@ -0,0 +1,102 @@
+#ifndef CAFFE_FAST_DATA_LAYER_HPP_
+#define CAFFE_FAST_DATA_LAYER_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/fast_data_transformer.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+
+#include "caffe/layers/data_layer.hpp"
+
+namespace caffe {
+
+/**
+ * @brief DataLayer that transforms its batches with FastDataTransformer.
+ *        Reading, sharding and prefetching are DataLayer's.
+ */
+template <typename Dtype>
+class FastDataLayer : public DataLayer<Dtype> {
+ public:
+  explicit FastDataLayer(const LayerParameter& param)
+      : DataLayer<Dtype>(param) {}
+
+  virtual void DataLayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    fast_transformer_.reset(
+        new FastDataTransformer<Dtype>(this->transform_param_, this->phase_));
+    fast_transformer_->InitRand();
+    DataLayer<Dtype>::DataLayerSetUp(bottom, top);
+  }
+
+ protected:
+  virtual void load_batch(Batch<Dtype>* batch) {
+    CPUTimer batch_timer;
+    batch_timer.Start();
+    double read_time = 0;
+    double trans_time = 0;
+    CPUTimer timer;
+    CHECK(batch->data_.count());
+    CHECK(this->transformed_data_.count());
+    const int batch_size = this->layer_param_.data_param().batch_size();
+    Datum datum;
+    for (int item_id = 0; item_id < batch_size; ++item_id) {
+      timer.Start();
+      while (this->Skip()) {
+        this->Next();
+      }
+      datum.ParseFromString(this->cursor_->value());
+      read_time += timer.MicroSeconds();
+      if (item_id == 0) {
+        // Reshape according to the first datum of each batch
+        vector<int> top_shape = fast_transformer_->InferBlobShape(datum);
+        this->transformed_data_.Reshape(top_shape);
+        top_shape[0] = batch_size;
+        batch->data_.Reshape(top_shape);
+      }
+      // Apply data transformations (mirror, scale, crop...)
+      timer.Start();
+      int offset = batch->data_.offset(item_id);
+      Dtype* top_data = batch->data_.mutable_cpu_data();
+      this->transformed_data_.set_cpu_data(top_data + offset);
+      fast_transformer_->Transform(datum, &(this->transformed_data_));
+      // Copy label.
+      if (this->output_labels_) {
+        Dtype* top_label = batch->label_.mutable_cpu_data();
+        top_label[item_id] = datum.label();
+      }
+      trans_time += timer.MicroSeconds();
+      this->Next();
+    }
+    timer.Stop();
+    batch_timer.Stop();
+    DLOG(INFO) << "Prefetch batch: " << batch_timer.MilliSeconds() << " ms.";
+    DLOG(INFO) << "     Read time: " << read_time / 1000 << " ms.";
+    DLOG(INFO) << "Transform time: " << trans_time / 1000 << " ms.";
+  }
+
+  shared_ptr<FastDataTransformer<Dtype> > fast_transformer_;
+};
+
+template <typename Dtype>
+shared_ptr<Layer<Dtype> > GetFastDataLayer(const LayerParameter& param) {
+  return shared_ptr<Layer<Dtype> >(new FastDataLayer<Dtype>(param));
+}
+
+/**
+ * @brief Makes "Data" layers of every Net constructed afterwards
+ *        FastDataLayers. Idempotent.
+ */
+inline void EnableFastDataTransformer() {
+  ReplaceLayerCreator<float>("Data", &GetFastDataLayer<float>,
+                             "EnableFastDataTransformer");
+  ReplaceLayerCreator<double>("Data", &GetFastDataLayer<double>,
+                              "EnableFastDataTransformer");
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_FAST_DATA_LAYER_HPP_
@@ -0,0 +1,168 @@
+#ifndef CAFFE_HALF_INNER_PRODUCT_LAYER_HPP_
+#define CAFFE_HALF_INNER_PRODUCT_LAYER_HPP_
+
+#include <sys/mman.h>
+
+#include <map>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/syncedmem.hpp"
+#include "caffe/util/half.hpp"
+
+#include "caffe/layers/inner_product_layer.hpp"
+
+namespace caffe {
+
+/**
+ * @brief InnerProductLayer that can keep its weights as fp16 or bf16 for
+ *        CPU inference.
+ *
+ * Until Compress() is called it behaves exactly like InnerProductLayer.
+ * Compress() narrows the weight blob into a 16-bit copy and releases the
+ * float storage: the blob keeps its shape but its data is pointed at
+ * read-only zero pages, which take no memory. Forward then runs
+ * caffe_cpu_gemm_half. The bias stays float.
+ *
+ * A compressed layer is inference only: Backward fails, and its weight blob
+ * must not be written (e.g. by CopyTrainedLayersFrom) afterwards.
+ */
+class HalfInnerProductLayer : public InnerProductLayer<float> {
+ public:
+  explicit HalfInnerProductLayer(const LayerParameter& param)
+      : InnerProductLayer<float>(param), type_(HALF_FP16),
+        zero_pages_(NULL), zero_bytes_(0) {}
+  virtual ~HalfInnerProductLayer() {
+    if (zero_pages_ != NULL) {
+      munmap(zero_pages_, zero_bytes_);
+    }
+  }
+
+  /// @brief Converts the current weights to type and frees the float copy.
+  void Compress(const HalfType type) {
+    CHECK(!compressed()) << "Layer " << this->layer_param_.name()
+                         << " is already compressed";
+    Blob<float>* weight = this->blobs_[0].get();
+    type_ = type;
+    weights_.reset(new SyncedMemory(weight->count() * sizeof(uint16_t)));
+    caffe_cpu_float_to_half(weight->count(), weight->cpu_data(),
+        static_cast<uint16_t*>(weights_->mutable_cpu_data()), type_);
+    zero_bytes_ = weight->count() * sizeof(float);
+    zero_pages_ = mmap(NULL, zero_bytes_, PROT_READ,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    CHECK(zero_pages_ != MAP_FAILED) << "Failed to map " << zero_bytes_
+                                     << " bytes";
+    weight->data()->set_cpu_data(zero_pages_);
+  }
+
+  /**
+   * @brief Uses the compressed weights of owner, whose weight blob this
+   *        layer shares (e.g. unrolled recurrent nets).
+   */
+  void ShareCompressed(const HalfInnerProductLayer& owner) {
+    CHECK(owner.compressed());
+    CHECK(!compressed());
+    type_ = owner.type_;
+    weights_ = owner.weights_;
+  }
+
+  inline bool compressed() const { return weights_ != NULL; }
+  inline HalfType half_type() const { return type_; }
+  /// @brief Bytes of weight storage (16 or 32 bits per weight).
+  inline size_t weight_bytes() const {
+    return this->blobs_[0]->count() *
+        (compressed() ? sizeof(uint16_t) : sizeof(float));
+  }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<float>*>& bottom,
+      const vector<Blob<float>*>& top) {
+    if (!compressed()) {
+      InnerProductLayer<float>::Forward_cpu(bottom, top);
+      return;
+    }
+    float* top_data = top[0]->mutable_cpu_data();
+    caffe_cpu_gemm_half(this->transpose_ ? CblasNoTrans : CblasTrans,
+        this->M_, this->N_, this->K_, 1.f, bottom[0]->cpu_data(),
+        static_cast<const uint16_t*>(weights_->cpu_data()), type_, 0.f,
+        top_data, &panel_);
+    if (this->bias_term_) {
+      caffe_cpu_gemm<float>(CblasNoTrans, CblasNoTrans, this->M_, this->N_,
+          1, 1.f, this->bias_multiplier_.cpu_data(),
+          this->blobs_[1]->cpu_data(), 1.f, top_data);
+    }
+  }
+
+  virtual void Backward_cpu(const vector<Blob<float>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<float>*>& bottom) {
+    CHECK(!compressed()) << "Layer " << this->layer_param_.name()
+        << " has compressed weights and supports inference only";
+    InnerProductLayer<float>::Backward_cpu(top, propagate_down, bottom);
+  }
+
+  HalfType type_;
+  shared_ptr<SyncedMemory> weights_;
+  std::vector<float> panel_;
+  void* zero_pages_;
+  size_t zero_bytes_;
+};
+
+inline shared_ptr<Layer<float> > GetHalfInnerProductLayer(
+    const LayerParameter& param) {
+  return shared_ptr<Layer<float> >(new HalfInnerProductLayer(param));
+}
+
+/**
+ * @brief Makes float "InnerProduct" layers of every Net constructed
+ *        afterwards HalfInnerProductLayers, so CompressWeights can find them.
+ *        Cannot be combined with EnablePrunedLayers or
+ *        EnableRowSparseGradients.
+ */
+inline void EnableHalfInnerProductLayer() {
+  ReplaceLayerCreator<float>("InnerProduct", &GetHalfInnerProductLayer,
+                             "EnableHalfInnerProductLayer");
+}
+
+/**
+ * @brief Compresses the weights of every HalfInnerProductLayer of net to
+ *        type, after the trained weights have been loaded. Layers sharing a
+ *        weight blob share the compressed copy. Returns the bytes saved.
+ */
+inline size_t CompressWeights(Net<float>* net, const HalfType type) {
+  std::map<const SyncedMemory*, HalfInnerProductLayer*> owners;
+  size_t saved = 0;
+  int compressed = 0;
+  for (int i = 0; i < net->layers().size(); ++i) {
+    HalfInnerProductLayer* layer =
+        dynamic_cast<HalfInnerProductLayer*>(net->layers()[i].get());
+    if (layer == NULL || layer->compressed()) {
+      continue;
+    }
+    const SyncedMemory* data = layer->blobs()[0]->data().get();
+    if (owners.count(data)) {
+      layer->ShareCompressed(*owners[data]);
+      continue;
+    }
+    const size_t before = layer->weight_bytes();
+    layer->Compress(type);
+    saved += before - layer->weight_bytes();
+    owners[data] = layer;
+    ++compressed;
+  }
+  if (compressed == 0) {
+    LOG(WARNING) << "No compressible layers in " << net->name()
+                 << "; call EnableHalfInnerProductLayer() before creating it";
+  }
+  LOG(INFO) << "Compressed " << compressed << " layers of " << net->name()
+            << " to " << (type == HALF_FP16 ? "fp16" : "bf16") << ", saved "
+            << saved / (1024 * 1024) << " MB";
+  return saved;
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_HALF_INNER_PRODUCT_LAYER_HPP_
@@ -0,0 +1,421 @@
+#ifndef CAFFE_HDF5_STREAM_DATA_LAYER_HPP_
+#define CAFFE_HDF5_STREAM_DATA_LAYER_HPP_
+
+#include <boost/thread.hpp>
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <deque>
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+#include <vector>
+
+#include "hdf5.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/rng.hpp"
+
+namespace caffe {
+
+/// @brief Counters of an HDF5StreamDataLayer; see stats().
+struct HDF5StreamStats {
+  HDF5StreamStats()
+      : bytes_read(0), read_seconds(0), batches(0), stalls(0),
+        stall_seconds(0) {}
+  /// @brief Bytes read from HDF5, and the time spent reading them.
+  uint64_t bytes_read;
+  double read_seconds;
+  /// @brief Batches consumed by Forward, how many of them were not ready
+  ///        yet, and the total time Forward waited for them.
+  uint64_t batches;
+  uint64_t stalls;
+  double stall_seconds;
+};
+
+/**
+ * @brief Streams data from HDF5 files that need not fit in memory, reading
+ *        on a background thread.
+ *
+ * Takes the same parameters as HDF5DataLayer: hdf5_data_param's source (a
+ * list of files), batch_size and shuffle, and one top per dataset, named
+ * after it. Instead of loading a whole file, the datasets are read as
+ * hyperslabs of CAFFE_HDF5_CHUNK_ROWS rows (default 1024) and the batches
+ * are assembled ahead of Forward, up to CAFFE_HDF5_PREFETCH of them (default
+ * 4; HDF5DataParameter has no prefetch field). Datasets must have at least
+ * one axis, the row axis.
+ *
+ * In data-parallel training every solver (see Caffe::solver_rank) streams
+ * its own share of the chunks, as DataLayer does with records.
+ *
+ * With shuffle, every epoch visits the chunks of all files in random order,
+ * and the rows of kShuffleChunks chunks at a time are shuffled together,
+ * so batches mix rows across chunk and file boundaries while only that
+ * window is in memory.
+ *
+ * Read throughput and the number of times Forward had to wait (stalls) are
+ * available from stats() and logged at the end of every epoch.
+ *
+ * Unless the HDF5 library is built thread-safe, nothing else should use it
+ * while the layer is reading (e.g. HDF5 snapshots).
+ */
+template <typename Dtype>
+class HDF5StreamDataLayer : public Layer<Dtype>, public InternalThread {
+ public:
+  explicit HDF5StreamDataLayer(const LayerParameter& param)
+      : Layer<Dtype>(param), chunk_rows_(1024), prefetch_(4), epoch_(0),
+        next_chunk_(0), pool_rows_(0), pool_pos_(0), file_(-1),
+        file_index_(-1) {
+    const char* env = getenv("CAFFE_HDF5_CHUNK_ROWS");
+    if (env != NULL && atoi(env) > 0) {
+      chunk_rows_ = atoi(env);
+    }
+    env = getenv("CAFFE_HDF5_PREFETCH");
+    if (env != NULL && atoi(env) > 0) {
+      prefetch_ = atoi(env);
+    }
+  }
+  virtual ~HDF5StreamDataLayer() { StopInternalThread(); }
+
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    const HDF5DataParameter& param = this->layer_param_.hdf5_data_param();
+    batch_size_ = param.batch_size();
+    CHECK_GT(batch_size_, 0) << "batch_size must be positive";
+    shuffle_ = param.shuffle();
+    std::ifstream source(param.source().c_str());
+    CHECK(source.is_open()) << "Failed to open source file "
+                            << param.source();
+    string line;
+    while (source >> line) {
+      filenames_.push_back(line);
+    }
+    CHECK_GT(filenames_.size(), 0) << "No files in " << param.source();
+
+    // Row shapes come from the first file; every file must agree. Chunks
+    // are numbered across all files and dealt out to the solvers in turn.
+    const int solver_count = Caffe::solver_count();
+    const int solver_rank = Caffe::solver_rank();
+    int num_chunks = 0;
+    row_shapes_.resize(top.size());
+    for (int f = 0; f < filenames_.size(); ++f) {
+      hid_t file = H5Fopen(filenames_[f].c_str(), H5F_ACC_RDONLY,
+          H5P_DEFAULT);
+      CHECK_GE(file, 0) << "Failed opening HDF5 file " << filenames_[f];
+      hsize_t rows = 0;
+      for (int i = 0; i < top.size(); ++i) {
+        vector<hsize_t> dims = DatasetDims(file, this->layer_param_.top(i));
+        const vector<int> row_shape(dims.begin() + 1, dims.end());
+        if (f == 0) {
+          row_shapes_[i] = row_shape;
+        }
+        CHECK(row_shape == row_shapes_[i]) << "Dataset "
+            << this->layer_param_.top(i) << " of " << filenames_[f]
+            << " has a different shape than in " << filenames_[0];
+        if (i == 0) {
+          rows = dims[0];
+        }
+        CHECK_EQ(dims[0], rows) << "Datasets of " << filenames_[f]
+                                << " differ in length";
+      }
+      H5Fclose(file);
+      for (hsize_t start = 0; start < rows; start += chunk_rows_) {
+        if (num_chunks++ % solver_count != solver_rank) {
+          continue;
+        }
+        Chunk chunk = { f, start,
+                        std::min<hsize_t>(chunk_rows_, rows - start) };
+        chunks_.push_back(chunk);
+      }
+    }
+    CHECK_GT(chunks_.size(), 0) << "The files of " << param.source()
+        << " hold " << num_chunks << " chunks, none for solver "
+        << solver_rank << " of " << solver_count;
+    row_dims_.resize(top.size());
+    for (int i = 0; i < top.size(); ++i) {
+      vector<int> shape(1, batch_size_);
+      shape.insert(shape.end(), row_shapes_[i].begin(), row_shapes_[i].end());
+      top[i]->Reshape(shape);
+      row_dims_[i] = top[i]->count(1);
+    }
+    LOG(INFO) << "Streaming " << chunks_.size() << " of " << num_chunks
+              << " chunks of up to " << chunk_rows_ << " rows from "
+              << filenames_.size() << " files";
+
+    batches_.resize(prefetch_);
+    for (int b = 0; b < batches_.size(); ++b) {
+      batches_[b].resize(top.size());
+      for (int i = 0; i < top.size(); ++i) {
+        batches_[b][i].reset(new Blob<Dtype>(top[i]->shape()));
+        // Touch the memory here, not on the reader thread.
+        batches_[b][i]->mutable_cpu_data();
+      }
+      free_.push_back(&batches_[b]);
+    }
+    StartInternalThread();
+  }
+
+  // Data layers have no bottoms, so reshaping is trivial.
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {}
+
+  virtual inline const char* type() const { return "HDF5StreamData"; }
+  virtual inline int ExactNumBottomBlobs() const { return 0; }
+  virtual inline int MinTopBlobs() const { return 1; }
+
+  HDF5StreamStats stats() const {
+    boost::mutex::scoped_lock lock(mutex_);
+    return stats_;
+  }
+
+ protected:
+  typedef vector<shared_ptr<Blob<Dtype> > > StreamBatch;
+  struct Chunk {
+    int file;
+    hsize_t start;
+    hsize_t rows;
+  };
+  /// Chunks whose rows are shuffled together.
+  static const int kShuffleChunks = 4;
+
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    StreamBatch* batch;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (full_.empty()) {
+        ++stats_.stalls;
+        CPUTimer timer;
+        timer.Start();
+        while (full_.empty()) {
+          cond_.wait(lock);
+        }
+        timer.Stop();
+        stats_.stall_seconds += timer.MilliSeconds() / 1000;
+      }
+      batch = full_.front();
+      full_.pop_front();
+      ++stats_.batches;
+    }
+    for (int i = 0; i < top.size(); ++i) {
+      caffe_copy((*batch)[i]->count(), (*batch)[i]->cpu_data(),
+          top[i]->mutable_cpu_data());
+    }
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      free_.push_back(batch);
+    }
+    cond_.notify_all();
+  }
+
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {}
+
+  virtual void InternalThreadEntry() {
+    try {
+      order_ = chunks_;
+      if (shuffle_) {
+        shuffle(order_.begin(), order_.end());
+      }
+      while (!must_stop()) {
+        StreamBatch* batch;
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          while (free_.empty()) {
+            cond_.wait(lock);
+          }
+          batch = free_.front();
+          free_.pop_front();
+        }
+        for (int r = 0; r < batch_size_; ++r) {
+          if (pool_pos_ == pool_rows_) {
+            FillPool();
+          }
+          const int row = pool_order_[pool_pos_++];
+          for (int i = 0; i < batch->size(); ++i) {
+            caffe_copy(row_dims_[i], &pool_[i][0] + row * row_dims_[i],
+                (*batch)[i]->mutable_cpu_data() + r * row_dims_[i]);
+          }
+        }
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          full_.push_back(batch);
+        }
+        cond_.notify_all();
+      }
+    } catch (boost::thread_interrupted&) {
+      // Interrupted exception is expected on shutdown
+    }
+    CloseFile();
+  }
+
+  /// Reads the next chunks of the epoch into the shuffle pool.
+  void FillPool() {
+    int window = 1;
+    if (shuffle_) {
+      window = kShuffleChunks;
+    }
+    pool_.resize(row_dims_.size());
+    pool_rows_ = 0;
+    CPUTimer timer;
+    timer.Start();
+    uint64_t bytes = 0;
+    for (int c = 0; c < window; ++c) {
+      if (next_chunk_ == order_.size()) {
+        if (c > 0) {
+          break;  // finish the epoch with a partial window
+        }
+        EndEpoch();
+      }
+      const Chunk& chunk = order_[next_chunk_++];
+      const hid_t file = OpenFile(chunk.file);
+      for (int i = 0; i < row_dims_.size(); ++i) {
+        pool_[i].resize((pool_rows_ + chunk.rows) * row_dims_[i]);
+        ReadRows(file, this->layer_param_.top(i), chunk.start, chunk.rows,
+            &pool_[i][0] + pool_rows_ * row_dims_[i]);
+        bytes += chunk.rows * row_dims_[i] * sizeof(Dtype);
+      }
+      pool_rows_ += chunk.rows;
+    }
+    timer.Stop();
+    pool_order_.resize(pool_rows_);
+    for (int r = 0; r < pool_rows_; ++r) {
+      pool_order_[r] = r;
+    }
+    if (shuffle_) {
+      shuffle(pool_order_.begin(), pool_order_.end());
+    }
+    pool_pos_ = 0;
+    boost::mutex::scoped_lock lock(mutex_);
+    stats_.bytes_read += bytes;
+    stats_.read_seconds += timer.MilliSeconds() / 1000;
+  }
+
+  /// Returns file index open; the previous file is closed when it changes.
+  hid_t OpenFile(int index) {
+    if (index != file_index_) {
+      CloseFile();
+      file_ = H5Fopen(filenames_[index].c_str(), H5F_ACC_RDONLY, H5P_DEFAULT);
+      CHECK_GE(file_, 0) << "Failed opening HDF5 file " << filenames_[index];
+      file_index_ = index;
+    }
+    return file_;
+  }
+
+  void CloseFile() {
+    if (file_ >= 0) {
+      H5Fclose(file_);
+    }
+    file_ = -1;
+    file_index_ = -1;
+  }
+
+  void EndEpoch() {
+    next_chunk_ = 0;
+    if (shuffle_) {
+      shuffle(order_.begin(), order_.end());
+    }
+    const HDF5StreamStats stats = this->stats();
+    LOG(INFO) << this->layer_param_.name() << ": epoch " << ++epoch_
+              << " done; read " << stats.bytes_read / (1024 * 1024)
+              << " MB at " << stats.bytes_read / (1024 * 1024) /
+                 std::max(stats.read_seconds, 1e-9)
+              << " MB/s, " << stats.stalls << " of " << stats.batches
+              << " batches stalled for " << stats.stall_seconds << " s";
+  }
+
+  static vector<hsize_t> DatasetDims(hid_t file, const string& name) {
+    hid_t dataset = H5Dopen2(file, name.c_str(), H5P_DEFAULT);
+    CHECK_GE(dataset, 0) << "Failed to find HDF5 dataset " << name;
+    hid_t space = H5Dget_space(dataset);
+    const int num_axes = H5Sget_simple_extent_ndims(space);
+    CHECK_GT(num_axes, 0) << "HDF5 dataset " << name
+                          << " is a scalar; it needs a row axis";
+    vector<hsize_t> dims(num_axes);
+    H5Sget_simple_extent_dims(space, &dims[0], NULL);
+    H5Sclose(space);
+    H5Dclose(dataset);
+    return dims;
+  }
+
+  /// Reads rows [start, start + rows) of dataset name into data.
+  static void ReadRows(hid_t file, const string& name, hsize_t start,
+      hsize_t rows, Dtype* data) {
+    hid_t dataset = H5Dopen2(file, name.c_str(), H5P_DEFAULT);
+    CHECK_GE(dataset, 0) << "Failed to find HDF5 dataset " << name;
+    hid_t space = H5Dget_space(dataset);
+    const int num_axes = H5Sget_simple_extent_ndims(space);
+    vector<hsize_t> offset(num_axes, 0), count(num_axes);
+    H5Sget_simple_extent_dims(space, &count[0], NULL);
+    offset[0] = start;
+    count[0] = rows;
+    CHECK_GE(H5Sselect_hyperslab(space, H5S_SELECT_SET, &offset[0], NULL,
+        &count[0], NULL), 0);
+    hid_t memory = H5Screate_simple(num_axes, &count[0], NULL);
+    const hid_t type = sizeof(Dtype) == sizeof(float) ? H5T_NATIVE_FLOAT :
+        H5T_NATIVE_DOUBLE;
+    CHECK_GE(H5Dread(dataset, type, memory, space, H5P_DEFAULT, data), 0)
+        << "Failed to read rows " << start << "-" << start + rows << " of "
+        << name;
+    H5Sclose(memory);
+    H5Sclose(space);
+    H5Dclose(dataset);
+  }
+
+  int batch_size_;
+  bool shuffle_;
+  int chunk_rows_;
+  int prefetch_;
+  vector<string> filenames_;
+  vector<vector<int> > row_shapes_;
+  vector<int> row_dims_;
+  vector<Chunk> chunks_;
+
+  // Reader thread state.
+  vector<Chunk> order_;
+  int epoch_;
+  int next_chunk_;
+  vector<vector<Dtype> > pool_;
+  vector<int> pool_order_;
+  int pool_rows_;
+  int pool_pos_;
+  hid_t file_;
+  int file_index_;
+
+  vector<StreamBatch> batches_;
+  std::deque<StreamBatch*> free_;
+  std::deque<StreamBatch*> full_;
+  HDF5StreamStats stats_;
+  mutable boost::mutex mutex_;
+  boost::condition_variable cond_;
+};
+
+template <typename Dtype>
+shared_ptr<Layer<Dtype> > GetHDF5StreamDataLayer(const LayerParameter& param) {
+  return shared_ptr<Layer<Dtype> >(new HDF5StreamDataLayer<Dtype>(param));
+}
+
+/**
+ * @brief Registers the "HDF5StreamData" layer type, so nets created
+ *        afterwards can use it. Idempotent.
+ */
+inline void RegisterHDF5StreamDataLayer() {
+  if (!LayerRegistry<float>::Registry().count("HDF5StreamData")) {
+    LayerRegistry<float>::AddCreator("HDF5StreamData",
+        &GetHDF5StreamDataLayer<float>);
+  }
+  if (!LayerRegistry<double>::Registry().count("HDF5StreamData")) {
+    LayerRegistry<double>::AddCreator("HDF5StreamData",
+        &GetHDF5StreamDataLayer<double>);
+  }
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_HDF5_STREAM_DATA_LAYER_HPP_
@@ -0,0 +1,141 @@
+#ifndef CAFFE_OVERSAMPLE_LAYER_HPP_
+#define CAFFE_OVERSAMPLE_LAYER_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Takes the four corner crops and the center crop of every image,
+ *        followed by their mirror images, as caffe.io.oversample does.
+ *
+ * The crop size is transform_param.crop_size. The kNumCrops crops of image
+ * n are items n * kNumCrops to (n + 1) * kNumCrops - 1 of the top, so a
+ * later layer can aggregate them per image (see AddCropAggregation).
+ */
+template <typename Dtype>
+class OversampleLayer : public Layer<Dtype> {
+ public:
+  static const int kNumCrops = 10;
+
+  explicit OversampleLayer(const LayerParameter& param)
+      : Layer<Dtype>(param) {}
+
+  virtual void LayerSetUp(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    crop_size_ = this->layer_param_.transform_param().crop_size();
+    CHECK_GT(crop_size_, 0) << "Oversample needs transform_param.crop_size";
+  }
+
+  virtual void Reshape(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    CHECK_EQ(bottom[0]->num_axes(), 4) << "Oversample takes N x C x H x W";
+    CHECK_GE(bottom[0]->height(), crop_size_);
+    CHECK_GE(bottom[0]->width(), crop_size_);
+    vector<int> shape = bottom[0]->shape();
+    shape[0] *= kNumCrops;
+    shape[2] = crop_size_;
+    shape[3] = crop_size_;
+    top[0]->Reshape(shape);
+  }
+
+  virtual inline const char* type() const { return "Oversample"; }
+  virtual inline int ExactNumBottomBlobs() const { return 1; }
+  virtual inline int ExactNumTopBlobs() const { return 1; }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    const Dtype* bottom_data = bottom[0]->cpu_data();
+    Dtype* top_data = top[0]->mutable_cpu_data();
+    for (int n = 0; n < bottom[0]->num(); ++n) {
+      for (int k = 0; k < kNumCrops / 2; ++k) {
+        for (int c = 0; c < bottom[0]->channels(); ++c) {
+          const Dtype* src = bottom_data + bottom[0]->offset(n, c,
+              OffsetH(bottom[0], k), OffsetW(bottom[0], k));
+          Dtype* dst = top_data + top[0]->offset(n * kNumCrops + k, c);
+          Dtype* mirrored = top_data +
+              top[0]->offset(n * kNumCrops + kNumCrops / 2 + k, c);
+          for (int h = 0; h < crop_size_; ++h) {
+            caffe_copy(crop_size_, src, dst);
+            for (int w = 0; w < crop_size_; ++w) {
+              mirrored[crop_size_ - 1 - w] = src[w];
+            }
+            src += bottom[0]->width();
+            dst += crop_size_;
+            mirrored += crop_size_;
+          }
+        }
+      }
+    }
+  }
+
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+    if (!propagate_down[0]) { return; }
+    const Dtype* top_diff = top[0]->cpu_diff();
+    Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
+    caffe_set(bottom[0]->count(), Dtype(0), bottom_diff);
+    for (int n = 0; n < bottom[0]->num(); ++n) {
+      for (int k = 0; k < kNumCrops / 2; ++k) {
+        for (int c = 0; c < bottom[0]->channels(); ++c) {
+          Dtype* dst = bottom_diff + bottom[0]->offset(n, c,
+              OffsetH(bottom[0], k), OffsetW(bottom[0], k));
+          const Dtype* src = top_diff + top[0]->offset(n * kNumCrops + k, c);
+          const Dtype* mirrored = top_diff +
+              top[0]->offset(n * kNumCrops + kNumCrops / 2 + k, c);
+          for (int h = 0; h < crop_size_; ++h) {
+            for (int w = 0; w < crop_size_; ++w) {
+              dst[w] += src[w] + mirrored[crop_size_ - 1 - w];
+            }
+            dst += bottom[0]->width();
+            src += crop_size_;
+            mirrored += crop_size_;
+          }
+        }
+      }
+    }
+  }
+
+  // Crops 0-3 are the corners in reading order, crop 4 is the center.
+  int OffsetH(const Blob<Dtype>* bottom, int k) const {
+    const int margin = bottom->height() - crop_size_;
+    return k == 4 ? margin / 2 : (k < 2 ? 0 : margin);
+  }
+  int OffsetW(const Blob<Dtype>* bottom, int k) const {
+    const int margin = bottom->width() - crop_size_;
+    return k == 4 ? margin / 2 : (k % 2 == 0 ? 0 : margin);
+  }
+
+  int crop_size_;
+};
+
+template <typename Dtype>
+shared_ptr<Layer<Dtype> > GetOversampleLayer(const LayerParameter& param) {
+  return shared_ptr<Layer<Dtype> >(new OversampleLayer<Dtype>(param));
+}
+
+/**
+ * @brief Registers the "Oversample" layer type, so nets created afterwards
+ *        can use it. Idempotent.
+ */
+inline void RegisterOversampleLayer() {
+  if (!LayerRegistry<float>::Registry().count("Oversample")) {
+    LayerRegistry<float>::AddCreator("Oversample",
+        &GetOversampleLayer<float>);
+  }
+  if (!LayerRegistry<double>::Registry().count("Oversample")) {
+    LayerRegistry<double>::AddCreator("Oversample",
+        &GetOversampleLayer<double>);
+  }
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_OVERSAMPLE_LAYER_HPP_
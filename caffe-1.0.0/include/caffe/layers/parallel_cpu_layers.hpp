@@ -0,0 +1,242 @@
+#ifndef CAFFE_PARALLEL_CPU_LAYERS_HPP_
+#define CAFFE_PARALLEL_CPU_LAYERS_HPP_
+
+#include <algorithm>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/parallel_math.hpp"
+
+#include "caffe/layers/eltwise_layer.hpp"
+#include "caffe/layers/relu_layer.hpp"
+#include "caffe/layers/scale_layer.hpp"
+
+namespace caffe {
+
+/**
+ * @brief ReLULayer whose CPU forward and backward loops are threaded with
+ *        CAFFE_PARALLEL_FOR; results are bit-identical to ReLULayer.
+ */
+template <typename Dtype>
+class ParallelReLULayer : public ReLULayer<Dtype> {
+ public:
+  explicit ParallelReLULayer(const LayerParameter& param)
+      : ReLULayer<Dtype>(param) {}
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    const Dtype* bottom_data = bottom[0]->cpu_data();
+    Dtype* top_data = top[0]->mutable_cpu_data();
+    const int count = bottom[0]->count();
+    const Dtype negative_slope =
+        this->layer_param_.relu_param().negative_slope();
+    CAFFE_PARALLEL_FOR(i, count,
+        top_data[i] = std::max(bottom_data[i], Dtype(0))
+            + negative_slope * std::min(bottom_data[i], Dtype(0)));
+  }
+
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+    if (!propagate_down[0]) {
+      return;
+    }
+    const Dtype* bottom_data = bottom[0]->cpu_data();
+    const Dtype* top_diff = top[0]->cpu_diff();
+    Dtype* bottom_diff = bottom[0]->mutable_cpu_diff();
+    const int count = bottom[0]->count();
+    const Dtype negative_slope =
+        this->layer_param_.relu_param().negative_slope();
+    CAFFE_PARALLEL_FOR(i, count,
+        bottom_diff[i] = top_diff[i] * ((bottom_data[i] > 0)
+            + negative_slope * (bottom_data[i] <= 0)));
+  }
+};
+
+/**
+ * @brief EltwiseLayer with a threaded SUM forward and backward and PROD
+ *        forward. SUM adds all bottoms in one pass over memory, in the same
+ *        order as EltwiseLayer; MAX and the PROD backward use EltwiseLayer.
+ */
+template <typename Dtype>
+class ParallelEltwiseLayer : public EltwiseLayer<Dtype> {
+ public:
+  explicit ParallelEltwiseLayer(const LayerParameter& param)
+      : EltwiseLayer<Dtype>(param) {}
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    const int count = top[0]->count();
+    Dtype* top_data = top[0]->mutable_cpu_data();
+    switch (this->op_) {
+    case EltwiseParameter_EltwiseOp_PROD:
+      caffe_parallel_mul(count, bottom[0]->cpu_data(), bottom[1]->cpu_data(),
+          top_data);
+      for (int i = 2; i < bottom.size(); ++i) {
+        caffe_parallel_mul(count, top_data, bottom[i]->cpu_data(), top_data);
+      }
+      break;
+    case EltwiseParameter_EltwiseOp_SUM: {
+      sum_inputs_.resize(bottom.size());
+      for (int i = 0; i < bottom.size(); ++i) {
+        sum_inputs_[i] = bottom[i]->cpu_data();
+      }
+      const Dtype* const* inputs = &sum_inputs_[0];
+      const Dtype* coeffs = &this->coeffs_[0];
+      const int num_inputs = bottom.size();
+      CAFFE_PARALLEL_FOR(i, count,
+          top_data[i] = SumAt(i, num_inputs, inputs, coeffs));
+      break;
+    }
+    default:
+      EltwiseLayer<Dtype>::Forward_cpu(bottom, top);
+    }
+  }
+
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+    if (this->op_ != EltwiseParameter_EltwiseOp_SUM) {
+      EltwiseLayer<Dtype>::Backward_cpu(top, propagate_down, bottom);
+      return;
+    }
+    const int count = top[0]->count();
+    const Dtype* top_diff = top[0]->cpu_diff();
+    for (int i = 0; i < bottom.size(); ++i) {
+      if (propagate_down[i]) {
+        caffe_parallel_scale(count, this->coeffs_[i], top_diff,
+            bottom[i]->mutable_cpu_diff());
+      }
+    }
+  }
+
+  static inline Dtype SumAt(const int i, const int num_inputs,
+      const Dtype* const* inputs, const Dtype* coeffs) {
+    Dtype sum = 0;
+    for (int j = 0; j < num_inputs; ++j) {
+      sum += coeffs[j] * inputs[j][i];
+    }
+    return sum;
+  }
+
+  vector<const Dtype*> sum_inputs_;
+};
+
+/**
+ * @brief ScaleLayer with a threaded CPU forward that also applies the bias
+ *        term in the same pass. Matches ScaleLayer up to float rounding;
+ *        Backward is ScaleLayer's.
+ */
+template <typename Dtype>
+class ParallelScaleLayer : public ScaleLayer<Dtype> {
+ public:
+  explicit ParallelScaleLayer(const LayerParameter& param)
+      : ScaleLayer<Dtype>(param) {}
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    const int count = bottom[0]->count();
+    if (bottom[0] == top[0]) {
+      // In-place computation; Backward needs the bottom data.
+      caffe_copy(count, bottom[0]->cpu_data(),
+          this->temp_.mutable_cpu_data());
+    }
+    const Dtype* bottom_data = bottom[0]->cpu_data();
+    const Dtype* scale_data =
+        (bottom.size() > 1 ? bottom[1] : this->blobs_[0].get())->cpu_data();
+    const Dtype* bias_data = this->bias_layer_ ?
+        this->bias_layer_->blobs()[0]->cpu_data() : NULL;
+    Dtype* top_data = top[0]->mutable_cpu_data();
+    const int scale_dim = this->scale_dim_;
+    const int inner_dim = this->inner_dim_;
+    const int planes = this->outer_dim_ * scale_dim;
+#ifdef _OPENMP
+    const int threads = caffe_parallel_threads(count);
+    #pragma omp parallel for num_threads(threads) if (threads > 1) \
+        schedule(static)
+#endif
+    for (int p = 0; p < planes; ++p) {
+      const int d = p % scale_dim;
+      const Dtype factor = scale_data[d];
+      const Dtype bias = bias_data ? bias_data[d] : Dtype(0);
+      const Dtype* in = bottom_data + p * inner_dim;
+      Dtype* out = top_data + p * inner_dim;
+      for (int i = 0; i < inner_dim; ++i) {
+        out[i] = factor * in[i] + bias;
+      }
+    }
+  }
+};
+
+// Creators installed by EnableParallelCPULayers. Layers that ask for another
+// engine, or that are created in GPU mode, go to the original creators.
+template <typename Dtype>
+class ParallelCPULayerCreators {
+ public:
+  typedef typename LayerRegistry<Dtype>::Creator Creator;
+
+  static Creator& original_relu() {
+    static Creator creator = NULL;
+    return creator;
+  }
+  static Creator& original_eltwise() {
+    static Creator creator = NULL;
+    return creator;
+  }
+  static Creator& original_scale() {
+    static Creator creator = NULL;
+    return creator;
+  }
+
+  static shared_ptr<Layer<Dtype> > ReLU(const LayerParameter& param) {
+    const int engine = param.relu_param().engine();
+    if (engine == ReLUParameter_Engine_CAFFE ||
+        (engine == ReLUParameter_Engine_DEFAULT &&
+         Caffe::mode() == Caffe::CPU)) {
+      return shared_ptr<Layer<Dtype> >(new ParallelReLULayer<Dtype>(param));
+    }
+    return original_relu()(param);
+  }
+  static shared_ptr<Layer<Dtype> > Eltwise(const LayerParameter& param) {
+    if (Caffe::mode() == Caffe::CPU) {
+      return shared_ptr<Layer<Dtype> >(new ParallelEltwiseLayer<Dtype>(param));
+    }
+    return original_eltwise()(param);
+  }
+  static shared_ptr<Layer<Dtype> > Scale(const LayerParameter& param) {
+    if (Caffe::mode() == Caffe::CPU) {
+      return shared_ptr<Layer<Dtype> >(new ParallelScaleLayer<Dtype>(param));
+    }
+    return original_scale()(param);
+  }
+
+  static void Install() {
+    const string owner = "EnableParallelCPULayers";
+    original_relu() = ReplaceLayerCreator<Dtype>("ReLU",
+        &ParallelCPULayerCreators<Dtype>::ReLU, owner);
+    original_eltwise() = ReplaceLayerCreator<Dtype>("Eltwise",
+        &ParallelCPULayerCreators<Dtype>::Eltwise, owner);
+    original_scale() = ReplaceLayerCreator<Dtype>("Scale",
+        &ParallelCPULayerCreators<Dtype>::Scale, owner);
+  }
+};
+
+/**
+ * @brief Makes the ReLU, Eltwise and Scale layer types create the threaded
+ *        CPU variants above for every Net constructed afterwards. The
+ *        elementwise kernels inside libcaffe (caffe_add, caffe_exp, ...)
+ *        stay serial; these layers call caffe_parallel_* instead.
+ *        Idempotent.
+ */
+template <typename Dtype>
+void EnableParallelCPULayers() {
+  ParallelCPULayerCreators<Dtype>::Install();
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_PARALLEL_CPU_LAYERS_HPP_
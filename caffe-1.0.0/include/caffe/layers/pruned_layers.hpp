@@ -0,0 +1,300 @@
+#ifndef CAFFE_PRUNED_LAYERS_HPP_
+#define CAFFE_PRUNED_LAYERS_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/im2col.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/sparse_weights.hpp"
+
+#include "caffe/layers/conv_layer.hpp"
+#include "caffe/layers/inner_product_layer.hpp"
+
+namespace caffe {
+
+/**
+ * @brief InnerProductLayer that runs Forward_cpu on a SparseWeights copy of
+ *        its weights once Sparsify() finds enough of them zero.
+ *
+ * The dense weights are kept, so Densify() switches back; a sparsified layer
+ * is inference only, since its sparse copy would go stale.
+ */
+template <typename Dtype>
+class PrunedInnerProductLayer : public InnerProductLayer<Dtype> {
+ public:
+  explicit PrunedInnerProductLayer(const LayerParameter& param)
+      : InnerProductLayer<Dtype>(param) {}
+
+  /**
+   * @brief Builds the sparse copy of the current weights if, including the
+   *        zeros padding partial blocks, at least min_sparsity of the stored
+   *        matrix would be zero. Returns whether it did.
+   */
+  bool Sparsify(const double min_sparsity) {
+    const Blob<Dtype>& weight = *this->blobs_[0];
+    const SparseFormat format = SparseWeights<Dtype>::ChooseFormat(
+        weight.cpu_data(), this->N_, this->K_, this->transpose_);
+    shared_ptr<SparseWeights<Dtype> > sparse(new SparseWeights<Dtype>());
+    sparse->Build(weight.cpu_data(), this->N_, this->K_, this->transpose_,
+        format);
+    sparse_.reset();
+    if (1 - static_cast<double>(sparse->stored_values()) / weight.count() <
+        min_sparsity) {
+      return false;
+    }
+    sparse_ = sparse;
+    return true;
+  }
+  void Densify() { sparse_.reset(); }
+
+  inline bool sparse() const { return sparse_ != NULL; }
+  inline const SparseWeights<Dtype>* sparse_weights() const {
+    return sparse_.get();
+  }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    if (!sparse()) {
+      InnerProductLayer<Dtype>::Forward_cpu(bottom, top);
+      return;
+    }
+    const int M = this->M_;
+    const int N = this->N_;
+    const int K = this->K_;
+    const Dtype* bottom_data = bottom[0]->cpu_data();
+    Dtype* top_data = top[0]->mutable_cpu_data();
+    if (M == 1) {
+      sparse_->Multiply(bottom_data, 1, top_data);
+    } else {
+      // top^T (N x M) = W bottom^T (K x M)
+      input_.resize(K * M);
+      output_.resize(N * M);
+      for (int m = 0; m < M; ++m) {
+        for (int k = 0; k < K; ++k) {
+          input_[k * M + m] = bottom_data[m * K + k];
+        }
+      }
+      sparse_->Multiply(&input_[0], M, &output_[0]);
+      for (int m = 0; m < M; ++m) {
+        for (int n = 0; n < N; ++n) {
+          top_data[m * N + n] = output_[n * M + m];
+        }
+      }
+    }
+    if (this->bias_term_) {
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasNoTrans, M, N, 1, (Dtype)1.,
+          this->bias_multiplier_.cpu_data(), this->blobs_[1]->cpu_data(),
+          (Dtype)1., top_data);
+    }
+  }
+
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+    CHECK(!sparse()) << "Layer " << this->layer_param_.name()
+        << " has sparse weights and supports inference only";
+    InnerProductLayer<Dtype>::Backward_cpu(top, propagate_down, bottom);
+  }
+
+  shared_ptr<SparseWeights<Dtype> > sparse_;
+  vector<Dtype> input_;
+  vector<Dtype> output_;
+};
+
+/**
+ * @brief ConvolutionLayer that runs Forward_cpu on SparseWeights copies of
+ *        its weights (one per group) once Sparsify() finds enough of them
+ *        zero, multiplying them into the im2col buffer as
+ *        BaseConvolutionLayer::forward_cpu_gemm does with the dense weights.
+ */
+template <typename Dtype>
+class PrunedConvolutionLayer : public ConvolutionLayer<Dtype> {
+ public:
+  explicit PrunedConvolutionLayer(const LayerParameter& param)
+      : ConvolutionLayer<Dtype>(param) {}
+
+  /// @brief As PrunedInnerProductLayer::Sparsify.
+  bool Sparsify(const double min_sparsity) {
+    const Blob<Dtype>& weight = *this->blobs_[0];
+    const int rows = this->num_output_ / this->group_;
+    const int cols = weight.count(1);
+    vector<shared_ptr<SparseWeights<Dtype> > > sparse(this->group_);
+    int stored = 0;
+    for (int g = 0; g < this->group_; ++g) {
+      const Dtype* w = weight.cpu_data() + this->weight_offset_ * g;
+      sparse[g].reset(new SparseWeights<Dtype>());
+      sparse[g]->Build(w, rows, cols, false,
+          SparseWeights<Dtype>::ChooseFormat(w, rows, cols, false));
+      stored += sparse[g]->stored_values();
+    }
+    sparse_.clear();
+    if (1 - static_cast<double>(stored) / weight.count() < min_sparsity) {
+      return false;
+    }
+    sparse_.swap(sparse);
+    return true;
+  }
+  void Densify() { sparse_.clear(); }
+
+  inline bool sparse() const { return !sparse_.empty(); }
+  inline const SparseWeights<Dtype>* sparse_weights(int group) const {
+    return sparse_[group].get();
+  }
+
+ protected:
+  virtual void Forward_cpu(const vector<Blob<Dtype>*>& bottom,
+      const vector<Blob<Dtype>*>& top) {
+    if (!sparse()) {
+      ConvolutionLayer<Dtype>::Forward_cpu(bottom, top);
+      return;
+    }
+    const int kernel_dim = this->blobs_[0]->count(1);
+    const int spatial_dim = this->out_spatial_dim_;
+    const int col_offset = kernel_dim * spatial_dim;
+    const int output_offset = this->num_output_ / this->group_ * spatial_dim;
+    for (int i = 0; i < bottom.size(); ++i) {
+      const Dtype* bottom_data = bottom[i]->cpu_data();
+      Dtype* top_data = top[i]->mutable_cpu_data();
+      for (int n = 0; n < this->num_; ++n) {
+        const Dtype* col_buff = bottom_data + n * this->bottom_dim_;
+        if (!this->is_1x1_) {
+          col_.resize(col_offset * this->group_);
+          Im2col(col_buff, &col_[0]);
+          col_buff = &col_[0];
+        }
+        Dtype* output = top_data + n * this->top_dim_;
+        for (int g = 0; g < this->group_; ++g) {
+          sparse_[g]->Multiply(col_buff + col_offset * g, spatial_dim,
+              output + output_offset * g);
+        }
+        if (this->bias_term_) {
+          this->forward_cpu_bias(output, this->blobs_[1]->cpu_data());
+        }
+      }
+    }
+  }
+
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+    CHECK(!sparse()) << "Layer " << this->layer_param_.name()
+        << " has sparse weights and supports inference only";
+    ConvolutionLayer<Dtype>::Backward_cpu(top, propagate_down, bottom);
+  }
+
+  // BaseConvolutionLayer::conv_im2col_cpu, which is private.
+  void Im2col(const Dtype* data, Dtype* col_buff) {
+    const int* input_shape = this->conv_input_shape_.cpu_data();
+    const int* kernel = this->kernel_shape_.cpu_data();
+    const int* pad = this->pad_.cpu_data();
+    const int* stride = this->stride_.cpu_data();
+    const int* dilation = this->dilation_.cpu_data();
+    if (!this->force_nd_im2col_ && this->num_spatial_axes_ == 2) {
+      im2col_cpu(data, this->channels_, input_shape[1], input_shape[2],
+          kernel[0], kernel[1], pad[0], pad[1], stride[0], stride[1],
+          dilation[0], dilation[1], col_buff);
+    } else {
+      im2col_nd_cpu(data, this->num_spatial_axes_, input_shape,
+          &this->col_buffer_shape_[0], kernel, pad, stride, dilation,
+          col_buff);
+    }
+  }
+
+  vector<shared_ptr<SparseWeights<Dtype> > > sparse_;
+  vector<Dtype> col_;
+};
+
+template <typename Dtype>
+class PrunedLayerCreators {
+ public:
+  typedef typename LayerRegistry<Dtype>::Creator Creator;
+
+  static Creator& original_convolution() {
+    static Creator creator = NULL;
+    return creator;
+  }
+
+  static shared_ptr<Layer<Dtype> > InnerProduct(const LayerParameter& param) {
+    return shared_ptr<Layer<Dtype> >(
+        new PrunedInnerProductLayer<Dtype>(param));
+  }
+  static shared_ptr<Layer<Dtype> > Convolution(const LayerParameter& param) {
+    const int engine = param.convolution_param().engine();
+    if (engine == ConvolutionParameter_Engine_CAFFE ||
+        (engine == ConvolutionParameter_Engine_DEFAULT &&
+         Caffe::mode() == Caffe::CPU)) {
+      return shared_ptr<Layer<Dtype> >(
+          new PrunedConvolutionLayer<Dtype>(param));
+    }
+    return original_convolution()(param);
+  }
+
+  static void Install() {
+    original_convolution() = ReplaceLayerCreator<Dtype>("Convolution",
+        &PrunedLayerCreators<Dtype>::Convolution, "EnablePrunedLayers");
+    ReplaceLayerCreator<Dtype>("InnerProduct",
+        &PrunedLayerCreators<Dtype>::InnerProduct, "EnablePrunedLayers");
+  }
+};
+
+/**
+ * @brief Makes "InnerProduct" and CPU "Convolution" layers of every Net
+ *        constructed afterwards pruned layers, so SparsifyWeights can find
+ *        them. Cannot be combined with EnableHalfInnerProductLayer or
+ *        EnableRowSparseGradients.
+ */
+template <typename Dtype>
+void EnablePrunedLayers() {
+  PrunedLayerCreators<Dtype>::Install();
+}
+
+/**
+ * @brief Calls Sparsify(min_sparsity) on every pruned layer of net, after
+ *        its trained weights have been loaded, and returns how many layers
+ *        now use sparse weights.
+ *
+ * Whether sparse weights pay off depends on the pattern: with AVX2, 8x1 and
+ * 4x1 blocks beat the dense GEMM from about 80% zeros, and unstructured
+ * (CSR) weights from about 90% for convolutions, less for inner products at
+ * small batch sizes. tools/sparsify_weights measures it per layer.
+ */
+template <typename Dtype>
+int SparsifyWeights(Net<Dtype>* net, const double min_sparsity = 0.8) {
+  int sparsified = 0;
+  int candidates = 0;
+  for (int i = 0; i < net->layers().size(); ++i) {
+    Layer<Dtype>* layer = net->layers()[i].get();
+    PrunedInnerProductLayer<Dtype>* ip =
+        dynamic_cast<PrunedInnerProductLayer<Dtype>*>(layer);
+    PrunedConvolutionLayer<Dtype>* conv =
+        dynamic_cast<PrunedConvolutionLayer<Dtype>*>(layer);
+    if (ip == NULL && conv == NULL) {
+      continue;
+    }
+    ++candidates;
+    const bool sparse = ip != NULL ? ip->Sparsify(min_sparsity) :
+        conv->Sparsify(min_sparsity);
+    if (sparse) {
+      const SparseWeights<Dtype>* weights =
+          ip != NULL ? ip->sparse_weights() : conv->sparse_weights(0);
+      LOG(INFO) << "Layer " << net->layer_names()[i] << " uses "
+                << SparseFormatName(weights->format()) << " sparse weights";
+      ++sparsified;
+    }
+  }
+  if (candidates == 0) {
+    LOG(WARNING) << "No prunable layers in " << net->name()
+                 << "; call EnablePrunedLayers() before creating it";
+  }
+  LOG(INFO) << sparsified << " of " << candidates << " layers of "
+            << net->name() << " use sparse weights";
+  return sparsified;
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_PRUNED_LAYERS_HPP_
@@ -0,0 +1,309 @@
+#ifndef CAFFE_RECURRENT_STEPPER_HPP_
+#define CAFFE_RECURRENT_STEPPER_HPP_
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/util/math_functions.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Stateful, step-wise CPU inference with the weights of an LSTMLayer.
+ *
+ * LSTMLayer runs an unrolled Net of T timesteps and has to be fed the whole
+ * sequence, carrying state between calls through its cont input and
+ * exposed hidden blobs. LSTMStepper instead keeps h and c for num_streams
+ * independent streams between calls, so a stream can be scored as its
+ * tokens arrive, at a cost per token independent of any unrolled length.
+ *
+ * For a chunk of T timesteps Forward does one GEMM for the input transform
+ * of all four gates and all timesteps, then per timestep one GEMM for the
+ * recurrent transform and a single fused pass for the gate nonlinearities and
+ * the cell update. The results equal the unrolled net's, up to float
+ * rounding.
+ *
+ * The weight blobs are shared with the layer, not copied.
+ */
+template <typename Dtype>
+class LSTMStepper {
+ public:
+  LSTMStepper(Layer<Dtype>* lstm, const int num_streams)
+      : num_streams_(num_streams) {
+    CHECK_EQ(string(lstm->type()), "LSTM");
+    CHECK_GT(num_streams, 0);
+    // Parameter order of the unrolled net: W_xc, b_c, [W_xc_static], W_hc.
+    const vector<shared_ptr<Blob<Dtype> > >& blobs = lstm->blobs();
+    CHECK(blobs.size() == 3 || blobs.size() == 4)
+        << "Unexpected LSTM parameters; are the weights initialized?";
+    w_xc_ = blobs[0];
+    b_c_ = blobs[1];
+    if (blobs.size() == 4) {
+      w_xc_static_ = blobs[2];
+    }
+    w_hc_ = blobs.back();
+    hidden_dim_ = w_hc_->shape(1);
+    input_dim_ = w_xc_->shape(1);
+    CHECK_EQ(w_xc_->shape(0), 4 * hidden_dim_);
+    vector<int> state_shape(3);
+    state_shape[0] = 1;
+    state_shape[1] = num_streams_;
+    state_shape[2] = hidden_dim_;
+    h_.Reshape(state_shape);
+    c_.Reshape(state_shape);
+    state_shape[2] = 4 * hidden_dim_;
+    gate_offset_.Reshape(state_shape);
+    ResetGateOffset();
+    Reset();
+  }
+
+  /// @brief Zeroes the state of all streams.
+  void Reset() {
+    caffe_set(h_.count(), Dtype(0), h_.mutable_cpu_data());
+    caffe_set(c_.count(), Dtype(0), c_.mutable_cpu_data());
+  }
+  /// @brief Zeroes the state of one stream, to start a new sequence on it.
+  void Reset(const int stream) {
+    CHECK_LT(stream, num_streams_);
+    caffe_set(hidden_dim_, Dtype(0),
+        h_.mutable_cpu_data() + stream * hidden_dim_);
+    caffe_set(hidden_dim_, Dtype(0),
+        c_.mutable_cpu_data() + stream * hidden_dim_);
+  }
+
+  /**
+   * @brief Sets the static input (num_streams x static dim) of an LSTM with
+   *        one; it is added to the gates of every following timestep.
+   */
+  void SetStaticInput(const Dtype* x_static) {
+    CHECK(w_xc_static_) << "The LSTM has no static input";
+    ResetGateOffset();
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, num_streams_,
+        4 * hidden_dim_, w_xc_static_->shape(1), Dtype(1), x_static,
+        w_xc_static_->cpu_data(), Dtype(1), gate_offset_.mutable_cpu_data());
+  }
+
+  /**
+   * @brief Advances all streams by T timesteps.
+   *
+   * @param x inputs, T x num_streams x input dim, as the LSTM's bottom[0]
+   * @param cont optional T x num_streams continuation indicators, as
+   *        bottom[1]: a 0 resets that stream's state before the timestep.
+   *        NULL continues every stream.
+   * @param h optional output for the hidden states, T x num_streams x
+   *        hidden dim, as the LSTM's top. The last one is also in hidden().
+   */
+  void Forward(const int T, const Dtype* x, const Dtype* cont, Dtype* h) {
+    const int N = num_streams_;
+    const int H = hidden_dim_;
+    if (gates_.count() < T * N * 4 * H) {
+      gates_.Reshape(1, 1, 1, T * N * 4 * H);
+    }
+    Dtype* gates = gates_.mutable_cpu_data();
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, T * N, 4 * H, input_dim_,
+        Dtype(1), x, w_xc_->cpu_data(), Dtype(0), gates);
+    Dtype* h_state = h_.mutable_cpu_data();
+    Dtype* c_state = c_.mutable_cpu_data();
+    const Dtype* offset = gate_offset_.cpu_data();
+    for (int t = 0; t < T; ++t) {
+      if (cont != NULL) {
+        for (int n = 0; n < N; ++n) {
+          if (cont[t * N + n] == 0) {
+            Reset(n);
+          }
+        }
+      }
+      Dtype* gates_t = gates + t * N * 4 * H;
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, N, 4 * H, H, Dtype(1),
+          h_state, w_hc_->cpu_data(), Dtype(1), gates_t);
+      // Gate order as in LSTMUnitLayer: i, f, o, g.
+      for (int n = 0; n < N; ++n) {
+        const Dtype* pre = gates_t + n * 4 * H;
+        const Dtype* off = offset + n * 4 * H;
+        Dtype* c_n = c_state + n * H;
+        Dtype* h_n = h_state + n * H;
+        for (int d = 0; d < H; ++d) {
+          const Dtype i = sigmoid(pre[d] + off[d]);
+          const Dtype f = sigmoid(pre[H + d] + off[H + d]);
+          const Dtype o = sigmoid(pre[2 * H + d] + off[2 * H + d]);
+          const Dtype g = std::tanh(pre[3 * H + d] + off[3 * H + d]);
+          c_n[d] = f * c_n[d] + i * g;
+          h_n[d] = o * std::tanh(c_n[d]);
+        }
+      }
+      if (h != NULL) {
+        caffe_copy(N * H, h_state, h + t * N * H);
+      }
+    }
+  }
+
+  /// @brief One timestep for every stream: x is num_streams x input dim.
+  inline void Step(const Dtype* x, Dtype* h) { Forward(1, x, NULL, h); }
+
+  /// @brief The hidden state h, 1 x num_streams x hidden dim; writable to
+  ///        seed the state, like the LSTM's exposed h_0.
+  inline Blob<Dtype>* hidden() { return &h_; }
+  /// @brief The cell state c, 1 x num_streams x hidden dim.
+  inline Blob<Dtype>* cell() { return &c_; }
+  inline int num_streams() const { return num_streams_; }
+  inline int input_dim() const { return input_dim_; }
+  inline int hidden_dim() const { return hidden_dim_; }
+
+ private:
+  void ResetGateOffset() {
+    Dtype* offset = gate_offset_.mutable_cpu_data();
+    for (int n = 0; n < num_streams_; ++n) {
+      caffe_copy(4 * hidden_dim_, b_c_->cpu_data(),
+          offset + n * 4 * hidden_dim_);
+    }
+  }
+  static inline Dtype sigmoid(Dtype x) {
+    return Dtype(1) / (Dtype(1) + std::exp(-x));
+  }
+
+  const int num_streams_;
+  int input_dim_;
+  int hidden_dim_;
+  shared_ptr<Blob<Dtype> > w_xc_, b_c_, w_xc_static_, w_hc_;
+  Blob<Dtype> h_, c_;
+  /// Bias (plus static input transform) added to every timestep's gates.
+  Blob<Dtype> gate_offset_;
+  Blob<Dtype> gates_;
+
+  DISABLE_COPY_AND_ASSIGN(LSTMStepper);
+};
+
+/**
+ * @brief Stateful, step-wise CPU inference with the weights of an RNNLayer;
+ *        see LSTMStepper. The output transform o_t = tanh(W_ho h_t + b_o)
+ *        is done for all T timesteps of a chunk with one GEMM after the
+ *        recurrence.
+ */
+template <typename Dtype>
+class RNNStepper {
+ public:
+  RNNStepper(Layer<Dtype>* rnn, const int num_streams)
+      : num_streams_(num_streams) {
+    CHECK_EQ(string(rnn->type()), "RNN");
+    CHECK_GT(num_streams, 0);
+    // Parameter order of the unrolled net:
+    // W_xh, b_h, [W_xh_static], W_hh, W_ho, b_o.
+    const vector<shared_ptr<Blob<Dtype> > >& blobs = rnn->blobs();
+    CHECK(blobs.size() == 5 || blobs.size() == 6)
+        << "Unexpected RNN parameters; are the weights initialized?";
+    const int n = blobs.size();
+    w_xh_ = blobs[0];
+    b_h_ = blobs[1];
+    if (n == 6) {
+      w_xh_static_ = blobs[2];
+    }
+    w_hh_ = blobs[n - 3];
+    w_ho_ = blobs[n - 2];
+    b_o_ = blobs[n - 1];
+    hidden_dim_ = w_hh_->shape(1);
+    input_dim_ = w_xh_->shape(1);
+    output_dim_ = w_ho_->shape(0);
+    vector<int> state_shape(3);
+    state_shape[0] = 1;
+    state_shape[1] = num_streams_;
+    state_shape[2] = hidden_dim_;
+    h_.Reshape(state_shape);
+    offset_.Reshape(state_shape);
+    ResetOffset();
+    Reset();
+  }
+
+  void Reset() { caffe_set(h_.count(), Dtype(0), h_.mutable_cpu_data()); }
+  void Reset(const int stream) {
+    CHECK_LT(stream, num_streams_);
+    caffe_set(hidden_dim_, Dtype(0),
+        h_.mutable_cpu_data() + stream * hidden_dim_);
+  }
+
+  void SetStaticInput(const Dtype* x_static) {
+    CHECK(w_xh_static_) << "The RNN has no static input";
+    ResetOffset();
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, num_streams_, hidden_dim_,
+        w_xh_static_->shape(1), Dtype(1), x_static, w_xh_static_->cpu_data(),
+        Dtype(1), offset_.mutable_cpu_data());
+  }
+
+  /**
+   * @brief Advances all streams by T timesteps; x and cont as for
+   *        LSTMStepper::Forward, o receives the T x num_streams x output dim
+   *        outputs (as the RNN's top).
+   */
+  void Forward(const int T, const Dtype* x, const Dtype* cont, Dtype* o) {
+    const int N = num_streams_;
+    const int H = hidden_dim_;
+    if (pre_.count() < T * N * H) {
+      pre_.Reshape(1, 1, 1, T * N * H);
+    }
+    Dtype* pre = pre_.mutable_cpu_data();
+    caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, T * N, H, input_dim_,
+        Dtype(1), x, w_xh_->cpu_data(), Dtype(0), pre);
+    Dtype* h_state = h_.mutable_cpu_data();
+    const Dtype* offset = offset_.cpu_data();
+    for (int t = 0; t < T; ++t) {
+      if (cont != NULL) {
+        for (int n = 0; n < N; ++n) {
+          if (cont[t * N + n] == 0) {
+            Reset(n);
+          }
+        }
+      }
+      Dtype* pre_t = pre + t * N * H;
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, N, H, H, Dtype(1),
+          h_state, w_hh_->cpu_data(), Dtype(1), pre_t);
+      for (int i = 0; i < N * H; ++i) {
+        h_state[i] = std::tanh(pre_t[i] + offset[i]);
+        pre_t[i] = h_state[i];  // keep h_t for the output transform
+      }
+    }
+    if (o != NULL) {
+      for (int i = 0; i < T * N; ++i) {
+        caffe_copy(output_dim_, b_o_->cpu_data(), o + i * output_dim_);
+      }
+      caffe_cpu_gemm<Dtype>(CblasNoTrans, CblasTrans, T * N, output_dim_, H,
+          Dtype(1), pre, w_ho_->cpu_data(), Dtype(1), o);
+      for (int i = 0; i < T * N * output_dim_; ++i) {
+        o[i] = std::tanh(o[i]);
+      }
+    }
+  }
+
+  inline void Step(const Dtype* x, Dtype* o) { Forward(1, x, NULL, o); }
+
+  inline Blob<Dtype>* hidden() { return &h_; }
+  inline int num_streams() const { return num_streams_; }
+  inline int input_dim() const { return input_dim_; }
+  inline int hidden_dim() const { return hidden_dim_; }
+  inline int output_dim() const { return output_dim_; }
+
+ private:
+  void ResetOffset() {
+    Dtype* offset = offset_.mutable_cpu_data();
+    for (int n = 0; n < num_streams_; ++n) {
+      caffe_copy(hidden_dim_, b_h_->cpu_data(), offset + n * hidden_dim_);
+    }
+  }
+
+  const int num_streams_;
+  int input_dim_;
+  int hidden_dim_;
+  int output_dim_;
+  shared_ptr<Blob<Dtype> > w_xh_, b_h_, w_xh_static_, w_hh_, w_ho_, b_o_;
+  Blob<Dtype> h_;
+  Blob<Dtype> offset_;
+  Blob<Dtype> pre_;
+
+  DISABLE_COPY_AND_ASSIGN(RNNStepper);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_RECURRENT_STEPPER_HPP_
@@ -0,0 +1,57 @@
+#ifndef CAFFE_SPARSE_EMBED_LAYER_HPP_
+#define CAFFE_SPARSE_EMBED_LAYER_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/row_sparse.hpp"
+
+#include "caffe/layers/embed_layer.hpp"
+
+namespace caffe {
+
+/**
+ * @brief EmbedLayer that reports the vocabulary rows its Backward writes to
+ *        RowSparseDiffs, so that RowSparseSolver only regularizes, updates
+ *        and clears those rows of the (vocabulary x num_output) weights.
+ */
+template <typename Dtype>
+class SparseEmbedLayer : public EmbedLayer<Dtype> {
+ public:
+  explicit SparseEmbedLayer(const LayerParameter& param)
+      : EmbedLayer<Dtype>(param) {}
+  virtual ~SparseEmbedLayer() {
+    if (this->blobs_.size() > 0) {
+      RowSparseDiffs<Dtype>::Get().Forget(*this->blobs_[0]);
+    }
+  }
+
+ protected:
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+    // EmbedLayer already accumulates only into the rows indexed by bottom.
+    EmbedLayer<Dtype>::Backward_cpu(top, propagate_down, bottom);
+    if (this->param_propagate_down_[0]) {
+      const Dtype* bottom_data = bottom[0]->cpu_data();
+      rows_.resize(this->M_);
+      for (int n = 0; n < this->M_; ++n) {
+        rows_[n] = static_cast<int>(bottom_data[n]);
+      }
+      RowSparseDiffs<Dtype>::Get().MarkRows(*this->blobs_[0], &rows_[0],
+          this->M_);
+    }
+  }
+
+  vector<int> rows_;
+};
+
+template <typename Dtype>
+shared_ptr<Layer<Dtype> > GetSparseEmbedLayer(const LayerParameter& param) {
+  return shared_ptr<Layer<Dtype> >(new SparseEmbedLayer<Dtype>(param));
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_SPARSE_EMBED_LAYER_HPP_
@@ -0,0 +1,105 @@
+#ifndef CAFFE_SPARSE_INNER_PRODUCT_LAYER_HPP_
+#define CAFFE_SPARSE_INNER_PRODUCT_LAYER_HPP_
+
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/layer.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/row_sparse.hpp"
+
+#include "caffe/layers/inner_product_layer.hpp"
+
+namespace caffe {
+
+/**
+ * @brief InnerProductLayer whose weight gradient skips the input features
+ *        that are zero across the whole batch (e.g. bag-of-words or one-hot
+ *        inputs) and reports the rows it wrote to RowSparseDiffs.
+ *
+ * Rows of the weights correspond to input features only when they are
+ * stored transposed (K x N), so this needs inner_product_param { transpose:
+ * true }; otherwise, or when more than half of the features are active, it
+ * computes and reports a dense gradient. Reporting it keeps weights tied to
+ * a SparseEmbedLayer correct.
+ */
+template <typename Dtype>
+class SparseInnerProductLayer : public InnerProductLayer<Dtype> {
+ public:
+  explicit SparseInnerProductLayer(const LayerParameter& param)
+      : InnerProductLayer<Dtype>(param) {}
+  virtual ~SparseInnerProductLayer() {
+    if (this->blobs_.size() > 0) {
+      RowSparseDiffs<Dtype>::Get().Forget(*this->blobs_[0]);
+    }
+  }
+
+ protected:
+  virtual void Backward_cpu(const vector<Blob<Dtype>*>& top,
+      const vector<bool>& propagate_down, const vector<Blob<Dtype>*>& bottom) {
+    if (!this->param_propagate_down_[0]) {
+      InnerProductLayer<Dtype>::Backward_cpu(top, propagate_down, bottom);
+      return;
+    }
+    Blob<Dtype>& weight = *this->blobs_[0];
+    if (!this->transpose_) {
+      InnerProductLayer<Dtype>::Backward_cpu(top, propagate_down, bottom);
+      RowSparseDiffs<Dtype>::Get().MarkDense(weight);
+      return;
+    }
+    const int M = this->M_;
+    const int K = this->K_;
+    const int N = this->N_;
+    const Dtype* bottom_data = bottom[0]->cpu_data();
+    active_.assign(K, false);
+    rows_.clear();
+    for (int m = 0; m < M; ++m) {
+      const Dtype* x = bottom_data + m * K;
+      for (int k = 0; k < K; ++k) {
+        if (x[k] != Dtype(0) && !active_[k]) {
+          active_[k] = true;
+          rows_.push_back(k);
+        }
+      }
+    }
+    if (rows_.size() * 2 > K) {
+      InnerProductLayer<Dtype>::Backward_cpu(top, propagate_down, bottom);
+      RowSparseDiffs<Dtype>::Get().MarkDense(weight);
+      return;
+    }
+    // weight_diff[k, :] += sum_m bottom[m, k] * top_diff[m, :], over the
+    // nonzero bottom entries only.
+    const Dtype* top_diff = top[0]->cpu_diff();
+    Dtype* weight_diff = weight.mutable_cpu_diff();
+    for (int m = 0; m < M; ++m) {
+      for (int i = 0; i < rows_.size(); ++i) {
+        const int k = rows_[i];
+        const Dtype x = bottom_data[m * K + k];
+        if (x != Dtype(0)) {
+          caffe_axpy<Dtype>(N, x, top_diff + m * N, weight_diff + k * N);
+        }
+      }
+    }
+    if (rows_.size() > 0) {
+      RowSparseDiffs<Dtype>::Get().MarkRows(weight, &rows_[0], rows_.size());
+    }
+    // The bias and bottom gradients are InnerProductLayer's.
+    this->param_propagate_down_[0] = false;
+    InnerProductLayer<Dtype>::Backward_cpu(top, propagate_down, bottom);
+    this->param_propagate_down_[0] = true;
+  }
+
+  vector<bool> active_;
+  vector<int> rows_;
+};
+
+template <typename Dtype>
+shared_ptr<Layer<Dtype> > GetSparseInnerProductLayer(
+    const LayerParameter& param) {
+  return shared_ptr<Layer<Dtype> >(new SparseInnerProductLayer<Dtype>(param));
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_SPARSE_INNER_PRODUCT_LAYER_HPP_
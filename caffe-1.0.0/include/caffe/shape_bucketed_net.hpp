@@ -0,0 +1,157 @@
+#ifndef CAFFE_SHAPE_BUCKETED_NET_HPP_
+#define CAFFE_SHAPE_BUCKETED_NET_HPP_
+
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/blob_host_pool.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Runs a deployed net on a small, known set of input shapes without
+ *        any per-call reallocation.
+ *
+ * Every bucket (one shape per net input) gets a Net of its own that shares
+ * the weights of net(). It is reshaped once at construction, so layer
+ * geometry, im2col buffers and top blobs are sized for that bucket; the
+ * Reshape that Layer::Forward still does on every pass then finds every
+ * shape unchanged and allocates nothing. Inputs of any other shape run
+ * through net() itself, reshaped through a BlobHostPool so that with a
+ * pooled HostAllocator policy varying shapes reuse memory.
+ *
+ * Nets run through Net::Forward, so loss layers, loss weights and the
+ * net's forward callbacks behave exactly as usual. This trades memory (one
+ * set of activations per bucket) for latency. The net must take its data
+ * from Input layers, and the input blobs of a bucket net must not be
+ * reshaped. Not thread-safe.
+ */
+template <typename Dtype>
+class ShapeBucketedNet {
+ public:
+  /// One shape per net input, in input_blobs() order.
+  typedef vector<vector<int> > InputShapes;
+
+  ShapeBucketedNet(const NetParameter& param,
+      const vector<InputShapes>& buckets) {
+    Init(param, buckets);
+  }
+  ShapeBucketedNet(const string& param_file, Phase phase,
+      const vector<InputShapes>& buckets) {
+    NetParameter param;
+    ReadNetParamsFromTextFileOrDie(param_file, &param);
+    param.mutable_state()->set_phase(phase);
+    Init(param, buckets);
+  }
+
+  /**
+   * @brief The net that owns the weights (load them here, e.g. with
+   *        CopyTrainedLayersFrom) and runs inputs that match no bucket.
+   */
+  Net<Dtype>* net() { return net_.get(); }
+  int num_buckets() const { return buckets_.size(); }
+  Net<Dtype>* bucket(int index) { return buckets_[index].get(); }
+  const InputShapes& bucket_shapes(int index) const {
+    return bucket_shapes_[index];
+  }
+
+  /// @brief The bucket for exactly these input shapes, or -1.
+  int FindBucket(const InputShapes& shapes) const {
+    for (int i = 0; i < bucket_shapes_.size(); ++i) {
+      if (bucket_shapes_[i] == shapes) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  /**
+   * @brief Returns the net to fill and run for inputs of these shapes: the
+   *        matching bucket net, or net() with its inputs reshaped to them.
+   */
+  Net<Dtype>* NetFor(const InputShapes& shapes) {
+    const int index = FindBucket(shapes);
+    if (index >= 0) {
+      ++hits_;
+      return buckets_[index].get();
+    }
+    ++misses_;
+    CHECK_EQ(shapes.size(), net_->num_inputs());
+    for (int i = 0; i < shapes.size(); ++i) {
+      net_->input_blobs()[i]->Reshape(shapes[i]);
+    }
+    host_pool_.Reshape(net_.get());
+    return net_.get();
+  }
+
+  /**
+   * @brief Runs a net returned by NetFor with Net::Forward and returns its
+   *        output blobs; the total weighted loss goes to loss if given.
+   */
+  const vector<Blob<Dtype>*>& Run(Net<Dtype>* net, Dtype* loss = NULL) {
+    return net->Forward(loss);
+  }
+
+  /**
+   * @brief Copies inputs (one blob per net input) into the net for their
+   *        shapes, runs it and returns its output blobs.
+   */
+  const vector<Blob<Dtype>*>& Forward(const vector<Blob<Dtype>*>& inputs,
+      Dtype* loss = NULL) {
+    InputShapes shapes(inputs.size());
+    for (int i = 0; i < inputs.size(); ++i) {
+      shapes[i] = inputs[i]->shape();
+    }
+    Net<Dtype>* net = NetFor(shapes);
+    for (int i = 0; i < inputs.size(); ++i) {
+      net->input_blobs()[i]->CopyFrom(*inputs[i]);
+    }
+    return Run(net, loss);
+  }
+
+  /// @brief Calls that were served by a bucket net / by net().
+  size_t hits() const { return hits_; }
+  size_t misses() const { return misses_; }
+
+ protected:
+  void Init(const NetParameter& param, const vector<InputShapes>& buckets) {
+    hits_ = 0;
+    misses_ = 0;
+    net_.reset(new Net<Dtype>(param));
+    CHECK_GT(net_->num_inputs(), 0) << "The net needs Input layers";
+    for (int b = 0; b < buckets.size(); ++b) {
+      CHECK_LT(FindBucket(buckets[b]), 0) << "Duplicate bucket " << b;
+      CHECK_EQ(buckets[b].size(), net_->num_inputs())
+          << "Bucket " << b << " needs one shape per net input";
+      shared_ptr<Net<Dtype> > net(new Net<Dtype>(param));
+      net->ShareTrainedLayersWith(net_.get());
+      for (int i = 0; i < buckets[b].size(); ++i) {
+        net->input_blobs()[i]->Reshape(buckets[b][i]);
+      }
+      net->Reshape();
+      buckets_.push_back(net);
+      bucket_shapes_.push_back(buckets[b]);
+      LOG(INFO) << "Prepared shape bucket " << b << ": "
+                << net->input_blobs()[0]->shape_string()
+                << (buckets[b].size() > 1 ? ", ..." : "");
+    }
+  }
+
+  BlobHostPool<Dtype> host_pool_;  // Outlives net_'s blobs
+  shared_ptr<Net<Dtype> > net_;
+  vector<shared_ptr<Net<Dtype> > > buckets_;
+  vector<InputShapes> bucket_shapes_;
+  size_t hits_;
+  size_t misses_;
+
+  DISABLE_COPY_AND_ASSIGN(ShapeBucketedNet);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_SHAPE_BUCKETED_NET_HPP_
@@ -40,6 +40,7 @@
 
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "caffe/common.hpp"
@@ -118,6 +119,35 @@ class SolverRegisterer {
   }
 };
 
+/**
+ * @brief Replaces the creator of a registered solver type on behalf of owner
+ *        (the name of the Enable* function doing it) and returns the creator
+ *        it replaced. Like ReplaceLayerCreator, a second owner fails a CHECK
+ *        and replacing again for the same owner changes nothing.
+ */
+template <typename Dtype>
+typename SolverRegistry<Dtype>::Creator ReplaceSolverCreator(
+    const string& type, typename SolverRegistry<Dtype>::Creator creator,
+    const string& owner) {
+  typedef typename SolverRegistry<Dtype>::Creator Creator;
+  // type -> (owner, creator it replaced)
+  static std::map<string, std::pair<string, Creator> > replaced;
+  typename SolverRegistry<Dtype>::CreatorRegistry& registry =
+      SolverRegistry<Dtype>::Registry();
+  CHECK_EQ(registry.count(type), 1) << "Solver type " << type
+                                    << " is not registered";
+  typename std::map<string, std::pair<string, Creator> >::iterator it =
+      replaced.find(type);
+  if (it != replaced.end()) {
+    CHECK_EQ(it->second.first, owner) << "Solver type " << type
+        << " was already replaced by " << it->second.first
+        << ", which cannot be combined with " << owner;
+    return it->second.second;
+  }
+  replaced[type] = std::make_pair(owner, registry[type]);
+  registry[type] = creator;
+  return replaced[type].second;
+}
 
 #define REGISTER_SOLVER_CREATOR(type, creator)                                 \
   static SolverRegisterer<float> g_creator_f_##type(#type, creator<float>);    \
@@ -0,0 +1,448 @@
+#ifndef CAFFE_SPARSE_SGD_SOLVERS_HPP_
+#define CAFFE_SPARSE_SGD_SOLVERS_HPP_
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/layer_factory.hpp"
+#include "caffe/net.hpp"
+#include "caffe/sgd_solvers.hpp"
+#include "caffe/solver_factory.hpp"
+#include "caffe/util/math_functions.hpp"
+#include "caffe/util/row_sparse.hpp"
+
+#include "caffe/layers/sparse_embed_layer.hpp"
+#include "caffe/layers/sparse_inner_product_layer.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Wraps an SGD-family solver so that parameters tracked in
+ *        RowSparseDiffs are cleared, regularized and updated only on the
+ *        rows written during the iteration.
+ *
+ * Rows that were not touched are brought up to date lazily, the next time
+ * they are touched and before every test pass and snapshot: the momentum
+ * they would have kept applying is applied exactly, and the weight decay
+ * they missed is applied as (1 - lr * decay)^k with the current learning
+ * rate (L1 decay shrinks towards zero by k * lr * decay). Adam moments of
+ * untouched rows are not decayed ("lazy Adam").
+ *
+ * Only SGD and Adam have row-wise updates; other base solvers, GPU mode and
+ * multi-solver training update tracked parameters densely. So does
+ * Solver::Step, which runs instead of Step below when called through a
+ * Solver<Dtype>* (pycaffe's solver.step(), wrapping solvers): it would
+ * snapshot and return without catching the rows up. Every layer that
+ * writes a tracked parameter's diff must report to RowSparseDiffs.
+ */
+template <typename Dtype, typename Base>
+class RowSparseSolver : public Base {
+ public:
+  explicit RowSparseSolver(const SolverParameter& param)
+      : Base(param), in_step_(false) {}
+
+  using Base::Solve;
+  virtual void Solve(const char* resume_file = NULL) {
+    if (!this->callbacks_.empty()) {
+      // Solver::Callback can only be invoked by Solver::Step.
+      Base::Solve(resume_file);
+      return;
+    }
+    CHECK(Caffe::root_solver());
+    LOG(INFO) << "Solving " << this->net_->name();
+    LOG(INFO) << "Learning Rate Policy: " << this->param_.lr_policy();
+    this->requested_early_exit_ = false;
+    if (resume_file) {
+      LOG(INFO) << "Restoring previous solver status from " << resume_file;
+      this->Restore(resume_file);
+      last_update_.clear();
+    }
+    const int start_iter = this->iter_;
+    Step(this->param_.max_iter() - this->iter_);
+    if (this->param_.snapshot_after_train()
+        && (!this->param_.snapshot()
+            || this->iter_ % this->param_.snapshot() != 0)) {
+      this->Snapshot();
+    }
+    if (this->requested_early_exit_) {
+      LOG(INFO) << "Optimization stopped early.";
+      return;
+    }
+    if (this->param_.display() && this->iter_ % this->param_.display() == 0) {
+      Dtype loss;
+      this->net_->Forward(&loss);
+      this->UpdateSmoothedLoss(loss, start_iter, this->param_.average_loss());
+      LOG(INFO) << "Iteration " << this->iter_ << ", loss = "
+                << this->smoothed_loss_;
+    }
+    if (this->param_.test_interval() &&
+        this->iter_ % this->param_.test_interval() == 0) {
+      this->TestAll();
+    }
+    LOG(INFO) << "Optimization Done.";
+  }
+
+  /// @brief Solver::Step, clearing only the diffs of untracked parameters.
+  ///        Every row is up to date when it returns.
+  void Step(int iters) {
+    if (!this->callbacks_.empty()) {
+      Solver<Dtype>::Step(iters);
+      return;
+    }
+    in_step_ = true;
+    const int start_iter = this->iter_;
+    const int stop_iter = this->iter_ + iters;
+    const int average_loss = this->param_.average_loss();
+    this->losses_.clear();
+    this->smoothed_loss_ = 0;
+    this->iteration_timer_.Start();
+
+    while (this->iter_ < stop_iter) {
+      ClearParamDiffs();
+      if (this->param_.test_interval() &&
+          this->iter_ % this->param_.test_interval() == 0 &&
+          (this->iter_ > 0 || this->param_.test_initialization())) {
+        if (Caffe::root_solver()) {
+          this->TestAll();
+        }
+        if (this->requested_early_exit_) {
+          break;
+        }
+      }
+      const bool display = this->param_.display() &&
+          this->iter_ % this->param_.display() == 0;
+      this->net_->set_debug_info(display && this->param_.debug_info());
+      Dtype loss = 0;
+      for (int i = 0; i < this->param_.iter_size(); ++i) {
+        loss += this->net_->ForwardBackward();
+      }
+      loss /= this->param_.iter_size();
+      this->UpdateSmoothedLoss(loss, start_iter, average_loss);
+      if (display) {
+        DisplayProgress();
+      }
+      ApplyUpdate();
+      ++this->iter_;
+
+      SolverAction::Enum request = this->GetRequestedAction();
+      if ((this->param_.snapshot() &&
+           this->iter_ % this->param_.snapshot() == 0 &&
+           Caffe::root_solver()) ||
+          request == SolverAction::SNAPSHOT) {
+        CatchUp(this->iter_);
+        this->Snapshot();
+      }
+      if (request == SolverAction::STOP) {
+        this->requested_early_exit_ = true;
+        break;
+      }
+    }
+    // Callers may read or save the weights once Step returns.
+    CatchUp(this->iter_);
+    in_step_ = false;
+  }
+
+ protected:
+  virtual void ApplyUpdate() {
+    if (!SparseEnabled()) {
+      SyncAll();
+      Base::ApplyUpdate();
+      return;
+    }
+    const Dtype rate = this->GetLearningRate();
+    if (this->param_.display() && this->iter_ % this->param_.display() == 0) {
+      LOG_IF(INFO, Caffe::root_solver()) << "Iteration " << this->iter_
+          << ", lr = " << rate;
+    }
+    this->ClipGradients();
+    const vector<Blob<Dtype>*>& params = this->net_->learnable_params();
+    last_update_.resize(params.size());
+    const std::string type = this->type();
+    const bool row_wise = type == "SGD" || type == "Adam";
+    for (int id = 0; id < params.size(); ++id) {
+      bool dense = false;
+      if (!RowSparseDiffs<Dtype>::Get().Take(*params[id], &rows_, &dense)) {
+        DenseUpdate(id, rate);
+      } else if (dense || !row_wise) {
+        CatchUp(id, this->iter_, rate);
+        DenseUpdate(id, rate);
+        // Keep the diff all zero for ClearParamDiffs to skip.
+        caffe_set(params[id]->count(), Dtype(0),
+            params[id]->mutable_cpu_diff());
+        std::fill(last_update_[id].begin(), last_update_[id].end(),
+            this->iter_ + 1);
+      } else {
+        SparseUpdate(id, rate);
+      }
+    }
+    // Tests and snapshots read every row.
+    const int next = this->iter_ + 1;
+    if ((this->param_.test_interval() &&
+         next % this->param_.test_interval() == 0) ||
+        (this->param_.snapshot() && next % this->param_.snapshot() == 0)) {
+      for (int id = 0; id < params.size(); ++id) {
+        CatchUp(id, next, rate);
+      }
+    }
+  }
+
+  bool SparseEnabled() const {
+    return in_step_ && Caffe::mode() == Caffe::CPU &&
+        Caffe::solver_count() == 1 && this->callbacks_.empty();
+  }
+
+  /// @brief Before a dense update: catches up every row, forgets when rows
+  ///        were updated and drops the rows marked since.
+  void SyncAll() {
+    const vector<Blob<Dtype>*>& params = this->net_->learnable_params();
+    bool dense;
+    for (int id = 0; id < params.size(); ++id) {
+      RowSparseDiffs<Dtype>::Get().Take(*params[id], &rows_, &dense);
+    }
+    if (last_update_.empty()) {
+      return;
+    }
+    const Dtype rate = this->GetLearningRate();
+    for (int id = 0; id < last_update_.size(); ++id) {
+      CatchUp(id, this->iter_, rate);
+    }
+    last_update_.clear();
+  }
+
+  void ClearParamDiffs() {
+    if (!SparseEnabled()) {
+      this->net_->ClearParamDiffs();
+      return;
+    }
+    const vector<Blob<Dtype>*>& params = this->net_->learnable_params();
+    for (int i = 0; i < params.size(); ++i) {
+      if (!RowSparseDiffs<Dtype>::Get().Tracked(*params[i])) {
+        caffe_set(params[i]->count(), Dtype(0),
+            params[i]->mutable_cpu_diff());
+      }
+    }
+  }
+
+  void DenseUpdate(int param_id, Dtype rate) {
+    this->Normalize(param_id);
+    this->Regularize(param_id);
+    this->ComputeUpdateValue(param_id, rate);
+    this->net_->learnable_params()[param_id]->Update();
+  }
+
+  /// @brief Normalize, Regularize, ComputeUpdateValue and Update restricted
+  ///        to rows_, leaving their diff zero.
+  void SparseUpdate(int param_id, Dtype rate) {
+    Blob<Dtype>* param = this->net_->learnable_params()[param_id];
+    const int dim = RowDim(*param);
+    vector<int>& last = LastUpdate(param_id);
+    const Dtype local_rate = rate * this->net_->params_lr()[param_id];
+    const Dtype local_decay = this->param_.weight_decay() *
+        this->net_->params_weight_decay()[param_id];
+    const std::string& regularization = this->param_.regularization_type();
+    CHECK(regularization == "L1" || regularization == "L2")
+        << "Unknown regularization type: " << regularization;
+    const Dtype norm = Dtype(1) / this->param_.iter_size();
+    const bool adam = std::string(this->type()) == "Adam";
+    const Dtype momentum = this->param_.momentum();
+    const Dtype beta2 = this->param_.momentum2();
+    const int t = this->iter_ + 1;
+    const Dtype correction = adam ?
+        std::sqrt(Dtype(1) - std::pow(beta2, t)) /
+        (Dtype(1) - std::pow(momentum, t)) : Dtype(0);
+    const Dtype eps_hat = this->param_.delta();
+    Dtype* data = param->mutable_cpu_data();
+    Dtype* diff = param->mutable_cpu_diff();
+    Dtype* history = this->history_[param_id]->mutable_cpu_data();
+    Dtype* history2 = adam ?
+        this->history_[param_id + this->update_.size()]->mutable_cpu_data() :
+        NULL;
+    for (int i = 0; i < rows_.size(); ++i) {
+      const int r = rows_[i];
+      if (last[r] < this->iter_) {
+        CatchUpRow(param_id, r, this->iter_ - last[r], rate);
+      }
+      Dtype* w = data + r * dim;
+      Dtype* g = diff + r * dim;
+      Dtype* m = history + r * dim;
+      if (this->param_.iter_size() > 1) {
+        caffe_scal(dim, norm, g);
+      }
+      if (local_decay) {
+        if (regularization == "L2") {
+          caffe_axpy(dim, local_decay, w, g);
+        } else {
+          for (int j = 0; j < dim; ++j) {
+            g[j] += local_decay * caffe_sign(w[j]);
+          }
+        }
+      }
+      if (adam) {
+        Dtype* v = history2 + r * dim;
+        const Dtype step = local_rate * correction;
+        for (int j = 0; j < dim; ++j) {
+          m[j] = momentum * m[j] + (Dtype(1) - momentum) * g[j];
+          v[j] = beta2 * v[j] + (Dtype(1) - beta2) * g[j] * g[j];
+          w[j] -= step * m[j] / (std::sqrt(v[j]) + eps_hat);
+        }
+      } else {
+        for (int j = 0; j < dim; ++j) {
+          m[j] = local_rate * g[j] + momentum * m[j];
+          w[j] -= m[j];
+        }
+      }
+      caffe_set(dim, Dtype(0), g);
+      last[r] = this->iter_ + 1;
+    }
+  }
+
+  /// @brief Applies the updates missed by every row of param_id before
+  ///        iteration iter.
+  void CatchUp(int param_id, int iter, Dtype rate) {
+    if (last_update_[param_id].empty()) {
+      return;
+    }
+    vector<int>& last = last_update_[param_id];
+    for (int r = 0; r < last.size(); ++r) {
+      if (last[r] < iter) {
+        CatchUpRow(param_id, r, iter - last[r], rate);
+        last[r] = iter;
+      }
+    }
+  }
+
+  void CatchUp(int iter) {
+    if (!SparseEnabled()) {
+      return;
+    }
+    const Dtype rate = this->GetLearningRate();
+    for (int id = 0; id < last_update_.size(); ++id) {
+      CatchUp(id, iter, rate);
+    }
+  }
+
+  /// @brief Applies steps iterations of momentum and weight decay with a
+  ///        zero gradient to row r.
+  void CatchUpRow(int param_id, int r, int steps, Dtype rate) {
+    Blob<Dtype>* param = this->net_->learnable_params()[param_id];
+    const int dim = RowDim(*param);
+    Dtype* w = param->mutable_cpu_data() + r * dim;
+    const Dtype momentum = this->param_.momentum();
+    if (std::string(this->type()) == "SGD" && momentum > Dtype(0)) {
+      // h_k = momentum^k h and w -= h_1 + ... + h_steps.
+      Dtype* h = this->history_[param_id]->mutable_cpu_data() + r * dim;
+      const Dtype decay_k = std::pow(momentum, steps);
+      const Dtype drift = momentum < Dtype(1) ?
+          momentum * (Dtype(1) - decay_k) / (Dtype(1) - momentum) :
+          Dtype(steps);
+      caffe_axpy(dim, -drift, h, w);
+      caffe_scal(dim, decay_k, h);
+    }
+    const Dtype shrink = rate * this->net_->params_lr()[param_id] *
+        this->param_.weight_decay() *
+        this->net_->params_weight_decay()[param_id];
+    if (shrink == Dtype(0)) {
+      return;
+    }
+    if (this->param_.regularization_type() == "L2") {
+      const Dtype scale = std::pow(std::max(Dtype(1) - shrink, Dtype(0)),
+          steps);
+      caffe_scal(dim, scale, w);
+    } else {
+      const Dtype total = shrink * steps;
+      for (int j = 0; j < dim; ++j) {
+        w[j] = caffe_sign(w[j]) * std::max(std::fabs(w[j]) - total, Dtype(0));
+      }
+    }
+  }
+
+  vector<int>& LastUpdate(int param_id) {
+    vector<int>& last = last_update_[param_id];
+    if (last.empty()) {
+      const Blob<Dtype>& param = *this->net_->learnable_params()[param_id];
+      last.assign(param.count() / RowDim(param), this->iter_);
+    }
+    return last;
+  }
+
+  static int RowDim(const Blob<Dtype>& param) {
+    return param.num_axes() > 0 ? param.count(1) : 1;
+  }
+
+  void DisplayProgress() {
+    float lapse = this->iteration_timer_.Seconds();
+    float per_s = (this->iter_ - this->iterations_last_) / (lapse ? lapse : 1);
+    LOG_IF(INFO, Caffe::root_solver()) << "Iteration " << this->iter_
+        << " (" << per_s << " iter/s, " << lapse << "s/"
+        << this->param_.display() << " iters), loss = "
+        << this->smoothed_loss_;
+    this->iteration_timer_.Start();
+    this->iterations_last_ = this->iter_;
+    const vector<Blob<Dtype>*>& result = this->net_->output_blobs();
+    int score_index = 0;
+    for (int j = 0; j < result.size(); ++j) {
+      const Dtype* result_vec = result[j]->cpu_data();
+      const int blob_index = this->net_->output_blob_indices()[j];
+      const string& output_name = this->net_->blob_names()[blob_index];
+      const Dtype loss_weight = this->net_->blob_loss_weights()[blob_index];
+      for (int k = 0; k < result[j]->count(); ++k) {
+        std::ostringstream loss_msg_stream;
+        if (loss_weight) {
+          loss_msg_stream << " (* " << loss_weight
+                          << " = " << loss_weight * result_vec[k] << " loss)";
+        }
+        LOG_IF(INFO, Caffe::root_solver()) << "    Train net output #"
+            << score_index++ << ": " << output_name << " = "
+            << result_vec[k] << loss_msg_stream.str();
+      }
+    }
+  }
+
+  /// Per learnable param, the iteration each row is up to date with.
+  vector<vector<int> > last_update_;
+  vector<int> rows_;
+  /// Whether Step below, rather than Solver::Step, is running.
+  bool in_step_;
+
+  DISABLE_COPY_AND_ASSIGN(RowSparseSolver);
+};
+
+template <typename Dtype>
+Solver<Dtype>* GetRowSparseSGDSolver(const SolverParameter& param) {
+  return new RowSparseSolver<Dtype, SGDSolver<Dtype> >(param);
+}
+
+template <typename Dtype>
+Solver<Dtype>* GetRowSparseAdamSolver(const SolverParameter& param) {
+  return new RowSparseSolver<Dtype, AdamSolver<Dtype> >(param);
+}
+
+/**
+ * @brief Makes "Embed" and "InnerProduct" layers report the rows of their
+ *        weight gradients, and "SGD" and "Adam" solvers created afterwards
+ *        update only those rows. Cannot be combined with
+ *        EnableHalfInnerProductLayer or EnablePrunedLayers.
+ */
+inline void EnableRowSparseGradients() {
+  const string owner = "EnableRowSparseGradients";
+  ReplaceLayerCreator<float>("Embed", &GetSparseEmbedLayer<float>, owner);
+  ReplaceLayerCreator<double>("Embed", &GetSparseEmbedLayer<double>, owner);
+  ReplaceLayerCreator<float>("InnerProduct",
+      &GetSparseInnerProductLayer<float>, owner);
+  ReplaceLayerCreator<double>("InnerProduct",
+      &GetSparseInnerProductLayer<double>, owner);
+  ReplaceSolverCreator<float>("SGD", &GetRowSparseSGDSolver<float>, owner);
+  ReplaceSolverCreator<double>("SGD", &GetRowSparseSGDSolver<double>, owner);
+  ReplaceSolverCreator<float>("Adam", &GetRowSparseAdamSolver<float>, owner);
+  ReplaceSolverCreator<double>("Adam", &GetRowSparseAdamSolver<double>,
+                               owner);
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_SPARSE_SGD_SOLVERS_HPP_
@@ -0,0 +1,265 @@
+#ifndef CAFFE_UTIL_ASYNC_SNAPSHOT_HPP_
+#define CAFFE_UTIL_ASYNC_SNAPSHOT_HPP_
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/thread.hpp>
+
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/message.h"
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/sgd_solvers.hpp"
+#include "caffe/solver.hpp"
+#include "caffe/util/format.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Takes solver snapshots without stalling Solver::Step.
+ *
+ * At a snapshot point the training thread only memcpy's every layer blob
+ * (and the SGDSolver family's history) into a staging buffer. A background
+ * thread then fills the NetParameter / SolverState protos, writes them to
+ * a temporary file, fsyncs it and renames it over the final name, so a
+ * crash never leaves a truncated .caffemodel behind. At most max_pending
+ * snapshots are staged at once; a further snapshot waits for a free buffer.
+ *
+ * Attach it to a solver whose own synchronous snapshotting is disabled
+ * (snapshot: 0) and pass the interval here; filenames follow
+ * Solver::SnapshotFilename. Only the binary proto format is written.
+ */
+template <typename Dtype>
+class AsyncSnapshotter : public Solver<Dtype>::Callback,
+                         public InternalThread {
+ public:
+  AsyncSnapshotter(Solver<Dtype>* solver, int interval, int max_pending = 1)
+    : solver_(solver), interval_(interval), last_iter_(-1), writing_(0) {
+    CHECK_GT(max_pending, 0);
+    CHECK(solver_->param().has_snapshot_prefix())
+        << "In solver params, snapshot is specified but snapshot_prefix is not";
+    LOG_IF(WARNING, solver_->param().snapshot_format() !=
+        SolverParameter_SnapshotFormat_BINARYPROTO)
+        << "AsyncSnapshotter only writes the binary proto format";
+    // The layer structure is captured once; only blob data changes later.
+    solver_->net()->ToProto(&net_template_, false);
+    for (int i = 0; i < net_template_.layer_size(); ++i) {
+      LayerParameter* layer = net_template_.mutable_layer(i);
+      for (int j = 0; j < layer->blobs_size(); ++j) {
+        layer->mutable_blobs(j)->clear_data();
+        layer->mutable_blobs(j)->clear_double_data();
+      }
+    }
+    for (int i = 0; i < max_pending; ++i) {
+      free_.push_back(shared_ptr<Staged>(new Staged()));
+    }
+    solver_->add_callback(this);
+    StartInternalThread();
+  }
+
+  virtual ~AsyncSnapshotter() {
+    Flush();
+    StopInternalThread();
+  }
+
+  /**
+   * @brief Stages a snapshot of the current iteration and returns as soon
+   *        as the copy is done; e.g. call it after Solve() for the final one.
+   */
+  void Snapshot() {
+    shared_ptr<Staged> staged;
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      while (free_.empty()) {
+        cond_.wait(lock);
+      }
+      staged = free_.front();
+      free_.pop_front();
+    }
+    Stage(staged.get());
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      full_.push_back(staged);
+    }
+    cond_.notify_all();
+    last_iter_ = solver_->iter();
+  }
+
+  /// @brief Blocks until every staged snapshot is on disk.
+  void Flush() {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!full_.empty() || writing_ > 0) {
+      cond_.wait(lock);
+    }
+  }
+
+ protected:
+  struct Staged {
+    int iter;
+    int current_step;
+    vector<vector<Dtype> > blobs;    // per layer blob, in proto order
+    vector<vector<Dtype> > history;
+    vector<vector<int> > history_shapes;
+  };
+
+  void on_start() {
+    const int iter = solver_->iter();
+    if (interval_ > 0 && iter > 0 && iter % interval_ == 0 &&
+        iter != last_iter_ && Caffe::root_solver()) {
+      Snapshot();
+    }
+  }
+  void on_gradients_ready() {}
+
+  void Stage(Staged* staged) {
+    const Net<Dtype>& net = *solver_->net();
+    staged->iter = solver_->iter();
+    staged->current_step = CurrentStep(solver_->param(), staged->iter);
+    staged->blobs.resize(0);
+    for (int i = 0; i < net.layers().size(); ++i) {
+      const vector<shared_ptr<Blob<Dtype> > >& blobs =
+          net.layers()[i]->blobs();
+      for (int j = 0; j < blobs.size(); ++j) {
+        const Dtype* data = blobs[j]->cpu_data();
+        staged->blobs.push_back(vector<Dtype>(data, data + blobs[j]->count()));
+      }
+    }
+    staged->history.resize(0);
+    staged->history_shapes.resize(0);
+    SGDSolver<Dtype>* sgd = dynamic_cast<SGDSolver<Dtype>*>(solver_);
+    if (sgd != NULL) {
+      for (int i = 0; i < sgd->history().size(); ++i) {
+        const Blob<Dtype>& blob = *sgd->history()[i];
+        staged->history.push_back(
+            vector<Dtype>(blob.cpu_data(), blob.cpu_data() + blob.count()));
+        staged->history_shapes.push_back(blob.shape());
+      }
+    }
+  }
+
+  virtual void InternalThreadEntry() {
+    try {
+      while (!must_stop()) {
+        shared_ptr<Staged> staged;
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          while (full_.empty()) {
+            cond_.wait(lock);
+          }
+          staged = full_.front();
+          full_.pop_front();
+          ++writing_;
+        }
+        Write(*staged);
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          --writing_;
+          free_.push_back(staged);
+        }
+        cond_.notify_all();
+      }
+    } catch (boost::thread_interrupted&) {
+      // Interrupted exception is expected on shutdown
+    }
+  }
+
+  void Write(const Staged& staged) {
+    const string prefix = solver_->param().snapshot_prefix() + "_iter_" +
+        format_int(staged.iter);
+    const string model_filename = prefix + ".caffemodel";
+    NetParameter net_param(net_template_);
+    int k = 0;
+    for (int i = 0; i < net_param.layer_size(); ++i) {
+      LayerParameter* layer = net_param.mutable_layer(i);
+      for (int j = 0; j < layer->blobs_size(); ++j) {
+        FillBlobProto(staged.blobs[k++], layer->mutable_blobs(j));
+      }
+    }
+    CHECK_EQ(k, staged.blobs.size());
+    LOG(INFO) << "Snapshotting to binary proto file " << model_filename;
+    WriteAtomically(net_param, model_filename);
+
+    SolverState state;
+    state.set_iter(staged.iter);
+    state.set_learned_net(model_filename);
+    state.set_current_step(staged.current_step);
+    for (int i = 0; i < staged.history.size(); ++i) {
+      BlobProto* history_blob = state.add_history();
+      const vector<int>& shape = staged.history_shapes[i];
+      for (int j = 0; j < shape.size(); ++j) {
+        history_blob->mutable_shape()->add_dim(shape[j]);
+      }
+      FillBlobProto(staged.history[i], history_blob);
+    }
+    const string state_filename = prefix + ".solverstate";
+    LOG(INFO) << "Snapshotting solver state to binary proto file "
+              << state_filename;
+    WriteAtomically(state, state_filename);
+  }
+
+  static void FillBlobProto(const vector<Dtype>& values, BlobProto* proto);
+
+  static void WriteAtomically(const ::google::protobuf::Message& proto,
+      const string& filename) {
+    const string tmp = filename + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK_GE(fd, 0) << "Failed to open " << tmp;
+    CHECK(proto.SerializeToFileDescriptor(fd)) << "Failed to write " << tmp;
+    CHECK_EQ(fsync(fd), 0) << "Failed to fsync " << tmp;
+    CHECK_EQ(close(fd), 0);
+    CHECK_EQ(rename(tmp.c_str(), filename.c_str()), 0)
+        << "Failed to rename " << tmp << " to " << filename;
+  }
+
+  // Mirrors the multistep bookkeeping of SGDSolver::GetLearningRate.
+  static int CurrentStep(const SolverParameter& param, int iter) {
+    int step = 0;
+    while (step < param.stepvalue_size() && iter >= param.stepvalue(step)) {
+      ++step;
+    }
+    return step;
+  }
+
+  Solver<Dtype>* solver_;
+  const int interval_;
+  int last_iter_;
+  NetParameter net_template_;
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  std::deque<shared_ptr<Staged> > free_;
+  std::deque<shared_ptr<Staged> > full_;
+  int writing_;
+
+  DISABLE_COPY_AND_ASSIGN(AsyncSnapshotter);
+};
+
+template <>
+inline void AsyncSnapshotter<float>::FillBlobProto(
+    const vector<float>& values, BlobProto* proto) {
+  proto->mutable_data()->Reserve(values.size());
+  for (int i = 0; i < values.size(); ++i) {
+    proto->add_data(values[i]);
+  }
+}
+
+template <>
+inline void AsyncSnapshotter<double>::FillBlobProto(
+    const vector<double>& values, BlobProto* proto) {
+  proto->mutable_double_data()->Reserve(values.size());
+  for (int i = 0; i < values.size(); ++i) {
+    proto->add_double_data(values[i]);
+  }
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_ASYNC_SNAPSHOT_HPP_
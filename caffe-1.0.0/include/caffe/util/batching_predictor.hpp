@@ -0,0 +1,202 @@
+#ifndef CAFFE_UTIL_BATCHING_PREDICTOR_HPP_
+#define CAFFE_UTIL_BATCHING_PREDICTOR_HPP_
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/future.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/internal_thread.hpp"
+#include "caffe/net.hpp"
+#include "caffe/util/blob_host_pool.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Dynamic-batching front end for a deployed Net.
+ *
+ * Concurrent callers Submit() one sample each; a single internal thread
+ * groups pending samples into one batch of up to max_batch_size, waiting at
+ * most max_wait_us after the first sample of a batch arrives, runs a single
+ * Net::Forward and fulfills every caller's future with its slice of each
+ * output blob.
+ *
+ * The batch is padded up to the smallest configured bucket size that fits,
+ * and the input blob is only reshaped when that bucket changes, so a steady
+ * load runs Forward without any Reshape. Bucket changes reshape through a
+ * BlobHostPool, so with a pooled HostAllocator policy they reuse memory
+ * instead of allocating. The net must not be used by anyone else while the
+ * predictor is running; its first input blob receives the samples and its
+ * shape(0) is the batch axis.
+ */
+template <typename Dtype>
+class BatchingPredictor : public InternalThread {
+ public:
+  /// One vector per net output blob, holding this sample's slice.
+  typedef vector<vector<Dtype> > Output;
+
+  struct Options {
+    Options() : max_batch_size(16), max_wait_us(2000) { }
+    int max_batch_size;
+    int max_wait_us;
+    /// Allowed batch sizes; empty means powers of two up to max_batch_size.
+    vector<int> buckets;
+  };
+
+  BatchingPredictor(shared_ptr<Net<Dtype> > net, const Options& options)
+    : net_(net), options_(options), current_bucket_(0) {
+    CHECK_GT(options_.max_batch_size, 0);
+    CHECK_GE(options_.max_wait_us, 0);
+    CHECK_GE(net_->num_inputs(), 1) << "Net has no input blob";
+    if (options_.buckets.empty()) {
+      for (int size = 1; size < options_.max_batch_size; size *= 2) {
+        options_.buckets.push_back(size);
+      }
+      options_.buckets.push_back(options_.max_batch_size);
+    }
+    std::sort(options_.buckets.begin(), options_.buckets.end());
+    CHECK_GE(options_.buckets.back(), options_.max_batch_size)
+        << "No bucket can hold max_batch_size samples";
+    vector<int> shape = net_->input_blobs()[0]->shape();
+    CHECK_GE(shape.size(), 1);
+    shape[0] = 1;
+    sample_shape_ = shape;
+    sample_count_ = net_->input_blobs()[0]->count(1);
+    StartInternalThread();
+  }
+
+  virtual ~BatchingPredictor() { StopInternalThread(); }
+
+  /**
+   * @brief Queues one sample of input_blobs()[0]->count(1) values and
+   *        returns a future for its outputs. The sample is copied.
+   */
+  boost::unique_future<Output> Submit(const Dtype* sample) {
+    shared_ptr<Request> request(new Request());
+    request->input.assign(sample, sample + sample_count_);
+    boost::unique_future<Output> future = request->promise.get_future();
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      pending_.push_back(request);
+    }
+    cond_.notify_one();
+    return boost::move(future);
+  }
+
+  /// @brief Synchronous convenience wrapper around Submit.
+  Output Predict(const Dtype* sample) {
+    return Submit(sample).get();
+  }
+
+  int sample_count() const { return sample_count_; }
+
+ protected:
+  struct Request {
+    vector<Dtype> input;
+    boost::promise<Output> promise;
+  };
+
+  virtual void InternalThreadEntry() {
+    vector<shared_ptr<Request> > batch;
+    try {
+      while (!must_stop()) {
+        CollectBatch(&batch);
+        RunBatch(batch);
+        batch.clear();
+      }
+    } catch (boost::thread_interrupted&) {
+      // Interrupted exception is expected on shutdown
+    }
+    boost::mutex::scoped_lock lock(mutex_);
+    for (int i = 0; i < pending_.size(); ++i) {
+      pending_[i]->promise.set_exception(
+          boost::copy_exception(boost::thread_interrupted()));
+    }
+    pending_.clear();
+  }
+
+  // Blocks for the first request, then until the batch is full or
+  // max_wait_us has passed since that request was taken.
+  void CollectBatch(vector<shared_ptr<Request> >* batch) {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (pending_.empty()) {
+      cond_.wait(lock);
+    }
+    const boost::system_time deadline = boost::get_system_time() +
+        boost::posix_time::microseconds(options_.max_wait_us);
+    for (;;) {
+      while (!pending_.empty() && batch->size() < options_.max_batch_size) {
+        batch->push_back(pending_.front());
+        pending_.pop_front();
+      }
+      if (batch->size() >= options_.max_batch_size ||
+          !cond_.timed_wait(lock, deadline)) {
+        break;
+      }
+    }
+    // Pick up anything that raced with the timeout.
+    while (!pending_.empty() && batch->size() < options_.max_batch_size) {
+      batch->push_back(pending_.front());
+      pending_.pop_front();
+    }
+  }
+
+  void RunBatch(const vector<shared_ptr<Request> >& batch) {
+    const int n = batch.size();
+    const int bucket = *std::lower_bound(options_.buckets.begin(),
+        options_.buckets.end(), n);
+    Blob<Dtype>* input = net_->input_blobs()[0];
+    if (bucket != current_bucket_) {
+      vector<int> shape = sample_shape_;
+      shape[0] = bucket;
+      input->Reshape(shape);
+      host_pool_.Reshape(net_.get());
+      current_bucket_ = bucket;
+    }
+    Dtype* input_data = input->mutable_cpu_data();
+    for (int i = 0; i < n; ++i) {
+      std::copy(batch[i]->input.begin(), batch[i]->input.end(),
+          input_data + i * sample_count_);
+    }
+    // Padding rows are computed and discarded; zero them to stay finite.
+    std::fill(input_data + n * sample_count_,
+        input_data + bucket * sample_count_, Dtype(0));
+    const vector<Blob<Dtype>*>& outputs = net_->Forward();
+    for (int i = 0; i < n; ++i) {
+      Output output(outputs.size());
+      for (int j = 0; j < outputs.size(); ++j) {
+        const Blob<Dtype>* blob = outputs[j];
+        if (blob->num_axes() == 0 || blob->shape(0) != bucket) {
+          // Not batched, e.g. a scalar loss; every caller gets all of it.
+          output[j].assign(blob->cpu_data(), blob->cpu_data() + blob->count());
+          continue;
+        }
+        const int count = blob->count(1);
+        const Dtype* data = blob->cpu_data() + i * count;
+        output[j].assign(data, data + count);
+      }
+      batch[i]->promise.set_value(output);
+    }
+  }
+
+  BlobHostPool<Dtype> host_pool_;  // Outlives net_'s blobs
+  shared_ptr<Net<Dtype> > net_;
+  Options options_;
+  vector<int> sample_shape_;
+  int sample_count_;
+  int current_bucket_;
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+  std::deque<shared_ptr<Request> > pending_;
+
+  DISABLE_COPY_AND_ASSIGN(BatchingPredictor);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_BATCHING_PREDICTOR_HPP_
@@ -0,0 +1,96 @@
+#ifndef CAFFE_UTIL_BLOB_HOST_POOL_HPP_
+#define CAFFE_UTIL_BLOB_HOST_POOL_HPP_
+
+#include <cstring>
+#include <list>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/syncedmem.hpp"
+#include "caffe/util/host_allocator.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Backs the blobs of a net with memory from HostAllocator.
+ *
+ * When Blob::Reshape outgrows a blob's capacity it replaces the blob's
+ * SyncedMemory, which allocates lazily on first access. Reshape(net) gives
+ * every such SyncedMemory that has not allocated yet a zeroed block from
+ * HostAllocator through set_cpu_data, and returns the blocks of
+ * SyncedMemory%s that nothing references any more to the allocator. With a
+ * pooled policy, reshaping between previously seen sizes then allocates
+ * nothing from the system.
+ *
+ * Only active with a pooled HostAllocator policy and in CPU mode; otherwise
+ * Reshape(net) is just net->Reshape(). Destroy the pool after its net:
+ * blocks a blob still references when the pool goes away are leaked rather
+ * than freed under it.
+ */
+template <typename Dtype>
+class BlobHostPool {
+ public:
+  BlobHostPool() { }
+  ~BlobHostPool() { Collect(); }
+
+  /// @brief Reshapes net and gives its newly allocated blobs pooled memory.
+  void Reshape(Net<Dtype>* net) {
+    net->Reshape();
+    if (!HostAllocator::Get().pooled() || Caffe::mode() != Caffe::CPU) {
+      return;
+    }
+    const vector<shared_ptr<Blob<Dtype> > >& blobs = net->blobs();
+    for (int i = 0; i < blobs.size(); ++i) {
+      if (blobs[i]->count() == 0) {
+        continue;
+      }
+      Give(blobs[i]->data());
+      Give(blobs[i]->diff());
+    }
+    Collect();
+  }
+
+ private:
+  struct Block {
+    shared_ptr<SyncedMemory> memory;
+    void* ptr;
+  };
+
+  void Give(const shared_ptr<SyncedMemory>& memory) {
+    // Anything past UNINITIALIZED already holds memory, possibly ours.
+    if (memory->head() != SyncedMemory::UNINITIALIZED) {
+      return;
+    }
+    Block block;
+    block.memory = memory;
+    block.ptr = HostAllocator::Get().Alloc(memory->size());
+    // SyncedMemory zeroes what it allocates; keep that.
+    memset(block.ptr, 0, memory->size());
+    memory->set_cpu_data(block.ptr);
+    blocks_.push_back(block);
+  }
+
+  // Frees the blocks whose SyncedMemory only this pool still references.
+  void Collect() {
+    for (typename std::list<Block>::iterator it = blocks_.begin();
+         it != blocks_.end();) {
+      if (it->memory.unique()) {
+        it->memory.reset();
+        HostAllocator::Get().Free(it->ptr);
+        it = blocks_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  std::list<Block> blocks_;
+
+  DISABLE_COPY_AND_ASSIGN(BlobHostPool);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_BLOB_HOST_POOL_HPP_
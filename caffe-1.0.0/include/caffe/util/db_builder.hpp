@@ -0,0 +1,401 @@
+#ifndef CAFFE_UTIL_DB_BUILDER_HPP_
+#define CAFFE_UTIL_DB_BUILDER_HPP_
+
+#include <sys/stat.h>
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef USE_LEVELDB
+#include "leveldb/db.h"
+#include "leveldb/write_batch.h"
+#endif  // USE_LEVELDB
+#ifdef USE_LMDB
+#include "lmdb.h"
+#endif  // USE_LMDB
+
+#include "caffe/common.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/format.hpp"
+#include "caffe/util/io.hpp"
+
+namespace caffe { namespace db {
+
+/**
+ * @brief Write-only, append-only sink used for bulk dataset creation.
+ *
+ * Unlike Transaction, a BatchWriter requires keys to be handed over in
+ * strictly ascending order, which lets the backends skip the B-tree search
+ * on every insert (MDB_APPEND) and commit whole batches at once.
+ */
+class BatchWriter {
+ public:
+  BatchWriter() { }
+  virtual ~BatchWriter() { }
+  /// @brief Create a new database; estimated_bytes is a hint for presizing.
+  virtual void Open(const string& source, size_t estimated_bytes) = 0;
+  /// @brief Write one batch of sorted key/value pairs in a single commit.
+  virtual void Write(const vector<pair<string, string> >& batch) = 0;
+  virtual void Close() = 0;
+
+  DISABLE_COPY_AND_ASSIGN(BatchWriter);
+};
+
+#ifdef USE_LMDB
+class LMDBBatchWriter : public BatchWriter {
+ public:
+  LMDBBatchWriter() : mdb_env_(NULL), map_size_(0) { }
+  virtual ~LMDBBatchWriter() { Close(); }
+
+  virtual void Open(const string& source, size_t estimated_bytes) {
+    CHECK(mdb_env_ == NULL) << "LMDBBatchWriter already open";
+    CHECK_EQ(mkdir(source.c_str(), 0744), 0) << "mkdir " << source
+                                             << " failed";
+    Check(mdb_env_create(&mdb_env_));
+    // Leave room for B-tree pages and per-record headers.
+    map_size_ = RoundToPage(std::max(estimated_bytes + estimated_bytes / 2,
+        static_cast<size_t>(1) << 26));
+    Check(mdb_env_set_mapsize(mdb_env_, map_size_));
+    // The database is only durable once Close() has run; a crashed build is
+    // simply restarted, so skip the per-commit fsync.
+    Check(mdb_env_open(mdb_env_, source.c_str(),
+        MDB_NOSYNC | MDB_NOMETASYNC, 0664));
+    MDB_txn* txn;
+    Check(mdb_txn_begin(mdb_env_, NULL, 0, &txn));
+    Check(mdb_dbi_open(txn, NULL, 0, &mdb_dbi_));
+    Check(mdb_txn_commit(txn));
+    LOG(INFO) << "Opened lmdb " << source << " with map size "
+              << (map_size_ >> 20) << " MB";
+  }
+
+  virtual void Write(const vector<pair<string, string> >& batch) {
+    CHECK(mdb_env_ != NULL) << "LMDBBatchWriter is not open";
+    while (!TryWrite(batch)) {
+      // Only reached if the estimate was too small; no transaction is active.
+      map_size_ *= 2;
+      LOG(INFO) << "Growing lmdb map size to " << (map_size_ >> 20) << " MB";
+      Check(mdb_env_set_mapsize(mdb_env_, map_size_));
+    }
+  }
+
+  virtual void Close() {
+    if (mdb_env_ != NULL) {
+      Check(mdb_env_sync(mdb_env_, 1));
+      mdb_dbi_close(mdb_env_, mdb_dbi_);
+      mdb_env_close(mdb_env_);
+      mdb_env_ = NULL;
+    }
+  }
+
+ private:
+  static void Check(int mdb_status) {
+    CHECK_EQ(mdb_status, MDB_SUCCESS) << mdb_strerror(mdb_status);
+  }
+
+  static size_t RoundToPage(size_t bytes) {
+    const size_t page = 1 << 20;
+    return (bytes + page - 1) / page * page;
+  }
+
+  // Returns false if the map filled up; the batch is then rolled back.
+  bool TryWrite(const vector<pair<string, string> >& batch) {
+    MDB_txn* txn;
+    Check(mdb_txn_begin(mdb_env_, NULL, 0, &txn));
+    for (size_t i = 0; i < batch.size(); ++i) {
+      MDB_val key, value;
+      key.mv_size = batch[i].first.size();
+      key.mv_data = const_cast<char*>(batch[i].first.data());
+      value.mv_size = batch[i].second.size();
+      value.mv_data = const_cast<char*>(batch[i].second.data());
+      int status = mdb_put(txn, mdb_dbi_, &key, &value, MDB_APPEND);
+      if (status == MDB_MAP_FULL) {
+        mdb_txn_abort(txn);
+        return false;
+      }
+      CHECK_NE(status, MDB_KEYEXIST) << "Keys must be written in ascending "
+                                     << "order, got " << batch[i].first;
+      Check(status);
+    }
+    int status = mdb_txn_commit(txn);
+    if (status == MDB_MAP_FULL) {
+      return false;
+    }
+    Check(status);
+    return true;
+  }
+
+  MDB_env* mdb_env_;
+  MDB_dbi mdb_dbi_;
+  size_t map_size_;
+};
+#endif  // USE_LMDB
+
+#ifdef USE_LEVELDB
+class LevelDBBatchWriter : public BatchWriter {
+ public:
+  LevelDBBatchWriter() : db_(NULL) { }
+  virtual ~LevelDBBatchWriter() { Close(); }
+
+  virtual void Open(const string& source, size_t estimated_bytes) {
+    CHECK(db_ == NULL) << "LevelDBBatchWriter already open";
+    leveldb::Options options;
+    options.create_if_missing = true;
+    options.error_if_exists = true;
+    // Larger memtables mean fewer, bigger sorted runs for sequential keys;
+    // size them from the estimate so small databases stay small.
+    const size_t min_buffer = 4 << 20, max_buffer = 256 << 20;
+    options.write_buffer_size = std::min(max_buffer,
+        std::max(min_buffer, estimated_bytes / 8));
+    options.max_open_files = 100;
+    leveldb::Status status = leveldb::DB::Open(options, source, &db_);
+    CHECK(status.ok()) << "Failed to open leveldb " << source
+                       << std::endl << status.ToString();
+    LOG(INFO) << "Opened leveldb " << source << " with write buffer "
+              << (options.write_buffer_size >> 20) << " MB";
+  }
+
+  virtual void Write(const vector<pair<string, string> >& batch) {
+    CHECK(db_ != NULL) << "LevelDBBatchWriter is not open";
+    leveldb::WriteBatch write_batch;
+    for (size_t i = 0; i < batch.size(); ++i) {
+      write_batch.Put(batch[i].first, batch[i].second);
+    }
+    leveldb::Status status = db_->Write(leveldb::WriteOptions(), &write_batch);
+    CHECK(status.ok()) << "Failed to write batch to leveldb "
+                       << std::endl << status.ToString();
+  }
+
+  virtual void Close() {
+    if (db_ != NULL) {
+      delete db_;
+      db_ = NULL;
+    }
+  }
+
+ private:
+  leveldb::DB* db_;
+};
+#endif  // USE_LEVELDB
+
+inline BatchWriter* GetBatchWriter(const string& backend) {
+#ifdef USE_LEVELDB
+  if (backend == "leveldb") {
+    return new LevelDBBatchWriter();
+  }
+#endif  // USE_LEVELDB
+#ifdef USE_LMDB
+  if (backend == "lmdb") {
+    return new LMDBBatchWriter();
+  }
+#endif  // USE_LMDB
+  LOG(FATAL) << "Unknown database backend";
+  return NULL;
+}
+
+/**
+ * @brief Pipelined replacement for the convert_imageset main loop.
+ *
+ * A pool of worker threads decodes, resizes and re-encodes images into
+ * serialized Datum%s, while the calling thread collects them back in list
+ * order and hands them to a BatchWriter in large sorted commits. Keys are
+ * "<zero-padded line id>_<filename>"; the id is padded to 8 digits as it
+ * always was, or to as many as the largest id needs, so the keys of one
+ * database always sort in list order.
+ */
+class DatasetBuilder {
+ public:
+  struct Options {
+    Options()
+      : root_folder(), resize_height(0), resize_width(0), is_color(true),
+        encoding(), num_workers(4), batch_size(1000), max_in_flight(8000),
+        log_every(10000), estimate_samples(100) { }
+    string root_folder;
+    int resize_height;
+    int resize_width;
+    bool is_color;
+    string encoding;  ///< "" keeps raw pixels, otherwise e.g. "jpg" or "png"
+    int num_workers;
+    int batch_size;     ///< records per commit
+    int max_in_flight;  ///< bound on encoded records waiting to be written
+    int log_every;
+    int estimate_samples;  ///< records used to presize the database, 0 for none
+  };
+
+  /// @brief Fills datum from one list entry; returns false to skip it.
+  typedef boost::function<bool(const pair<string, int>&, Datum*)>
+      EncodeFunction;
+
+  explicit DatasetBuilder(const Options& options)
+    : options_(options), next_index_(0), num_lines_(0), lines_(NULL) {
+    CHECK_GT(options_.num_workers, 0);
+    CHECK_GT(options_.batch_size, 0);
+    CHECK_GE(options_.max_in_flight, options_.batch_size);
+    encode_ = boost::bind(&DatasetBuilder::ReadImage, this, _1, _2);
+  }
+
+  /// @brief Replaces the default ReadImageToDatum-based encoder.
+  void set_encode_function(EncodeFunction encode) { encode_ = encode; }
+
+  /**
+   * @brief Converts all lines into writer, which must not be open yet.
+   * @return the number of records written.
+   */
+  int Build(const vector<pair<string, int> >& lines, const string& source,
+      BatchWriter* writer) {
+    lines_ = &lines;
+    num_lines_ = lines.size();
+    next_index_ = 0;
+    done_.clear();
+    boost::thread_group workers;
+    for (int i = 0; i < options_.num_workers; ++i) {
+      workers.create_thread(boost::bind(&DatasetBuilder::WorkerEntry, this));
+    }
+
+    const boost::posix_time::ptime start =
+        boost::posix_time::microsec_clock::local_time();
+    vector<pair<string, string> > batch;
+    batch.reserve(options_.batch_size);
+    const int key_digits = KeyDigits(num_lines_);
+    size_t sampled_bytes = 0;
+    int sampled = 0;
+    bool opened = false;
+    int written = 0;
+    for (int index = 0; index < num_lines_; ++index) {
+      string value;
+      if (!Take(index, &value)) {
+        LOG(WARNING) << "Skipping " << lines[index].first;
+        continue;
+      }
+      if (sampled < options_.estimate_samples) {
+        sampled_bytes += value.size();
+        ++sampled;
+      }
+      batch.push_back(make_pair(
+          caffe::format_int(index, key_digits) + "_" + lines[index].first, string()));
+      batch.back().second.swap(value);
+      if (!opened && (sampled >= options_.estimate_samples ||
+                      static_cast<int>(batch.size()) >= options_.batch_size)) {
+        writer->Open(source, sampled ? sampled_bytes / sampled * num_lines_ : 0);
+        opened = true;
+      }
+      if (static_cast<int>(batch.size()) >= options_.batch_size) {
+        writer->Write(batch);
+        written += batch.size();
+        batch.clear();
+      }
+      if (options_.log_every > 0 && (index + 1) % options_.log_every == 0) {
+        LogThroughput(start, index + 1, written);
+      }
+    }
+    workers.join_all();
+    if (!opened) {
+      writer->Open(source, sampled ? sampled_bytes / sampled * num_lines_ : 0);
+    }
+    if (!batch.empty()) {
+      writer->Write(batch);
+      written += batch.size();
+    }
+    writer->Close();
+    LogThroughput(start, num_lines_, written);
+    lines_ = NULL;
+    return written;
+  }
+
+ private:
+  static int KeyDigits(int num_lines) {
+    int digits = 1;
+    for (int n = num_lines - 1; n >= 10; n /= 10) {
+      ++digits;
+    }
+    return std::max(digits, 8);
+  }
+
+  bool ReadImage(const pair<string, int>& line, Datum* datum) {
+    return ReadImageToDatum(options_.root_folder + line.first, line.second,
+        options_.resize_height, options_.resize_width, options_.is_color,
+        options_.encoding, datum);
+  }
+
+  void WorkerEntry() {
+    Datum datum;
+    string value;
+    for (;;) {
+      int index;
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        // Bound memory: do not run ahead of the writer by more than
+        // max_in_flight records.
+        while (next_index_ < num_lines_ &&
+               static_cast<int>(done_.size()) >= options_.max_in_flight) {
+          taken_.wait(lock);
+        }
+        if (next_index_ >= num_lines_) {
+          return;
+        }
+        index = next_index_++;
+      }
+      datum.Clear();
+      bool ok = encode_((*lines_)[index], &datum);
+      value.clear();
+      if (ok) {
+        CHECK(datum.SerializeToString(&value));
+      }
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        pair<bool, string>& slot = done_[index];
+        slot.first = ok;
+        slot.second.swap(value);
+      }
+      ready_.notify_all();
+    }
+  }
+
+  // Blocks until record index has been encoded, then removes it.
+  bool Take(int index, string* value) {
+    boost::mutex::scoped_lock lock(mutex_);
+    std::map<int, pair<bool, string> >::iterator it;
+    while ((it = done_.find(index)) == done_.end()) {
+      ready_.wait(lock);
+    }
+    bool ok = it->second.first;
+    value->swap(it->second.second);
+    done_.erase(it);
+    lock.unlock();
+    taken_.notify_all();
+    return ok;
+  }
+
+  void LogThroughput(const boost::posix_time::ptime& start, int processed,
+      int written) const {
+    const double seconds = (boost::posix_time::microsec_clock::local_time()
+        - start).total_microseconds() / 1e6;
+    LOG(INFO) << "Processed " << processed << " files, wrote " << written
+              << " (" << (seconds > 0 ? processed / seconds : 0.0)
+              << " images/s)";
+  }
+
+  Options options_;
+  EncodeFunction encode_;
+  boost::mutex mutex_;
+  boost::condition_variable ready_;
+  boost::condition_variable taken_;
+  std::map<int, pair<bool, string> > done_;
+  int next_index_;
+  int num_lines_;
+  const vector<pair<string, int> >* lines_;
+
+  DISABLE_COPY_AND_ASSIGN(DatasetBuilder);
+};
+
+}  // namespace db
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_DB_BUILDER_HPP_
@@ -0,0 +1,261 @@
+#ifndef CAFFE_UTIL_FAST_CPU_KERNELS_HPP_
+#define CAFFE_UTIL_FAST_CPU_KERNELS_HPP_
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "caffe/util/parallel_for.hpp"
+
+// Inference-oriented CPU kernels for pooling, cross-channel LRN and softmax
+// over NCHW data. Every inner loop runs over contiguous memory with no
+// data-dependent branches so the compiler can vectorize it, and the outer
+// loop over independent planes / rows is split across caffe threads (see
+// parallel_for.hpp). Results match the reference layers up to float
+// rounding: sums are accumulated in a different order.
+
+namespace caffe {
+
+/**
+ * @brief Max (is_max) or average pooling of num * channels planes, with the
+ *        same window and padding rules as PoolingLayer, but without writing
+ *        the argmax mask.
+ *
+ * Pooling is done separably: the kernel_h input rows of a window are first
+ * reduced elementwise into one row (a long, contiguous, vectorizable loop),
+ * then the horizontal windows are reduced over that row.
+ */
+template <typename Dtype>
+void caffe_cpu_pool_forward(const bool is_max, const int planes,
+    const int height, const int width, const int pooled_height,
+    const int pooled_width, const int kernel_h, const int kernel_w,
+    const int stride_h, const int stride_w, const int pad_h, const int pad_w,
+    const Dtype* bottom, Dtype* top) {
+#ifdef _OPENMP
+  const int threads =
+      caffe_parallel_threads(planes * height * width);
+  #pragma omp parallel num_threads(threads) if (threads > 1)
+#endif
+  {
+    std::vector<Dtype> row(width);
+#ifdef _OPENMP
+    #pragma omp for schedule(static)
+#endif
+    for (int p = 0; p < planes; ++p) {
+      const Dtype* in = bottom + p * height * width;
+      Dtype* out = top + p * pooled_height * pooled_width;
+      for (int ph = 0; ph < pooled_height; ++ph) {
+        int hstart = ph * stride_h - pad_h;
+        int hend = std::min(hstart + kernel_h, height + (is_max ? 0 : pad_h));
+        const int pool_h = hend - hstart;
+        hstart = std::max(hstart, 0);
+        hend = std::min(hend, height);
+        Dtype* r = &row[0];
+        const Dtype init = is_max ? -std::numeric_limits<Dtype>::max() : 0;
+        for (int w = 0; w < width; ++w) {
+          r[w] = init;
+        }
+        for (int h = hstart; h < hend; ++h) {
+          const Dtype* in_row = in + h * width;
+          if (is_max) {
+            for (int w = 0; w < width; ++w) {
+              r[w] = std::max(r[w], in_row[w]);
+            }
+          } else {
+            for (int w = 0; w < width; ++w) {
+              r[w] += in_row[w];
+            }
+          }
+        }
+        Dtype* out_row = out + ph * pooled_width;
+        for (int pw = 0; pw < pooled_width; ++pw) {
+          int wstart = pw * stride_w - pad_w;
+          int wend = std::min(wstart + kernel_w, width + (is_max ? 0 : pad_w));
+          const int pool_size = pool_h * (wend - wstart);
+          wstart = std::max(wstart, 0);
+          wend = std::min(wend, width);
+          Dtype value = init;
+          if (is_max) {
+            for (int w = wstart; w < wend; ++w) {
+              value = std::max(value, r[w]);
+            }
+          } else {
+            for (int w = wstart; w < wend; ++w) {
+              value += r[w];
+            }
+            value /= pool_size;
+          }
+          out_row[pw] = value;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Cross-channel LRN forward, as LRNLayer::CrossChannelForward_cpu:
+ *        top = bottom * (k + alpha / size * sum_window(bottom^2))^-beta.
+ *
+ * The window sum of squares is kept as a running sum over each image's
+ * spatial plane: moving to the next channel adds one squared plane and
+ * drops one, so the cost is independent of size and no padded copy of the
+ * input is needed. If scale is not NULL it receives the normalizer, as the
+ * reference layer's scale_ blob does for Backward.
+ */
+template <typename Dtype>
+void caffe_cpu_lrn_cross_channel_forward(const int num, const int channels,
+    const int spatial, const int size, const Dtype alpha, const Dtype beta,
+    const Dtype k, const Dtype* bottom, Dtype* top, Dtype* scale) {
+  const int pre_pad = (size - 1) / 2;
+  const int post_pad = size - pre_pad - 1;
+  const Dtype alpha_over_size = alpha / size;
+  const bool beta_is_075 = std::fabs(beta - Dtype(0.75)) < Dtype(1e-6);
+#ifdef _OPENMP
+  const int threads =
+      caffe_parallel_threads(num * channels * spatial);
+  #pragma omp parallel num_threads(threads) if (threads > 1)
+#endif
+  {
+    std::vector<Dtype> sum_buffer(spatial);
+#ifdef _OPENMP
+    #pragma omp for schedule(static)
+#endif
+    for (int n = 0; n < num; ++n) {
+      const Dtype* in = bottom + n * channels * spatial;
+      Dtype* out = top + n * channels * spatial;
+      Dtype* sum = &sum_buffer[0];
+      for (int i = 0; i < spatial; ++i) {
+        sum[i] = 0;
+      }
+      for (int c = 0; c <= std::min(post_pad, channels - 1); ++c) {
+        const Dtype* x = in + c * spatial;
+        for (int i = 0; i < spatial; ++i) {
+          sum[i] += x[i] * x[i];
+        }
+      }
+      for (int c = 0; c < channels; ++c) {
+        if (c > 0) {
+          const int head = c + post_pad;
+          const int tail = c - pre_pad - 1;
+          if (head < channels) {
+            const Dtype* x = in + head * spatial;
+            for (int i = 0; i < spatial; ++i) {
+              sum[i] += x[i] * x[i];
+            }
+          }
+          if (tail >= 0) {
+            const Dtype* x = in + tail * spatial;
+            for (int i = 0; i < spatial; ++i) {
+              sum[i] -= x[i] * x[i];
+            }
+          }
+        }
+        const Dtype* x = in + c * spatial;
+        Dtype* y = out + c * spatial;
+        Dtype* s = scale ? scale + (n * channels + c) * spatial : NULL;
+        if (beta_is_075) {
+          // s^-0.75 == 1 / (sqrt(s) * sqrt(sqrt(s))), much cheaper than pow.
+          for (int i = 0; i < spatial; ++i) {
+            const Dtype v = k + alpha_over_size * sum[i];
+            const Dtype root = std::sqrt(v);
+            y[i] = x[i] / (root * std::sqrt(root));
+          }
+        } else {
+          for (int i = 0; i < spatial; ++i) {
+            const Dtype v = k + alpha_over_size * sum[i];
+            y[i] = x[i] * std::exp(-beta * std::log(v));
+          }
+        }
+        if (s != NULL) {
+          for (int i = 0; i < spatial; ++i) {
+            s[i] = k + alpha_over_size * sum[i];
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Softmax over the channels axis of outer_num blocks of
+ *        channels x inner_num values, as SoftmaxLayer::Forward_cpu.
+ *
+ * For each block the max, exp and sum are computed in one sweep over the
+ * channels (vectorized across inner_num) and the normalization in a
+ * second; no sum_multiplier GEMMs and no extra scale blob are involved.
+ */
+template <typename Dtype>
+void caffe_cpu_softmax_forward(const int outer_num, const int channels,
+    const int inner_num, const Dtype* bottom, Dtype* top) {
+#ifdef _OPENMP
+  const int threads =
+      caffe_parallel_threads(outer_num * channels * inner_num);
+  #pragma omp parallel num_threads(threads) if (threads > 1)
+#endif
+  {
+    std::vector<Dtype> max_buffer(inner_num), sum_buffer(inner_num);
+#ifdef _OPENMP
+    #pragma omp for schedule(static)
+#endif
+    for (int o = 0; o < outer_num; ++o) {
+      const Dtype* in = bottom + o * channels * inner_num;
+      Dtype* out = top + o * channels * inner_num;
+      Dtype* max_val = &max_buffer[0];
+      Dtype* sum = &sum_buffer[0];
+      if (inner_num == 1) {
+        // Classifier outputs: a single row, reduce it directly.
+        Dtype m = in[0];
+        for (int c = 1; c < channels; ++c) {
+          m = std::max(m, in[c]);
+        }
+        Dtype s = 0;
+        for (int c = 0; c < channels; ++c) {
+          out[c] = std::exp(in[c] - m);
+          s += out[c];
+        }
+        const Dtype inv = Dtype(1) / s;
+        for (int c = 0; c < channels; ++c) {
+          out[c] *= inv;
+        }
+        continue;
+      }
+      for (int i = 0; i < inner_num; ++i) {
+        max_val[i] = in[i];
+        sum[i] = 0;
+      }
+      for (int c = 1; c < channels; ++c) {
+        const Dtype* x = in + c * inner_num;
+        for (int i = 0; i < inner_num; ++i) {
+          max_val[i] = std::max(max_val[i], x[i]);
+        }
+      }
+      for (int c = 0; c < channels; ++c) {
+        const Dtype* x = in + c * inner_num;
+        Dtype* y = out + c * inner_num;
+        for (int i = 0; i < inner_num; ++i) {
+          y[i] = std::exp(x[i] - max_val[i]);
+          sum[i] += y[i];
+        }
+      }
+      for (int i = 0; i < inner_num; ++i) {
+        sum[i] = Dtype(1) / sum[i];
+      }
+      for (int c = 0; c < channels; ++c) {
+        Dtype* y = out + c * inner_num;
+        for (int i = 0; i < inner_num; ++i) {
+          y[i] *= sum[i];
+        }
+      }
+    }
+  }
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_FAST_CPU_KERNELS_HPP_
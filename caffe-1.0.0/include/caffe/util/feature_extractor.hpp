@@ -0,0 +1,419 @@
+#ifndef CAFFE_UTIL_FEATURE_EXTRACTOR_HPP_
+#define CAFFE_UTIL_FEATURE_EXTRACTOR_HPP_
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+
+#include <cstdio>
+#include <deque>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db_builder.hpp"
+#include "caffe/util/format.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Destination of one feature blob. Open receives the shape of one
+ *        item (the blob shape without its num axis); Write then receives
+ *        every batch in order, always from the same thread.
+ */
+template <typename Dtype>
+class FeatureSink {
+ public:
+  FeatureSink() { }
+  virtual ~FeatureSink() { }
+  virtual void Open(const vector<int>& item_shape) = 0;
+  virtual void Write(const Dtype* data, int num) = 0;
+  virtual void Close() = 0;
+
+  DISABLE_COPY_AND_ASSIGN(FeatureSink);
+};
+
+/**
+ * @brief Writes one float Datum per item to a database, keyed by the
+ *        10-digit item index, with the backends' bulk-append writers.
+ */
+template <typename Dtype>
+class DBFeatureSink : public FeatureSink<Dtype> {
+ public:
+  /// @param expected_num number of items, used to presize the database
+  DBFeatureSink(const string& backend, const string& source, int expected_num)
+    : writer_(db::GetBatchWriter(backend)), source_(source),
+      expected_num_(expected_num), count_(0) { }
+
+  virtual void Open(const vector<int>& item_shape) {
+    CHECK_LE(item_shape.size(), 3) << "Datum holds at most C x H x W";
+    dim_ = 1;
+    for (int i = 0; i < item_shape.size(); ++i) {
+      dim_ *= item_shape[i];
+    }
+    datum_.set_channels(item_shape.size() > 0 ? item_shape[0] : 1);
+    datum_.set_height(item_shape.size() > 1 ? item_shape[1] : 1);
+    datum_.set_width(item_shape.size() > 2 ? item_shape[2] : 1);
+    datum_.mutable_float_data()->Resize(dim_, 0);
+    writer_->Open(source_, static_cast<size_t>(expected_num_) *
+        (dim_ * sizeof(float) + 32));
+  }
+
+  virtual void Write(const Dtype* data, int num) {
+    batch_.resize(num);
+    float* values = datum_.mutable_float_data()->mutable_data();
+    for (int n = 0; n < num; ++n) {
+      for (int i = 0; i < dim_; ++i) {
+        values[i] = data[n * dim_ + i];
+      }
+      batch_[n].first = caffe::format_int(count_++, 10);
+      CHECK(datum_.SerializeToString(&batch_[n].second));
+    }
+    writer_->Write(batch_);
+  }
+
+  virtual void Close() {
+    writer_->Close();
+    LOG(INFO) << "Wrote " << count_ << " features to " << source_;
+  }
+
+ private:
+  shared_ptr<db::BatchWriter> writer_;
+  string source_;
+  int expected_num_;
+  int count_;
+  int dim_;
+  Datum datum_;
+  vector<pair<string, string> > batch_;
+};
+
+/**
+ * @brief Writes all items back to back into one file, as native-endian
+ *        Dtype values, optionally behind a NumPy .npy header so that the
+ *        file opens with numpy.load(filename, mmap_mode='r').
+ *
+ * The header has a fixed size and is rewritten with the final item count
+ * on Close. Without it, the raw file maps with numpy.memmap given the dtype
+ * and the item shape that Close logs.
+ */
+template <typename Dtype>
+class NpyFeatureSink : public FeatureSink<Dtype> {
+ public:
+  NpyFeatureSink(const string& filename, bool header)
+    : filename_(filename), header_(header), file_(NULL), count_(0) { }
+  virtual ~NpyFeatureSink() {
+    if (file_ != NULL) {
+      std::fclose(file_);
+    }
+  }
+
+  virtual void Open(const vector<int>& item_shape) {
+    item_shape_ = item_shape;
+    dim_ = 1;
+    for (int i = 0; i < item_shape.size(); ++i) {
+      dim_ *= item_shape[i];
+    }
+    file_ = std::fopen(filename_.c_str(), "wb");
+    CHECK(file_ != NULL) << "Failed to open " << filename_;
+    std::setvbuf(file_, NULL, _IOFBF, 4 << 20);
+    if (header_) {
+      WriteHeader();
+    }
+  }
+
+  virtual void Write(const Dtype* data, int num) {
+    const size_t values = static_cast<size_t>(num) * dim_;
+    CHECK_EQ(std::fwrite(data, sizeof(Dtype), values, file_), values)
+        << "Failed to write " << filename_;
+    count_ += num;
+  }
+
+  virtual void Close() {
+    if (header_) {
+      CHECK_EQ(std::fseek(file_, 0, SEEK_SET), 0);
+      WriteHeader();
+    }
+    CHECK_EQ(std::fclose(file_), 0) << "Failed to close " << filename_;
+    file_ = NULL;
+    LOG(INFO) << "Wrote " << count_ << " features of shape "
+              << ShapeString() << " " << (sizeof(Dtype) == 4 ? "float32"
+              : "float64") << " to " << filename_;
+  }
+
+ private:
+  static const int kHeaderBytes = 128;
+
+  // "(count, d1, d2, ...)", with the trailing comma of a 1-tuple.
+  string ShapeString() const {
+    std::ostringstream out;
+    out << "(" << count_ << (item_shape_.empty() ? "," : "");
+    for (int i = 0; i < item_shape_.size(); ++i) {
+      out << ", " << item_shape_[i];
+    }
+    out << ")";
+    return out.str();
+  }
+
+  // Format version 1.0: magic, version, little-endian header length, then
+  // a Python dict literal padded with spaces and ended by a newline.
+  void WriteHeader() {
+    std::ostringstream dict;
+    dict << "{'descr': '<f" << sizeof(Dtype) << "', 'fortran_order': False, "
+         << "'shape': " << ShapeString() << ", }";
+    string header("\x93NUMPY\x01\x00", 8);
+    const int length = kHeaderBytes - 10;
+    header += static_cast<char>(length & 0xff);
+    header += static_cast<char>(length >> 8);
+    string text = dict.str();
+    CHECK_LT(static_cast<int>(text.size()), length)
+        << "Feature shape too long for the header";
+    text.resize(length - 1, ' ');
+    header += text + "\n";
+    CHECK_EQ(std::fwrite(header.data(), 1, header.size(), file_),
+        header.size()) << "Failed to write " << filename_;
+  }
+
+  string filename_;
+  bool header_;
+  std::FILE* file_;
+  vector<int> item_shape_;
+  int dim_;
+  int count_;
+};
+
+/**
+ * @brief Pipelined replacement for the extract_features main loop.
+ *
+ * The calling thread runs the forward passes and only memcpy's the feature
+ * blobs into one of queue_depth staging batches. Every sink has a writer
+ * thread of its own that serializes and writes those batches, so output
+ * for different blobs is produced in parallel and overlaps the next
+ * forward pass. Input reading already overlaps through the prefetching
+ * data layers.
+ */
+template <typename Dtype>
+class FeatureExtractor {
+ public:
+  /// @param sinks one per blob name; owned by the caller
+  FeatureExtractor(Net<Dtype>* net, const vector<string>& blob_names,
+      const vector<FeatureSink<Dtype>*>& sinks, int queue_depth = 4)
+    : net_(net), sinks_(sinks), queues_(sinks.size()) {
+    CHECK_EQ(blob_names.size(), sinks.size());
+    CHECK_GT(queue_depth, 0);
+    for (int i = 0; i < blob_names.size(); ++i) {
+      CHECK(net_->has_blob(blob_names[i]))
+          << "Unknown feature blob name " << blob_names[i];
+      blobs_.push_back(net_->blob_by_name(blob_names[i]));
+    }
+    for (int i = 0; i < queue_depth; ++i) {
+      free_.push_back(shared_ptr<StagedBatch>(new StagedBatch()));
+    }
+  }
+
+  /**
+   * @brief Runs num_batches forward passes and writes every feature blob
+   *        to its sink, then closes the sinks.
+   * @return the number of items written for the first blob.
+   */
+  int Extract(int num_batches, int log_every = 100) {
+    boost::thread_group writers;
+    for (int i = 0; i < sinks_.size(); ++i) {
+      writers.create_thread(
+          boost::bind(&FeatureExtractor::WriterEntry, this, i));
+    }
+    const boost::posix_time::ptime start =
+        boost::posix_time::microsec_clock::local_time();
+    int items = 0;
+    for (int batch_index = 0; batch_index < num_batches; ++batch_index) {
+      net_->Forward();
+      shared_ptr<StagedBatch> staged = TakeFree();
+      staged->data.resize(blobs_.size());
+      staged->num.resize(blobs_.size());
+      for (int i = 0; i < blobs_.size(); ++i) {
+        const Blob<Dtype>& blob = *blobs_[i];
+        staged->data[i].assign(blob.cpu_data(), blob.cpu_data() + blob.count());
+        staged->num[i] = blob.shape(0);
+        if (batch_index == 0) {
+          vector<int> item_shape(blob.shape().begin() + 1, blob.shape().end());
+          sinks_[i]->Open(item_shape);
+        }
+      }
+      items += staged->num[0];
+      Push(staged);
+      if (log_every > 0 && (batch_index + 1) % log_every == 0) {
+        LogThroughput(start, batch_index + 1, items);
+      }
+    }
+    Push(shared_ptr<StagedBatch>());
+    writers.join_all();
+    if (num_batches > 0) {
+      for (int i = 0; i < sinks_.size(); ++i) {
+        sinks_[i]->Close();
+      }
+    }
+    LogThroughput(start, num_batches, items);
+    return items;
+  }
+
+ private:
+  struct StagedBatch {
+    vector<vector<Dtype> > data;  // per blob
+    vector<int> num;
+    int pending;  // writers that still have to write this batch
+  };
+
+  shared_ptr<StagedBatch> TakeFree() {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (free_.empty()) {
+      cond_.wait(lock);
+    }
+    shared_ptr<StagedBatch> staged = free_.front();
+    free_.pop_front();
+    return staged;
+  }
+
+  // A NULL batch tells the writers to stop.
+  void Push(shared_ptr<StagedBatch> staged) {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (staged) {
+        staged->pending = sinks_.size();
+      }
+      for (int i = 0; i < queues_.size(); ++i) {
+        queues_[i].push_back(staged);
+      }
+    }
+    cond_.notify_all();
+  }
+
+  void WriterEntry(int index) {
+    for (;;) {
+      shared_ptr<StagedBatch> staged;
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        while (queues_[index].empty()) {
+          cond_.wait(lock);
+        }
+        staged = queues_[index].front();
+        queues_[index].pop_front();
+      }
+      if (!staged) {
+        return;
+      }
+      sinks_[index]->Write(&staged->data[index][0], staged->num[index]);
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (--staged->pending == 0) {
+          free_.push_back(staged);
+        }
+      }
+      cond_.notify_all();
+    }
+  }
+
+  void LogThroughput(const boost::posix_time::ptime& start, int batches,
+      int items) const {
+    const double seconds = (boost::posix_time::microsec_clock::local_time()
+        - start).total_microseconds() / 1e6;
+    LOG(INFO) << "Extracted " << batches << " batches, " << items
+              << " items (" << (seconds > 0 ? items / seconds : 0.0)
+              << " items/s)";
+  }
+
+  Net<Dtype>* net_;
+  vector<shared_ptr<Blob<Dtype> > > blobs_;
+  vector<FeatureSink<Dtype>*> sinks_;
+  std::deque<shared_ptr<StagedBatch> > free_;
+  vector<std::deque<shared_ptr<StagedBatch> > > queues_;
+  boost::mutex mutex_;
+  boost::condition_variable cond_;
+
+  DISABLE_COPY_AND_ASSIGN(FeatureExtractor);
+};
+
+/**
+ * @brief Feeds the net kNumCrops oversampled crops per image: the top named
+ *        input of its (first) producer is renamed and an Oversample layer
+ *        producing input from it is inserted right after that layer.
+ *        Register the layer type with RegisterOversampleLayer first.
+ */
+inline void AddOversampling(NetParameter* param, const string& input,
+    int crop_size) {
+  int producer = -1;
+  for (int i = 0; i < param->layer_size() && producer < 0; ++i) {
+    for (int j = 0; j < param->layer(i).top_size(); ++j) {
+      if (param->layer(i).top(j) == input) {
+        param->mutable_layer(i)->set_top(j, input + "_full");
+        producer = i;
+        break;
+      }
+    }
+  }
+  CHECK_GE(producer, 0) << "No layer produces " << input;
+  LayerParameter* oversample = param->add_layer();
+  oversample->set_name(input + "_oversample");
+  oversample->set_type("Oversample");
+  oversample->add_bottom(input + "_full");
+  oversample->add_top(input);
+  oversample->mutable_transform_param()->set_crop_size(crop_size);
+  for (int i = param->layer_size() - 1; i > producer + 1; --i) {
+    param->mutable_layer()->SwapElements(i, i - 1);
+  }
+}
+
+/**
+ * @brief Appends layers that pool each of blob_names over every crops
+ *        consecutive items, i.e. over the crops of one image, with the
+ *        given method (AVE or MAX).
+ * @return the names of the pooled (N x D) blobs, in order.
+ */
+inline vector<string> AddCropAggregation(NetParameter* param,
+    const vector<string>& blob_names, int crops,
+    PoolingParameter_PoolMethod method) {
+  CHECK_GT(crops, 0);
+  vector<string> pooled;
+  for (int i = 0; i < blob_names.size(); ++i) {
+    const string& name = blob_names[i];
+    // (N * crops) x D  ->  N x 1 x crops x D  ->  N x 1 x 1 x D  ->  N x D
+    LayerParameter* flatten = param->add_layer();
+    flatten->set_name(name + "_flatten");
+    flatten->set_type("Flatten");
+    flatten->add_bottom(name);
+    flatten->add_top(name + "_flat");
+    LayerParameter* reshape = param->add_layer();
+    reshape->set_name(name + "_group_crops");
+    reshape->set_type("Reshape");
+    reshape->add_bottom(name + "_flat");
+    reshape->add_top(name + "_crops");
+    reshape->mutable_reshape_param()->set_axis(0);
+    reshape->mutable_reshape_param()->set_num_axes(1);
+    BlobShape* shape = reshape->mutable_reshape_param()->mutable_shape();
+    shape->add_dim(-1);
+    shape->add_dim(1);
+    shape->add_dim(crops);
+    LayerParameter* pool = param->add_layer();
+    pool->set_name(name + "_pool_crops");
+    pool->set_type("Pooling");
+    pool->add_bottom(name + "_crops");
+    pool->add_top(name + "_pooled");
+    pool->mutable_pooling_param()->set_pool(method);
+    pool->mutable_pooling_param()->set_kernel_h(crops);
+    pool->mutable_pooling_param()->set_kernel_w(1);
+    LayerParameter* output = param->add_layer();
+    output->set_name(name + "_aggregate");
+    output->set_type("Flatten");
+    output->add_bottom(name + "_pooled");
+    output->add_top(name + "_aggregated");
+    pooled.push_back(name + "_aggregated");
+  }
+  return pooled;
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_FEATURE_EXTRACTOR_HPP_
@@ -0,0 +1,189 @@
+#ifndef CAFFE_UTIL_HALF_HPP_
+#define CAFFE_UTIL_HALF_HPP_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+#include "caffe/common.hpp"
+#include "caffe/util/math_functions.hpp"
+
+// 16-bit floating point storage for CPU inference. Values are only stored
+// in 16 bits; all arithmetic is done in float after converting blocks of
+// them back (see caffe_cpu_gemm_half).
+//
+// - HALF_FP16 is IEEE binary16: 10 mantissa bits, range +-65504. Converted
+//   with F16C instructions when compiled with -mf16c (or -march=native on a
+//   CPU that has them), otherwise in portable code.
+// - HALF_BF16 is bfloat16, the top half of a float: 7 mantissa bits, full
+//   float range. Conversion is a shift and vectorizes on any SIMD ISA.
+//
+// Both round to nearest even when narrowing.
+
+namespace caffe {
+
+enum HalfType { HALF_FP16, HALF_BF16 };
+
+inline uint16_t caffe_float_to_fp16(float value) {
+  uint32_t x;
+  memcpy(&x, &value, sizeof(x));
+  const uint16_t sign = (x >> 16) & 0x8000;
+  x &= 0x7fffffff;
+  if (x >= 0x7f800000) {  // Inf or NaN (kept quiet)
+    return sign | 0x7c00 | (x > 0x7f800000 ? 0x200 : 0);
+  }
+  if (x >= 0x477ff000) {  // rounds to a magnitude of at least 65520
+    return sign | 0x7c00;
+  }
+  if (x < 0x38800000) {  // below the smallest normal half, 2^-14
+    if (x <= 0x33000000) {  // at most 2^-25, rounds to zero
+      return sign;
+    }
+    const int shift = 126 - static_cast<int>(x >> 23);
+    const uint32_t mantissa = (x & 0x7fffff) | 0x800000;
+    uint32_t h = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (h & 1))) {
+      ++h;
+    }
+    return sign | h;
+  }
+  uint32_t h = (x >> 13) - ((127 - 15) << 10);
+  const uint32_t rest = x & 0x1fff;
+  if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+    ++h;  // a carry into the exponent is the correct rounding
+  }
+  return sign | h;
+}
+
+inline float caffe_fp16_to_float(uint16_t h) {
+  const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t x;
+  if (exponent == 0x1f) {
+    x = sign | 0x7f800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+  } else if (mantissa == 0) {
+    x = sign;
+  } else {  // subnormal half, normal float
+    exponent = 127 - 15 + 1;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+  }
+  float value;
+  memcpy(&value, &x, sizeof(value));
+  return value;
+}
+
+inline uint16_t caffe_float_to_bf16(float value) {
+  uint32_t x;
+  memcpy(&x, &value, sizeof(x));
+  if ((x & 0x7fffffff) > 0x7f800000) {
+    return (x >> 16) | 0x40;  // keep NaN a (quiet) NaN
+  }
+  return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+inline float caffe_bf16_to_float(uint16_t h) {
+  const uint32_t x = static_cast<uint32_t>(h) << 16;
+  float value;
+  memcpy(&value, &x, sizeof(value));
+  return value;
+}
+
+/// @brief Narrows n floats to type.
+inline void caffe_cpu_float_to_half(const int n, const float* x, uint16_t* y,
+    const HalfType type) {
+  int i = 0;
+  if (type == HALF_BF16) {
+    for (; i < n; ++i) {
+      y[i] = caffe_float_to_bf16(x[i]);
+    }
+    return;
+  }
+#ifdef __F16C__
+  for (; i + 8 <= n; i += 8) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(y + i),
+        _mm256_cvtps_ph(_mm256_loadu_ps(x + i), 0));
+  }
+#endif
+  for (; i < n; ++i) {
+    y[i] = caffe_float_to_fp16(x[i]);
+  }
+}
+
+/// @brief Widens n values of type to float.
+inline void caffe_cpu_half_to_float(const int n, const uint16_t* x, float* y,
+    const HalfType type) {
+  int i = 0;
+  if (type == HALF_BF16) {
+    for (; i < n; ++i) {
+      y[i] = caffe_bf16_to_float(x[i]);
+    }
+    return;
+  }
+#ifdef __F16C__
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(y + i, _mm256_cvtph_ps(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i))));
+  }
+#endif
+  for (; i < n; ++i) {
+    y[i] = caffe_fp16_to_float(x[i]);
+  }
+}
+
+/**
+ * @brief C = alpha * A * op(B) + beta * C, where A (M x K) and C (M x N) are
+ *        float and B is stored as 16-bit type (N x K for CblasTrans,
+ *        K x N for CblasNoTrans).
+ *
+ * B is widened one panel of whole rows at a time into *panel, sized to stay
+ * in L2, and each panel is multiplied with sgemm while it is hot. B is thus
+ * read from memory once at half the bytes of a float matrix, which is what
+ * bounds inner products with small M.
+ */
+inline void caffe_cpu_gemm_half(const CBLAS_TRANSPOSE TransB, const int M,
+    const int N, const int K, const float alpha, const float* A,
+    const uint16_t* B, const HalfType type, const float beta, float* C,
+    std::vector<float>* panel) {
+  // Floats per widened panel: 128KB.
+  const int kPanelSize = 32768;
+  if (TransB == CblasTrans) {
+    const int rows = std::max(1, std::min(N, kPanelSize / K));
+    panel->resize(static_cast<size_t>(rows) * K);
+    for (int n = 0; n < N; n += rows) {
+      const int nb = std::min(rows, N - n);
+      caffe_cpu_half_to_float(nb * K, B + static_cast<size_t>(n) * K,
+          &(*panel)[0], type);
+      cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, M, nb, K, alpha,
+          A, K, &(*panel)[0], K, beta, C + n, N);
+    }
+  } else {
+    const int rows = std::max(1, std::min(K, kPanelSize / N));
+    panel->resize(static_cast<size_t>(rows) * N);
+    for (int k = 0; k < K; k += rows) {
+      const int kb = std::min(rows, K - k);
+      caffe_cpu_half_to_float(kb * N, B + static_cast<size_t>(k) * N,
+          &(*panel)[0], type);
+      cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, M, N, kb, alpha,
+          A + k, K, &(*panel)[0], N, k == 0 ? beta : 1.f, C, N);
+    }
+  }
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_HALF_HPP_
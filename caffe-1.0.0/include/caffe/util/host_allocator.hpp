@@ -0,0 +1,263 @@
+#ifndef CAFFE_UTIL_HOST_ALLOCATOR_HPP_
+#define CAFFE_UTIL_HOST_ALLOCATOR_HPP_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "glog/logging.h"
+
+namespace caffe {
+
+/**
+ * @brief Caching host allocator for code that allocates host buffers itself.
+ *
+ * Blocks are 64-byte aligned and rounded up to a size class (four classes
+ * per power of two). Freed blocks are kept in per-class free lists and
+ * handed out again, so a caller whose buffer sizes vary (e.g. with the batch
+ * size) stops reaching malloc once it has seen its largest sizes. Blocks of
+ * at least 2 MB can optionally be backed by transparent huge pages.
+ *
+ * SyncedMemory is compiled into libcaffe and allocates through the library's
+ * own CaffeMallocHost; BlobHostPool (caffe/util/blob_host_pool.hpp) hands
+ * blobs memory from this allocator instead. Memory from Alloc() must only be
+ * released with Free().
+ *
+ * The policy is fixed on first use from the CAFFE_HOST_ALLOCATOR environment
+ * variable ("malloc", "pooled" or "pooled_hugepage"; default "malloc"), or
+ * earlier through set_policy(). Under "malloc" nothing is cached: Alloc and
+ * Free go straight to the system. CAFFE_HOST_POOL_LIMIT_MB bounds the
+ * cached, unused bytes. pthread primitives are used instead of boost::mutex
+ * so this header stays safe to include from CUDA sources (see #1009, #1010).
+ */
+class HostAllocator {
+ public:
+  enum Policy { MALLOC, POOLED, POOLED_HUGEPAGE };
+
+  struct Stats {
+    size_t bytes_in_use;    ///< handed out and not yet freed
+    size_t peak_bytes_in_use;
+    size_t bytes_cached;    ///< held in free lists
+    size_t num_allocs;
+    size_t num_hits;        ///< allocations served from a free list
+    double hit_rate() const {
+      return num_allocs ? static_cast<double>(num_hits) / num_allocs : 0.;
+    }
+  };
+
+  static HostAllocator& Get() {
+    // Never destroyed: blobs in static storage may be freed after main().
+    static HostAllocator* instance = new HostAllocator();
+    return *instance;
+  }
+
+  /// @brief Selects the policy; must be called before the first allocation.
+  void set_policy(Policy policy) {
+    Lock lock(&mutex_);
+    CHECK(!policy_fixed_ || policy == policy_)
+        << "HostAllocator policy cannot change after the first allocation";
+    policy_ = policy;
+    policy_fixed_ = true;
+    __atomic_store_n(&fixed_policy_, policy_, __ATOMIC_RELEASE);
+  }
+  Policy policy() {
+    // Lock-free once fixed, as callers ask on every allocation.
+    const int fixed = __atomic_load_n(&fixed_policy_, __ATOMIC_ACQUIRE);
+    if (fixed >= 0) {
+      return static_cast<Policy>(fixed);
+    }
+    Lock lock(&mutex_);
+    FixPolicy();
+    return policy_;
+  }
+  inline bool pooled() { return policy() != MALLOC; }
+
+  void* Alloc(size_t size) {
+    const size_t bucket = BucketSize(size);
+    Lock lock(&mutex_);
+    FixPolicy();
+    ++stats_.num_allocs;
+    void* block = NULL;
+    std::map<size_t, std::vector<void*> >::iterator it = free_.find(bucket);
+    if (policy_ != MALLOC && it != free_.end() && !it->second.empty()) {
+      block = it->second.back();
+      it->second.pop_back();
+      stats_.bytes_cached -= bucket;
+      ++stats_.num_hits;
+    } else {
+      block = NewBlock(bucket);
+    }
+    stats_.bytes_in_use += bucket;
+    if (stats_.bytes_in_use > stats_.peak_bytes_in_use) {
+      stats_.peak_bytes_in_use = stats_.bytes_in_use;
+    }
+    return static_cast<char*>(block) + kHeaderSize;
+  }
+
+  void Free(void* ptr) {
+    if (ptr == NULL) {
+      return;
+    }
+    void* block = static_cast<char*>(ptr) - kHeaderSize;
+    const Header* header = static_cast<const Header*>(block);
+    CHECK(header->magic == kMagic) << "pointer not from HostAllocator";
+    const size_t bucket = header->bucket;
+    Lock lock(&mutex_);
+    stats_.bytes_in_use -= bucket;
+    if (policy_ == MALLOC || stats_.bytes_cached + bucket > cache_limit_) {
+      DeleteBlock(block);
+      return;
+    }
+    free_[bucket].push_back(block);
+    stats_.bytes_cached += bucket;
+  }
+
+  /// @brief Returns every cached block to the system.
+  void Trim() {
+    Lock lock(&mutex_);
+    for (std::map<size_t, std::vector<void*> >::iterator it = free_.begin();
+         it != free_.end(); ++it) {
+      for (size_t i = 0; i < it->second.size(); ++i) {
+        DeleteBlock(it->second[i]);
+      }
+    }
+    free_.clear();
+    stats_.bytes_cached = 0;
+  }
+
+  Stats stats() {
+    Lock lock(&mutex_);
+    return stats_;
+  }
+
+  void LogStats() {
+    Stats s = stats();
+    LOG(INFO) << "Host allocator: " << (s.bytes_in_use >> 20) << " MB in use, "
+              << (s.peak_bytes_in_use >> 20) << " MB peak, "
+              << (s.bytes_cached >> 20) << " MB cached, hit rate "
+              << s.hit_rate();
+  }
+
+  /// @brief Size actually reserved for a request of size bytes.
+  static size_t BucketSize(size_t size) {
+    if (size <= kAlignment) {
+      return kAlignment;
+    }
+    // Four classes per power of two keep the waste below 25%.
+    size_t power = 1;
+    while (power < size) {
+      power <<= 1;
+    }
+    const size_t step = power >= 4 * kAlignment ? power / 8 : kAlignment;
+    return (size + step - 1) / step * step;
+  }
+
+ private:
+  static const size_t kAlignment = 64;
+  static const size_t kHeaderSize = 64;  // keeps user pointers aligned
+  static const size_t kHugePageSize = 2 << 20;
+  static const uint32_t kMagic = 0xCAFFE64;
+
+  struct Header {
+    size_t bucket;
+    uint32_t magic;
+    uint32_t mapped;  // allocated with mmap rather than posix_memalign
+  };
+
+  class Lock {
+   public:
+    explicit Lock(pthread_mutex_t* mutex) : mutex_(mutex) {
+      pthread_mutex_lock(mutex_);
+    }
+    ~Lock() { pthread_mutex_unlock(mutex_); }
+   private:
+    pthread_mutex_t* mutex_;
+  };
+
+  HostAllocator() : policy_(MALLOC), policy_fixed_(false), fixed_policy_(-1),
+      cache_limit_(static_cast<size_t>(-1)) {
+    pthread_mutex_init(&mutex_, NULL);
+    memset(&stats_, 0, sizeof(stats_));
+    const char* limit = getenv("CAFFE_HOST_POOL_LIMIT_MB");
+    if (limit != NULL) {
+      cache_limit_ = static_cast<size_t>(atol(limit)) << 20;
+    }
+  }
+  // Called with mutex_ held.
+  void FixPolicy() {
+    if (policy_fixed_) {
+      return;
+    }
+    const char* env = getenv("CAFFE_HOST_ALLOCATOR");
+    const std::string name = env ? env : "malloc";
+    if (name == "pooled") {
+      policy_ = POOLED;
+    } else if (name == "pooled_hugepage") {
+      policy_ = POOLED_HUGEPAGE;
+    } else {
+      LOG_IF(WARNING, name != "malloc") << "Unknown CAFFE_HOST_ALLOCATOR "
+                                        << name << ", using malloc";
+      policy_ = MALLOC;
+    }
+    policy_fixed_ = true;
+    __atomic_store_n(&fixed_policy_, policy_, __ATOMIC_RELEASE);
+  }
+
+  void* NewBlock(size_t bucket) {
+    const size_t bytes = bucket + kHeaderSize;
+    void* block = NULL;
+    bool mapped = false;
+    if (policy_ == POOLED_HUGEPAGE && bytes >= kHugePageSize) {
+      block = mmap(NULL, MappedSize(bytes), PROT_READ | PROT_WRITE,
+          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      CHECK(block != MAP_FAILED) << "host allocation of size " << bucket
+                                 << " failed";
+#ifdef MADV_HUGEPAGE
+      madvise(block, MappedSize(bytes), MADV_HUGEPAGE);
+#endif
+      mapped = true;
+    } else {
+      CHECK_EQ(posix_memalign(&block, kAlignment, bytes), 0)
+          << "host allocation of size " << bucket << " failed";
+    }
+    Header* header = static_cast<Header*>(block);
+    header->bucket = bucket;
+    header->magic = kMagic;
+    header->mapped = mapped;
+    return block;
+  }
+
+  void DeleteBlock(void* block) {
+    const Header* header = static_cast<const Header*>(block);
+    if (header->mapped) {
+      munmap(block, MappedSize(header->bucket + kHeaderSize));
+    } else {
+      free(block);
+    }
+  }
+
+  static size_t MappedSize(size_t bytes) {
+    return (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+  }
+
+  pthread_mutex_t mutex_;
+  Policy policy_;
+  bool policy_fixed_;
+  int fixed_policy_;  // policy_ once fixed, else -1; read without mutex_
+  size_t cache_limit_;
+  Stats stats_;
+  std::map<size_t, std::vector<void*> > free_;
+
+  HostAllocator(const HostAllocator&);
+  HostAllocator& operator=(const HostAllocator&);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_HOST_ALLOCATOR_HPP_
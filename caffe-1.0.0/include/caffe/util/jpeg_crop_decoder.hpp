@@ -0,0 +1,148 @@
+#ifndef CAFFE_UTIL_JPEG_CROP_DECODER_HPP_
+#define CAFFE_UTIL_JPEG_CROP_DECODER_HPP_
+
+#ifdef USE_LIBJPEG_TURBO
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>  // jpeglib.h needs FILE
+#include <jpeglib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "caffe/common.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Decodes only a crop window of a JPEG with libjpeg-turbo: rows
+ *        above the window are skipped without color conversion or
+ *        upsampling and rows below it are not decoded at all, and only the
+ *        iMCU columns covering the window are processed.
+ *
+ * Pixels are produced interleaved (HWC) in BGR order, like cv::imdecode, so
+ * results agree with the OpenCV decode path up to decoder differences.
+ * Errors make the calls return false instead of aborting the process, so
+ * callers can fall back to OpenCV (e.g. for CMYK JPEGs).
+ */
+class JPEGCropDecoder {
+ public:
+  JPEGCropDecoder() : header_read_(false) {
+    cinfo_.err = jpeg_std_error(&error_.pub);
+    error_.pub.error_exit = &JPEGCropDecoder::ErrorExit;
+    error_.pub.output_message = &JPEGCropDecoder::OutputMessage;
+    jpeg_create_decompress(&cinfo_);
+  }
+  ~JPEGCropDecoder() { jpeg_destroy_decompress(&cinfo_); }
+
+  /// @brief Whether data starts with a JPEG SOI marker.
+  static bool IsJPEG(const string& data) {
+    return data.size() > 2 && static_cast<uint8_t>(data[0]) == 0xFF &&
+        static_cast<uint8_t>(data[1]) == 0xD8;
+  }
+
+  /**
+   * @brief Parses the header of data, which must stay alive until
+   *        DecodeCrop. color is 1 to decode as BGR, 0 as grayscale, and -1
+   *        to keep the image's own (like DecodeDatumToCVMatNative).
+   */
+  bool ReadHeader(const string& data, const int color) {
+    header_read_ = false;
+    if (!IsJPEG(data)) {
+      return false;
+    }
+    if (setjmp(error_.jump)) {
+      jpeg_abort_decompress(&cinfo_);
+      return false;
+    }
+    jpeg_mem_src(&cinfo_,
+        reinterpret_cast<unsigned char*>(const_cast<char*>(data.data())),
+        data.size());
+    jpeg_read_header(&cinfo_, TRUE);
+    if (cinfo_.num_components != 1 && cinfo_.num_components != 3) {
+      jpeg_abort_decompress(&cinfo_);
+      return false;
+    }
+    const bool gray = color == 0 || (color < 0 && cinfo_.num_components == 1);
+    cinfo_.out_color_space = gray ? JCS_GRAYSCALE : JCS_EXT_BGR;
+    channels_ = gray ? 1 : 3;
+    header_read_ = true;
+    return true;
+  }
+
+  inline int height() const { return cinfo_.image_height; }
+  inline int width() const { return cinfo_.image_width; }
+  inline int channels() const { return channels_; }
+
+  /**
+   * @brief Decodes rows [h_off, h_off + crop_h) and columns
+   *        [w_off, w_off + crop_w) into out, crop_h x crop_w x channels().
+   */
+  bool DecodeCrop(const int h_off, const int w_off, const int crop_h,
+      const int crop_w, uint8_t* out) {
+    CHECK(header_read_) << "ReadHeader must succeed before DecodeCrop";
+    CHECK_LE(h_off + crop_h, height());
+    CHECK_LE(w_off + crop_w, width());
+    header_read_ = false;
+    if (setjmp(error_.jump)) {
+      jpeg_abort_decompress(&cinfo_);
+      return false;
+    }
+    jpeg_start_decompress(&cinfo_);
+    // Fancy chroma upsampling reads one neighbouring pixel on each side, so
+    // ask for one more column around the window; libjpeg-turbo then widens
+    // it to iMCU boundaries.
+    JDIMENSION x_off = std::max(w_off - 1, 0);
+    JDIMENSION x_width = std::min(w_off + crop_w + 1, width()) - x_off;
+    if (x_width < width()) {
+      jpeg_crop_scanline(&cinfo_, &x_off, &x_width);
+    } else {
+      x_off = 0;
+      x_width = width();
+    }
+    if (h_off > 0) {
+      jpeg_skip_scanlines(&cinfo_, h_off);
+    }
+    row_.resize(x_width * channels_);
+    const int skip = (w_off - x_off) * channels_;
+    const int row_bytes = crop_w * channels_;
+    for (int h = 0; h < crop_h; ++h) {
+      JSAMPROW row = &row_[0];
+      jpeg_read_scanlines(&cinfo_, &row, 1);
+      memcpy(out + h * row_bytes, &row_[skip], row_bytes);
+    }
+    // The rows below the window are never decoded.
+    jpeg_abort_decompress(&cinfo_);
+    return true;
+  }
+
+ private:
+  struct ErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+  };
+
+  static void ErrorExit(j_common_ptr cinfo) {
+    longjmp(reinterpret_cast<ErrorManager*>(cinfo->err)->jump, 1);
+  }
+  static void OutputMessage(j_common_ptr cinfo) {
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+    DLOG(WARNING) << "libjpeg: " << message;
+  }
+
+  struct jpeg_decompress_struct cinfo_;
+  ErrorManager error_;
+  bool header_read_;
+  int channels_;
+  std::vector<uint8_t> row_;
+
+  DISABLE_COPY_AND_ASSIGN(JPEGCropDecoder);
+};
+
+}  // namespace caffe
+
+#endif  // USE_LIBJPEG_TURBO
+#endif  // CAFFE_UTIL_JPEG_CROP_DECODER_HPP_
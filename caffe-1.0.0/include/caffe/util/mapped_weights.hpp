@@ -0,0 +1,252 @@
+#ifndef CAFFE_UTIL_MAPPED_WEIGHTS_HPP_
+#define CAFFE_UTIL_MAPPED_WEIGHTS_HPP_
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>  // NOLINT(readability/streams)
+#include <map>
+#include <string>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/net.hpp"
+#include "caffe/proto/caffe.pb.h"
+
+namespace caffe {
+
+/**
+ * @brief A weight container that can be mmapped straight into blobs.
+ *
+ * File layout:
+ *   MappedWeightsHeader
+ *   NetParameter (binary proto) holding layer names, types and blob shapes
+ *     but no blob data
+ *   padding up to data_offset (page aligned)
+ *   raw tensors in layer/blob order, each starting on a 64-byte boundary
+ *
+ * Loading maps the file copy-on-write and points every matching layer blob
+ * at its tensor with SyncedMemory::set_cpu_data, so weights are neither
+ * parsed nor copied: pages are faulted in on first use and shared between
+ * processes serving the same model. The returned MappedWeights must outlive
+ * the net.
+ */
+struct MappedWeightsHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t dtype_size;   // sizeof(float) or sizeof(double)
+  uint64_t proto_size;
+  uint64_t data_offset;
+};
+
+const char kMappedWeightsMagic[8] = {'C', 'A', 'F', 'F', 'E', 'M', 'M', 'W'};
+const size_t kMappedWeightsAlignment = 64;
+const size_t kMappedWeightsPageSize = 4096;
+
+inline size_t MappedWeightsAlign(size_t offset, size_t alignment) {
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+/// @brief Whether filename starts with the mapped weights magic.
+inline bool IsMappedWeightsFile(const string& filename) {
+  std::ifstream file(filename.c_str(), std::ios::binary);
+  char magic[sizeof(kMappedWeightsMagic)];
+  if (!file.read(magic, sizeof(magic))) {
+    return false;
+  }
+  return memcmp(magic, kMappedWeightsMagic, sizeof(magic)) == 0;
+}
+
+/**
+ * @brief Writes the blobs of a trained NetParameter (e.g. a parsed
+ *        .caffemodel) as a mapped weights file of element type Dtype.
+ */
+template <typename Dtype>
+void WriteMappedWeights(const NetParameter& trained, const string& filename) {
+  NetParameter header_param(trained);
+  vector<Blob<Dtype>*> blobs;
+  for (int i = 0; i < header_param.layer_size(); ++i) {
+    LayerParameter* layer = header_param.mutable_layer(i);
+    for (int j = 0; j < layer->blobs_size(); ++j) {
+      Blob<Dtype>* blob = new Blob<Dtype>();
+      blob->FromProto(layer->blobs(j));
+      blobs.push_back(blob);
+      // Keep only the shape; FromProto normalizes legacy 4D fields.
+      BlobProto* proto = layer->mutable_blobs(j);
+      proto->Clear();
+      for (int k = 0; k < blob->num_axes(); ++k) {
+        proto->mutable_shape()->add_dim(blob->shape(k));
+      }
+    }
+  }
+  string proto_bytes;
+  CHECK(header_param.SerializeToString(&proto_bytes));
+  MappedWeightsHeader header;
+  memcpy(header.magic, kMappedWeightsMagic, sizeof(header.magic));
+  header.version = 1;
+  header.dtype_size = sizeof(Dtype);
+  header.proto_size = proto_bytes.size();
+  header.data_offset = MappedWeightsAlign(sizeof(header) + proto_bytes.size(),
+      kMappedWeightsPageSize);
+
+  std::ofstream out(filename.c_str(), std::ios::binary | std::ios::trunc);
+  CHECK(out) << "Failed to open " << filename;
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(proto_bytes.data(), proto_bytes.size());
+  size_t offset = sizeof(header) + proto_bytes.size();
+  const string padding(kMappedWeightsPageSize, '\0');
+  for (int i = 0; i < blobs.size(); ++i) {
+    const size_t start = MappedWeightsAlign(offset,
+        i == 0 ? kMappedWeightsPageSize : kMappedWeightsAlignment);
+    out.write(padding.data(), start - offset);
+    const size_t bytes = blobs[i]->count() * sizeof(Dtype);
+    out.write(reinterpret_cast<const char*>(blobs[i]->cpu_data()), bytes);
+    offset = start + bytes;
+    delete blobs[i];
+  }
+  CHECK(out) << "Failed to write " << filename;
+}
+
+/**
+ * @brief Read-only, copy-on-write mapping of a mapped weights file.
+ */
+class MappedWeights {
+ public:
+  explicit MappedWeights(const string& filename)
+    : filename_(filename), base_(NULL), size_(0) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    CHECK_GE(fd, 0) << "Failed to open " << filename;
+    struct stat st;
+    CHECK_EQ(fstat(fd, &st), 0);
+    size_ = st.st_size;
+    // Checked before mapping: the magic and sizes are read from the header.
+    CHECK_GE(size_, sizeof(MappedWeightsHeader)) << filename << " is truncated";
+    // PROT_WRITE with MAP_PRIVATE lets set_cpu_data take a non-const
+    // pointer; nothing is copied unless a page is actually written.
+    base_ = mmap(NULL, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    CHECK(base_ != MAP_FAILED) << "Failed to mmap " << filename;
+    const MappedWeightsHeader* header = this->header();
+    CHECK_EQ(memcmp(header->magic, kMappedWeightsMagic,
+        sizeof(kMappedWeightsMagic)), 0) << filename
+        << " is not a mapped weights file";
+    CHECK_EQ(header->version, 1) << "Unsupported mapped weights version";
+    // The proto must lie between the header and the tensors; compare by
+    // subtraction so that corrupt sizes cannot overflow.
+    CHECK_GE(header->data_offset, sizeof(*header)) << filename
+        << " is corrupt";
+    CHECK_LE(header->data_offset, size_) << filename << " is truncated";
+    CHECK_LE(header->proto_size, header->data_offset - sizeof(*header))
+        << filename << " is corrupt";
+    CHECK(param_.ParseFromArray(static_cast<char*>(base_) + sizeof(*header),
+        header->proto_size)) << "Failed to parse header of " << filename;
+  }
+  ~MappedWeights() {
+    if (base_ != NULL) {
+      munmap(base_, size_);
+    }
+  }
+
+  inline const MappedWeightsHeader* header() const {
+    return static_cast<const MappedWeightsHeader*>(base_);
+  }
+  /// @brief Layer names, types and blob shapes (without data).
+  inline const NetParameter& param() const { return param_; }
+  inline const string& filename() const { return filename_; }
+
+  /**
+   * @brief Points the blobs of every layer of net with a matching name at
+   *        the mapped tensors, like Net::CopyTrainedLayersFrom.
+   */
+  template <typename Dtype>
+  void ShareWith(Net<Dtype>* net) {
+    CHECK_EQ(header()->dtype_size, sizeof(Dtype))
+        << filename_ << " stores a different element type";
+    size_t offset = header()->data_offset;
+    bool first = true;
+    for (int i = 0; i < param_.layer_size(); ++i) {
+      const LayerParameter& source_layer = param_.layer(i);
+      vector<size_t> offsets;
+      for (int j = 0; j < source_layer.blobs_size(); ++j) {
+        offset = MappedWeightsAlign(offset,
+            first ? kMappedWeightsPageSize : kMappedWeightsAlignment);
+        first = false;
+        offsets.push_back(offset);
+        offset += ProtoCount(source_layer.blobs(j)) * sizeof(Dtype);
+      }
+      CHECK_LE(offset, size_) << filename_ << " is truncated";
+      const string& source_layer_name = source_layer.name();
+      if (!net->has_layer(source_layer_name)) {
+        DLOG(INFO) << "Ignoring source layer " << source_layer_name;
+        continue;
+      }
+      DLOG(INFO) << "Mapping source layer " << source_layer_name;
+      vector<shared_ptr<Blob<Dtype> > >& target_blobs =
+          net->layer_by_name(source_layer_name)->blobs();
+      CHECK_EQ(target_blobs.size(), source_layer.blobs_size())
+          << "Incompatible number of blobs for layer " << source_layer_name;
+      for (int j = 0; j < target_blobs.size(); ++j) {
+        if (!target_blobs[j]->ShapeEquals(source_layer.blobs(j))) {
+          Blob<Dtype> source_blob;
+          source_blob.Reshape(ProtoShape(source_layer.blobs(j)));
+          LOG(FATAL) << "Cannot map param " << j << " weights from layer '"
+              << source_layer_name << "'; shape mismatch.  Source param shape "
+              << "is " << source_blob.shape_string() << "; target param shape "
+              << "is " << target_blobs[j]->shape_string();
+        }
+        target_blobs[j]->data()->set_cpu_data(
+            static_cast<char*>(base_) + offsets[j]);
+      }
+    }
+  }
+
+ private:
+  static vector<int> ProtoShape(const BlobProto& proto) {
+    vector<int> shape;
+    for (int i = 0; i < proto.shape().dim_size(); ++i) {
+      shape.push_back(proto.shape().dim(i));
+    }
+    return shape;
+  }
+  static size_t ProtoCount(const BlobProto& proto) {
+    size_t count = 1;
+    for (int i = 0; i < proto.shape().dim_size(); ++i) {
+      count *= proto.shape().dim(i);
+    }
+    return count;
+  }
+
+  const string filename_;
+  void* base_;
+  size_t size_;
+  NetParameter param_;
+
+  DISABLE_COPY_AND_ASSIGN(MappedWeights);
+};
+
+/**
+ * @brief Drop-in for Net::CopyTrainedLayersFrom that maps mapped weights
+ *        files and falls back to the regular loaders for .caffemodel and
+ *        .h5. Returns the mapping (NULL for the fallback), which the caller
+ *        keeps alive as long as the net.
+ */
+template <typename Dtype>
+shared_ptr<MappedWeights> CopyTrainedLayersFrom(Net<Dtype>* net,
+    const string& trained_filename) {
+  if (!IsMappedWeightsFile(trained_filename)) {
+    net->CopyTrainedLayersFrom(trained_filename);
+    return shared_ptr<MappedWeights>();
+  }
+  shared_ptr<MappedWeights> weights(new MappedWeights(trained_filename));
+  weights->ShareWith(net);
+  return weights;
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_MAPPED_WEIGHTS_HPP_
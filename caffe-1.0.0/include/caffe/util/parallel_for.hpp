@@ -0,0 +1,97 @@
+#ifndef CAFFE_UTIL_PARALLEL_FOR_HPP_
+#define CAFFE_UTIL_PARALLEL_FOR_HPP_
+
+#include <cstdlib>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Threading for the header-only elementwise CPU kernels in
+// parallel_math.hpp and the layers built on them.
+//
+// When Caffe is built with OpenMP (-fopenmp), loops over at least
+// caffe_parallel_grain() elements are split into contiguous, statically
+// scheduled chunks, one per thread, and each chunk is left to the compiler
+// to vectorize. Every element is still computed by exactly the same
+// expression, so results are bit-identical to the serial loop. Without
+// OpenMP the loops stay serial.
+//
+// The thread count defaults to CAFFE_NUM_THREADS if set, otherwise to the
+// OpenMP default, and can be changed at runtime with
+// caffe_set_num_threads(); 1 disables threading.
+
+namespace caffe {
+
+inline int& caffe_num_threads_storage() {
+  static int num_threads = -1;
+  return num_threads;
+}
+
+inline int& caffe_parallel_grain_storage() {
+  // Below this many elements per thread, fork/join costs more than it saves.
+  static int grain = 32768;
+  return grain;
+}
+
+inline int caffe_get_num_threads() {
+  int& num_threads = caffe_num_threads_storage();
+  if (num_threads < 0) {
+    const char* env = getenv("CAFFE_NUM_THREADS");
+    if (env != NULL && atoi(env) > 0) {
+      num_threads = atoi(env);
+    } else {
+#ifdef _OPENMP
+      num_threads = omp_get_max_threads();
+#else
+      num_threads = 1;
+#endif
+    }
+  }
+  return num_threads;
+}
+
+inline void caffe_set_num_threads(int num_threads) {
+  caffe_num_threads_storage() = num_threads > 0 ? num_threads : 1;
+}
+
+inline int caffe_parallel_grain() { return caffe_parallel_grain_storage(); }
+
+inline void caffe_set_parallel_grain(int grain) {
+  caffe_parallel_grain_storage() = grain > 0 ? grain : 1;
+}
+
+// Number of threads worth using for a loop of n elements.
+inline int caffe_parallel_threads(const int n) {
+  const int by_size = n / caffe_parallel_grain();
+  const int num_threads = caffe_get_num_threads();
+  return by_size < 1 ? 1 : (by_size < num_threads ? by_size : num_threads);
+}
+
+}  // namespace caffe
+
+// Runs `operation` for i in [0, n), threaded as described above.
+#if defined(_OPENMP) && _OPENMP >= 201307
+#define CAFFE_PARALLEL_FOR(i, n, operation) \
+  do { \
+    const int caffe_parallel_threads_ = caffe::caffe_parallel_threads(n); \
+    _Pragma("omp parallel for simd num_threads(caffe_parallel_threads_) \
+        if (caffe_parallel_threads_ > 1) schedule(static)") \
+    for (int i = 0; i < (n); ++i) { operation; } \
+  } while (0)
+#elif defined(_OPENMP)
+#define CAFFE_PARALLEL_FOR(i, n, operation) \
+  do { \
+    const int caffe_parallel_threads_ = caffe::caffe_parallel_threads(n); \
+    _Pragma("omp parallel for num_threads(caffe_parallel_threads_) \
+        if (caffe_parallel_threads_ > 1) schedule(static)") \
+    for (int i = 0; i < (n); ++i) { operation; } \
+  } while (0)
+#else
+#define CAFFE_PARALLEL_FOR(i, n, operation) \
+  do { \
+    for (int i = 0; i < (n); ++i) { operation; } \
+  } while (0)
+#endif
+
+#endif  // CAFFE_UTIL_PARALLEL_FOR_HPP_
@@ -0,0 +1,100 @@
+#ifndef CAFFE_UTIL_PARALLEL_MATH_HPP_
+#define CAFFE_UTIL_PARALLEL_MATH_HPP_
+
+#include <cmath>
+
+#include "glog/logging.h"
+
+#include "caffe/util/parallel_for.hpp"
+
+// Header-only, threaded counterparts of the elementwise caffe_* functions in
+// math_functions.hpp. Those are compiled into libcaffe, so they stay serial
+// whatever these headers say; code that wants threaded kernels calls the
+// caffe_parallel_* functions below instead (see parallel_cpu_layers.hpp).
+//
+// The elementwise functions compute every element with the same expression
+// as the serial loops, so they give bit-identical results. caffe_parallel_
+// asum sums per thread and then across threads, so it matches caffe_cpu_asum
+// up to float rounding.
+
+namespace caffe {
+
+#define DEFINE_CAFFE_PARALLEL_UNARY_FUNC(name, operation) \
+  template <typename Dtype> \
+  void caffe_parallel_##name(const int n, const Dtype* a, Dtype* y) { \
+    CHECK_GE(n, 0); \
+    CAFFE_PARALLEL_FOR(i, n, operation); \
+  }
+
+#define DEFINE_CAFFE_PARALLEL_BINARY_FUNC(name, operation) \
+  template <typename Dtype> \
+  void caffe_parallel_##name(const int n, const Dtype* a, const Dtype* b, \
+      Dtype* y) { \
+    CHECK_GE(n, 0); \
+    CAFFE_PARALLEL_FOR(i, n, operation); \
+  }
+
+DEFINE_CAFFE_PARALLEL_UNARY_FUNC(sqr, y[i] = a[i] * a[i])
+DEFINE_CAFFE_PARALLEL_UNARY_FUNC(sqrt, y[i] = std::sqrt(a[i]))
+DEFINE_CAFFE_PARALLEL_UNARY_FUNC(exp, y[i] = std::exp(a[i]))
+DEFINE_CAFFE_PARALLEL_UNARY_FUNC(log, y[i] = std::log(a[i]))
+DEFINE_CAFFE_PARALLEL_UNARY_FUNC(abs, y[i] = std::fabs(a[i]))
+
+DEFINE_CAFFE_PARALLEL_BINARY_FUNC(add, y[i] = a[i] + b[i])
+DEFINE_CAFFE_PARALLEL_BINARY_FUNC(sub, y[i] = a[i] - b[i])
+DEFINE_CAFFE_PARALLEL_BINARY_FUNC(mul, y[i] = a[i] * b[i])
+DEFINE_CAFFE_PARALLEL_BINARY_FUNC(div, y[i] = a[i] / b[i])
+
+#undef DEFINE_CAFFE_PARALLEL_UNARY_FUNC
+#undef DEFINE_CAFFE_PARALLEL_BINARY_FUNC
+
+template <typename Dtype>
+void caffe_parallel_powx(const int n, const Dtype* a, const Dtype b,
+    Dtype* y) {
+  CHECK_GE(n, 0);
+  CAFFE_PARALLEL_FOR(i, n, y[i] = std::pow(a[i], b));
+}
+
+/// @brief y = alpha * x
+template <typename Dtype>
+void caffe_parallel_scale(const int n, const Dtype alpha, const Dtype* x,
+    Dtype* y) {
+  CHECK_GE(n, 0);
+  CAFFE_PARALLEL_FOR(i, n, y[i] = alpha * x[i]);
+}
+
+/// @brief y = alpha * x + y
+template <typename Dtype>
+void caffe_parallel_axpy(const int n, const Dtype alpha, const Dtype* x,
+    Dtype* y) {
+  CHECK_GE(n, 0);
+  CAFFE_PARALLEL_FOR(i, n, y[i] += alpha * x[i]);
+}
+
+/// @brief y = alpha * x + beta * y
+template <typename Dtype>
+void caffe_parallel_axpby(const int n, const Dtype alpha, const Dtype* x,
+    const Dtype beta, Dtype* y) {
+  CHECK_GE(n, 0);
+  CAFFE_PARALLEL_FOR(i, n, y[i] = alpha * x[i] + beta * y[i]);
+}
+
+/// @brief Sum of the absolute values of x.
+template <typename Dtype>
+Dtype caffe_parallel_asum(const int n, const Dtype* x) {
+  CHECK_GE(n, 0);
+  Dtype sum = 0;
+#ifdef _OPENMP
+  const int threads = caffe_parallel_threads(n);
+  #pragma omp parallel for num_threads(threads) if (threads > 1) \
+      schedule(static) reduction(+:sum)
+#endif
+  for (int i = 0; i < n; ++i) {
+    sum += std::fabs(x[i]);
+  }
+  return sum;
+}
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_PARALLEL_MATH_HPP_
@@ -0,0 +1,112 @@
+#ifndef CAFFE_UTIL_ROW_SPARSE_HPP_
+#define CAFFE_UTIL_ROW_SPARSE_HPP_
+
+#include <boost/thread/mutex.hpp>
+
+#include <map>
+#include <vector>
+
+#include "caffe/blob.hpp"
+#include "caffe/common.hpp"
+#include "caffe/syncedmem.hpp"
+
+namespace caffe {
+
+/**
+ * @brief Records which rows (indices along axis 0) of a parameter's diff
+ *        were written since its last update.
+ *
+ * Layers whose weight gradients only touch a few rows (e.g. EmbedLayer on a
+ * large vocabulary) mark those rows during Backward; RowSparseSolver then
+ * regularizes, updates and clears only them. Entries are keyed by the diff
+ * memory, so layers sharing a parameter mark the same entry as its owner.
+ * A parameter that has been marked is "tracked": its diff must be all zero
+ * outside the marked rows, or be marked dense for the iteration.
+ */
+template <typename Dtype>
+class RowSparseDiffs {
+ public:
+  static RowSparseDiffs& Get() {
+    static RowSparseDiffs* instance = new RowSparseDiffs();
+    return *instance;
+  }
+
+  /// @brief Adds rows[0..n) to the rows of param's diff written this
+  ///        iteration; duplicates are allowed.
+  void MarkRows(const Blob<Dtype>& param, const int* rows, const int n) {
+    const int num_rows = param.num_axes() > 0 ? param.shape(0) : 1;
+    boost::mutex::scoped_lock lock(mutex_);
+    Entry& entry = entries_[param.diff().get()];
+    if (entry.marked.size() != num_rows) {
+      entry.marked.assign(num_rows, false);
+      entry.rows.clear();
+    }
+    for (int i = 0; i < n; ++i) {
+      DCHECK_GE(rows[i], 0);
+      DCHECK_LT(rows[i], num_rows);
+      if (!entry.marked[rows[i]]) {
+        entry.marked[rows[i]] = true;
+        entry.rows.push_back(rows[i]);
+      }
+    }
+  }
+
+  /// @brief Marks param's whole diff as written this iteration.
+  void MarkDense(const Blob<Dtype>& param) {
+    boost::mutex::scoped_lock lock(mutex_);
+    entries_[param.diff().get()].dense = true;
+  }
+
+  bool Tracked(const Blob<Dtype>& param) {
+    boost::mutex::scoped_lock lock(mutex_);
+    return entries_.count(param.diff().get()) > 0;
+  }
+
+  /**
+   * @brief Moves the rows marked for param into rows and resets them.
+   *        Returns false if param is not tracked; *dense is set when the
+   *        whole diff has to be treated as written.
+   */
+  bool Take(const Blob<Dtype>& param, vector<int>* rows, bool* dense) {
+    boost::mutex::scoped_lock lock(mutex_);
+    typename std::map<const SyncedMemory*, Entry>::iterator it =
+        entries_.find(param.diff().get());
+    if (it == entries_.end()) {
+      return false;
+    }
+    Entry& entry = it->second;
+    for (int i = 0; i < entry.rows.size(); ++i) {
+      entry.marked[entry.rows[i]] = false;
+    }
+    rows->swap(entry.rows);
+    entry.rows.clear();
+    *dense = entry.dense;
+    entry.dense = false;
+    return true;
+  }
+
+  /// @brief Stops tracking param, e.g. when its layer is destroyed.
+  void Forget(const Blob<Dtype>& param) {
+    boost::mutex::scoped_lock lock(mutex_);
+    entries_.erase(param.diff().get());
+  }
+
+ private:
+  struct Entry {
+    Entry() : dense(false) {}
+    vector<int> rows;
+    vector<bool> marked;
+    bool dense;
+  };
+
+  RowSparseDiffs() {}
+
+  boost::mutex mutex_;
+  std::map<const SyncedMemory*, Entry> entries_;
+
+  DISABLE_COPY_AND_ASSIGN(RowSparseDiffs);
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_ROW_SPARSE_HPP_
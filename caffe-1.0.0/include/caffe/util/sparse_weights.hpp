@@ -0,0 +1,358 @@
+#ifndef CAFFE_UTIL_SPARSE_WEIGHTS_HPP_
+#define CAFFE_UTIL_SPARSE_WEIGHTS_HPP_
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "caffe/common.hpp"
+#include "caffe/util/parallel_for.hpp"
+
+namespace caffe {
+
+/// @brief Nonzero patterns SparseWeights can store.
+enum SparseFormat {
+  SPARSE_CSR = 1,     ///< one value per stored column index
+  SPARSE_BLOCK4 = 4,  ///< 4 consecutive rows x 1 column per stored index
+  SPARSE_BLOCK8 = 8   ///< 8 consecutive rows x 1 column per stored index
+};
+
+inline const char* SparseFormatName(const SparseFormat format) {
+  switch (format) {
+  case SPARSE_CSR: return "CSR";
+  case SPARSE_BLOCK4: return "4x1 blocks";
+  case SPARSE_BLOCK8: return "8x1 blocks";
+  }
+  return "";
+}
+
+/**
+ * @brief One B x kTile tile of Y = W X: y[b][t] = sum over the blocks j in
+ *        [begin, end) of values[j * B + b] * x[col_idx[j] * ldx + t].
+ *
+ * The generic version is plain C++; the float one below keeps the tile in
+ * SIMD registers, which compilers do not do for a local array.
+ */
+template <typename Dtype, int B>
+struct BlockSparseTile {
+  enum { kTile = 64 / B > 32 ? 32 : 64 / B };
+
+  static void Run(const int* col_idx, const Dtype* values, const int begin,
+      const int end, const Dtype* x, const int ldx, const int valid_rows,
+      Dtype* y, const int ldy) {
+    Dtype acc[B][kTile];
+    for (int b = 0; b < B; ++b) {
+      for (int t = 0; t < kTile; ++t) {
+        acc[b][t] = 0;
+      }
+    }
+    for (int j = begin; j < end; ++j) {
+      const Dtype* xj = x + col_idx[j] * ldx;
+      const Dtype* v = values + j * B;
+      for (int b = 0; b < B; ++b) {
+        for (int t = 0; t < kTile; ++t) {
+          acc[b][t] += v[b] * xj[t];
+        }
+      }
+    }
+    for (int b = 0; b < valid_rows; ++b) {
+      std::copy(acc[b], acc[b] + kTile, y + b * ldy);
+    }
+  }
+};
+
+#if defined(__AVX__) || defined(__SSE2__)
+// Fully unrolling the loops over a tile's accumulators lets the compiler
+// keep them in registers.
+#if defined(__clang__)
+#define CAFFE_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__) && __GNUC__ >= 8
+#define CAFFE_UNROLL _Pragma("GCC unroll 16")
+#else
+#define CAFFE_UNROLL
+#endif
+
+template <int B>
+struct BlockSparseTile<float, B> {
+#ifdef __AVX__
+  typedef __m256 Vec;
+  enum { kWidth = 8 };
+  static inline Vec Zero() { return _mm256_setzero_ps(); }
+  static inline Vec Load(const float* p) { return _mm256_loadu_ps(p); }
+  static inline Vec Broadcast(const float* p) {
+    return _mm256_broadcast_ss(p);
+  }
+  static inline void Store(float* p, Vec v) { _mm256_storeu_ps(p, v); }
+  static inline Vec MulAdd(Vec a, Vec b, Vec c) {
+#ifdef __FMA__
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+  }
+#else
+  typedef __m128 Vec;
+  enum { kWidth = 4 };
+  static inline Vec Zero() { return _mm_setzero_ps(); }
+  static inline Vec Load(const float* p) { return _mm_loadu_ps(p); }
+  static inline Vec Broadcast(const float* p) { return _mm_load1_ps(p); }
+  static inline void Store(float* p, Vec v) { _mm_storeu_ps(p, v); }
+  static inline Vec MulAdd(Vec a, Vec b, Vec c) {
+    return _mm_add_ps(_mm_mul_ps(a, b), c);
+  }
+#endif
+  // B x kVectors accumulators plus kVectors inputs fit in 16 registers.
+  enum { kVectors = B >= 8 ? 1 : (B >= 4 ? 2 : 4) };
+  enum { kTile = kVectors * kWidth };
+
+  static void Run(const int* col_idx, const float* values, const int begin,
+      const int end, const float* x, const int ldx, const int valid_rows,
+      float* y, const int ldy) {
+    Vec acc[B][kVectors];
+    CAFFE_UNROLL
+    for (int b = 0; b < B; ++b) {
+      CAFFE_UNROLL
+      for (int v = 0; v < kVectors; ++v) {
+        acc[b][v] = Zero();
+      }
+    }
+    for (int j = begin; j < end; ++j) {
+      const float* xj = x + col_idx[j] * ldx;
+      Vec xv[kVectors];
+      CAFFE_UNROLL
+      for (int v = 0; v < kVectors; ++v) {
+        xv[v] = Load(xj + v * kWidth);
+      }
+      const float* w = values + j * B;
+      CAFFE_UNROLL
+      for (int b = 0; b < B; ++b) {
+        const Vec wb = Broadcast(w + b);
+        CAFFE_UNROLL
+        for (int v = 0; v < kVectors; ++v) {
+          acc[b][v] = MulAdd(wb, xv[v], acc[b][v]);
+        }
+      }
+    }
+    CAFFE_UNROLL
+    for (int b = 0; b < B; ++b) {
+      if (b >= valid_rows) {
+        break;
+      }
+      CAFFE_UNROLL
+      for (int v = 0; v < kVectors; ++v) {
+        Store(y + b * ldy + v * kWidth, acc[b][v]);
+      }
+    }
+  }
+};
+#endif  // __AVX__ || __SSE2__
+
+/**
+ * @brief Y = W X for a rows x cols block-sparse W (B x 1 blocks; B = 1 is
+ *        CSR) and row-major X (cols x P) and Y (rows x P), as when W is a
+ *        convolution's weights and X its im2col buffer.
+ *
+ * X is processed in panels of kPanel columns, copied contiguously so that
+ * the rows the nonzeros gather stay in cache (and in few pages) while every
+ * block row walks its blocks over them with BlockSparseTile. Block rows are
+ * split across caffe threads.
+ */
+template <typename Dtype, int B>
+void caffe_cpu_block_sparse_mm(const int rows, const int cols, const int P,
+    const int* row_ptr, const int* col_idx, const Dtype* values,
+    const Dtype* X, Dtype* Y, vector<Dtype>* panel) {
+  typedef BlockSparseTile<Dtype, B> Tile;
+  const int kPanel = 64;
+  const int tile = Tile::kTile;
+  const int block_rows = (rows + B - 1) / B;
+  panel->resize(cols * kPanel);
+  Dtype* x_panel = &(*panel)[0];
+  for (int p0 = 0; p0 < P; p0 += kPanel) {
+    const int width = std::min(kPanel, P - p0);
+    for (int c = 0; c < cols; ++c) {
+      std::copy(X + c * P + p0, X + c * P + p0 + width, x_panel + c * kPanel);
+    }
+#ifdef _OPENMP
+    const int threads =
+        caffe_parallel_threads(row_ptr[block_rows] * B * width);
+    #pragma omp parallel for num_threads(threads) if (threads > 1) \
+        schedule(dynamic, 4)
+#endif
+    for (int br = 0; br < block_rows; ++br) {
+      const int valid_rows = std::min(B, rows - br * B);
+      const int begin = row_ptr[br];
+      const int end = row_ptr[br + 1];
+      Dtype* y = Y + br * B * P + p0;
+      int t0 = 0;
+      for (; t0 + tile <= width; t0 += tile) {
+        Tile::Run(col_idx, values, begin, end, x_panel + t0, kPanel,
+            valid_rows, y + t0, P);
+      }
+      // The last columns of Y, fewer than a tile.
+      for (int b = 0; b < valid_rows; ++b) {
+        std::fill(y + b * P + t0, y + b * P + width, Dtype(0));
+      }
+      for (int j = begin; j < end; ++j) {
+        const Dtype* x = x_panel + col_idx[j] * kPanel;
+        for (int b = 0; b < valid_rows; ++b) {
+          const Dtype v = values[j * B + b];
+          for (int t = t0; t < width; ++t) {
+            y[b * P + t] += v * x[t];
+          }
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief A sparse copy of a dense weight matrix for inference, in CSR or
+ *        block-sparse (4x1 / 8x1) form.
+ *
+ * Blocks are B consecutive rows of one column, i.e. B output channels
+ * sharing an input; structured pruning that removes whole blocks leaves
+ * them either all zero (skipped) or dense (stored, B multiply-adds per
+ * index load). Partial blocks are stored with explicit zeros.
+ */
+template <typename Dtype>
+class SparseWeights {
+ public:
+  SparseWeights() : rows_(0), cols_(0), format_(SPARSE_CSR) {}
+
+  /// @brief The fraction of w[0..count) that is exactly zero.
+  static double Sparsity(const Dtype* w, const int count) {
+    int zeros = 0;
+    for (int i = 0; i < count; ++i) {
+      zeros += w[i] == Dtype(0);
+    }
+    return count > 0 ? static_cast<double>(zeros) / count : 0;
+  }
+
+  /**
+   * @brief The widest block format whose stored blocks would be at least
+   *        70% nonzero, or CSR. w is rows x cols, or cols x rows when
+   *        transposed.
+   */
+  static SparseFormat ChooseFormat(const Dtype* w, const int rows,
+      const int cols, const bool transposed) {
+    int nnz = 0;
+    for (int i = 0; i < rows * cols; ++i) {
+      nnz += w[i] != Dtype(0);
+    }
+    const SparseFormat formats[] = { SPARSE_BLOCK8, SPARSE_BLOCK4 };
+    for (int f = 0; f < 2; ++f) {
+      const int B = formats[f];
+      if (rows < B) {
+        continue;
+      }
+      const int blocks = CountBlocks(w, rows, cols, transposed, B);
+      if (blocks > 0 && nnz >= 0.7 * blocks * B) {
+        return formats[f];
+      }
+    }
+    return SPARSE_CSR;
+  }
+
+  /// @brief Stores the nonzeros of w (laid out as for ChooseFormat).
+  void Build(const Dtype* w, const int rows, const int cols,
+      const bool transposed, const SparseFormat format) {
+    rows_ = rows;
+    cols_ = cols;
+    format_ = format;
+    const int B = format;
+    const int block_rows = (rows + B - 1) / B;
+    row_ptr_.assign(1, 0);
+    col_idx_.clear();
+    values_.clear();
+    for (int br = 0; br < block_rows; ++br) {
+      const int valid_rows = std::min(B, rows - br * B);
+      for (int c = 0; c < cols; ++c) {
+        bool nonzero = false;
+        for (int b = 0; b < valid_rows; ++b) {
+          nonzero |= At(w, br * B + b, c, transposed) != Dtype(0);
+        }
+        if (!nonzero) {
+          continue;
+        }
+        col_idx_.push_back(c);
+        for (int b = 0; b < B; ++b) {
+          values_.push_back(b < valid_rows ?
+              At(w, br * B + b, c, transposed) : Dtype(0));
+        }
+      }
+      row_ptr_.push_back(col_idx_.size());
+    }
+  }
+
+  /// @brief Y (rows x P) = W X (cols x P), both row-major.
+  void Multiply(const Dtype* X, const int P, Dtype* Y) {
+    if (col_idx_.empty()) {
+      std::fill(Y, Y + rows_ * P, Dtype(0));
+      return;
+    }
+    switch (format_) {
+    case SPARSE_CSR:
+      caffe_cpu_block_sparse_mm<Dtype, 1>(rows_, cols_, P, &row_ptr_[0],
+          &col_idx_[0], &values_[0], X, Y, &panel_);
+      break;
+    case SPARSE_BLOCK4:
+      caffe_cpu_block_sparse_mm<Dtype, 4>(rows_, cols_, P, &row_ptr_[0],
+          &col_idx_[0], &values_[0], X, Y, &panel_);
+      break;
+    case SPARSE_BLOCK8:
+      caffe_cpu_block_sparse_mm<Dtype, 8>(rows_, cols_, P, &row_ptr_[0],
+          &col_idx_[0], &values_[0], X, Y, &panel_);
+      break;
+    }
+  }
+
+  inline int rows() const { return rows_; }
+  inline int cols() const { return cols_; }
+  inline SparseFormat format() const { return format_; }
+  /// @brief Stored values, including the zeros padding partial blocks.
+  inline int stored_values() const { return values_.size(); }
+  inline size_t bytes() const {
+    return values_.size() * sizeof(Dtype) +
+        (col_idx_.size() + row_ptr_.size()) * sizeof(int);
+  }
+
+ private:
+  inline Dtype At(const Dtype* w, const int r, const int c,
+      const bool transposed) const {
+    return transposed ? w[c * rows_ + r] : w[r * cols_ + c];
+  }
+
+  static int CountBlocks(const Dtype* w, const int rows, const int cols,
+      const bool transposed, const int B) {
+    int blocks = 0;
+    for (int r0 = 0; r0 < rows; r0 += B) {
+      for (int c = 0; c < cols; ++c) {
+        for (int r = r0; r < std::min(r0 + B, rows); ++r) {
+          if ((transposed ? w[c * rows + r] : w[r * cols + c]) != Dtype(0)) {
+            ++blocks;
+            break;
+          }
+        }
+      }
+    }
+    return blocks;
+  }
+
+  int rows_;
+  int cols_;
+  SparseFormat format_;
+  vector<int> row_ptr_;  // per block row, into col_idx_
+  vector<int> col_idx_;  // per stored block
+  vector<Dtype> values_;  // B per stored block
+  vector<Dtype> panel_;
+};
+
+}  // namespace caffe
+
+#endif  // CAFFE_UTIL_SPARSE_WEIGHTS_HPP_
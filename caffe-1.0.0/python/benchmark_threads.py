@@ -0,0 +1,119 @@
+#!/usr/bin/env python
+"""
+benchmark_threads.py measures how much Python threads that each preprocess
+a batch and run their own copy of a net overlap, with inputs copied into
+the net and with inputs shared by Net.share_input().
+
+Threads only overlap inside Caffe when the _caffe_nogil module is built
+(see setup_nogil.py),
+since forward() otherwise holds the GIL.
+"""
+import argparse
+import sys
+import threading
+import time
+
+import numpy as np
+
+import caffe
+
+
+def preprocess(raw, mean, out):
+    """
+    Typical serving-side preprocessing: HWC uint8 images to mean-subtracted
+    CHW float32, written to `out`.
+    """
+    np.subtract(raw.transpose(0, 3, 1, 2), mean, out=out, casting='unsafe')
+
+
+def run(nets, input_name, iterations, share):
+    """
+    Run `iterations` preprocess + forward steps in one thread per net and
+    return the images per second over all threads.
+    """
+    def work(net):
+        shape = net.blobs[input_name].data.shape
+        rng = np.random.RandomState(0)
+        raw = rng.randint(0, 256, (shape[0], shape[2], shape[3], shape[1]))
+        raw = raw.astype(np.uint8)
+        mean = np.full((shape[1], 1, 1), 117, dtype=np.float32)
+        data = np.empty(shape, dtype=np.float32)
+        if share:
+            net.share_input(input_name, data)
+        for _ in range(iterations):
+            preprocess(raw, mean, data)
+            net.forward(**{input_name: data})
+
+    threads = [threading.Thread(target=work, args=(net,)) for net in nets]
+    start = time.time()
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    elapsed = time.time() - start
+    batch = nets[0].blobs[input_name].data.shape[0]
+    return len(nets) * iterations * batch / elapsed
+
+
+def main(argv):
+    parser = argparse.ArgumentParser()
+    parser.add_argument(
+        "model_def",
+        help="Deploy model definition with an Input layer."
+    )
+    parser.add_argument(
+        "--pretrained_model",
+        help="Trained model weights file (random weights otherwise)."
+    )
+    parser.add_argument(
+        "--threads",
+        type=int,
+        default=4,
+        help="Largest number of threads to run."
+    )
+    parser.add_argument(
+        "--iterations",
+        type=int,
+        default=20,
+        help="Forward passes per thread."
+    )
+    args = parser.parse_args(argv[1:])
+
+    caffe.set_mode_cpu()
+    if args.pretrained_model:
+        first = caffe.Net(args.model_def, args.pretrained_model, caffe.TEST)
+    else:
+        first = caffe.Net(args.model_def, caffe.TEST)
+    input_name = first.inputs[0]
+    if len(first.blobs[input_name].data.shape) != 4:
+        raise Exception('The first input must be N x C x H x W.')
+    nets = [first]
+    for _ in range(1, args.threads):
+        # The nets share the weights but have their own activations.
+        net = caffe.Net(args.model_def, caffe.TEST)
+        net.share_with(first)
+        nets.append(net)
+
+    print("GIL released in forward: {}".format(
+        caffe.pycaffe._caffe_nogil is not None))
+    modes = [False, True] if caffe.pycaffe._caffe_nogil is not None \
+        else [False]
+    base = None
+    threads = 1
+    while threads <= args.threads:
+        for share in modes:
+            rate = run(nets[:threads], input_name, args.iterations, share)
+            base = base or rate
+            print("{} thread(s), {} inputs: {:.1f} images/s ({:.2f}x)".format(
+                threads, "shared" if share else "copied", rate, rate / base))
+        threads *= 2
+    if threads // 2 != args.threads:
+        for share in modes:
+            rate = run(nets, input_name, args.iterations, share)
+            print("{} thread(s), {} inputs: {:.1f} images/s ({:.2f}x)".format(
+                args.threads, "shared" if share else "copied", rate,
+                rate / base))
+
+
+if __name__ == '__main__':
+    main(sys.argv)
@@ -0,0 +1,106 @@
+// Companion module to _caffe: forward / backward passes that release the
+// GIL, and zero-copy binding of NumPy arrays to blobs. pycaffe.py uses it
+// when it is importable. It links against libcaffe like _caffe.so; build it
+// with python/setup_nogil.py.
+#include <Python.h>  // NOLINT(build/include_alpha)
+
+// Produce deprecation warnings (needs to come before arrayobject.h inclusion).
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+
+#include <boost/python.hpp>
+#include <numpy/arrayobject.h>
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "caffe/caffe.hpp"
+
+namespace bp = boost::python;
+
+namespace caffe {
+
+// For Python, for now, we'll just always use float as the type.
+typedef float Dtype;
+const int NPY_DTYPE = NPY_FLOAT32;
+
+// Lets other Python threads run while the calling one is inside Caffe. The
+// net must not be touched from Python until the call returns.
+class ScopedGILRelease {
+ public:
+  ScopedGILRelease() : state_(PyEval_SaveThread()) {}
+  ~ScopedGILRelease() { PyEval_RestoreThread(state_); }
+
+ private:
+  PyThreadState* state_;
+
+  DISABLE_COPY_AND_ASSIGN(ScopedGILRelease);
+};
+
+// PythonLayer calls into Python without taking the GIL back, so nets with
+// one keep holding it.
+bool HasPythonLayer(const Net<Dtype>& net) {
+  for (int i = 0; i < net.layers().size(); ++i) {
+    if (std::string(net.layers()[i]->type()) == "Python") {
+      return true;
+    }
+  }
+  return false;
+}
+
+Dtype Net_ForwardFromTo(Net<Dtype>* net, int start, int end) {
+  if (HasPythonLayer(*net)) {
+    return net->ForwardFromTo(start, end);
+  }
+  ScopedGILRelease release;
+  return net->ForwardFromTo(start, end);
+}
+
+void Net_BackwardFromTo(Net<Dtype>* net, int start, int end) {
+  if (HasPythonLayer(*net)) {
+    net->BackwardFromTo(start, end);
+    return;
+  }
+  ScopedGILRelease release;
+  net->BackwardFromTo(start, end);
+}
+
+// Reshapes blob to array's shape and makes array its data, without copying.
+// The caller keeps array alive for as long as the blob uses it; the binding
+// ends when the blob next reallocates (a Reshape to a larger count).
+void Blob_ShareData(Blob<Dtype>* blob, bp::object array_obj) {
+  if (!PyArray_Check(array_obj.ptr())) {
+    throw std::runtime_error("Shared data must be a numpy array");
+  }
+  PyArrayObject* array = reinterpret_cast<PyArrayObject*>(array_obj.ptr());
+  if (!(PyArray_FLAGS(array) & NPY_ARRAY_C_CONTIGUOUS)) {
+    throw std::runtime_error("Shared data must be C contiguous");
+  }
+  if (!(PyArray_FLAGS(array) & NPY_ARRAY_ALIGNED)) {
+    throw std::runtime_error("Shared data must be aligned");
+  }
+  if (PyArray_TYPE(array) != NPY_DTYPE) {
+    throw std::runtime_error("Shared data must be float32");
+  }
+  std::vector<int> shape(PyArray_NDIM(array));
+  for (int i = 0; i < shape.size(); ++i) {
+    shape[i] = PyArray_DIMS(array)[i];
+  }
+  blob->Reshape(shape);
+  blob->data()->set_cpu_data(PyArray_DATA(array));
+}
+
+BOOST_PYTHON_MODULE(_caffe_nogil) {
+  // Net and Blob are registered with boost::python by _caffe, which has to
+  // be imported first.
+  bp::import("caffe._caffe");
+  bp::def("forward", &Net_ForwardFromTo);
+  bp::def("backward", &Net_BackwardFromTo);
+  bp::def("share_data", &Blob_ShareData);
+
+  // boost python expects a void (missing) return value, while import_array
+  // returns NULL for python3. import_array1() forces a void return value.
+  import_array1();
+}
+
+}  // namespace caffe
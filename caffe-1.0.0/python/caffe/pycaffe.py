@@ -12,6 +12,11 @@ import numpy as np
 
 from ._caffe import Net, SGDSolver, NesterovSolver, AdaGradSolver, \
         RMSPropSolver, AdaDeltaSolver, AdamSolver, NCCL, Timer
+try:
+    # Optional: GIL-free forward / backward and zero-copy inputs.
+    from . import _caffe_nogil
+except ImportError:
+    _caffe_nogil = None
 import caffe.io
 
 import six
@@ -123,12 +128,21 @@ def _Net_forward(self, blobs=None, start=None, end=None, **kwargs):
             raise Exception('Input blob arguments do not match net inputs.')
         # Set input according to defined shapes and make arrays single and
         # C-contiguous as Caffe expects.
+        shared = getattr(self, '_shared_inputs', {})
         for in_, blob in six.iteritems(kwargs):
             if blob.shape[0] != self.blobs[in_].shape[0]:
                 raise Exception('Input is not batch sized')
-            self.blobs[in_].data[...] = blob
-
-    self._forward(start_ind, end_ind)
+            # A shared array stops backing its blob when the blob
+            # reallocates, so compare memory rather than identity.
+            if (in_ not in shared or
+                    blob.ctypes.data != self.blobs[in_].data.ctypes.data):
+                self.blobs[in_].data[...] = blob
+
+    # Other Python threads may run while the net computes.
+    if _caffe_nogil is not None:
+        _caffe_nogil.forward(self, start_ind, end_ind)
+    else:
+        self._forward(start_ind, end_ind)
 
     # Unpack blobs to extract
     return {out: self.blobs[out].data for out in outputs}
@@ -176,7 +190,10 @@ def _Net_backward(self, diffs=None, start=None, end=None, **kwargs):
                 raise Exception('Diff is not batch sized')
             self.blobs[top].diff[...] = diff
 
-    self._backward(start_ind, end_ind)
+    if _caffe_nogil is not None:
+        _caffe_nogil.backward(self, start_ind, end_ind)
+    else:
+        self._backward(start_ind, end_ind)
 
     # Unpack diffs to extract
     return {out: self.blobs[out].diff for out in outputs}
@@ -269,6 +286,33 @@ def _Net_set_input_arrays(self, data, labels):
     return self._set_input_arrays(data, labels)
 
 
+def _Net_share_input(self, name, array):
+    """
+    Back input blob `name` with `array` instead of copying inputs into it:
+    writing to `array` sets the input in place, and passing it to forward()
+    copies nothing. The binding ends when the blob reallocates (a reshape to
+    a larger size); forward() then copies the array again.
+
+    Parameters
+    ----------
+    name : name of an input blob.
+    array : C-contiguous float32 ndarray owned by the caller. The net keeps
+            a reference to it, and its shape becomes the blob's shape.
+    """
+    if _caffe_nogil is None:
+        raise Exception('Sharing inputs needs the _caffe_nogil module.')
+    if name not in self.inputs:
+        raise Exception('{} is not an input blob.'.format(name))
+    blob = self.blobs[name]
+    reshaped = blob.data.shape != array.shape
+    _caffe_nogil.share_data(blob, array)
+    if reshaped:
+        self.reshape()
+    if not hasattr(self, '_shared_inputs'):
+        self._shared_inputs = {}
+    self._shared_inputs[name] = array
+
+
 def _Net_batch(self, blobs):
     """
     Batch blob lists according to net's batch size.
@@ -338,6 +382,7 @@ Net.backward = _Net_backward
 Net.forward_all = _Net_forward_all
 Net.forward_backward_all = _Net_forward_backward_all
 Net.set_input_arrays = _Net_set_input_arrays
+Net.share_input = _Net_share_input
 Net._batch = _Net_batch
 Net.inputs = _Net_inputs
 Net.outputs = _Net_outputs
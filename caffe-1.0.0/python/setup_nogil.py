@@ -0,0 +1,34 @@
+#!/usr/bin/env python
+"""
+Builds the optional caffe/_caffe_nogil extension next to caffe/_caffe.so:
+
+    cd python && python setup_nogil.py build_ext --inplace
+
+CAFFE_ROOT (default: the parent of this directory) must hold include/ and
+lib/libcaffe.so. Set CAFFE_CPU_ONLY=1 for a CPU-only libcaffe, and
+BOOST_PYTHON_LIB if the Boost.Python library is not named
+boost_python<major><minor>.
+"""
+import os
+import sys
+
+import numpy as np
+from setuptools import Extension, setup
+
+here = os.path.dirname(os.path.abspath(__file__))
+caffe_root = os.environ.get('CAFFE_ROOT', os.path.dirname(here))
+boost_python = os.environ.get(
+    'BOOST_PYTHON_LIB', 'boost_python{}{}'.format(*sys.version_info[:2]))
+macros = [('CPU_ONLY', None)] if os.environ.get('CAFFE_CPU_ONLY') else []
+
+nogil = Extension(
+    'caffe._caffe_nogil',
+    sources=[os.path.join(here, 'caffe', '_caffe_nogil.cpp')],
+    include_dirs=[os.path.join(caffe_root, 'include'), np.get_include()],
+    define_macros=macros,
+    library_dirs=[os.path.join(caffe_root, 'lib')],
+    runtime_library_dirs=[os.path.join(caffe_root, 'lib')],
+    libraries=['caffe', boost_python, 'glog', 'protobuf'],
+    extra_compile_args=['-O2', '-Wno-sign-compare'])
+
+setup(name='caffe_nogil', ext_modules=[nogil])
@@ -0,0 +1,106 @@
+// Load generator for BatchingPredictor: runs a closed-loop client pool
+// against a deploy net for each batch limit and reports throughput and
+// latency percentiles, so a max batch size / max wait trade-off can be
+// picked for a given latency budget.
+//
+// Usage:
+//    batching_benchmark --model=deploy.prototxt [--weights=net.caffemodel]
+//        [--batch_limits=1,4,8,16] [--max_wait_us=2000] [--clients=32]
+//        [--requests=200]
+#include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "caffe/caffe.hpp"
+#include "caffe/util/batching_predictor.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using caffe::BatchingPredictor;
+using caffe::CPUTimer;
+using caffe::Caffe;
+using caffe::Net;
+using caffe::shared_ptr;
+using caffe::string;
+using caffe::vector;
+
+DEFINE_string(model, "", "The deploy model definition protocol buffer.");
+DEFINE_string(weights, "", "Optional trained weights.");
+DEFINE_string(batch_limits, "1,2,4,8,16,32",
+    "Comma-separated max batch sizes to benchmark.");
+DEFINE_int32(max_wait_us, 2000,
+    "Longest time a request waits for its batch to fill.");
+DEFINE_int32(clients, 32, "Number of concurrent closed-loop clients.");
+DEFINE_int32(requests, 200, "Requests issued by each client.");
+
+// Each client submits one sample at a time and records its latency.
+static void Client(BatchingPredictor<float>* predictor,
+    const vector<float>* sample, vector<float>* latencies_ms) {
+  CPUTimer timer;
+  for (int i = 0; i < FLAGS_requests; ++i) {
+    timer.Start();
+    predictor->Predict(&(*sample)[0]);
+    timer.Stop();
+    latencies_ms->push_back(timer.MilliSeconds());
+  }
+}
+
+static float Percentile(const vector<float>& sorted, float p) {
+  int index = static_cast<int>(p * (sorted.size() - 1) + 0.5);
+  return sorted[std::min<int>(index, sorted.size() - 1)];
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  gflags::SetUsageMessage("Benchmark dynamic batching of a deploy net.\n"
+      "Usage: batching_benchmark --model=deploy.prototxt [FLAGS]");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  CHECK(!FLAGS_model.empty()) << "Set --model";
+  Caffe::set_mode(Caffe::CPU);
+
+  vector<string> limits;
+  boost::split(limits, FLAGS_batch_limits, boost::is_any_of(","));
+  LOG(INFO) << "limit\tthroughput/s\tp50 ms\tp99 ms\tmax ms";
+  for (int l = 0; l < limits.size(); ++l) {
+    shared_ptr<Net<float> > net(new Net<float>(FLAGS_model, caffe::TEST));
+    if (!FLAGS_weights.empty()) {
+      net->CopyTrainedLayersFrom(FLAGS_weights);
+    }
+    BatchingPredictor<float>::Options options;
+    options.max_batch_size = atoi(limits[l].c_str());
+    options.max_wait_us = FLAGS_max_wait_us;
+    BatchingPredictor<float> predictor(net, options);
+    vector<float> sample(predictor.sample_count());
+    caffe::caffe_rng_uniform<float>(sample.size(), 0, 1, &sample[0]);
+    // Warm up before measuring.
+    predictor.Predict(&sample[0]);
+
+    vector<vector<float> > latencies(FLAGS_clients);
+    CPUTimer total;
+    total.Start();
+    boost::thread_group clients;
+    for (int c = 0; c < FLAGS_clients; ++c) {
+      clients.create_thread(boost::bind(&Client, &predictor, &sample,
+          &latencies[c]));
+    }
+    clients.join_all();
+    total.Stop();
+
+    vector<float> all;
+    for (int c = 0; c < latencies.size(); ++c) {
+      all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+    }
+    std::sort(all.begin(), all.end());
+    LOG(INFO) << options.max_batch_size << "\t"
+              << all.size() / total.Seconds() << "\t"
+              << Percentile(all, 0.5) << "\t"
+              << Percentile(all, 0.99) << "\t"
+              << all.back();
+  }
+  return 0;
+}
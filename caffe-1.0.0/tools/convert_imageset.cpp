@@ -0,0 +1,177 @@
+// This program converts a set of images to a lmdb/leveldb by storing them
+// as Datum proto buffers. Images are decoded and encoded on --threads worker
+// threads and written in sorted batches of --batch_size records; see
+// caffe::db::DatasetBuilder.
+//
+// Usage:
+//   convert_imageset [FLAGS] ROOTFOLDER/ LISTFILE DB_NAME
+//
+// where ROOTFOLDER is the root folder that holds all the images, and LISTFILE
+// should be a list of files as well as their labels, in the format as
+//   subfolder1/file1.JPEG 7
+//   ....
+
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <fstream>  // NOLINT(readability/streams)
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+
+#include "caffe/proto/caffe.pb.h"
+#include "caffe/util/db_builder.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/rng.hpp"
+
+using namespace caffe;  // NOLINT(build/namespaces)
+using std::pair;
+using boost::scoped_ptr;
+
+DEFINE_bool(gray, false,
+    "When this option is on, treat images as grayscale ones");
+DEFINE_bool(shuffle, false,
+    "Randomly shuffle the order of images and their labels");
+DEFINE_string(backend, "lmdb",
+        "The backend {lmdb, leveldb} for storing the result");
+DEFINE_int32(resize_width, 0, "Width images are resized to");
+DEFINE_int32(resize_height, 0, "Height images are resized to");
+DEFINE_bool(check_size, false,
+    "When this option is on, check that all the datum have the same size");
+DEFINE_bool(encoded, false,
+    "When this option is on, the encoded image will be save in datum");
+DEFINE_string(encode_type, "",
+    "Optional: What type should we encode the image as ('png','jpg',...).");
+DEFINE_int32(threads, 4, "Number of threads decoding and encoding images");
+DEFINE_int32(batch_size, 1000, "Number of records written per commit");
+
+#ifdef USE_OPENCV
+// Encodes one list entry on a DatasetBuilder worker thread.
+class ImageEncoder {
+ public:
+  ImageEncoder(const string& root_folder, int resize_height, int resize_width,
+      bool is_color, bool encoded, const string& encode_type, bool check_size)
+    : root_folder_(root_folder), resize_height_(resize_height),
+      resize_width_(resize_width), is_color_(is_color), encoded_(encoded),
+      encode_type_(encode_type), check_size_(check_size), data_size_(0),
+      data_size_initialized_(false) { }
+
+  bool Encode(const pair<string, int>& line, Datum* datum) {
+    string enc = encode_type_;
+    if (encoded_ && !enc.size()) {
+      // Guess the encoding type from the file name
+      const string& fn = line.first;
+      size_t p = fn.rfind('.');
+      if ( p == fn.npos )
+        LOG(WARNING) << "Failed to guess the encoding of '" << fn << "'";
+      enc = fn.substr(p+1);
+      std::transform(enc.begin(), enc.end(), enc.begin(), ::tolower);
+    }
+    if (!ReadImageToDatum(root_folder_ + line.first, line.second,
+        resize_height_, resize_width_, is_color_, enc, datum)) {
+      return false;
+    }
+    if (check_size_) {
+      const size_t size = datum->channels() * datum->height() * datum->width();
+      boost::mutex::scoped_lock lock(mutex_);
+      if (!data_size_initialized_) {
+        data_size_ = size;
+        data_size_initialized_ = true;
+      } else {
+        const std::string& data = datum->data();
+        CHECK_EQ(data.size(), data_size_) << "Incorrect data field size "
+            << data.size();
+      }
+    }
+    return true;
+  }
+
+ private:
+  const string root_folder_;
+  const int resize_height_;
+  const int resize_width_;
+  const bool is_color_;
+  const bool encoded_;
+  const string encode_type_;
+  const bool check_size_;
+  boost::mutex mutex_;
+  size_t data_size_;
+  bool data_size_initialized_;
+};
+#endif  // USE_OPENCV
+
+int main(int argc, char** argv) {
+#ifdef USE_OPENCV
+  ::google::InitGoogleLogging(argv[0]);
+  // Print output to stderr (while still logging)
+  FLAGS_alsologtostderr = 1;
+
+#ifndef GFLAGS_GFLAGS_H_
+  namespace gflags = google;
+#endif
+
+  gflags::SetUsageMessage("Convert a set of images to the leveldb/lmdb\n"
+        "format used as input for Caffe.\n"
+        "Usage:\n"
+        "    convert_imageset [FLAGS] ROOTFOLDER/ LISTFILE DB_NAME\n"
+        "The ImageNet dataset for the training demo is at\n"
+        "    http://www.image-net.org/download-images\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (argc < 4) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/convert_imageset");
+    return 1;
+  }
+
+  const bool is_color = !FLAGS_gray;
+  const bool check_size = FLAGS_check_size;
+  const bool encoded = FLAGS_encoded;
+  const string encode_type = FLAGS_encode_type;
+
+  std::ifstream infile(argv[2]);
+  std::vector<std::pair<std::string, int> > lines;
+  std::string line;
+  size_t pos;
+  int label;
+  while (std::getline(infile, line)) {
+    pos = line.find_last_of(' ');
+    label = atoi(line.substr(pos + 1).c_str());
+    lines.push_back(std::make_pair(line.substr(0, pos), label));
+  }
+  if (FLAGS_shuffle) {
+    // randomly shuffle data
+    LOG(INFO) << "Shuffling data";
+    shuffle(lines.begin(), lines.end());
+  }
+  LOG(INFO) << "A total of " << lines.size() << " images.";
+
+  if (encode_type.size() && !encoded)
+    LOG(INFO) << "encode_type specified, assuming encoded=true.";
+
+  int resize_height = std::max<int>(0, FLAGS_resize_height);
+  int resize_width = std::max<int>(0, FLAGS_resize_width);
+
+  db::DatasetBuilder::Options options;
+  options.num_workers = std::max<int>(1, FLAGS_threads);
+  options.batch_size = std::max<int>(1, FLAGS_batch_size);
+  options.max_in_flight = std::max(options.max_in_flight, options.batch_size);
+  options.log_every = 1000;
+  db::DatasetBuilder builder(options);
+  ImageEncoder encoder(argv[1], resize_height, resize_width, is_color,
+      encoded, encode_type, check_size);
+  builder.set_encode_function(
+      boost::bind(&ImageEncoder::Encode, &encoder, _1, _2));
+
+  // Create new DB
+  scoped_ptr<db::BatchWriter> writer(db::GetBatchWriter(FLAGS_backend));
+  builder.Build(lines, argv[3], writer.get());
+#else
+  LOG(FATAL) << "This tool requires OpenCV; compile with USE_OPENCV.";
+#endif  // USE_OPENCV
+  return 0;
+}
@@ -0,0 +1,63 @@
+// Converts a trained .caffemodel into the mmappable weights format read by
+// caffe::CopyTrainedLayersFrom in caffe/util/mapped_weights.hpp.
+//
+// Usage:
+//    convert_mapped_weights [FLAGS] INPUT.caffemodel OUTPUT.caffeweights
+//
+// With --model, both files are loaded into the net afterwards and the load
+// times are reported.
+#include <string>
+
+#include "caffe/caffe.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/mapped_weights.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::CPUTimer;
+using caffe::Net;
+using caffe::NetParameter;
+using caffe::shared_ptr;
+using caffe::string;
+
+DEFINE_string(model, "",
+    "Optional deploy prototxt used to compare load times.");
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = 1;
+  gflags::SetUsageMessage("Convert a .caffemodel to mapped weights.\n"
+      "Usage:\n"
+      "    convert_mapped_weights [FLAGS] INPUT.caffemodel OUTPUT\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc != 3) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0],
+        "tools/convert_mapped_weights");
+    return 1;
+  }
+  const string input = argv[1];
+  const string output = argv[2];
+
+  NetParameter trained;
+  caffe::ReadNetParamsFromBinaryFileOrDie(input, &trained);
+  caffe::WriteMappedWeights<float>(trained, output);
+  LOG(INFO) << "Wrote " << output;
+
+  if (!FLAGS_model.empty()) {
+    caffe::Caffe::set_mode(caffe::Caffe::CPU);
+    CPUTimer timer;
+    Net<float> proto_net(FLAGS_model, caffe::TEST);
+    timer.Start();
+    proto_net.CopyTrainedLayersFrom(input);
+    timer.Stop();
+    LOG(INFO) << "CopyTrainedLayersFrom(" << input << "): "
+              << timer.MilliSeconds() << " ms";
+    Net<float> mapped_net(FLAGS_model, caffe::TEST);
+    timer.Start();
+    shared_ptr<caffe::MappedWeights> weights =
+        caffe::CopyTrainedLayersFrom(&mapped_net, output);
+    timer.Stop();
+    LOG(INFO) << "CopyTrainedLayersFrom(" << output << "): "
+              << timer.MilliSeconds() << " ms";
+  }
+  return 0;
+}
@@ -0,0 +1,137 @@
+// Extracts the given blobs of a net, batch by batch, to databases or to
+// contiguous (optionally .npy) files. Forward passes, serialization and
+// writing run on separate threads; see caffe::FeatureExtractor.
+//
+// Usage:
+//    extract_features [--oversample=227] [--crops=10] [--aggregate=mean]
+//        pretrained_net_param feature_extraction_proto_file
+//        extract_feature_blob_name1[,name2,...]
+//        save_feature_dataset_name1[,name2,...] num_mini_batches
+//        db_type [CPU/GPU] [DEVICE_ID=0]
+//
+// db_type is lmdb, leveldb, npy (NumPy, memory-mappable with
+// numpy.load(name, mmap_mode='r')) or raw (the same without the header).
+// --oversample feeds the net the ten caffe.io.oversample crops of every
+// input image and --crops pools the features over them in the net, so one
+// feature vector is written per image; --crops alone applies to data that
+// already holds that many consecutive crops per image.
+#include <boost/algorithm/string.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "caffe/caffe.hpp"
+#include "caffe/layers/oversample_layer.hpp"
+#include "caffe/util/feature_extractor.hpp"
+#include "caffe/util/upgrade_proto.hpp"
+
+using caffe::Caffe;
+using caffe::FeatureSink;
+using caffe::Net;
+using caffe::NetParameter;
+using caffe::shared_ptr;
+using caffe::string;
+using caffe::vector;
+
+DEFINE_int32(oversample, 0,
+    "Optional; crop size of the ten oversampled crops per input image.");
+DEFINE_string(input_blob, "data",
+    "The data blob that --oversample crops.");
+DEFINE_int32(crops, 0,
+    "Optional; pool the features over every this many consecutive items. "
+    "Defaults to 10 with --oversample.");
+DEFINE_string(aggregate, "mean", "How crops are pooled: mean or max.");
+DEFINE_int32(queue_depth, 4, "Batches buffered between forward and writers.");
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = 1;
+  gflags::SetUsageMessage("Extract features of a trained net.\n"
+      "Usage:\n"
+      "    extract_features [FLAGS] pretrained_net_param "
+      "feature_extraction_proto_file\n"
+      "        extract_feature_blob_name1[,name2,...] "
+      "save_feature_dataset_name1[,name2,...]\n"
+      "        num_mini_batches db_type [CPU/GPU] [DEVICE_ID=0]\n"
+      "db_type is lmdb, leveldb, npy or raw.\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (argc < 7) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/extract_features");
+    return 1;
+  }
+
+  if (argc >= 8 && strcmp(argv[7], "GPU") == 0) {
+    int device_id = argc >= 9 ? atoi(argv[8]) : 0;
+    CHECK_GE(device_id, 0);
+    LOG(INFO) << "Using Device_id=" << device_id;
+    Caffe::SetDevice(device_id);
+    Caffe::set_mode(Caffe::GPU);
+  } else {
+    LOG(INFO) << "Using CPU";
+    Caffe::set_mode(Caffe::CPU);
+  }
+
+  const string pretrained_binary_proto(argv[1]);
+  NetParameter param;
+  caffe::ReadNetParamsFromTextFileOrDie(argv[2], &param);
+  param.mutable_state()->set_phase(caffe::TEST);
+  NetParameter filtered;
+  Net<float>::FilterNet(param, &filtered);
+
+  vector<string> blob_names;
+  boost::split(blob_names, argv[3], boost::is_any_of(","));
+  vector<string> dataset_names;
+  boost::split(dataset_names, argv[4], boost::is_any_of(","));
+  CHECK_EQ(blob_names.size(), dataset_names.size())
+      << " the number of blob names and dataset names must be equal";
+  const int num_mini_batches = atoi(argv[5]);
+  const string db_type(argv[6]);
+
+  int crops = FLAGS_crops;
+  if (FLAGS_oversample > 0) {
+    caffe::RegisterOversampleLayer();
+    caffe::AddOversampling(&filtered, FLAGS_input_blob, FLAGS_oversample);
+    if (crops == 0) {
+      crops = caffe::OversampleLayer<float>::kNumCrops;
+    }
+  }
+  if (crops > 1) {
+    CHECK(FLAGS_aggregate == "mean" || FLAGS_aggregate == "max")
+        << "Unknown --aggregate " << FLAGS_aggregate;
+    blob_names = caffe::AddCropAggregation(&filtered, blob_names, crops,
+        FLAGS_aggregate == "max" ? caffe::PoolingParameter_PoolMethod_MAX :
+        caffe::PoolingParameter_PoolMethod_AVE);
+  }
+
+  Net<float> feature_extraction_net(filtered);
+  feature_extraction_net.CopyTrainedLayersFrom(pretrained_binary_proto);
+
+  vector<shared_ptr<FeatureSink<float> > > sinks;
+  vector<FeatureSink<float>*> sink_pointers;
+  for (int i = 0; i < blob_names.size(); ++i) {
+    CHECK(feature_extraction_net.has_blob(blob_names[i]))
+        << "Unknown feature blob name " << blob_names[i]
+        << " in the network " << argv[2];
+    if (db_type == "npy" || db_type == "raw") {
+      sinks.push_back(shared_ptr<FeatureSink<float> >(
+          new caffe::NpyFeatureSink<float>(dataset_names[i],
+              db_type == "npy")));
+    } else {
+      const int batch_size =
+          feature_extraction_net.blob_by_name(blob_names[i])->shape(0);
+      sinks.push_back(shared_ptr<FeatureSink<float> >(
+          new caffe::DBFeatureSink<float>(db_type, dataset_names[i],
+              num_mini_batches * batch_size)));
+    }
+    sink_pointers.push_back(sinks.back().get());
+  }
+
+  LOG(INFO) << "Extracting Features";
+  caffe::FeatureExtractor<float> extractor(&feature_extraction_net,
+      blob_names, sink_pointers, FLAGS_queue_depth);
+  extractor.Extract(num_mini_batches);
+  LOG(INFO) << "Successfully extracted the features!";
+  return 0;
+}
@@ -0,0 +1,116 @@
+// Compares a deploy net's outputs with float weights against the same net
+// with its inner product weights stored as fp16 or bf16, and reports the
+// error and the weight memory saved.
+//
+// Usage:
+//    half_precision_check --model=deploy.prototxt --weights=net.caffemodel
+//        [--type=fp16|bf16] [--iterations=10]
+//
+// The net must take its data from Input layers, which are filled with
+// Gaussian noise.
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "caffe/caffe.hpp"
+#include "caffe/layers/half_inner_product_layer.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using caffe::Blob;
+using caffe::CPUTimer;
+using caffe::Caffe;
+using caffe::Net;
+using caffe::string;
+using caffe::vector;
+
+DEFINE_string(model, "", "The deploy model definition protocol buffer.");
+DEFINE_string(weights, "", "The trained weights.");
+DEFINE_string(type, "fp16", "Weight storage type: fp16 or bf16.");
+DEFINE_int32(iterations, 10, "Number of random inputs to compare.");
+
+static double ForwardMilliseconds(Net<float>* net) {
+  CPUTimer timer;
+  timer.Start();
+  net->Forward();
+  timer.Stop();
+  return timer.MilliSeconds();
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = 1;
+  gflags::SetUsageMessage("Check the accuracy of half-precision weights.\n"
+      "Usage:\n"
+      "    half_precision_check --model=deploy.prototxt "
+      "--weights=net.caffemodel\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_model.empty() || FLAGS_weights.empty()) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/half_precision_check");
+    return 1;
+  }
+  CHECK(FLAGS_type == "fp16" || FLAGS_type == "bf16")
+      << "Unknown --type " << FLAGS_type;
+  const caffe::HalfType type =
+      FLAGS_type == "fp16" ? caffe::HALF_FP16 : caffe::HALF_BF16;
+
+  Caffe::set_mode(Caffe::CPU);
+  caffe::EnableHalfInnerProductLayer();
+  Net<float> reference(FLAGS_model, caffe::TEST);
+  reference.CopyTrainedLayersFrom(FLAGS_weights);
+  Net<float> half(FLAGS_model, caffe::TEST);
+  half.CopyTrainedLayersFrom(FLAGS_weights);
+  const size_t saved = caffe::CompressWeights(&half, type);
+  CHECK_GT(reference.input_blobs().size(), 0)
+      << "The net needs Input layers";
+
+  const vector<Blob<float>*>& outputs = reference.output_blobs();
+  vector<double> max_error(outputs.size(), 0);
+  vector<double> max_value(outputs.size(), 0);
+  int top1_agree = 0, top1_total = 0;
+  double reference_ms = 0, half_ms = 0;
+  for (int iter = 0; iter < FLAGS_iterations; ++iter) {
+    for (int i = 0; i < reference.input_blobs().size(); ++i) {
+      Blob<float>* input = reference.input_blobs()[i];
+      caffe::caffe_rng_gaussian<float>(input->count(), 0.f, 1.f,
+          input->mutable_cpu_data());
+      half.input_blobs()[i]->CopyFrom(*input);
+    }
+    reference_ms += ForwardMilliseconds(&reference);
+    half_ms += ForwardMilliseconds(&half);
+    for (int i = 0; i < outputs.size(); ++i) {
+      const float* expected = outputs[i]->cpu_data();
+      const float* actual = half.output_blobs()[i]->cpu_data();
+      for (int j = 0; j < outputs[i]->count(); ++j) {
+        max_error[i] = std::max<double>(max_error[i],
+            std::fabs(expected[j] - actual[j]));
+        max_value[i] = std::max<double>(max_value[i], std::fabs(expected[j]));
+      }
+      // Classifier outputs: does the arg max survive?
+      if (outputs[i]->num_axes() == 2) {
+        const int dim = outputs[i]->shape(1);
+        for (int n = 0; n < outputs[i]->shape(0); ++n) {
+          const float* e = expected + n * dim;
+          const float* a = actual + n * dim;
+          top1_agree += std::max_element(e, e + dim) - e ==
+              std::max_element(a, a + dim) - a;
+          ++top1_total;
+        }
+      }
+    }
+  }
+  for (int i = 0; i < outputs.size(); ++i) {
+    LOG(INFO) << half.blob_names()[half.output_blob_indices()[i]]
+              << ": max abs error " << max_error[i] << " (relative "
+              << max_error[i] / std::max(max_value[i], 1e-30) << ")";
+  }
+  if (top1_total > 0) {
+    LOG(INFO) << "Top-1 agreement: " << top1_agree << " / " << top1_total;
+  }
+  LOG(INFO) << "Weight memory saved: " << saved / (1024 * 1024) << " MB";
+  LOG(INFO) << "Average forward: float " << reference_ms / FLAGS_iterations
+            << " ms, " << FLAGS_type << " " << half_ms / FLAGS_iterations
+            << " ms";
+  return 0;
+}
@@ -0,0 +1,162 @@
+// Converts the inner product and convolution weights of a pruned net to
+// sparse storage and reports, per layer, the sparsity, the chosen format and
+// the forward time against the dense weights.
+//
+// Usage:
+//    sparsify_weights --model=deploy.prototxt --weights=net.caffemodel
+//        [--min_sparsity=0.8] [--epsilon=0] [--output=pruned.caffemodel]
+//
+// With --epsilon, weights no larger in magnitude are pruned to zero first,
+// and --output saves the weights so pruned. The net must take its data from
+// Input layers, which are filled with Gaussian noise.
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "caffe/caffe.hpp"
+#include "caffe/layers/pruned_layers.hpp"
+#include "caffe/util/benchmark.hpp"
+#include "caffe/util/io.hpp"
+#include "caffe/util/math_functions.hpp"
+
+using caffe::Blob;
+using caffe::CPUTimer;
+using caffe::Caffe;
+using caffe::Layer;
+using caffe::Net;
+using caffe::NetParameter;
+using caffe::SparseWeights;
+using caffe::string;
+using caffe::vector;
+
+DEFINE_string(model, "", "The deploy model definition protocol buffer.");
+DEFINE_string(weights, "", "The trained weights.");
+DEFINE_double(min_sparsity, 0.8,
+    "Layers with at least this fraction of zero weights are sparsified.");
+DEFINE_double(epsilon, 0, "Prune weights with |w| <= epsilon to zero.");
+DEFINE_string(output, "", "Optional .caffemodel to save the pruned weights.");
+DEFINE_int32(iterations, 20, "Number of timed forward passes.");
+
+static bool Prunable(const Layer<float>* layer) {
+  return dynamic_cast<const caffe::PrunedInnerProductLayer<float>*>(layer) ||
+      dynamic_cast<const caffe::PrunedConvolutionLayer<float>*>(layer);
+}
+
+// Average milliseconds of forwarding layers [start, end].
+static double ForwardMilliseconds(Net<float>* net, int start, int end) {
+  net->ForwardFromTo(start, end);
+  CPUTimer timer;
+  timer.Start();
+  for (int i = 0; i < FLAGS_iterations; ++i) {
+    net->ForwardFromTo(start, end);
+  }
+  timer.Stop();
+  return timer.MilliSeconds() / FLAGS_iterations;
+}
+
+int main(int argc, char** argv) {
+  ::google::InitGoogleLogging(argv[0]);
+  FLAGS_alsologtostderr = 1;
+  gflags::SetUsageMessage("Convert pruned weights to sparse storage.\n"
+      "Usage:\n"
+      "    sparsify_weights --model=deploy.prototxt "
+      "--weights=net.caffemodel\n");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_model.empty() || FLAGS_weights.empty()) {
+    gflags::ShowUsageWithFlagsRestrict(argv[0], "tools/sparsify_weights");
+    return 1;
+  }
+
+  Caffe::set_mode(Caffe::CPU);
+  caffe::EnablePrunedLayers<float>();
+  Net<float> net(FLAGS_model, caffe::TEST);
+  net.CopyTrainedLayersFrom(FLAGS_weights);
+  CHECK_GT(net.input_blobs().size(), 0) << "The net needs Input layers";
+  const int num_layers = net.layers().size();
+
+  vector<double> sparsity(num_layers, 0);
+  for (int i = 0; i < num_layers; ++i) {
+    if (!Prunable(net.layers()[i].get())) {
+      continue;
+    }
+    Blob<float>* weight = net.layers()[i]->blobs()[0].get();
+    if (FLAGS_epsilon > 0) {
+      float* w = weight->mutable_cpu_data();
+      for (int j = 0; j < weight->count(); ++j) {
+        if (std::fabs(w[j]) <= FLAGS_epsilon) {
+          w[j] = 0;
+        }
+      }
+    }
+    sparsity[i] = SparseWeights<float>::Sparsity(weight->cpu_data(),
+        weight->count());
+  }
+  if (!FLAGS_output.empty()) {
+    NetParameter pruned;
+    net.ToProto(&pruned);
+    caffe::WriteProtoToBinaryFile(pruned, FLAGS_output);
+    LOG(INFO) << "Wrote " << FLAGS_output;
+  }
+
+  for (int i = 0; i < net.input_blobs().size(); ++i) {
+    Blob<float>* input = net.input_blobs()[i];
+    caffe::caffe_rng_gaussian<float>(input->count(), 0.f, 1.f,
+        input->mutable_cpu_data());
+  }
+  net.Forward();
+  vector<vector<float> > expected(net.output_blobs().size());
+  for (int i = 0; i < expected.size(); ++i) {
+    const Blob<float>* output = net.output_blobs()[i];
+    expected[i].assign(output->cpu_data(),
+        output->cpu_data() + output->count());
+  }
+  vector<double> dense_ms(num_layers, 0);
+  for (int i = 0; i < num_layers; ++i) {
+    if (Prunable(net.layers()[i].get())) {
+      dense_ms[i] = ForwardMilliseconds(&net, i, i);
+    }
+  }
+  const double dense_total = ForwardMilliseconds(&net, 0, num_layers - 1);
+
+  caffe::SparsifyWeights(&net, FLAGS_min_sparsity);
+  const double sparse_total = ForwardMilliseconds(&net, 0, num_layers - 1);
+  double max_error = 0;
+  for (int i = 0; i < expected.size(); ++i) {
+    const float* actual = net.output_blobs()[i]->cpu_data();
+    for (int j = 0; j < expected[i].size(); ++j) {
+      max_error = std::max<double>(max_error,
+          std::fabs(expected[i][j] - actual[j]));
+    }
+  }
+  for (int i = 0; i < num_layers; ++i) {
+    Layer<float>* layer = net.layers()[i].get();
+    if (!Prunable(layer)) {
+      continue;
+    }
+    caffe::PrunedInnerProductLayer<float>* ip =
+        dynamic_cast<caffe::PrunedInnerProductLayer<float>*>(layer);
+    caffe::PrunedConvolutionLayer<float>* conv =
+        dynamic_cast<caffe::PrunedConvolutionLayer<float>*>(layer);
+    const bool sparse = ip != NULL ? ip->sparse() : conv->sparse();
+    if (!sparse) {
+      LOG(INFO) << net.layer_names()[i] << " (" << layer->type()
+                << "): sparsity " << sparsity[i] << ", dense "
+                << dense_ms[i] << " ms";
+      continue;
+    }
+    const double sparse_ms = ForwardMilliseconds(&net, i, i);
+    const caffe::SparseFormat format = ip != NULL ?
+        ip->sparse_weights()->format() : conv->sparse_weights(0)->format();
+    LOG(INFO) << net.layer_names()[i] << " (" << layer->type()
+              << "): sparsity " << sparsity[i] << ", "
+              << caffe::SparseFormatName(format) << ", dense " << dense_ms[i]
+              << " ms, sparse " << sparse_ms << " ms, speedup "
+              << dense_ms[i] / sparse_ms << "x";
+  }
+  LOG(INFO) << "Max abs output difference: " << max_error;
+  LOG(INFO) << "Forward: dense " << dense_total << " ms, sparse "
+            << sparse_total << " ms, speedup " << dense_total / sparse_total
+            << "x";
+  return 0;
+}
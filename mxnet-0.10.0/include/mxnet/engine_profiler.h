@@ -0,0 +1,509 @@
+/*!
+ * Copyright (c) 2017 by Contributors
+ * \file engine_profiler.h
+ * \brief Engine decorator that records when every operation was pushed,
+ *  when its dependencies were satisfied, and when and where it ran.
+ */
+#ifndef MXNET_ENGINE_PROFILER_H_
+#define MXNET_ENGINE_PROFILER_H_
+
+#include <dmlc/base.h>
+#include <dmlc/logging.h>
+#if DMLC_USE_CXX11
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#endif
+#include "./engine.h"
+
+namespace mxnet {
+namespace engine {
+
+#if DMLC_USE_CXX11
+/*!
+ * \brief Timeline of one pushed operation, in microseconds since
+ *  ProfilingEngine::Start.
+ */
+struct OprTimeline {
+  /*! \brief operator name, or "unknown" */
+  std::string name;
+  /*! \brief execution context */
+  Context ctx;
+  /*! \brief when the operation was pushed */
+  int64_t enqueue_us{0};
+  /*!
+   * \brief when its last read/write dependency completed, or enqueue_us if
+   *  nothing was pending; filled in by Analyze()
+   */
+  int64_t ready_us{0};
+  /*! \brief when a worker started executing it */
+  int64_t start_us{-1};
+  /*! \brief when it signalled completion */
+  int64_t end_us{-1};
+  /*! \brief dense index of the worker thread that ran it */
+  int thread{-1};
+  /*! \brief operations it had to wait for, by index */
+  std::vector<int> deps;
+  /*!
+   * \brief the dependency that completed last, i.e. the one that made this
+   *  operation ready, or -1; filled in by Analyze()
+   */
+  int critical_dep{-1};
+  /*! \brief whether it has run to completion */
+  inline bool done() const { return end_us >= 0; }
+  /*! \return time spent waiting for dependencies */
+  inline int64_t dep_wait_us() const { return ready_us - enqueue_us; }
+  /*! \return time spent ready but not running, i.e. waiting for a worker */
+  inline int64_t queue_wait_us() const { return start_us - ready_us; }
+  /*! \return execution time */
+  inline int64_t exec_us() const { return end_us - start_us; }
+};
+
+/*! \brief Aggregates of a recorded session; see ProfilingEngine::Analyze. */
+struct EngineProfileSummary {
+  /*! \brief from the first push to the last completion */
+  int64_t wall_us{0};
+  /*! \brief completed operations */
+  size_t num_oprs{0};
+  /*! \brief sums over all completed operations */
+  int64_t total_dep_wait_us{0};
+  int64_t total_queue_wait_us{0};
+  int64_t total_exec_us{0};
+  /*! \brief busy time of every worker thread, by thread index */
+  std::vector<int64_t> thread_busy_us;
+  /*! \brief the chain of operations ending at the last completion, in order */
+  std::vector<int> critical_path;
+  /*! \brief execution and worker-queue time along the critical path */
+  int64_t critical_exec_us{0};
+  int64_t critical_queue_wait_us{0};
+};
+
+/*!
+ * \brief Engine that forwards everything to another engine and records the
+ *  timeline of every operation pushed while profiling is on.
+ *
+ *  Start and end times are taken on the worker around the operation's
+ *  function. The dependency-ready time is reconstructed from the variables:
+ *  an operation reading a variable waits for the last operation that wrote
+ *  it, and one writing it also waits for every reader since, which is the
+ *  order the engine itself enforces. So for every operation
+ *    enqueue -> ready is time blocked on dependencies,
+ *    ready -> start is time spent queued for a worker (engine overhead or
+ *      too few threads),
+ *    start -> end is compute.
+ *  Following the last-completing dependency back from the last operation
+ *  gives the critical path. When it accounts for most of the wall time and
+ *  is mostly execution, the run is compute bound; large queue waits, on the
+ *  path or overall, point at the engine.
+ *
+ *  To profile everything, create it around the engine selected by
+ *  MXNET_ENGINE_TYPE where the engine singleton is made; code can also push
+ *  through an instance directly.
+ *  Recording takes a lock per event, so leave it stopped outside profiling
+ *  runs; pushes made while stopped are forwarded untouched.
+ */
+class ProfilingEngine : public Engine {
+ public:
+  /*! \param base the engine that actually schedules and runs operations */
+  explicit ProfilingEngine(std::shared_ptr<Engine> base)
+      : base_(std::move(base)), origin_(Clock::now()) {}
+  /*!
+   * \brief Start a new recording, dropping the previous one. Waits for the
+   *  operations in flight first, so must not be called from one.
+   */
+  void Start() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      running_ = false;
+    }
+    base_->WaitForAll();
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &kv : opr_info_) kv.second->pending.clear();
+    oprs_.clear();
+    vars_.clear();
+    threads_.clear();
+    origin_ = Clock::now();
+    // a push recorded before may still be on its way to the base engine
+    ++session_;
+    running_ = true;
+  }
+  /*! \brief stop recording; operations in flight still get their end time */
+  void Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+  }
+  /*! \return whether pushes are being recorded */
+  bool running() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return running_;
+  }
+  /*!
+   * \brief Copy the recorded timelines and fill in their ready times and
+   *  critical dependencies. Call after WaitForAll; incomplete operations are
+   *  left out of the summary.
+   * \param summary if not null, receives the aggregates
+   */
+  std::vector<OprTimeline> Analyze(EngineProfileSummary *summary = nullptr) const {
+    std::vector<OprTimeline> oprs;
+    size_t num_threads;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      oprs.assign(oprs_.begin(), oprs_.end());
+      num_threads = threads_.size();
+    }
+    // dependencies always have smaller indices, so one pass suffices
+    for (OprTimeline &opr : oprs) {
+      opr.ready_us = opr.enqueue_us;
+      for (int dep : opr.deps) {
+        if (oprs[dep].done() && oprs[dep].end_us > opr.ready_us) {
+          opr.ready_us = oprs[dep].end_us;
+          opr.critical_dep = dep;
+        }
+      }
+      if (opr.start_us >= 0) opr.ready_us = std::min(opr.ready_us, opr.start_us);
+    }
+    if (summary == nullptr) return oprs;
+    EngineProfileSummary &s = *summary;
+    s = EngineProfileSummary();
+    s.thread_busy_us.assign(num_threads, 0);
+    int64_t first = -1, last = -1;
+    int last_opr = -1;
+    for (size_t i = 0; i < oprs.size(); ++i) {
+      const OprTimeline &opr = oprs[i];
+      if (!opr.done()) continue;
+      ++s.num_oprs;
+      s.total_dep_wait_us += opr.dep_wait_us();
+      s.total_queue_wait_us += opr.queue_wait_us();
+      s.total_exec_us += opr.exec_us();
+      s.thread_busy_us[opr.thread] += opr.exec_us();
+      if (first < 0 || opr.enqueue_us < first) first = opr.enqueue_us;
+      if (opr.end_us > last) {
+        last = opr.end_us;
+        last_opr = static_cast<int>(i);
+      }
+    }
+    s.wall_us = last_opr < 0 ? 0 : last - first;
+    for (int i = last_opr; i >= 0; i = oprs[i].critical_dep) {
+      s.critical_path.push_back(i);
+      s.critical_exec_us += oprs[i].exec_us();
+      s.critical_queue_wait_us += oprs[i].queue_wait_us();
+    }
+    std::reverse(s.critical_path.begin(), s.critical_path.end());
+    return oprs;
+  }
+  /*!
+   * \brief Write the recording in Chrome trace format (chrome://tracing).
+   *
+   *  Every worker thread is a row of execution spans, one process per
+   *  device. Dependency and queue waits are async spans grouped by operator
+   *  name, and the critical path gets a row of its own.
+   */
+  void DumpChromeTrace(std::ostream &os) const {
+    EngineProfileSummary summary;
+    std::vector<OprTimeline> oprs = Analyze(&summary);
+    std::vector<bool> critical(oprs.size(), false);
+    for (int i : summary.critical_path) critical[i] = true;
+    const int kCriticalTid = -1;
+    bool first = true;
+    auto begin = [&os, &first]() -> std::ostream& {
+      os << (first ? "\n    " : ",\n    ");
+      first = false;
+      return os;
+    };
+    os << "{\n  \"traceEvents\": [";
+    std::vector<std::pair<int, int> > named;
+    for (size_t i = 0; i < oprs.size(); ++i) {
+      const OprTimeline &opr = oprs[i];
+      if (!opr.done()) continue;
+      const int pid = Pid(opr.ctx);
+      if (std::find(named.begin(), named.end(), std::make_pair(pid, opr.thread)) ==
+          named.end()) {
+        if (std::find_if(named.begin(), named.end(),
+                         [pid](const std::pair<int, int> &p) { return p.first == pid; }) ==
+            named.end()) {
+          begin() << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid
+                  << ", \"args\": {\"name\": \"" << DeviceName(opr.ctx) << "\"}}";
+          begin() << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid
+                  << ", \"tid\": " << kCriticalTid
+                  << ", \"args\": {\"name\": \"critical path\"}}";
+        }
+        begin() << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << pid
+                << ", \"tid\": " << opr.thread
+                << ", \"args\": {\"name\": \"worker " << opr.thread << "\"}}";
+        named.emplace_back(pid, opr.thread);
+      }
+      begin() << "{\"name\": \"" << opr.name << "\", \"cat\": \"operator\", \"ph\": \"X\""
+              << ", \"ts\": " << opr.start_us << ", \"dur\": " << opr.exec_us()
+              << ", \"pid\": " << pid << ", \"tid\": " << opr.thread
+              << ", \"args\": {\"id\": " << i
+              << ", \"dep_wait_us\": " << opr.dep_wait_us()
+              << ", \"queue_wait_us\": " << opr.queue_wait_us()
+              << ", \"waited_for\": " << opr.critical_dep << "}}";
+      if (critical[i]) {
+        begin() << "{\"name\": \"" << opr.name << "\", \"cat\": \"critical\", \"ph\": \"X\""
+                << ", \"ts\": " << opr.start_us << ", \"dur\": " << opr.exec_us()
+                << ", \"pid\": " << pid << ", \"tid\": " << kCriticalTid
+                << ", \"args\": {\"id\": " << i << "}}";
+      }
+      WriteAsync(begin, "dependency_wait", opr.name, i, pid, opr.enqueue_us, opr.ready_us);
+      WriteAsync(begin, "queue_wait", opr.name, i, pid, opr.ready_us, opr.start_us);
+    }
+    os << "\n  ],\n  \"displayTimeUnit\": \"ms\",\n  \"otherData\": {"
+       << "\"wall_us\": " << summary.wall_us
+       << ", \"exec_us\": " << summary.total_exec_us
+       << ", \"dep_wait_us\": " << summary.total_dep_wait_us
+       << ", \"queue_wait_us\": " << summary.total_queue_wait_us
+       << ", \"critical_path_oprs\": " << summary.critical_path.size()
+       << ", \"critical_path_exec_us\": " << summary.critical_exec_us
+       << ", \"critical_path_queue_wait_us\": " << summary.critical_queue_wait_us
+       << "}\n}\n";
+  }
+  /*! \brief DumpChromeTrace to a file */
+  void DumpChromeTrace(const std::string &filename) const {
+    std::ofstream os(filename.c_str());
+    CHECK(os) << "Cannot open " << filename;
+    DumpChromeTrace(os);
+  }
+  /*! \brief Print totals, per-thread utilization and the critical path. */
+  void PrintSummary(std::ostream &os) const {
+    EngineProfileSummary s;
+    Analyze(&s);
+    const double wall = std::max<int64_t>(s.wall_us, 1);
+    os << "Engine profile: " << s.num_oprs << " operations in " << s.wall_us / 1000.0
+       << " ms\n"
+       << "  exec " << s.total_exec_us / 1000.0 << " ms, dependency wait "
+       << s.total_dep_wait_us / 1000.0 << " ms, queue wait "
+       << s.total_queue_wait_us / 1000.0 << " ms\n";
+    for (size_t t = 0; t < s.thread_busy_us.size(); ++t) {
+      os << "  worker " << t << ": " << 100.0 * s.thread_busy_us[t] / wall << "% busy\n";
+    }
+    os << "  critical path: " << s.critical_path.size() << " operations, exec "
+       << 100.0 * s.critical_exec_us / wall << "% and queue wait "
+       << 100.0 * s.critical_queue_wait_us / wall << "% of wall time\n";
+  }
+
+  // Engine interface.
+  void NotifyShutdown() override { base_->NotifyShutdown(); }
+  VarHandle NewVariable() override { return base_->NewVariable(); }
+  OprHandle NewOperator(AsyncFn fn,
+                        std::vector<VarHandle> const& const_vars,
+                        std::vector<VarHandle> const& mutable_vars,
+                        FnProperty prop = FnProperty::kNormal,
+                        const char* opr_name = nullptr) override {
+    std::shared_ptr<OprInfo> info = std::make_shared<OprInfo>();
+    info->name = opr_name ? opr_name : "unknown";
+    info->const_vars = const_vars;
+    info->mutable_vars = mutable_vars;
+    DeduplicateVarHandle(&info->const_vars, &info->mutable_vars);
+    // an operator can be pushed many times; each run takes the oldest
+    // recorded push, as runs of one operator are ordered by its variables
+    AsyncFn wrapped = [this, info, fn](RunContext ctx, CallbackOnComplete on_complete) {
+      int index = -1;
+      uint64_t session;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        session = session_;
+        if (!info->pending.empty()) {
+          index = info->pending.front();
+          info->pending.pop_front();
+        }
+      }
+      Run(fn, session, index, ctx, on_complete);
+    };
+    OprHandle op = base_->NewOperator(wrapped, const_vars, mutable_vars, prop, opr_name);
+    std::lock_guard<std::mutex> lock(mutex_);
+    opr_info_[op] = info;
+    return op;
+  }
+  void DeleteOperator(OprHandle op) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      opr_info_.erase(op);
+    }
+    base_->DeleteOperator(op);
+  }
+  void Push(OprHandle op, Context exec_ctx, int priority = 0,
+            bool profiling = false) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (running_) {
+        auto it = opr_info_.find(op);
+        CHECK(it != opr_info_.end()) << "Operator was not created by this engine";
+        const OprInfo &info = *it->second;
+        it->second->pending.push_back(
+            Record(info.name, exec_ctx, info.const_vars, info.mutable_vars));
+      }
+    }
+    base_->Push(op, exec_ctx, priority, profiling);
+  }
+  void PushAsync(AsyncFn exec_fun, Context exec_ctx,
+                 std::vector<VarHandle> const& const_vars,
+                 std::vector<VarHandle> const& mutable_vars,
+                 FnProperty prop = FnProperty::kNormal,
+                 int priority = 0,
+                 const char* opr_name = nullptr) override {
+    int index = -1;
+    uint64_t session;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      session = session_;
+      if (running_) {
+        std::vector<VarHandle> reads(const_vars), writes(mutable_vars);
+        DeduplicateVarHandle(&reads, &writes);
+        index = Record(opr_name ? opr_name : "unknown", exec_ctx, reads, writes);
+      }
+    }
+    if (index < 0) {
+      base_->PushAsync(exec_fun, exec_ctx, const_vars, mutable_vars, prop, priority,
+                       opr_name);
+      return;
+    }
+    base_->PushAsync([this, exec_fun, session, index](RunContext ctx,
+                                                       CallbackOnComplete on_complete) {
+        Run(exec_fun, session, index, ctx, on_complete);
+      }, exec_ctx, const_vars, mutable_vars, prop, priority, opr_name);
+  }
+  void DeleteVariable(SyncFn delete_fn, Context exec_ctx, VarHandle var) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      vars_.erase(var);
+    }
+    base_->DeleteVariable(delete_fn, exec_ctx, var);
+  }
+  void WaitForVar(VarHandle var) override { base_->WaitForVar(var); }
+  void WaitForAll() override { base_->WaitForAll(); }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+  /*! \brief what a pushed operator needs to be recorded */
+  struct OprInfo {
+    std::string name;
+    std::vector<VarHandle> const_vars, mutable_vars;
+    /*! \brief recorded pushes that have not started yet */
+    std::deque<int> pending;
+  };
+  /*! \brief recorded operations that last wrote and since read a variable */
+  struct VarInfo {
+    int writer{-1};
+    std::vector<int> readers;
+  };
+  /*! \brief completion callback state of a recorded operation */
+  struct Completion {
+    ProfilingEngine *engine;
+    uint64_t session;
+    int index;
+    CallbackOnComplete on_complete;
+  };
+
+  int64_t Now() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        Clock::now() - origin_).count();
+  }
+  static int Pid(const Context &ctx) {
+    return ctx.dev_type == Context::kGPU ? 1 + ctx.dev_id : 0;
+  }
+  static std::string DeviceName(const Context &ctx) {
+    return ctx.dev_type == Context::kGPU ? "gpu(" + std::to_string(ctx.dev_id) + ")" : "cpu";
+  }
+  template<typename Begin>
+  static void WriteAsync(const Begin &begin, const char *cat, const std::string &name,
+                         size_t id, int pid, int64_t from, int64_t to) {
+    if (to <= from) return;
+    begin() << "{\"name\": \"" << name << "\", \"cat\": \"" << cat << "\", \"ph\": \"b\""
+            << ", \"id\": " << id << ", \"ts\": " << from << ", \"pid\": " << pid << "}";
+    begin() << "{\"name\": \"" << name << "\", \"cat\": \"" << cat << "\", \"ph\": \"e\""
+            << ", \"id\": " << id << ", \"ts\": " << to << ", \"pid\": " << pid << "}";
+  }
+  /*!
+   * \brief Append a timeline for a push and update the variable state, with
+   *  mutex_ held. The variable lists must be deduplicated.
+   */
+  int Record(const std::string &name, const Context &ctx,
+             const std::vector<VarHandle> &reads, const std::vector<VarHandle> &writes) {
+    const int index = static_cast<int>(oprs_.size());
+    oprs_.emplace_back();
+    OprTimeline &opr = oprs_.back();
+    opr.name = name;
+    opr.ctx = ctx;
+    opr.enqueue_us = Now();
+    for (VarHandle var : reads) {
+      VarInfo &v = vars_[var];
+      if (v.writer >= 0) opr.deps.push_back(v.writer);
+      v.readers.push_back(index);
+    }
+    for (VarHandle var : writes) {
+      VarInfo &v = vars_[var];
+      if (v.writer >= 0) opr.deps.push_back(v.writer);
+      opr.deps.insert(opr.deps.end(), v.readers.begin(), v.readers.end());
+      v.writer = index;
+      v.readers.clear();
+    }
+    return index;
+  }
+  /*!
+   * \brief run fn on a worker, recording a start and, on completion, an end;
+   *  pushes recorded in a session that Start has since dropped are not
+   */
+  void Run(const AsyncFn &fn, uint64_t session, int index, RunContext ctx,
+           CallbackOnComplete on_complete) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (session != session_) index = -1;
+      if (index >= 0) {
+        auto it = threads_.find(std::this_thread::get_id());
+        if (it == threads_.end()) {
+          it = threads_.emplace(std::this_thread::get_id(),
+                                static_cast<int>(threads_.size())).first;
+        }
+        oprs_[index].thread = it->second;
+        oprs_[index].start_us = Now();
+      }
+    }
+    if (index < 0) {
+      fn(ctx, on_complete);
+      return;
+    }
+    Completion *completion = new Completion{this, session, index, on_complete};
+    fn(ctx, CreateCallback(OnComplete, completion));
+  }
+  static void OnComplete(Engine*, void *param) {
+    Completion *completion = static_cast<Completion*>(param);
+    ProfilingEngine *self = completion->engine;
+    {
+      std::lock_guard<std::mutex> lock(self->mutex_);
+      if (completion->session == self->session_) {
+        self->oprs_[completion->index].end_us = self->Now();
+      }
+    }
+    CallbackOnComplete on_complete = completion->on_complete;
+    delete completion;
+    on_complete();
+  }
+
+  /*! \brief the engine doing the work */
+  std::shared_ptr<Engine> base_;
+  /*! \brief guards everything below */
+  mutable std::mutex mutex_;
+  bool running_{false};
+  /*! \brief incremented by Start, so indices of earlier recordings are ignored */
+  uint64_t session_{0};
+  Clock::time_point origin_;
+  /*! \brief recorded operations, in push order */
+  std::deque<OprTimeline> oprs_;
+  std::unordered_map<VarHandle, VarInfo> vars_;
+  std::unordered_map<OprHandle, std::shared_ptr<OprInfo> > opr_info_;
+  std::unordered_map<std::thread::id, int> threads_;
+};
+#endif  // DMLC_USE_CXX11
+}  // namespace engine
+}  // namespace mxnet
+#endif  // MXNET_ENGINE_PROFILER_H_
@@ -0,0 +1,277 @@
+/*!
+ * Copyright (c) 2017 by Contributors
+ * \file kvstore_shm.h
+ * \brief KVStore for several worker processes on one host, reducing
+ *  through POSIX shared memory.
+ */
+#ifndef MXNET_KVSTORE_SHM_H_
+#define MXNET_KVSTORE_SHM_H_
+
+#include <dmlc/logging.h>
+#include <dmlc/parameter.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "./engine.h"
+#include "./kvstore.h"
+#include "./ndarray.h"
+#include "./shm_reducer.h"
+
+namespace mxnet {
+namespace kvstore {
+
+/*!
+ * \brief KVStore of type "shm": synchronous data parallelism between
+ *  worker processes on one host, without networking.
+ *
+ *  Created by kvstore::Create("shm") below. Configured by the environment:
+ *  DMLC_NUM_WORKER worker processes, DMLC_WORKER_ID the rank of this one,
+ *  MXNET_KVSTORE_SHM_JOB an id unique to every launch (required with
+ *  several workers, e.g. the launcher's pid and a timestamp),
+ *  MXNET_KVSTORE_SHM_NAME the shared memory name, unique among jobs running
+ *  at once (default "/mxnet_kvstore"), and MXNET_KVSTORE_SHM_SHARD_SIZE the
+ *  floats per reduction shard (default 65536). The launcher only starts the
+ *  worker processes; there are no scheduler or server processes. The job id
+ *  keeps workers from attaching to segments a crashed launch left behind.
+ *
+ *  Push sums the values of all workers per key (ShmReducer). As on the
+ *  server of dist_sync, the updater of rank 0 applies the sum to the stored
+ *  value, assignment by default, and a Pull returns the stored value once
+ *  it includes every round this worker pushed. Values must be float32 on
+ *  CPU, and every worker must push each key once per round.
+ *
+ *  Like the dist stores, pushes and pulls complete asynchronously: the
+ *  engine operations only hand them to a progress thread, which drives the
+ *  reductions of all keys without blocking, so engine workers never wait
+ *  on other processes.
+ */
+class KVStoreShm : public KVStore {
+ public:
+  KVStoreShm()
+      : reducer_(dmlc::GetEnv("MXNET_KVSTORE_SHM_NAME", std::string("/mxnet_kvstore")),
+                 JobId(), dmlc::GetEnv("DMLC_WORKER_ID", 0), dmlc::GetEnv("DMLC_NUM_WORKER", 1),
+                 dmlc::GetEnv("MXNET_KVSTORE_SHM_SHARD_SIZE", 1 << 16)) {
+    type_ = "shm";
+    progress_ = std::thread([this]() { Progress(); });
+  }
+  virtual ~KVStoreShm() {
+    Engine::Get()->WaitForAll();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_one();
+    progress_.join();
+    // rank 0 removes the segments, so wait until nobody uses them
+    reducer_.Barrier();
+    for (auto &kv : keys_) {
+      Engine::Get()->DeleteVariable([](RunContext) {}, Context::CPU(), kv.second.var);
+    }
+  }
+
+  void Init(const std::vector<int> &keys, const std::vector<NDArray> &values) override {
+    CHECK_EQ(keys.size(), values.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      const NDArray &value = values[i];
+      std::vector<float> host;
+      if (get_rank() == 0) {
+        CHECK_EQ(value.dtype(), mshadow::kFloat32) << "shm kvstore only supports float32";
+        host.resize(value.shape().Size());
+        value.SyncCopyToCPU(host.data(), host.size());
+      }
+      reducer_.InitKey(keys[i], value.is_none() ? 0 : value.shape().Size(), host.data());
+      KeyState &state = keys_[keys[i]];
+      state.var = Engine::Get()->NewVariable();
+      if (get_rank() == 0) {
+        state.stored = Wrap(reducer_.MutableStored(keys[i]), value.shape());
+        state.merged = Wrap(reducer_.Merged(keys[i]), value.shape());
+      }
+    }
+  }
+
+  void Push(const std::vector<int> &keys, const std::vector<NDArray> &values,
+            int priority) override {
+    CHECK_EQ(keys.size(), values.size());
+    // duplicated keys are summed before pushing
+    std::vector<int> uniq;
+    std::unordered_map<int, std::vector<NDArray> > grouped;
+    for (size_t i = 0; i < keys.size(); ++i) {
+      if (!grouped.count(keys[i])) uniq.push_back(keys[i]);
+      grouped[keys[i]].push_back(values[i]);
+    }
+    for (int key : uniq) {
+      KeyState &state = State(key);
+      const std::vector<NDArray> &vals = grouped[key];
+      std::vector<Engine::VarHandle> reads;
+      for (const NDArray &v : vals) {
+        CHECK_EQ(v.ctx().dev_mask(), cpu::kDevMask) << "shm kvstore only supports CPU arrays";
+        CHECK_EQ(v.shape().Size(), reducer_.Size(key)) << "Shape of key " << key << " changed";
+        reads.push_back(v.var());
+      }
+      std::vector<Engine::VarHandle> writes = {state.var};
+      if (get_rank() == 0) writes.push_back(state.merged.var());
+      const uint64_t round = state.rounds++;
+      Engine::Get()->PushAsync([this, key, round, vals](RunContext, Engine::CallbackOnComplete cb) {
+          bool arrived = false;
+          Enqueue([this, key, round, vals, arrived]() mutable {
+              if (!arrived) {
+                FillSlot(key, vals);
+                reducer_.Arrive(key);
+                arrived = true;
+              }
+              return reducer_.ReduceStep(key, round);
+            }, cb);
+        }, Context::CPU(), reads, writes, FnProperty::kNormal, priority, "KVStoreShmPush");
+      if (get_rank() != 0) continue;
+      if (updater_ != nullptr) {
+        updater_(key, state.merged, &state.stored);
+      } else {
+        CopyFromTo(state.merged, &state.stored, priority);
+      }
+      Engine::Get()->PushSync([this, key, round](RunContext) {
+          reducer_.Publish(key, round);
+        }, Context::CPU(), {state.stored.var()}, {state.var}, FnProperty::kNormal, priority,
+        "KVStoreShmPublish");
+    }
+  }
+
+  void Pull(const std::vector<int> &keys, const std::vector<NDArray*> &values,
+            int priority) override {
+    CHECK_EQ(keys.size(), values.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      const int key = keys[i];
+      KeyState &state = State(key);
+      NDArray out = *values[i];
+      CHECK_EQ(out.ctx().dev_mask(), cpu::kDevMask) << "shm kvstore only supports CPU arrays";
+      CHECK_EQ(out.shape().Size(), reducer_.Size(key)) << "Shape of key " << key << " changed";
+      // the key's variable also orders this pull before the next push of the key
+      std::vector<Engine::VarHandle> reads, writes = {out.var(), state.var};
+      if (get_rank() == 0) reads.push_back(state.stored.var());
+      const uint64_t rounds = state.rounds;
+      Engine::Get()->PushAsync([this, key, rounds, out](RunContext, Engine::CallbackOnComplete cb) {
+          Enqueue([this, key, rounds, out]() {
+              if (!reducer_.Published(key, rounds)) return false;
+              std::memcpy(out.data().dptr<float>(), reducer_.Stored(key),
+                          reducer_.Size(key) * sizeof(float));
+              return true;
+            }, cb);
+        }, Context::CPU(), reads, writes, FnProperty::kNormal, priority, "KVStoreShmPull");
+    }
+  }
+
+  int get_rank() const override { return reducer_.rank(); }
+  int get_group_size() const override { return reducer_.num_workers(); }
+  void Barrier() override {
+    Engine::Get()->WaitForAll();
+    reducer_.Barrier();
+  }
+
+ private:
+  struct KeyState {
+    /*! \brief orders the pushes and pulls of the key in this process */
+    Engine::VarHandle var = nullptr;
+    /*! \brief pushes so far */
+    uint64_t rounds = 0;
+    /*! \brief on rank 0, the shared stored value and merge buffer */
+    NDArray stored, merged;
+  };
+  /*! \brief a push or pull in flight: step() until it returns true */
+  struct Task {
+    std::function<bool()> step;
+    Engine::CallbackOnComplete on_complete;
+  };
+
+  static uint64_t JobId() {
+    const std::string job = dmlc::GetEnv("MXNET_KVSTORE_SHM_JOB", std::string());
+    CHECK(!job.empty() || dmlc::GetEnv("DMLC_NUM_WORKER", 1) == 1)
+        << "Set MXNET_KVSTORE_SHM_JOB to an id unique to this launch";
+    return std::hash<std::string>()(job);
+  }
+  static NDArray Wrap(float *data, const TShape &shape) {
+    return NDArray(TBlob(data, shape, cpu::kDevMask), 0);
+  }
+  KeyState &State(int key) {
+    auto it = keys_.find(key);
+    CHECK(it != keys_.end()) << "Key " << key << " has not been initialized";
+    return it->second;
+  }
+  void FillSlot(int key, const std::vector<NDArray> &vals) {
+    float *slot = reducer_.Slot(key);
+    const size_t size = reducer_.Size(key);
+    std::memcpy(slot, vals[0].data().dptr<float>(), size * sizeof(float));
+    for (size_t j = 1; j < vals.size(); ++j) {
+      const float *v = vals[j].data().dptr<float>();
+      for (size_t i = 0; i < size; ++i) slot[i] += v[i];
+    }
+  }
+  void Enqueue(std::function<bool()> step, Engine::CallbackOnComplete on_complete) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      incoming_.push_back(Task{std::move(step), on_complete});
+    }
+    cond_.notify_one();
+  }
+  /*! \brief step every task in flight, backing off while none advances */
+  void Progress() {
+    std::list<Task> tasks;
+    int idle = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (tasks.empty()) {
+          cond_.wait(lock, [this]() { return stop_ || !incoming_.empty(); });
+        }
+        if (stop_ && tasks.empty() && incoming_.empty()) return;
+        tasks.splice(tasks.end(), incoming_);
+      }
+      bool done = false;
+      for (auto it = tasks.begin(); it != tasks.end();) {
+        if (it->step()) {
+          it->on_complete();
+          it = tasks.erase(it);
+          done = true;
+        } else {
+          ++it;
+        }
+      }
+      idle = done ? 0 : idle + 1;
+      if (idle > 2000) {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      } else if (idle > 1000) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  ShmReducer reducer_;
+  std::unordered_map<int, KeyState> keys_;
+  std::thread progress_;
+  /*! \brief guards incoming_ and stop_ */
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::list<Task> incoming_;
+  bool stop_ = false;
+};
+
+/*!
+ * \brief KVStore::Create that also knows "shm". The factory in libmxnet
+ *  (src/kvstore/kvstore.cc) does not, so create stores through this one
+ *  to select KVStoreShm by name.
+ * \param type "shm", or any type KVStore::Create accepts
+ * \return a new created KVStore.
+ */
+inline KVStore *Create(const char *type = "local") {
+  if (std::string(type) == "shm") return new KVStoreShm();
+  return KVStore::Create(type);
+}
+
+}  // namespace kvstore
+}  // namespace mxnet
+#endif  // MXNET_KVSTORE_SHM_H_
@@ -0,0 +1,336 @@
+/*!
+ * Copyright (c) 2017 by Contributors
+ * \file numa.h
+ * \brief NUMA topology, thread placement, node-aware CPU memory and
+ *  per-node worker pools.
+ *
+ *  Configured through environment variables:
+ *  - MXNET_NUMA_SIMULATE_NODES: split the CPUs into this many nodes when the
+ *    machine has fewer, e.g. to try the scheduling on a single-socket box.
+ *  - MXNET_NUMA_WORKERS_PER_NODE: worker threads per node, 0 (default) for
+ *    one per CPU of the node.
+ *  - MXNET_NUMA_BIND_THREADS: pin workers to the CPUs of their node
+ *    (default 1).
+ *  - MXNET_NUMA_MEMORY_POLICY: placement of CPU memory, "first_touch"
+ *    (default), "interleave" or "none"; see MemoryPolicy.
+ */
+#ifndef MXNET_NUMA_H_
+#define MXNET_NUMA_H_
+
+#include <dmlc/base.h>
+#include <dmlc/logging.h>
+#include <dmlc/parameter.h>
+#if DMLC_USE_CXX11
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#endif
+#include <cstdlib>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace mxnet {
+namespace numa {
+
+#if DMLC_USE_CXX11
+/*!
+ * \brief The NUMA nodes of the machine and their CPUs, read from
+ *  /sys/devices/system/node. Machines without that information have a
+ *  single node holding every CPU.
+ */
+class Topology {
+ public:
+  /*! \return the topology of this machine, detected once */
+  static const Topology &Get() {
+    static Topology inst(dmlc::GetEnv("MXNET_NUMA_SIMULATE_NODES", 0));
+    return inst;
+  }
+  /*!
+   * \brief detect the topology
+   * \param simulate_nodes if the machine has fewer nodes than this, split
+   *  its CPUs evenly into this many simulated ones
+   */
+  explicit Topology(int simulate_nodes = 0) {
+#ifdef __linux__
+    for (int node = 0;; ++node) {
+      std::ifstream is("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+      if (!is) break;
+      std::string list;
+      std::getline(is, list);
+      cpus_.push_back(ParseCpuList(list));
+    }
+#endif
+    std::vector<int> all;
+    for (const std::vector<int> &cpus : cpus_) all.insert(all.end(), cpus.begin(), cpus.end());
+    if (all.empty()) {
+      const int num_cpus = std::max(1u, std::thread::hardware_concurrency());
+      for (int cpu = 0; cpu < num_cpus; ++cpu) all.push_back(cpu);
+      cpus_.assign(1, all);
+    }
+    if (simulate_nodes > num_nodes()) {
+      LOG(INFO) << "Simulating " << simulate_nodes << " NUMA nodes on " << all.size()
+                << " CPUs";
+      cpus_.assign(simulate_nodes, std::vector<int>());
+      for (size_t i = 0; i < all.size(); ++i) {
+        cpus_[i * simulate_nodes / all.size()].push_back(all[i]);
+      }
+      // fewer CPUs than nodes: let the extra nodes share them
+      for (int node = 0; node < simulate_nodes; ++node) {
+        if (cpus_[node].empty()) cpus_[node].push_back(all[node % all.size()]);
+      }
+      simulated_ = true;
+    }
+  }
+  /*! \return number of nodes */
+  inline int num_nodes() const { return static_cast<int>(cpus_.size()); }
+  /*! \return CPUs of a node */
+  inline const std::vector<int> &cpus(int node) const { return cpus_[node]; }
+  /*! \return whether the nodes are simulated, so memory cannot be bound to them */
+  inline bool simulated() const { return simulated_; }
+  /*! \return node of a CPU, or 0 if unknown */
+  int NodeOfCpu(int cpu) const {
+    for (int node = 0; node < num_nodes(); ++node) {
+      for (int c : cpus_[node]) {
+        if (c == cpu) return node;
+      }
+    }
+    return 0;
+  }
+  /*! \return node the calling thread runs on */
+  int CurrentNode() const {
+#ifdef __linux__
+    const int cpu = sched_getcpu();
+    if (cpu >= 0) return NodeOfCpu(cpu);
+#endif
+    return 0;
+  }
+
+ private:
+  // parse e.g. "0-3,8-11"
+  static std::vector<int> ParseCpuList(const std::string &list) {
+    std::vector<int> cpus;
+    std::istringstream is(list);
+    std::string range;
+    while (std::getline(is, range, ',')) {
+      if (range.empty()) continue;
+      const size_t dash = range.find('-');
+      const int first = std::atoi(range.substr(0, dash).c_str());
+      const int last = dash == std::string::npos ? first :
+          std::atoi(range.substr(dash + 1).c_str());
+      for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+  }
+
+  std::vector<std::vector<int> > cpus_;
+  bool simulated_{false};
+};
+
+/*!
+ * \brief Pin the calling thread to the CPUs of a node.
+ * \return whether it succeeded
+ */
+inline bool BindCurrentThread(int node) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : Topology::Get().cpus(node)) CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+  return false;
+#endif
+}
+
+/*! \brief Where CPU memory is placed. */
+enum class MemoryPolicy {
+  /*! \brief plain posix_memalign, as the default CPU storage does */
+  kNone,
+  /*!
+   * \brief Large blocks are mapped but not touched, so each page lands on
+   *  the node of the thread that first writes it. Pair with an engine that
+   *  runs the writers of a buffer on one node (NumaEngine).
+   */
+  kFirstTouch,
+  /*! \brief large blocks are interleaved page by page across all nodes */
+  kInterleave
+};
+
+/*! \return the policy named by MXNET_NUMA_MEMORY_POLICY */
+inline MemoryPolicy MemoryPolicyFromEnv() {
+  const std::string name = dmlc::GetEnv("MXNET_NUMA_MEMORY_POLICY", std::string("first_touch"));
+  if (name == "first_touch") return MemoryPolicy::kFirstTouch;
+  if (name == "interleave") return MemoryPolicy::kInterleave;
+  CHECK_EQ(name, "none") << "Unknown MXNET_NUMA_MEMORY_POLICY " << name;
+  return MemoryPolicy::kNone;
+}
+
+/*! \brief blocks from this size on are mapped page-wise under a NUMA policy */
+const size_t kMinMappedBytes = 1 << 16;
+/*! \brief alignment of smaller blocks, as in the default CPU storage */
+const size_t kAlignment = 16;
+
+/*!
+ * \brief Allocate CPU memory under a placement policy.
+ * \param size bytes
+ * \param policy placement; Free must be given the same one
+ * \param node if >= 0, bind the block to this node instead of applying the
+ *  policy (ignored on simulated nodes)
+ */
+inline void *Alloc(size_t size, MemoryPolicy policy, int node = -1) {
+#ifdef __linux__
+  if (policy != MemoryPolicy::kNone && size >= kMinMappedBytes) {
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) LOG(FATAL) << "Failed to map " << size << " bytes";
+    const Topology &topo = Topology::Get();
+    if (!topo.simulated() && topo.num_nodes() > 1 &&
+        (node >= 0 || policy == MemoryPolicy::kInterleave)) {
+      // mbind(2) through syscall to avoid depending on libnuma
+      const int kMpolBind = 2, kMpolInterleave = 3;
+      const size_t kBits = 8 * sizeof(unsigned long);  // NOLINT(runtime/int)
+      std::vector<unsigned long> mask(topo.num_nodes() / kBits + 1, 0);  // NOLINT(runtime/int)
+      for (int n = 0; n < topo.num_nodes(); ++n) {
+        if (node < 0 || n == node) mask[n / kBits] |= 1UL << (n % kBits);
+      }
+      if (syscall(SYS_mbind, ptr, size, node >= 0 ? kMpolBind : kMpolInterleave, mask.data(),
+                  mask.size() * kBits, 0) != 0) {
+        LOG(WARNING) << "mbind failed, falling back to first touch placement";
+      }
+    }
+    return ptr;
+  }
+#endif
+  void *ptr;
+  const int ret = posix_memalign(&ptr, kAlignment, size);
+  if (ret != 0) LOG(FATAL) << "Failed to allocate CPU Memory";
+  return ptr;
+}
+
+/*! \brief Free memory from Alloc with the same size and policy. */
+inline void Free(void *ptr, size_t size, MemoryPolicy policy) {
+#ifdef __linux__
+  if (policy != MemoryPolicy::kNone && size >= kMinMappedBytes) {
+    munmap(ptr, size);
+    return;
+  }
+#endif
+  free(ptr);
+}
+
+/*!
+ * \brief One pool of worker threads per node, each pinned to its node's
+ *  CPUs, running the functions pushed to that node in order.
+ */
+class WorkerPools {
+ public:
+  /*!
+   * \param threads_per_node workers per node, 0 for one per CPU of the node
+   * \param bind whether to pin workers to their node
+   */
+  WorkerPools(int threads_per_node, bool bind) {
+    const Topology &topo = Topology::Get();
+    pools_.reserve(topo.num_nodes());
+    for (int node = 0; node < topo.num_nodes(); ++node) {
+      pools_.emplace_back(new Pool());
+      const int num_threads = threads_per_node > 0 ? threads_per_node :
+          static_cast<int>(topo.cpus(node).size());
+      for (int i = 0; i < num_threads; ++i) {
+        pools_[node]->threads.emplace_back([this, node, bind]() {
+            if (bind && !BindCurrentThread(node)) {
+              LOG(WARNING) << "Cannot bind worker to NUMA node " << node;
+            }
+            Work(pools_[node].get());
+          });
+      }
+    }
+  }
+  /*! \brief pools sized and pinned by the environment */
+  WorkerPools()
+      : WorkerPools(dmlc::GetEnv("MXNET_NUMA_WORKERS_PER_NODE", 0),
+                    dmlc::GetEnv("MXNET_NUMA_BIND_THREADS", true)) {}
+  ~WorkerPools() {
+    for (auto &pool : pools_) {
+      {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->stop = true;
+      }
+      pool->cond.notify_all();
+    }
+    for (auto &pool : pools_) {
+      for (std::thread &t : pool->threads) t.join();
+    }
+  }
+  /*! \return number of pools */
+  inline int num_nodes() const { return static_cast<int>(pools_.size()); }
+  /*!
+   * \brief run fn on a worker of a node
+   * \param prioritized run it before everything queued on the node
+   */
+  void Push(int node, std::function<void()> fn, bool prioritized = false) {
+    Pool *pool = pools_[node].get();
+    ++pool->load;
+    {
+      std::lock_guard<std::mutex> lock(pool->mutex);
+      if (prioritized) {
+        pool->queue.push_front(std::move(fn));
+      } else {
+        pool->queue.push_back(std::move(fn));
+      }
+    }
+    pool->cond.notify_one();
+  }
+  /*! \return functions queued or running on a node */
+  inline int load(int node) const { return pools_[node]->load; }
+  /*! \return the node with the least load */
+  int LeastLoaded() const {
+    int best = 0;
+    for (int node = 1; node < num_nodes(); ++node) {
+      if (load(node) < load(best)) best = node;
+    }
+    return best;
+  }
+
+ private:
+  struct Pool {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::function<void()> > queue;
+    std::vector<std::thread> threads;
+    std::atomic<int> load{0};
+    bool stop{false};
+  };
+
+  static void Work(Pool *pool) {
+    while (true) {
+      std::function<void()> fn;
+      {
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        pool->cond.wait(lock, [pool]() { return pool->stop || !pool->queue.empty(); });
+        if (pool->queue.empty()) return;
+        fn = std::move(pool->queue.front());
+        pool->queue.pop_front();
+      }
+      fn();
+      --pool->load;
+    }
+  }
+
+  std::vector<std::unique_ptr<Pool> > pools_;
+};
+#endif  // DMLC_USE_CXX11
+}  // namespace numa
+}  // namespace mxnet
+#endif  // MXNET_NUMA_H_
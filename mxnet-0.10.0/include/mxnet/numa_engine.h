@@ -0,0 +1,299 @@
+/*!
+ * Copyright (c) 2017 by Contributors
+ * \file numa_engine.h
+ * \brief Engine and CPU storage that keep operators on the NUMA node of the
+ *  memory they use.
+ */
+#ifndef MXNET_NUMA_ENGINE_H_
+#define MXNET_NUMA_ENGINE_H_
+
+#include <dmlc/base.h>
+#include <dmlc/logging.h>
+#include <dmlc/parameter.h>
+#if DMLC_USE_CXX11
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#endif
+#include "./engine.h"
+#include "./numa.h"
+#include "./storage.h"
+
+namespace mxnet {
+namespace engine {
+
+#if DMLC_USE_CXX11
+/*!
+ * \brief Engine that leaves dependency tracking to another engine but runs
+ *  CPU operators on per-node worker pools (numa::WorkerPools).
+ *
+ *  Every variable gets a home node the first time an operator writes it:
+ *  the least loaded node at that point. Later operators run on the home of
+ *  the first of their mutable variables that has one, else of their const
+ *  variables. With first-touch placement (NumaStorage) the pages of an
+ *  array thus land on the node that keeps using them.
+ *
+ *  CPU operations pushed with PushAsync reach the underlying engine as
+ *  FnProperty::kAsync, so they don't hold one of its workers while they
+ *  run. Those created with NewOperator keep their property, since their
+ *  device is only known at Push; they hand off from the worker they get.
+ *  GPU operations, copies and operations that are asynchronous already
+ *  run as before.
+ *
+ *  NaiveEngine (MXNET_ENGINE_TYPE=NaiveEngine) requires every operation to
+ *  complete before Push returns, so over it NumaEngine runs everything
+ *  inline through the base engine and starts no workers.
+ */
+class NumaEngine : public Engine {
+ public:
+  /*!
+   * \param base the engine that tracks dependencies and runs non-CPU work
+   * \param pools the CPU workers, by default sized from the environment
+   * \param synchronous whether base completes operations before Push
+   *  returns; then nothing is handed to the workers
+   */
+  explicit NumaEngine(std::shared_ptr<Engine> base,
+                      std::shared_ptr<numa::WorkerPools> pools = nullptr,
+                      bool synchronous = BaseIsNaive())
+      : base_(std::move(base)), synchronous_(synchronous) {
+    if (!synchronous_) {
+      pools_ = pools ? std::move(pools) : std::make_shared<numa::WorkerPools>();
+    }
+  }
+  /*! \return whether the engine singleton is NaiveEngine, as Engine::Get picks it */
+  static bool BaseIsNaive() {
+    return dmlc::GetEnv("MXNET_ENGINE_TYPE", std::string("ThreadedEnginePerDevice")) ==
+        "NaiveEngine";
+  }
+  /*! \return the worker pools, nullptr when synchronous */
+  inline numa::WorkerPools *pools() const { return pools_.get(); }
+  /*! \return home node of a variable, or -1 if it was not written yet */
+  int HomeOf(VarHandle var) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = home_.find(var);
+    return it == home_.end() ? -1 : it->second;
+  }
+
+  // Engine interface.
+  void NotifyShutdown() override { base_->NotifyShutdown(); }
+  VarHandle NewVariable() override { return base_->NewVariable(); }
+  OprHandle NewOperator(AsyncFn fn,
+                        std::vector<VarHandle> const& const_vars,
+                        std::vector<VarHandle> const& mutable_vars,
+                        FnProperty prop = FnProperty::kNormal,
+                        const char* opr_name = nullptr) override {
+    if (synchronous_ || !Routable(prop)) {
+      return base_->NewOperator(fn, const_vars, mutable_vars, prop, opr_name);
+    }
+    const bool prioritized = prop == FnProperty::kCPUPrioritized;
+    return base_->NewOperator(
+        [this, fn, const_vars, mutable_vars, prioritized](RunContext ctx,
+                                                          CallbackOnComplete on_complete) {
+          // CPU workers run without a stream
+          if (ctx.stream != nullptr) {
+            fn(ctx, on_complete);
+            return;
+          }
+          const int node = Place(const_vars, mutable_vars);
+          pools_->Push(node, [fn, ctx, on_complete]() { fn(ctx, on_complete); }, prioritized);
+        }, const_vars, mutable_vars, prop, opr_name);
+  }
+  void DeleteOperator(OprHandle op) override { base_->DeleteOperator(op); }
+  void Push(OprHandle op, Context exec_ctx, int priority = 0,
+            bool profiling = false) override {
+    base_->Push(op, exec_ctx, priority, profiling);
+  }
+  void PushAsync(AsyncFn exec_fun, Context exec_ctx,
+                 std::vector<VarHandle> const& const_vars,
+                 std::vector<VarHandle> const& mutable_vars,
+                 FnProperty prop = FnProperty::kNormal,
+                 int priority = 0,
+                 const char* opr_name = nullptr) override {
+    if (synchronous_ || exec_ctx.dev_mask() != Context::kCPU || !Routable(prop)) {
+      base_->PushAsync(exec_fun, exec_ctx, const_vars, mutable_vars, prop, priority, opr_name);
+      return;
+    }
+    const bool prioritized = prop == FnProperty::kCPUPrioritized;
+    base_->PushAsync(
+        [this, exec_fun, const_vars, mutable_vars, prioritized](RunContext ctx,
+                                                                CallbackOnComplete on_complete) {
+          const int node = Place(const_vars, mutable_vars);
+          pools_->Push(node, [exec_fun, ctx, on_complete]() { exec_fun(ctx, on_complete); },
+                       prioritized);
+        }, exec_ctx, const_vars, mutable_vars, FnProperty::kAsync, priority, opr_name);
+  }
+  void DeleteVariable(SyncFn delete_fn, Context exec_ctx, VarHandle var) override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      home_.erase(var);
+    }
+    base_->DeleteVariable(delete_fn, exec_ctx, var);
+  }
+  void WaitForVar(VarHandle var) override { base_->WaitForVar(var); }
+  void WaitForAll() override { base_->WaitForAll(); }
+
+ private:
+  static bool Routable(FnProperty prop) {
+    return prop == FnProperty::kNormal || prop == FnProperty::kCPUPrioritized;
+  }
+  /*! \brief pick the node of an operation and home its unplaced outputs there */
+  int Place(const std::vector<VarHandle> &const_vars,
+            const std::vector<VarHandle> &mutable_vars) {
+    if (pools_->num_nodes() == 1) return 0;
+    std::lock_guard<std::mutex> lock(mutex_);
+    int node = -1;
+    for (const std::vector<VarHandle> *vars : {&mutable_vars, &const_vars}) {
+      for (VarHandle var : *vars) {
+        auto it = home_.find(var);
+        if (it != home_.end()) {
+          node = it->second;
+          break;
+        }
+      }
+      if (node >= 0) break;
+    }
+    if (node < 0) node = pools_->LeastLoaded();
+    for (VarHandle var : mutable_vars) home_.emplace(var, node);
+    return node;
+  }
+
+  std::shared_ptr<Engine> base_;
+  bool synchronous_;
+  std::shared_ptr<numa::WorkerPools> pools_;
+  /*! \brief guards home_ */
+  mutable std::mutex mutex_;
+  std::unordered_map<VarHandle, int> home_;
+};
+#endif  // DMLC_USE_CXX11
+}  // namespace engine
+
+#if DMLC_USE_CXX11
+/*!
+ * \brief Storage that allocates CPU memory under a NUMA placement policy
+ *  (numa::MemoryPolicy, MXNET_NUMA_MEMORY_POLICY by default) and forwards
+ *  everything else to another storage.
+ *
+ *  Freed CPU blocks that were mapped page-wise (numa::kMinMappedBytes and
+ *  up) are kept on a free list per node, by size rounded up to a page, and
+ *  only handed out again to threads running on that node: under first-touch
+ *  placement a recycled block keeps the pages of its first user. A block
+ *  belongs to the node its first page is on, or, where that cannot be asked
+ *  (simulated nodes), to the node of the thread that allocated it. Smaller
+ *  blocks, and all blocks under MemoryPolicy::kNone, are freed directly.
+ */
+class NumaStorage : public Storage {
+ public:
+  /*!
+   * \param base storage for non-CPU contexts
+   * \param policy placement of CPU memory
+   */
+  explicit NumaStorage(std::shared_ptr<Storage> base,
+                       numa::MemoryPolicy policy = numa::MemoryPolicyFromEnv())
+      : base_(std::move(base)), policy_(policy),
+        free_(policy == numa::MemoryPolicy::kFirstTouch ?
+              numa::Topology::Get().num_nodes() : 1) {}
+  ~NumaStorage() { ReleaseAll(); }
+  /*! \return the placement policy */
+  inline numa::MemoryPolicy policy() const { return policy_; }
+  Handle Alloc(size_t size, Context ctx) override {
+    if (ctx.dev_type != Context::kCPU) return base_->Alloc(size, ctx);
+    Handle handle;
+    handle.size = size;
+    handle.ctx = ctx;
+    handle.dptr = nullptr;
+    if (size == 0) return handle;
+    if (!Pooled(size)) {
+      handle.dptr = numa::Alloc(size, policy_);
+      return handle;
+    }
+    const int node = free_.size() == 1 ? 0 : numa::Topology::Get().CurrentNode();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::vector<void*> &blocks = free_[node][RoundSize(size)];
+      if (!blocks.empty()) {
+        handle.dptr = blocks.back();
+        blocks.pop_back();
+      }
+    }
+    if (handle.dptr == nullptr) handle.dptr = numa::Alloc(RoundSize(size), policy_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    allocated_on_[handle.dptr] = node;
+    return handle;
+  }
+  void Free(Handle handle) override {
+    if (handle.ctx.dev_type != Context::kCPU) {
+      base_->Free(handle);
+    } else if (handle.dptr != nullptr && !Pooled(handle.size)) {
+      numa::Free(handle.dptr, handle.size, policy_);
+    } else if (handle.dptr != nullptr) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = allocated_on_.find(handle.dptr);
+      CHECK(it != allocated_on_.end()) << "Freeing a block NumaStorage did not allocate";
+      int node = it->second;
+      allocated_on_.erase(it);
+      if (free_.size() > 1) node = PageNode(handle.dptr, node);
+      free_[node][RoundSize(handle.size)].push_back(handle.dptr);
+    }
+  }
+  void DirectFree(Handle handle) override {
+    if (handle.ctx.dev_type != Context::kCPU) {
+      base_->DirectFree(handle);
+    } else if (handle.dptr != nullptr) {
+      if (Pooled(handle.size)) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        allocated_on_.erase(handle.dptr);
+      }
+      numa::Free(handle.dptr, RoundSize(handle.size), policy_);
+    }
+  }
+  /*! \brief return every pooled CPU block to the system */
+  void ReleaseAll() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto &node : free_) {
+      for (auto &blocks : node) {
+        for (void *ptr : blocks.second) numa::Free(ptr, blocks.first, policy_);
+      }
+      node.clear();
+    }
+  }
+
+ private:
+  /*! \brief page size that pooled blocks are rounded up to */
+  static const size_t kPageBytes = 4096;
+  inline bool Pooled(size_t size) const {
+    return policy_ != numa::MemoryPolicy::kNone && size >= numa::kMinMappedBytes;
+  }
+  static inline size_t RoundSize(size_t size) {
+    return (size + kPageBytes - 1) / kPageBytes * kPageBytes;
+  }
+  /*! \return node holding the first page of a block, or fallback if unknown */
+  static int PageNode(void *ptr, int fallback) {
+#ifdef __linux__
+    if (!numa::Topology::Get().simulated()) {
+      // get_mempolicy(2) through syscall to avoid depending on libnuma
+      const unsigned long kMpolFNode = 1, kMpolFAddr = 2;  // NOLINT(runtime/int)
+      int node = -1;
+      if (syscall(SYS_get_mempolicy, &node, nullptr, 0, ptr, kMpolFNode | kMpolFAddr) == 0 &&
+          node >= 0 && node < numa::Topology::Get().num_nodes()) {
+        return node;
+      }
+    }
+#endif
+    return fallback;
+  }
+
+  std::shared_ptr<Storage> base_;
+  numa::MemoryPolicy policy_;
+  /*! \brief guards free_ and allocated_on_ */
+  std::mutex mutex_;
+  /*! \brief free blocks by node and rounded size */
+  std::vector<std::unordered_map<size_t, std::vector<void*> > > free_;
+  /*! \brief node every pooled block in use was allocated for */
+  std::unordered_map<void*, int> allocated_on_;
+};
+#endif  // DMLC_USE_CXX11
+}  // namespace mxnet
+#endif  // MXNET_NUMA_ENGINE_H_
@@ -0,0 +1,582 @@
+/*!
+ *  Copyright (c) 2017 by Contributors
+ * \file planned_predictor.h
+ * \brief Inference with a static, liveness-based memory plan.
+ *
+ *  A bound executor keeps a buffer for most intermediate results. For
+ *  inference every result dies as soon as its last reader ran, so a
+ *  PlannedPredictor plans all intermediates of the graph into one arena up
+ *  front: results whose lifetimes do not overlap share memory, and
+ *  elementwise operators write over their input when that input is not read
+ *  again. plan_report() compares the arena with one buffer per result.
+ *
+ *  The graph is run node by node through MXImperativeInvoke with views of
+ *  the arena as outputs, so only the public C API is used. Float32 models
+ *  only; one PlannedPredictor must only be used by one thread at a time.
+ */
+#ifndef MXNET_PLANNED_PREDICTOR_H_
+#define MXNET_PLANNED_PREDICTOR_H_
+
+#include <dmlc/json.h>
+#include <dmlc/logging.h>
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "./c_api.h"
+#include "./shared_predictor.h"
+
+namespace mxnet {
+
+/*! \brief Memory of a plan, against one buffer per planned result. */
+struct MemoryPlanReport {
+  /*! \brief planned results, i.e. operator outputs */
+  size_t num_entries = 0;
+  /*! \brief results written over one of their inputs */
+  size_t num_inplace = 0;
+  /*! \brief distinct buffers in the arena */
+  size_t num_buffers = 0;
+  /*! \brief bytes with one buffer per result */
+  size_t naive_bytes = 0;
+  /*! \brief bytes of the arena */
+  size_t planned_bytes = 0;
+};
+
+/*!
+ * \brief Assigns results of a sequence of operations to offsets in one
+ *  arena, sharing memory between results whose lifetimes do not overlap.
+ *
+ *  Operations are visited in execution order. A result with the in-place
+ *  hint takes over the buffer of an input of the same size that is read for
+ *  the last time by the same operation. Any other result takes the free
+ *  buffer closest in size above it (within kMatchRange), else grows the
+ *  largest free one below it, else gets a new buffer. Inputs go back to the
+ *  free list after the operation that reads them last, so an operation's
+ *  outputs never share memory with its inputs except in place.
+ */
+class StaticMemoryPlanner {
+ public:
+  /*! \brief free buffers more than this many times too large are not reused */
+  static const size_t kMatchRange = 16;
+
+  /*! \brief one operation, in execution order */
+  struct Step {
+    /*! \brief planned results read; -1 for anything else, e.g. weights */
+    std::vector<int> inputs;
+    /*! \brief planned results written */
+    std::vector<int> outputs;
+    /*! \brief whether output 0 may be written over an input */
+    bool inplace = false;
+  };
+
+  /*!
+   * \brief plan
+   * \param entry_sizes elements of every result
+   * \param steps the operations, each result written by exactly one
+   * \param keep results needed after the last step, e.g. the outputs
+   * \param element_bytes bytes per element
+   * \param align buffers start at multiples of this many elements
+   */
+  StaticMemoryPlanner(const std::vector<size_t> &entry_sizes, const std::vector<Step> &steps,
+                      const std::vector<int> &keep, size_t element_bytes = sizeof(mx_float),
+                      size_t align = 16)
+      : offsets_(entry_sizes.size(), 0) {
+    const int kForever = INT_MAX;
+    std::vector<int> last_use(entry_sizes.size(), -1);
+    for (size_t s = 0; s < steps.size(); ++s) {
+      for (int e : steps[s].outputs) last_use[e] = static_cast<int>(s);
+      for (int e : steps[s].inputs) {
+        if (e >= 0) last_use[e] = std::max(last_use[e], static_cast<int>(s));
+      }
+    }
+    for (int e : keep) last_use[e] = kForever;
+
+    std::vector<int> buffer_of(entry_sizes.size(), -1);
+    std::vector<size_t> buffer_size;
+    std::vector<int> refs;
+    std::multimap<size_t, int> free;
+    auto release = [&](int e) {
+      const int b = buffer_of[e];
+      if (--refs[b] == 0) free.emplace(buffer_size[b], b);
+    };
+    for (size_t s = 0; s < steps.size(); ++s) {
+      const Step &step = steps[s];
+      std::vector<int> inputs;
+      for (int e : step.inputs) {
+        if (e >= 0 && std::find(inputs.begin(), inputs.end(), e) == inputs.end()) {
+          inputs.push_back(e);
+        }
+      }
+      for (size_t k = 0; k < step.outputs.size(); ++k) {
+        const int e = step.outputs[k];
+        const size_t size = entry_sizes[e];
+        report_.naive_bytes += size * element_bytes;
+        ++report_.num_entries;
+        if (k == 0 && step.inplace) {
+          for (int in : inputs) {
+            if (last_use[in] == static_cast<int>(s) && entry_sizes[in] == size &&
+                refs[buffer_of[in]] == 1) {
+              buffer_of[e] = buffer_of[in];
+              ++refs[buffer_of[e]];
+              ++report_.num_inplace;
+              break;
+            }
+          }
+          if (buffer_of[e] >= 0) continue;
+        }
+        auto it = free.lower_bound(size);
+        if (it != free.end() && it->first <= size * kMatchRange) {
+          buffer_of[e] = it->second;
+          free.erase(it);
+        } else if (it != free.begin() && std::prev(it)->first * kMatchRange >= size) {
+          --it;
+          buffer_of[e] = it->second;
+          buffer_size[it->second] = size;
+          free.erase(it);
+        } else {
+          buffer_of[e] = static_cast<int>(buffer_size.size());
+          buffer_size.push_back(size);
+          refs.push_back(0);
+        }
+        refs[buffer_of[e]] = 1;
+      }
+      for (int e : inputs) {
+        if (last_use[e] == static_cast<int>(s)) release(e);
+      }
+      for (int e : step.outputs) {
+        if (last_use[e] == static_cast<int>(s)) release(e);
+      }
+    }
+
+    std::vector<size_t> buffer_offset(buffer_size.size());
+    for (size_t b = 0; b < buffer_size.size(); ++b) {
+      buffer_offset[b] = arena_size_;
+      arena_size_ += (buffer_size[b] + align - 1) / align * align;
+    }
+    for (size_t e = 0; e < entry_sizes.size(); ++e) {
+      if (buffer_of[e] >= 0) offsets_[e] = buffer_offset[buffer_of[e]];
+    }
+    report_.num_buffers = buffer_size.size();
+    report_.planned_bytes = arena_size_ * element_bytes;
+  }
+  /*! \return offset of every result in the arena, in elements */
+  const std::vector<size_t> &offsets() const { return offsets_; }
+  /*! \return elements of the arena */
+  size_t arena_size() const { return arena_size_; }
+  /*! \return the summary */
+  const MemoryPlanReport &report() const { return report_; }
+
+ private:
+  std::vector<size_t> offsets_;
+  size_t arena_size_ = 0;
+  MemoryPlanReport report_;
+};
+
+/*!
+ * \brief Runs a PredictorModel for fixed input shapes with all
+ *  intermediate results in one planned arena.
+ *
+ *  Same calls as PredictorContext, without Reshape: create another
+ *  PlannedPredictor for other shapes.
+ */
+class PlannedPredictor {
+ public:
+  /*! \brief shape of each input node, e.g. {{"data", {1, 3, 224, 224}}} */
+  typedef PredictorContext::InputShapes InputShapes;
+
+  /*!
+   * \brief plan and allocate
+   * \param model the shared model; must be float32
+   * \param input_shapes shapes of the input nodes
+   */
+  PlannedPredictor(std::shared_ptr<const PredictorModel> model, const InputShapes &input_shapes)
+      : model_(model), arena_(nullptr) {
+    Graph graph = LoadGraph();
+    std::vector<ShapeList> entry_shapes = InferShapes(graph, input_shapes);
+    CreateVariables(graph, input_shapes);
+
+    // planned results: the outputs of every operator node
+    std::vector<std::vector<int> > entry_id(graph.nodes.size());
+    std::vector<size_t> entry_sizes;
+    std::vector<std::vector<mx_uint> > shapes;
+    for (size_t i = 0; i < graph.nodes.size(); ++i) {
+      if (graph.nodes[i].op == "null") continue;
+      for (const std::vector<mx_uint> &shape : entry_shapes[i]) {
+        entry_id[i].push_back(static_cast<int>(entry_sizes.size()));
+        size_t size = 1;
+        for (mx_uint d : shape) size *= d;
+        entry_sizes.push_back(size);
+        shapes.push_back(shape);
+      }
+    }
+    std::vector<StaticMemoryPlanner::Step> steps;
+    for (size_t i = 0; i < graph.nodes.size(); ++i) {
+      const GraphNode &node = graph.nodes[i];
+      if (node.op == "null") continue;
+      StaticMemoryPlanner::Step step;
+      step.inplace = IsElementwise(node.op);
+      step.outputs = entry_id[i];
+      steps_.emplace_back();
+      OpStep &op = steps_.back();
+      op.creator = Creator(node.op);
+      for (const auto &kv : node.attrs) {
+        // hidden attributes such as __lr_mult__ are not operator parameters
+        if (kv.first.compare(0, 2, "__") == 0) continue;
+        op.keys.push_back(kv.first);
+        op.vals.push_back(kv.second);
+      }
+      for (const std::vector<int> &input : node.inputs) {
+        const GraphNode &src = graph.nodes[input[0]];
+        if (src.op == "null") {
+          step.inputs.push_back(-1);
+          op.inputs.push_back(Variable(src.name));
+        } else {
+          CHECK_LT(input[1], static_cast<int>(entry_id[input[0]].size()))
+              << "Hidden output of " << src.name << " used as input";
+          step.inputs.push_back(entry_id[input[0]][input[1]]);
+          op.inputs.push_back(nullptr);  // filled in with the view below
+        }
+      }
+      steps.push_back(step);
+    }
+    std::vector<int> keep;
+    for (const std::vector<int> &head : graph.heads) {
+      CHECK_NE(graph.nodes[head[0]].op, "null") << "Outputs must be operator results";
+      keep.push_back(entry_id[head[0]][head[1]]);
+    }
+
+    StaticMemoryPlanner plan(entry_sizes, steps, keep);
+    report_ = plan.report();
+    CreateViews(plan, shapes);
+    for (size_t s = 0; s < steps_.size(); ++s) {
+      for (size_t k = 0; k < steps[s].inputs.size(); ++k) {
+        if (steps[s].inputs[k] >= 0) steps_[s].inputs[k] = views_[steps[s].inputs[k]];
+      }
+      for (int e : steps[s].outputs) steps_[s].outputs.push_back(views_[e]);
+      for (size_t k = 0; k < steps_[s].keys.size(); ++k) {
+        steps_[s].key_ptrs.push_back(steps_[s].keys[k].c_str());
+        steps_[s].val_ptrs.push_back(steps_[s].vals[k].c_str());
+      }
+    }
+    for (int e : keep) outputs_.push_back(views_[e]);
+  }
+  ~PlannedPredictor() {
+    for (NDArrayHandle view : views_) MXNDArrayFree(view);
+    if (arena_ != nullptr) MXNDArrayFree(arena_);
+    for (NDArrayHandle array : owned_) MXNDArrayFree(array);
+  }
+
+  /*! \return the model this predictor runs */
+  const std::shared_ptr<const PredictorModel> &model() const { return model_; }
+  /*! \return the memory plan against one buffer per result */
+  const MemoryPlanReport &plan_report() const { return report_; }
+  /*! \return number of outputs */
+  mx_uint num_outputs() const { return outputs_.size(); }
+  /*!
+   * \brief set an input, as MXPredSetInput
+   * \param key The name of the input node.
+   * \param data The input data.
+   * \param size The number of elements in data, used for safety check.
+   */
+  void SetInput(const std::string &key, const mx_float *data, mx_uint size) {
+    auto it = inputs_.find(key);
+    CHECK(it != inputs_.end()) << "cannot find input key " << key;
+    MXNET_PREDICT_CALL(MXNDArraySyncCopyFromCPU(it->second, data, size));
+  }
+  /*! \brief run a forward pass, as MXPredForward */
+  void Forward() {
+    for (OpStep &op : steps_) {
+      int num_outputs = static_cast<int>(op.outputs.size());
+      NDArrayHandle *outputs = op.outputs.data();
+      MXNET_PREDICT_CALL(MXImperativeInvoke(
+          op.creator, static_cast<int>(op.inputs.size()), op.inputs.data(), &num_outputs,
+          &outputs, static_cast<int>(op.key_ptrs.size()), op.key_ptrs.data(),
+          op.val_ptrs.data()));
+    }
+  }
+  /*! \return the shape of output index, as MXPredGetOutputShape */
+  std::vector<mx_uint> GetOutputShape(mx_uint index) const {
+    CHECK_LT(index, outputs_.size()) << "Index exceed number of outputs";
+    mx_uint ndim;
+    const mx_uint *shape;
+    MXNET_PREDICT_CALL(MXNDArrayGetShape(outputs_[index], &ndim, &shape));
+    return std::vector<mx_uint>(shape, shape + ndim);
+  }
+  /*!
+   * \brief copy output index out, as MXPredGetOutput
+   * \param index The index of output node.
+   * \param data User allocated data to hold the output.
+   * \param size The size of data array, used for safe checking.
+   */
+  void GetOutput(mx_uint index, mx_float *data, mx_uint size) const {
+    CHECK_LT(index, outputs_.size()) << "Output index out of range";
+    MXNET_PREDICT_CALL(MXNDArraySyncCopyToCPU(outputs_[index], data, size));
+  }
+
+ private:
+  typedef std::vector<std::vector<mx_uint> > ShapeList;
+
+  /*! \brief a node of the symbol JSON */
+  struct GraphNode {
+    std::string op;
+    std::string name;
+    std::map<std::string, std::string> attrs;
+    /*! \brief (node, output index, version) of every input */
+    std::vector<std::vector<int> > inputs;
+
+    void Load(dmlc::JSONReader *reader) {
+      std::string key;
+      reader->BeginObject();
+      while (reader->NextObjectItem(&key)) {
+        if (key == "op") {
+          reader->ReadString(&op);
+        } else if (key == "name") {
+          reader->ReadString(&name);
+        } else if (key == "inputs") {
+          reader->Read(&inputs);
+        } else if (key == "attr" || key == "attrs" || key == "param") {
+          std::map<std::string, std::string> more;
+          reader->Read(&more);
+          attrs.insert(more.begin(), more.end());
+        } else if (key == "control_deps") {
+          std::vector<int> deps;
+          reader->Read(&deps);
+        } else if (key == "backward_source_id") {
+          int id;
+          reader->ReadNumber(&id);
+        } else {
+          LOG(FATAL) << "Unknown key " << key << " in node " << name;
+        }
+      }
+    }
+  };
+  /*! \brief the symbol JSON; nodes are in topological order */
+  struct Graph {
+    std::vector<GraphNode> nodes;
+    std::vector<std::vector<int> > heads;
+  };
+  /*! \brief an operator call of Forward */
+  struct OpStep {
+    AtomicSymbolCreator creator;
+    std::vector<NDArrayHandle> inputs, outputs;
+    std::vector<std::string> keys, vals;
+    std::vector<const char*> key_ptrs, val_ptrs;
+  };
+
+  /*!
+   * \brief operators whose output i only depends on input element i, so
+   *  it can overwrite an input of the same size
+   */
+  static bool IsElementwise(const std::string &op) {
+    static const std::set<std::string> ops = {
+      "Activation", "LeakyReLU", "BatchNorm", "Dropout", "Flatten", "Reshape",
+      "flatten", "reshape", "BlockGrad", "_copy", "identity", "relu", "sigmoid", "tanh",
+      "elemwise_add", "elemwise_sub", "elemwise_mul", "_Plus", "_plus", "_Minus",
+      "_minus", "_Mul", "_mul", "_PlusScalar", "_plus_scalar", "_MinusScalar",
+      "_minus_scalar", "_MulScalar", "_mul_scalar", "_DivScalar", "_div_scalar",
+      "clip", "negative", "abs", "exp", "log", "sqrt", "square"};
+    return ops.count(op) != 0;
+  }
+
+  static AtomicSymbolCreator Creator(const std::string &op) {
+    static const std::map<std::string, AtomicSymbolCreator> creators = []() {
+      std::map<std::string, AtomicSymbolCreator> creators;
+      mx_uint size;
+      AtomicSymbolCreator *array;
+      MXNET_PREDICT_CALL(MXSymbolListAtomicSymbolCreators(&size, &array));
+      for (mx_uint i = 0; i < size; ++i) {
+        const char *name;
+        MXNET_PREDICT_CALL(MXSymbolGetAtomicSymbolName(array[i], &name));
+        creators[name] = array[i];
+      }
+      return creators;
+    }();
+    auto it = creators.find(op);
+    CHECK(it != creators.end()) << "Unknown operator " << op;
+    return it->second;
+  }
+
+  Graph LoadGraph() const {
+    const char *json;
+    MXNET_PREDICT_CALL(MXSymbolSaveToJSON(model_->symbol(), &json));
+    std::istringstream is(json);
+    dmlc::JSONReader reader(&is);
+    Graph graph;
+    std::string key;
+    reader.BeginObject();
+    while (reader.NextObjectItem(&key)) {
+      if (key == "nodes") {
+        reader.Read(&graph.nodes);
+      } else if (key == "heads") {
+        reader.Read(&graph.heads);
+      } else if (key == "arg_nodes" || key == "node_row_ptr") {
+        std::vector<int> ignored;
+        reader.Read(&ignored);
+      } else if (key == "attrs") {
+        // graph attributes, e.g. {"mxnet_version": ["int", 1000]}
+        std::string name, type;
+        reader.BeginObject();
+        while (reader.NextObjectItem(&name)) {
+          reader.BeginArray();
+          CHECK(reader.NextArrayItem());
+          reader.ReadString(&type);
+          CHECK(reader.NextArrayItem());
+          CHECK_EQ(type, "int") << "Unsupported graph attribute " << name;
+          int64_t value;
+          reader.ReadNumber(&value);
+          CHECK(!reader.NextArrayItem());
+        }
+      } else {
+        LOG(FATAL) << "Unknown key " << key << " in symbol JSON";
+      }
+    }
+    return graph;
+  }
+
+  /*!
+   * \return the shapes of the visible outputs of every node; the internals
+   *  list them node by node in the order of the JSON
+   */
+  std::vector<ShapeList> InferShapes(const Graph &graph, const InputShapes &input_shapes) {
+    SymbolHandle internals;
+    MXNET_PREDICT_CALL(MXSymbolGetInternals(model_->symbol(), &internals));
+    mx_uint num_names;
+    const char **names_data;
+    MXNET_PREDICT_CALL(MXSymbolListOutputs(internals, &num_names, &names_data));
+    // the node of every internal output, by name: output names cannot tell,
+    // as ops name their outputs freely (e.g. RNN's rnn_state)
+    std::vector<std::string> owners(num_names);
+    for (mx_uint i = 0; i < num_names; ++i) {
+      SymbolHandle output;
+      MXNET_PREDICT_CALL(MXSymbolGetOutput(internals, i, &output));
+      const char *name;
+      int success;
+      const int ret = MXSymbolGetName(output, &name, &success);
+      if (ret == 0 && success) owners[i] = name;
+      MXSymbolFree(output);
+      CHECK_EQ(ret, 0) << "MXSymbolGetName failed: " << MXGetLastError();
+      CHECK(success) << "Internal output " << i << " has no node name";
+    }
+    std::vector<const char*> keys;
+    std::vector<mx_uint> indptr(1, 0), shape_data;
+    for (auto &kv : input_shapes) {
+      keys.push_back(kv.first.c_str());
+      shape_data.insert(shape_data.end(), kv.second.begin(), kv.second.end());
+      indptr.push_back(shape_data.size());
+    }
+    mx_uint in_size, out_size, aux_size;
+    const mx_uint *in_ndim, *out_ndim, *aux_ndim;
+    const mx_uint **in_data, **out_data, **aux_data;
+    int complete;
+    const int ret = MXSymbolInferShape(
+        internals, keys.size(), keys.data(), indptr.data(), shape_data.data(), &in_size,
+        &in_ndim, &in_data, &out_size, &out_ndim, &out_data, &aux_size, &aux_ndim, &aux_data,
+        &complete);
+    MXSymbolFree(internals);
+    CHECK_EQ(ret, 0) << "MXSymbolInferShape failed: " << MXGetLastError();
+    CHECK(complete) << "The shape information of is not enough to get the shapes";
+    CHECK_EQ(out_size, owners.size());
+    for (mx_uint i = 0; i < in_size; ++i) {
+      arg_shapes_.emplace_back(in_data[i], in_data[i] + in_ndim[i]);
+    }
+    for (mx_uint i = 0; i < aux_size; ++i) {
+      aux_shapes_.emplace_back(aux_data[i], aux_data[i] + aux_ndim[i]);
+    }
+
+    std::vector<ShapeList> shapes(graph.nodes.size());
+    size_t next = 0;
+    for (size_t i = 0; i < graph.nodes.size(); ++i) {
+      const GraphNode &node = graph.nodes[i];
+      // a variable has exactly one output
+      while (next < owners.size() && owners[next] == node.name &&
+             (node.op != "null" || shapes[i].empty())) {
+        shapes[i].emplace_back(out_data[next], out_data[next] + out_ndim[next]);
+        ++next;
+      }
+      CHECK(!shapes[i].empty()) << "No output of node " << node.name << " in the internals";
+    }
+    CHECK_EQ(next, owners.size()) << "Internals do not match the graph";
+    return shapes;
+  }
+
+  /*!
+   * \brief Weights are the model's arrays; inputs, other arguments and
+   *  auxiliary states get arrays of their own.
+   */
+  void CreateVariables(const Graph &graph, const InputShapes &input_shapes) {
+    const PredictorModel &model = *model_;
+    for (size_t i = 0; i < model.arg_names().size(); ++i) {
+      const std::string &name = model.arg_names()[i];
+      NDArrayHandle array = model.arg_param(name);
+      if (array == nullptr) {
+        array = NewArray(arg_shapes_[i]);
+        if (input_shapes.count(name)) inputs_[name] = array;
+      }
+      variables_[name] = array;
+    }
+    for (size_t i = 0; i < model.aux_names().size(); ++i) {
+      const std::string &name = model.aux_names()[i];
+      NDArrayHandle array = NewArray(aux_shapes_[i]);
+      const std::vector<mx_float> *value = model.aux_param(name);
+      if (value != nullptr) {
+        MXNET_PREDICT_CALL(MXNDArraySyncCopyFromCPU(array, value->data(), value->size()));
+      }
+      variables_[name] = array;
+    }
+  }
+
+  NDArrayHandle Variable(const std::string &name) const {
+    auto it = variables_.find(name);
+    CHECK(it != variables_.end()) << "Unknown variable " << name;
+    return it->second;
+  }
+
+  NDArrayHandle NewArray(const std::vector<mx_uint> &shape) {
+    NDArrayHandle array;
+    MXNET_PREDICT_CALL(MXNDArrayCreate(shape.data(), shape.size(), model_->dev_type(),
+                                       model_->dev_id(), 0, &array));
+    owned_.push_back(array);
+    return array;
+  }
+
+  /*! \brief allocate the arena and a view of it for every result */
+  void CreateViews(const StaticMemoryPlanner &plan, const ShapeList &shapes) {
+    const mx_uint arena_shape = static_cast<mx_uint>(std::max<size_t>(plan.arena_size(), 1));
+    MXNET_PREDICT_CALL(MXNDArrayCreate(&arena_shape, 1, model_->dev_type(), model_->dev_id(),
+                                       0, &arena_));
+    for (size_t e = 0; e < shapes.size(); ++e) {
+      size_t size = 1;
+      for (mx_uint d : shapes[e]) size *= d;
+      NDArrayHandle slice, view;
+      MXNET_PREDICT_CALL(MXNDArraySlice(arena_, plan.offsets()[e], plan.offsets()[e] + size,
+                                        &slice));
+      std::vector<int> dims(shapes[e].begin(), shapes[e].end());
+      MXNET_PREDICT_CALL(MXNDArrayReshape(slice, dims.size(), dims.data(), &view));
+      MXNDArrayFree(slice);
+      views_.push_back(view);
+    }
+  }
+
+  std::shared_ptr<const PredictorModel> model_;
+  ShapeList arg_shapes_, aux_shapes_;
+  std::map<std::string, NDArrayHandle> variables_, inputs_;
+  /*! \brief arrays created for inputs, other arguments and auxiliary states */
+  std::vector<NDArrayHandle> owned_;
+  NDArrayHandle arena_;
+  /*! \brief view of the arena for every planned result */
+  std::vector<NDArrayHandle> views_;
+  std::vector<NDArrayHandle> outputs_;
+  std::vector<OpStep> steps_;
+  MemoryPlanReport report_;
+
+  PlannedPredictor(const PlannedPredictor&) = delete;
+  PlannedPredictor& operator=(const PlannedPredictor&) = delete;
+};
+
+}  // namespace mxnet
+#endif  // MXNET_PLANNED_PREDICTOR_H_
@@ -0,0 +1,297 @@
+/*!
+ * Copyright (c) 2017 by Contributors
+ * \file pooled_storage.h
+ * \brief CPU storage that pools freed blocks by size class.
+ */
+#ifndef MXNET_POOLED_STORAGE_H_
+#define MXNET_POOLED_STORAGE_H_
+
+#include <dmlc/base.h>
+#include <dmlc/logging.h>
+#include <dmlc/parameter.h>
+#if DMLC_USE_CXX11
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+#endif
+#include <cstdlib>
+#include "./storage.h"
+
+namespace mxnet {
+namespace storage {
+
+#if DMLC_USE_CXX11
+/*! \brief Counters of a PooledCPUStorage. */
+struct CPUPoolStats {
+  /*! \brief bytes handed out and not freed yet, counted by size class */
+  uint64_t bytes_in_use{0};
+  /*! \brief bytes kept for reuse, including the per-thread caches */
+  uint64_t bytes_pooled{0};
+  /*! \brief largest bytes_in_use + bytes_pooled so far */
+  uint64_t peak_bytes{0};
+  /*! \brief allocations, and those served from the pool */
+  uint64_t num_allocs{0};
+  uint64_t num_hits{0};
+  /*! \brief blocks returned to the system by the high-water policy */
+  uint64_t num_trimmed{0};
+  /*! \return fraction of allocations served from the pool */
+  inline double hit_ratio() const {
+    return num_allocs == 0 ? 0.0 : static_cast<double>(num_hits) / num_allocs;
+  }
+};
+
+/*!
+ * \brief Storage that keeps freed CPU blocks for reuse and forwards other
+ *  devices to another storage.
+ *
+ *  Requests are rounded up to a size class: the next power of two below
+ *  2^MXNET_CPU_MEM_POOL_ROUND_LINEAR_CUTOFF bytes (default 24, i.e. 16 MB),
+ *  the next multiple of that above it. Blocks of up to 256 KB are cached
+ *  per thread, up to MXNET_CPU_MEM_POOL_THREAD_CACHE_KB (default 1024) per
+ *  thread, so that short-lived arrays are recycled without taking a lock;
+ *  everything else goes through one shared pool.
+ *
+ *  If MXNET_CPU_MEM_POOL_HIGH_WATER_MB is set, the pool keeps the memory it
+ *  holds (in use plus pooled) under that mark: a free that would exceed it
+ *  returns the block to the system, and an allocation that would exceed it
+ *  first releases shared pooled blocks, largest first.
+ *
+ *  Storage::Get(), and with it NDArray, allocates through the storage built
+ *  into libmxnet, whose CPU manager cannot be replaced from a header. The
+ *  pool therefore serves the code that allocates through an instance of it,
+ *  e.g. one wrapping Storage::_GetSharedRef() and passed wherever a
+ *  Storage* is taken; stats() reports on that instance.
+ */
+class PooledCPUStorage : public Storage {
+ public:
+  /*! \brief largest block cached per thread */
+  static const size_t kMaxThreadCachedBytes = 256 << 10;
+  /*! \brief smallest size class, also the block alignment */
+  static const size_t kMinClassBytes = 64;
+
+  /*!
+   * \param base storage for non-CPU contexts
+   * \param linear_cutoff log2 of the size from which classes grow linearly
+   * \param high_water_bytes memory held above which blocks are released,
+   *  0 for no limit
+   * \param thread_cache_bytes capacity of every per-thread cache, 0 to
+   *  disable them
+   */
+  PooledCPUStorage(std::shared_ptr<Storage> base, int linear_cutoff,
+                   size_t high_water_bytes, size_t thread_cache_bytes)
+      : base_(std::move(base)), central_(std::make_shared<Central>()),
+        linear_cutoff_(linear_cutoff), thread_cache_bytes_(thread_cache_bytes) {
+    CHECK(linear_cutoff >= 6 && linear_cutoff < 40)
+        << "MXNET_CPU_MEM_POOL_ROUND_LINEAR_CUTOFF out of range: " << linear_cutoff;
+    central_->high_water = high_water_bytes;
+  }
+  /*! \brief pool configured by the environment */
+  explicit PooledCPUStorage(std::shared_ptr<Storage> base)
+      : PooledCPUStorage(std::move(base),
+                         dmlc::GetEnv("MXNET_CPU_MEM_POOL_ROUND_LINEAR_CUTOFF", 24),
+                         static_cast<size_t>(
+                             dmlc::GetEnv("MXNET_CPU_MEM_POOL_HIGH_WATER_MB", 0)) << 20,
+                         static_cast<size_t>(
+                             dmlc::GetEnv("MXNET_CPU_MEM_POOL_THREAD_CACHE_KB", 1024)) << 10) {}
+  ~PooledCPUStorage() { ReleaseAll(); }
+
+  Handle Alloc(size_t size, Context ctx) override {
+    if (ctx.dev_type != Context::kCPU) return base_->Alloc(size, ctx);
+    Central &c = *central_;
+    const size_t bytes = RoundSize(size);
+    Handle handle;
+    handle.size = size;
+    handle.ctx = ctx;
+    handle.dptr = nullptr;
+    ++c.num_allocs;
+    if (ThreadCached(bytes)) handle.dptr = LocalCache()->Pop(bytes);
+    if (handle.dptr == nullptr) {
+      std::lock_guard<std::mutex> lock(c.mutex);
+      handle.dptr = c.Pop(bytes);
+      if (handle.dptr == nullptr) {
+        if (c.high_water != 0) c.Trim(c.high_water - std::min(c.high_water, bytes));
+        handle.dptr = SystemAlloc(bytes);
+        if (handle.dptr == nullptr) {
+          // out of memory: give back everything pooled and retry
+          c.Trim(0);
+          handle.dptr = SystemAlloc(bytes);
+          if (handle.dptr == nullptr) LOG(FATAL) << "Failed to allocate CPU Memory";
+        }
+      } else {
+        ++c.num_hits;
+      }
+    } else {
+      ++c.num_hits;
+    }
+    c.AddInUse(bytes);
+    return handle;
+  }
+  void Free(Handle handle) override {
+    if (handle.ctx.dev_type != Context::kCPU) {
+      base_->Free(handle);
+      return;
+    }
+    Central &c = *central_;
+    const size_t bytes = RoundSize(handle.size);
+    c.bytes_in_use -= bytes;
+    if (c.high_water != 0 && c.bytes_in_use + c.bytes_pooled + bytes > c.high_water) {
+      ++c.num_trimmed;
+      free(handle.dptr);
+      return;
+    }
+    if (ThreadCached(bytes) && LocalCache()->Push(handle.dptr, bytes, thread_cache_bytes_)) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(c.mutex);
+    c.Push(handle.dptr, bytes);
+  }
+  void DirectFree(Handle handle) override {
+    if (handle.ctx.dev_type != Context::kCPU) {
+      base_->DirectFree(handle);
+      return;
+    }
+    central_->bytes_in_use -= RoundSize(handle.size);
+    free(handle.dptr);
+  }
+  /*!
+   * \brief Return the shared pool and the calling thread's cache to the
+   *  system. Caches of other threads are returned when those threads exit.
+   */
+  void ReleaseAll() {
+    if (thread_cache_bytes_ != 0) LocalCache()->Flush();
+    std::lock_guard<std::mutex> lock(central_->mutex);
+    central_->Trim(0);
+  }
+  /*! \return a snapshot of the counters */
+  CPUPoolStats stats() const {
+    const Central &c = *central_;
+    CPUPoolStats s;
+    s.bytes_in_use = c.bytes_in_use;
+    s.bytes_pooled = c.bytes_pooled;
+    s.peak_bytes = c.peak_bytes;
+    s.num_allocs = c.num_allocs;
+    s.num_hits = c.num_hits;
+    s.num_trimmed = c.num_trimmed;
+    return s;
+  }
+  /*! \return the size class of a request */
+  size_t RoundSize(size_t size) const {
+    const size_t cutoff = size_t(1) << linear_cutoff_;
+    if (size <= kMinClassBytes) return kMinClassBytes;
+    if (size >= cutoff) return (size + cutoff - 1) / cutoff * cutoff;
+    size_t bytes = kMinClassBytes;
+    while (bytes < size) bytes <<= 1;
+    return bytes;
+  }
+
+ private:
+  /*! \brief free lists by size class */
+  typedef std::map<size_t, std::vector<void*> > FreeLists;
+  /*! \brief state shared by all threads; outlives the storage while caches hold it */
+  struct Central {
+    /*! \brief guards free */
+    std::mutex mutex;
+    FreeLists free;
+    size_t high_water{0};
+    std::atomic<uint64_t> bytes_in_use{0}, bytes_pooled{0}, peak_bytes{0};
+    std::atomic<uint64_t> num_allocs{0}, num_hits{0}, num_trimmed{0};
+
+    ~Central() { Trim(0); }
+    void *Pop(size_t bytes) {
+      auto it = free.find(bytes);
+      if (it == free.end() || it->second.empty()) return nullptr;
+      void *ptr = it->second.back();
+      it->second.pop_back();
+      bytes_pooled -= bytes;
+      return ptr;
+    }
+    void Push(void *ptr, size_t bytes) {
+      free[bytes].push_back(ptr);
+      bytes_pooled += bytes;
+    }
+    /*! \brief release pooled blocks, largest first, until holding at most target */
+    void Trim(uint64_t target) {
+      for (auto it = free.rbegin(); it != free.rend(); ++it) {
+        while (!it->second.empty() && bytes_in_use + bytes_pooled > target) {
+          std::free(it->second.back());
+          it->second.pop_back();
+          bytes_pooled -= it->first;
+          ++num_trimmed;
+        }
+      }
+    }
+    void AddInUse(size_t bytes) {
+      const uint64_t held = (bytes_in_use += bytes) + bytes_pooled;
+      uint64_t peak = peak_bytes;
+      while (held > peak && !peak_bytes.compare_exchange_weak(peak, held)) {}
+    }
+  };
+  /*! \brief blocks cached by one thread, handed back to Central on exit */
+  struct ThreadCache {
+    std::shared_ptr<Central> central;
+    FreeLists free;
+    size_t bytes{0};
+
+    explicit ThreadCache(std::shared_ptr<Central> c) : central(std::move(c)) {}
+    ~ThreadCache() { Flush(); }
+    void *Pop(size_t size) {
+      auto it = free.find(size);
+      if (it == free.end() || it->second.empty()) return nullptr;
+      void *ptr = it->second.back();
+      it->second.pop_back();
+      bytes -= size;
+      central->bytes_pooled -= size;
+      return ptr;
+    }
+    bool Push(void *ptr, size_t size, size_t capacity) {
+      if (bytes + size > capacity) return false;
+      free[size].push_back(ptr);
+      bytes += size;
+      central->bytes_pooled += size;
+      return true;
+    }
+    void Flush() {
+      std::lock_guard<std::mutex> lock(central->mutex);
+      for (auto &kv : free) {
+        for (void *ptr : kv.second) central->free[kv.first].push_back(ptr);
+      }
+      free.clear();
+      bytes = 0;
+    }
+  };
+
+  static void *SystemAlloc(size_t bytes) {
+    void *ptr;
+    return posix_memalign(&ptr, kMinClassBytes, bytes) == 0 ? ptr : nullptr;
+  }
+  inline bool ThreadCached(size_t bytes) const {
+    return bytes <= kMaxThreadCachedBytes && bytes <= thread_cache_bytes_;
+  }
+  /*! \return the calling thread's cache of this pool */
+  ThreadCache *LocalCache() {
+    static thread_local std::vector<std::unique_ptr<ThreadCache> > caches;
+    for (auto &cache : caches) {
+      if (cache->central == central_) return cache.get();
+    }
+    // drop the caches of pools that are gone
+    caches.erase(std::remove_if(caches.begin(), caches.end(),
+                                [](const std::unique_ptr<ThreadCache> &cache) {
+                                  return cache->central.use_count() == 1;
+                                }), caches.end());
+    caches.emplace_back(new ThreadCache(central_));
+    return caches.back().get();
+  }
+
+  std::shared_ptr<Storage> base_;
+  std::shared_ptr<Central> central_;
+  int linear_cutoff_;
+  size_t thread_cache_bytes_;
+};
+#endif  // DMLC_USE_CXX11
+}  // namespace storage
+}  // namespace mxnet
+#endif  // MXNET_POOLED_STORAGE_H_
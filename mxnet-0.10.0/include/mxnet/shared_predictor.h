@@ -0,0 +1,460 @@
+/*!
+ *  Copyright (c) 2017 by Contributors
+ * \file shared_predictor.h
+ * \brief Predictors that share one immutable copy of the model weights.
+ *
+ *  A PredictorModel parses the symbol JSON and the parameter bytes once and
+ *  holds the weights on the device. Any number of PredictorContexts can then
+ *  be created from it, e.g. one per serving thread; each binds its own
+ *  executor (inputs, activations and auxiliary states) and only references
+ *  the model's weight arrays, so a context costs the activation memory of
+ *  one forward pass instead of a full predictor.
+ *
+ *  SetInput / Forward / GetOutputShape / GetOutput behave like MXPredSetInput,
+ *  MXPredForward, MXPredGetOutputShape and MXPredGetOutput. On CPU,
+ *  GetInputBuffer / GetOutputBuffer expose the bound arrays themselves, so
+ *  inputs can be written and outputs read without either copy. Different
+ *  contexts may run concurrently on different threads; a single context must
+ *  only be used by one thread at a time.
+ *
+ *  Only the public C API is used, so this header works with any libmxnet.
+ */
+#ifndef MXNET_SHARED_PREDICTOR_H_
+#define MXNET_SHARED_PREDICTOR_H_
+
+#include <dmlc/logging.h>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "./c_api.h"
+#include "./c_predict_api.h"
+
+namespace mxnet {
+
+/*! \brief check the return value of a C API call */
+#define MXNET_PREDICT_CALL(func)                                  \
+  {                                                               \
+    int e = (func);                                               \
+    CHECK_EQ(e, 0) << #func << " failed: " << MXGetLastError();   \
+  }
+
+/*!
+ * \brief The symbol and the weights of a model, loaded once on one device
+ *  and never modified afterwards. Create it through std::make_shared, since
+ *  every PredictorContext keeps a reference to it.
+ */
+class PredictorModel {
+ public:
+  /*!
+   * \brief load a model, with the arguments of MXPredCreatePartialOut
+   * \param symbol_json The JSON string of the symbol.
+   * \param param_bytes The in-memory raw bytes of parameter ndarray file.
+   * \param param_size The size of parameter ndarray file.
+   * \param dev_type The device type, 1: cpu, 2:gpu
+   * \param dev_id The device id.
+   * \param output_keys Names of the internal nodes to output, e.g.
+   *    {"global_pool"}; empty for the outputs of the symbol.
+   */
+  PredictorModel(const std::string& symbol_json,
+                 const void* param_bytes, int param_size,
+                 int dev_type, int dev_id,
+                 const std::vector<std::string>& output_keys =
+                     std::vector<std::string>())
+      : dev_type_(dev_type), dev_id_(dev_id), symbol_(nullptr) {
+    MXNET_PREDICT_CALL(MXSymbolCreateFromJSON(symbol_json.c_str(), &symbol_));
+    if (!output_keys.empty()) {
+      SelectOutputs(output_keys);
+    }
+    arg_names_ = ListNames(MXSymbolListArguments);
+    aux_names_ = ListNames(MXSymbolListAuxiliaryStates);
+    LoadParams(param_bytes, param_size);
+  }
+  ~PredictorModel() {
+    for (auto& kv : arg_params_) {
+      MXNDArrayFree(kv.second);
+    }
+    if (symbol_ != nullptr) {
+      MXSymbolFree(symbol_);
+    }
+  }
+
+  /*! \return the symbol to bind; not to be modified */
+  SymbolHandle symbol() const { return symbol_; }
+  int dev_type() const { return dev_type_; }
+  int dev_id() const { return dev_id_; }
+  const std::vector<std::string>& arg_names() const { return arg_names_; }
+  const std::vector<std::string>& aux_names() const { return aux_names_; }
+  /*! \return the weight array of argument name on the device, or nullptr */
+  NDArrayHandle arg_param(const std::string& name) const {
+    auto it = arg_params_.find(name);
+    return it == arg_params_.end() ? nullptr : it->second;
+  }
+  /*! \return the host copy of auxiliary state name, or nullptr */
+  const std::vector<mx_float>* aux_param(const std::string& name) const {
+    auto it = aux_params_.find(name);
+    return it == aux_params_.end() ? nullptr : &it->second;
+  }
+  /*! \return bytes held by the weight arrays */
+  size_t param_bytes() const { return param_bytes_; }
+
+ private:
+  typedef int (*ListFunction)(SymbolHandle, mx_uint*, const char***);
+
+  std::vector<std::string> ListNames(ListFunction list) const {
+    mx_uint size;
+    const char** names;
+    MXNET_PREDICT_CALL(list(symbol_, &size, &names));
+    return std::vector<std::string>(names, names + size);
+  }
+
+  // Replaces the symbol by a group of the named internal outputs.
+  void SelectOutputs(const std::vector<std::string>& output_keys) {
+    SymbolHandle internals;
+    MXNET_PREDICT_CALL(MXSymbolGetInternals(symbol_, &internals));
+    mx_uint size;
+    const char** names;
+    MXNET_PREDICT_CALL(MXSymbolListOutputs(internals, &size, &names));
+    std::vector<std::string> all_outputs(names, names + size);
+    std::vector<SymbolHandle> outputs;
+    for (const std::string& key : output_keys) {
+      mx_uint index = 0;
+      while (index < size && all_outputs[index] != key + "_output") {
+        ++index;
+      }
+      CHECK_LT(index, size) << "didn't find node name: " << key << "_output";
+      SymbolHandle output;
+      MXNET_PREDICT_CALL(MXSymbolGetOutput(internals, index, &output));
+      outputs.push_back(output);
+    }
+    SymbolHandle group;
+    MXNET_PREDICT_CALL(MXSymbolCreateGroup(outputs.size(), outputs.data(),
+                                           &group));
+    for (SymbolHandle output : outputs) {
+      MXSymbolFree(output);
+    }
+    MXSymbolFree(internals);
+    MXSymbolFree(symbol_);
+    symbol_ = group;
+  }
+
+  // Weights go to the device once; auxiliary states stay on the host,
+  // since each context needs a private copy (operators may mutate them).
+  void LoadParams(const void* param_bytes, int param_size) {
+    std::map<std::string, bool> is_arg, is_aux;
+    for (const std::string& name : arg_names_) is_arg[name] = true;
+    for (const std::string& name : aux_names_) is_aux[name] = true;
+    NDListHandle list;
+    mx_uint length;
+    MXNET_PREDICT_CALL(MXNDListCreate(static_cast<const char*>(param_bytes),
+                                      param_size, &list, &length));
+    param_bytes_ = 0;
+    for (mx_uint i = 0; i < length; ++i) {
+      const char* key;
+      const mx_float* data;
+      const mx_uint* shape;
+      mx_uint ndim;
+      MXNET_PREDICT_CALL(MXNDListGet(list, i, &key, &data, &shape, &ndim));
+      size_t size = 1;
+      for (mx_uint j = 0; j < ndim; ++j) size *= shape[j];
+      if (!std::strncmp(key, "arg:", 4) && is_arg.count(key + 4)) {
+        NDArrayHandle array;
+        MXNET_PREDICT_CALL(MXNDArrayCreate(shape, ndim, dev_type_, dev_id_,
+                                           0, &array));
+        MXNET_PREDICT_CALL(MXNDArraySyncCopyFromCPU(array, data, size));
+        arg_params_[key + 4] = array;
+        param_bytes_ += size * sizeof(mx_float);
+      } else if (!std::strncmp(key, "aux:", 4) && is_aux.count(key + 4)) {
+        aux_params_[key + 4].assign(data, data + size);
+      }
+    }
+    MXNET_PREDICT_CALL(MXNDListFree(list));
+  }
+
+  int dev_type_;
+  int dev_id_;
+  SymbolHandle symbol_;
+  std::vector<std::string> arg_names_;
+  std::vector<std::string> aux_names_;
+  std::map<std::string, NDArrayHandle> arg_params_;
+  std::map<std::string, std::vector<mx_float> > aux_params_;
+  size_t param_bytes_;
+
+  PredictorModel(const PredictorModel&) = delete;
+  PredictorModel& operator=(const PredictorModel&) = delete;
+};
+
+/*!
+ * \brief One execution context of a PredictorModel: its own executors,
+ *  input arrays and auxiliary states, bound to the model's weights.
+ *
+ *  Reshape switches to other input shapes. Every set of shapes is bound
+ *  once and kept in a small LRU cache, so returning to a recent shape costs
+ *  a lookup instead of a bind; the executors of one context share a memory
+ *  pool, since they never run at the same time.
+ */
+class PredictorContext {
+ public:
+  /*! \brief shape of each input node, e.g. {{"data", {1, 3, 224, 224}}} */
+  typedef std::map<std::string, std::vector<mx_uint> > InputShapes;
+
+  /*!
+   * \brief bind a context
+   * \param model the shared model
+   * \param input_shapes the shapes to bind first
+   * \param max_cached_shapes number of bound shapes kept for Reshape
+   */
+  PredictorContext(std::shared_ptr<const PredictorModel> model,
+                   const InputShapes& input_shapes,
+                   size_t max_cached_shapes = 4)
+      : model_(model), max_cached_shapes_(max_cached_shapes),
+        binds_(0) {
+    CHECK_GT(max_cached_shapes_, 0U);
+    Reshape(input_shapes);
+  }
+  ~PredictorContext() {
+    cache_.clear();
+    for (NDArrayHandle aux : aux_arrays_) MXNDArrayFree(aux);
+  }
+
+  /*! \return the model this context runs */
+  const std::shared_ptr<const PredictorModel>& model() const { return model_; }
+  /*! \return number of outputs */
+  mx_uint num_outputs() const { return current().outputs.size(); }
+  /*! \return the input shapes of the current binding */
+  const InputShapes& input_shapes() const { return cache_.front().first; }
+
+  /*!
+   * \brief switch to other input shapes, reusing a cached binding if one
+   *  exists. Input values and buffers of the previous shapes are not
+   *  carried over; the least recently used binding beyond
+   *  max_cached_shapes is released.
+   */
+  void Reshape(const InputShapes& input_shapes) {
+    for (auto it = cache_.begin(); it != cache_.end(); ++it) {
+      if (it->first == input_shapes) {
+        cache_.splice(cache_.begin(), cache_, it);
+        return;
+      }
+    }
+    ExecutorHandle shared = cache_.empty() ? nullptr : current().exec;
+    std::unique_ptr<Binding> binding(Bind(input_shapes, shared));
+    cache_.emplace_front(input_shapes, std::move(binding));
+    ++binds_;
+    while (cache_.size() > max_cached_shapes_) {
+      cache_.pop_back();
+    }
+  }
+  /*! \return number of binds so far; Reshape to a cached shape adds none */
+  size_t num_binds() const { return binds_; }
+
+  /*!
+   * \brief set an input, as MXPredSetInput
+   * \param key The name of the input node.
+   * \param data The input data, with the current input shape.
+   * \param size The number of elements in data, used for safety check.
+   */
+  void SetInput(const std::string& key, const mx_float* data, mx_uint size) {
+    MXNET_PREDICT_CALL(MXNDArraySyncCopyFromCPU(Input(key), data, size));
+  }
+  /*! \brief run a forward pass, as MXPredForward */
+  void Forward() {
+    MXNET_PREDICT_CALL(MXExecutorForward(current().exec, 0));
+  }
+  /*! \return the shape of output index, as MXPredGetOutputShape */
+  std::vector<mx_uint> GetOutputShape(mx_uint index) const {
+    CHECK_LT(index, current().outputs.size())
+        << "Index exceed number of outputs";
+    mx_uint ndim;
+    const mx_uint* shape;
+    MXNET_PREDICT_CALL(MXNDArrayGetShape(current().outputs[index], &ndim,
+                                         &shape));
+    return std::vector<mx_uint>(shape, shape + ndim);
+  }
+  /*!
+   * \brief copy output index out, as MXPredGetOutput
+   * \param index The index of output node.
+   * \param data User allocated data to hold the output.
+   * \param size The size of data array, used for safe checking.
+   */
+  void GetOutput(mx_uint index, mx_float* data, mx_uint size) const {
+    CHECK_LT(index, current().outputs.size()) << "Output index out of range";
+    MXNET_PREDICT_CALL(MXNDArraySyncCopyToCPU(current().outputs[index], data,
+                                              size));
+  }
+  /*!
+   * \brief memory of input key, to be written in place of SetInput.
+   *  Waits until no pending operation uses the input, so the buffer can be
+   *  filled right away. CPU models only; the buffer is 16-byte aligned and
+   *  stays valid while the current shapes remain cached.
+   * \param key The name of the input node.
+   * \param size If not nullptr, receives the number of elements.
+   */
+  mx_float* GetInputBuffer(const std::string& key, mx_uint* size = nullptr) {
+    NDArrayHandle input = Input(key);
+    MXNET_PREDICT_CALL(MXNDArrayWaitToWrite(input));
+    return HostData(input, size);
+  }
+  /*!
+   * \brief memory of output index, to be read in place of GetOutput.
+   *  Waits for the last Forward to finish writing it. The contents are only
+   *  stable until the next Forward; the buffer itself stays valid while the
+   *  current shapes remain cached.
+   * \param index The index of output node.
+   * \param size If not nullptr, receives the number of elements.
+   */
+  const mx_float* GetOutputBuffer(mx_uint index, mx_uint* size = nullptr) {
+    CHECK_LT(index, current().outputs.size()) << "Output index out of range";
+    MXNET_PREDICT_CALL(MXNDArrayWaitToRead(current().outputs[index]));
+    return HostData(current().outputs[index], size);
+  }
+
+ private:
+  typedef std::vector<std::vector<mx_uint> > ShapeList;
+
+  /*! \brief the executor and arrays bound for one set of input shapes */
+  struct Binding {
+    Binding() : exec(nullptr) {}
+    ~Binding() {
+      for (NDArrayHandle output : outputs) MXNDArrayFree(output);
+      if (exec != nullptr) MXExecutorFree(exec);
+      for (NDArrayHandle arg : owned_args) MXNDArrayFree(arg);
+    }
+    ExecutorHandle exec;
+    std::map<std::string, NDArrayHandle> inputs;
+    std::vector<NDArrayHandle> owned_args;
+    std::vector<NDArrayHandle> outputs;
+  };
+
+  const Binding& current() const { return *cache_.front().second; }
+
+  NDArrayHandle Input(const std::string& key) const {
+    auto it = current().inputs.find(key);
+    CHECK(it != current().inputs.end()) << "cannot find input key " << key;
+    return it->second;
+  }
+
+  // Copies one group of shapes returned by MXSymbolInferShape, which are
+  // only valid until the next C API call on this thread.
+  static ShapeList CopyShapes(mx_uint size, const mx_uint* ndim,
+                              const mx_uint** data) {
+    ShapeList shapes(size);
+    for (mx_uint i = 0; i < size; ++i) {
+      shapes[i].assign(data[i], data[i] + ndim[i]);
+    }
+    return shapes;
+  }
+
+  mx_float* HostData(NDArrayHandle array, mx_uint* size) const {
+    CHECK(model_->dev_type() == 1 || model_->dev_type() == 3)
+        << "In-place buffers need a CPU model";
+    if (size != nullptr) {
+      mx_uint ndim;
+      const mx_uint* shape;
+      MXNET_PREDICT_CALL(MXNDArrayGetShape(array, &ndim, &shape));
+      *size = 1;
+      for (mx_uint i = 0; i < ndim; ++i) *size *= shape[i];
+    }
+    void* data;
+    MXNET_PREDICT_CALL(MXNDArrayGetData(array, &data));
+    return static_cast<mx_float*>(data);
+  }
+
+  // Auxiliary states do not depend on the input shapes, so all bindings
+  // of the context share the arrays created by the first one.
+  void InitAuxStates(const ShapeList& aux_shapes) {
+    const PredictorModel& model = *model_;
+    if (!aux_arrays_.empty() || aux_shapes.empty()) {
+      CHECK_EQ(aux_arrays_.size(), aux_shapes.size());
+      return;
+    }
+    for (size_t i = 0; i < aux_shapes.size(); ++i) {
+      NDArrayHandle array;
+      MXNET_PREDICT_CALL(MXNDArrayCreate(
+          aux_shapes[i].data(), aux_shapes[i].size(), model.dev_type(),
+          model.dev_id(), 0, &array));
+      aux_arrays_.push_back(array);
+      const std::vector<mx_float>* value =
+          model.aux_param(model.aux_names()[i]);
+      if (value != nullptr) {
+        MXNET_PREDICT_CALL(MXNDArraySyncCopyFromCPU(array, value->data(),
+                                                    value->size()));
+      }
+    }
+  }
+
+  Binding* Bind(const InputShapes& input_shapes, ExecutorHandle shared_exec) {
+    const PredictorModel& model = *model_;
+    std::vector<const char*> keys;
+    std::vector<mx_uint> indptr(1, 0), shape_data;
+    for (auto& kv : input_shapes) {
+      keys.push_back(kv.first.c_str());
+      shape_data.insert(shape_data.end(), kv.second.begin(), kv.second.end());
+      indptr.push_back(shape_data.size());
+    }
+    mx_uint in_size, out_size, aux_size;
+    const mx_uint *in_ndim, *out_ndim, *aux_ndim;
+    const mx_uint **in_data, **out_data, **aux_data;
+    int complete;
+    MXNET_PREDICT_CALL(MXSymbolInferShape(
+        model.symbol(), keys.size(), keys.data(), indptr.data(),
+        shape_data.data(), &in_size, &in_ndim, &in_data, &out_size,
+        &out_ndim, &out_data, &aux_size, &aux_ndim, &aux_data, &complete));
+    CHECK(complete)
+        << "The shape information of is not enough to get the shapes";
+    ShapeList arg_shapes = CopyShapes(in_size, in_ndim, in_data);
+    InitAuxStates(CopyShapes(aux_size, aux_ndim, aux_data));
+
+    // Weights are the model's arrays; every other argument (the inputs,
+    // and e.g. labels) gets an array of its own.
+    std::unique_ptr<Binding> binding(new Binding());
+    std::vector<NDArrayHandle> args;
+    for (size_t i = 0; i < arg_shapes.size(); ++i) {
+      const std::string& name = model.arg_names()[i];
+      NDArrayHandle array = model.arg_param(name);
+      if (array == nullptr) {
+        MXNET_PREDICT_CALL(MXNDArrayCreate(
+            arg_shapes[i].data(), arg_shapes[i].size(), model.dev_type(),
+            model.dev_id(), 0, &array));
+        binding->owned_args.push_back(array);
+        if (input_shapes.count(name)) binding->inputs[name] = array;
+      } else {
+        mx_uint ndim;
+        const mx_uint* shape;
+        MXNET_PREDICT_CALL(MXNDArrayGetShape(array, &ndim, &shape));
+        CHECK(std::vector<mx_uint>(shape, shape + ndim) == arg_shapes[i])
+            << "Shape of parameter " << name << " does not match the symbol";
+      }
+      args.push_back(array);
+    }
+    std::vector<NDArrayHandle> grads(args.size(), nullptr);
+    std::vector<mx_uint> grad_req(args.size(), 0);  // kNullOp
+    MXNET_PREDICT_CALL(MXExecutorBindEX(
+        model.symbol(), model.dev_type(), model.dev_id(), 0, nullptr,
+        nullptr, nullptr, args.size(), args.data(), grads.data(),
+        grad_req.data(), aux_arrays_.size(), aux_arrays_.data(),
+        shared_exec, &binding->exec));
+    mx_uint num_outputs;
+    NDArrayHandle* outputs;
+    MXNET_PREDICT_CALL(MXExecutorOutputs(binding->exec, &num_outputs,
+                                         &outputs));
+    binding->outputs.assign(outputs, outputs + num_outputs);
+    return binding.release();
+  }
+
+  std::shared_ptr<const PredictorModel> model_;
+  size_t max_cached_shapes_;
+  size_t binds_;
+  /*! \brief bindings, most recently used first; the front one is current */
+  std::list<std::pair<InputShapes, std::unique_ptr<Binding> > > cache_;
+  std::vector<NDArrayHandle> aux_arrays_;
+
+  PredictorContext(const PredictorContext&) = delete;
+  PredictorContext& operator=(const PredictorContext&) = delete;
+};
+
+}  // namespace mxnet
+#endif  // MXNET_SHARED_PREDICTOR_H_
@@ -0,0 +1,330 @@
+/*!
+ * Copyright (c) 2017 by Contributors
+ * \file shm_reducer.h
+ * \brief Lock-free sum reduction of values across the processes of one
+ *  host through POSIX shared memory.
+ */
+#ifndef MXNET_SHM_REDUCER_H_
+#define MXNET_SHM_REDUCER_H_
+
+#include <dmlc/base.h>
+#include <dmlc/logging.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+namespace mxnet {
+namespace kvstore {
+
+/*!
+ * \brief A named POSIX shared memory segment mapped into this process.
+ */
+class ShmSegment {
+ public:
+  /*!
+   * \brief create the segment, replacing a stale one of the same name; its
+   *  contents start zeroed
+   */
+  static ShmSegment *Create(const std::string &name, size_t size) {
+    shm_unlink(name.c_str());
+    const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    CHECK_GE(fd, 0) << "Cannot create shared memory " << name << ": " << strerror(errno);
+    const int ret = ftruncate(fd, size);
+    if (ret != 0) close(fd);
+    CHECK_EQ(ret, 0) << "Cannot size shared memory " << name << ": " << strerror(errno);
+    return new ShmSegment(name, fd, size, true);
+  }
+  /*!
+   * \brief map a segment another process creates, waiting until it exists
+   *  and has at least min_size bytes
+   */
+  static ShmSegment *Open(const std::string &name, size_t min_size) {
+    const auto start = std::chrono::steady_clock::now();
+    while (true) {
+      const int fd = shm_open(name.c_str(), O_RDWR, 0600);
+      struct stat st;
+      if (fd >= 0 && fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= min_size) {
+        return new ShmSegment(name, fd, st.st_size, false);
+      }
+      if (fd >= 0) close(fd);
+      CHECK(std::chrono::steady_clock::now() - start < std::chrono::minutes(5))
+          << "Timed out waiting for shared memory " << name;
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  ~ShmSegment() {
+    munmap(addr_, size_);
+    if (owner_) shm_unlink(name_.c_str());
+  }
+  /*! \return the mapped memory */
+  inline char *addr() const { return static_cast<char*>(addr_); }
+  /*! \return size in bytes */
+  inline size_t size() const { return size_; }
+
+ private:
+  ShmSegment(const std::string &name, int fd, size_t size, bool owner)
+      : name_(name), size_(size), owner_(owner) {
+    addr_ = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    CHECK(addr_ != MAP_FAILED) << "Cannot map shared memory " << name;
+  }
+
+  std::string name_;
+  void *addr_;
+  size_t size_;
+  bool owner_;
+};
+
+/*!
+ * \brief Sum reduction of float32 values across worker processes, one
+ *  shared memory segment per key.
+ *
+ *  A key holds the stored value, a merge buffer and one slot per worker.
+ *  Every round, each worker copies its value into its own slot, so writers
+ *  never contend, and counts itself in (Arrive). Once all are in, the
+ *  workers split the key into shards and claim them with compare-and-swap
+ *  (ReduceStep), so the sum is spread over the cores of every process
+ *  without locks. Rank 0 then moves the merged sum into the stored value
+ *  (see KVStoreShm) and publishes the round.
+ *
+ *  ReduceStep and Published never block, so a process can drive many keys
+ *  from one thread; Reduce and Wait are the blocking forms. Every worker
+ *  must reduce every key once per round, and must not arrive for the next
+ *  round of a key before the reduction of the previous one completed.
+ */
+class ShmReducer {
+ public:
+  /*!
+   * \param name segment name prefix, "/" followed by no other slashes
+   * \param job identifies the launch: equal for its workers, different
+   *  from earlier launches that may have left segments of the same name
+   * \param rank this worker, in [0, num_workers)
+   * \param num_workers worker processes
+   * \param shard_size floats per reduction shard
+   */
+  ShmReducer(const std::string &name, uint64_t job, int rank, int num_workers,
+             size_t shard_size)
+      : name_(name), rank_(rank), num_workers_(num_workers), shard_size_(shard_size) {
+    CHECK(!name.empty() && name[0] == '/' && name.find('/', 1) == std::string::npos)
+        << "Invalid shared memory name " << name;
+    CHECK(rank >= 0 && rank < num_workers) << "Invalid rank " << rank;
+    CHECK_GT(shard_size, 0U);
+    if (rank == 0) {
+      control_.reset(ShmSegment::Create(name_, sizeof(Control)));
+      new (control_->addr()) Control();
+      ControlBlock()->num_workers = num_workers;
+      ControlBlock()->job = job;
+      ControlBlock()->ready.store(1);
+    } else {
+      // a segment left by a crashed launch stays until rank 0 replaces it,
+      // so reopen until the one of this launch shows up
+      const auto start = std::chrono::steady_clock::now();
+      while (true) {
+        control_.reset(ShmSegment::Open(name_, sizeof(Control)));
+        const Control *c = ControlBlock();
+        for (int i = 0; i < 100 && c->ready.load() == 0; ++i) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (c->ready.load() != 0 && c->job == job) break;
+        CHECK(std::chrono::steady_clock::now() - start < std::chrono::minutes(5))
+            << "Timed out waiting for rank 0 to create " << name_ << " for job " << job;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      CHECK_EQ(ControlBlock()->num_workers, static_cast<uint32_t>(num_workers))
+          << "Workers disagree on the number of workers";
+    }
+  }
+  /*! \brief The segments go away with rank 0; Barrier first so nobody still uses them. */
+  ~ShmReducer() { keys_.clear(); }
+
+  inline int rank() const { return rank_; }
+  inline int num_workers() const { return num_workers_; }
+
+  /*! \brief block until every worker called Barrier as often as this one */
+  void Barrier() {
+    Control *c = ControlBlock();
+    const uint64_t generation = c->generation.load();
+    if (c->waiting.fetch_add(1) + 1 == static_cast<uint64_t>(num_workers_)) {
+      c->waiting.store(0);
+      c->generation.fetch_add(1);
+    } else {
+      Spin([c, generation]() { return c->generation.load() != generation; });
+    }
+  }
+  /*!
+   * \brief create a key; collective, every worker calls it with the same
+   *  keys in the same order
+   * \param key the key
+   * \param size floats of the value; on ranks other than 0, 0 to take the
+   *  size rank 0 gave
+   * \param value initial value, only read on rank 0
+   */
+  void InitKey(int key, size_t size, const float *value) {
+    CHECK(keys_.find(key) == keys_.end()) << "Key " << key << " is initialized twice";
+    Key k;
+    if (rank_ == 0) {
+      k.segment.reset(ShmSegment::Create(KeyName(key), Layout(size, nullptr)));
+      k.header = new (k.segment->addr()) KeyHeader();
+      k.header->size = size;
+      Layout(size, &k);
+      if (value != nullptr) std::memcpy(k.stored, value, size * sizeof(float));
+      Barrier();
+    } else {
+      Barrier();
+      k.segment.reset(ShmSegment::Open(KeyName(key), sizeof(KeyHeader)));
+      k.header = reinterpret_cast<KeyHeader*>(k.segment->addr());
+      CHECK(size == 0 || size == k.header->size)
+          << "Workers disagree on the size of key " << key;
+      CHECK_GE(k.segment->size(), Layout(k.header->size, nullptr));
+      Layout(k.header->size, &k);
+    }
+    keys_[key] = std::move(k);
+  }
+  /*! \return floats of a key, as set by rank 0 (valid after InitKey) */
+  size_t Size(int key) const { return Get(key).header->size; }
+  /*! \return the slot this worker fills before Arrive */
+  float *Slot(int key) {
+    const Key &k = Get(key);
+    return k.slots + rank_ * Stride(k.header->size);
+  }
+  /*! \return the stored value, valid once the rounds wanted are published */
+  const float *Stored(int key) const { return Get(key).stored; }
+  /*! \return the stored value for rank 0 to update */
+  float *MutableStored(int key) {
+    CHECK_EQ(rank_, 0);
+    return Get(key).stored;
+  }
+  /*! \return the merge buffer, holding the sum once a round is reduced */
+  float *Merged(int key) { return Get(key).merged; }
+  /*! \brief count this worker in for the next round, after filling Slot(key) */
+  void Arrive(int key) { Get(key).header->arrived.fetch_add(1); }
+  /*!
+   * \brief Help sum the slots of all workers into the merge buffer.
+   * \param round rounds of this key reduced before, i.e. 0 first
+   * \return whether the sum of round is complete; until then, call again
+   */
+  bool ReduceStep(int key, uint64_t round) {
+    Key &k = Get(key);
+    KeyHeader *h = k.header;
+    const size_t size = h->size;
+    const uint64_t shards = (size + shard_size_ - 1) / shard_size_;
+    const uint64_t end = (round + 1) * shards;
+    if (h->arrived.load() < (round + 1) * num_workers_) return false;
+    uint64_t claim = h->claimed.load();
+    while (claim < end && !h->claimed.compare_exchange_weak(claim, claim + 1)) {}
+    if (claim < end) {
+      const size_t begin = (claim - round * shards) * shard_size_;
+      const size_t n = std::min(shard_size_, size - begin);
+      float *out = k.merged + begin;
+      std::memcpy(out, k.slots + begin, n * sizeof(float));
+      for (int w = 1; w < num_workers_; ++w) {
+        const float *in = k.slots + w * Stride(size) + begin;
+        for (size_t i = 0; i < n; ++i) out[i] += in[i];
+      }
+      h->reduced.fetch_add(1);
+    }
+    return h->reduced.load() >= end;
+  }
+  /*! \brief Arrive and reduce round, returning once the sum is complete */
+  void Reduce(int key, uint64_t round) {
+    Arrive(key);
+    Spin([this, key, round]() { return ReduceStep(key, round); });
+  }
+  /*! \brief mark the stored value as updated with round; rank 0 only */
+  void Publish(int key, uint64_t round) {
+    CHECK_EQ(rank_, 0);
+    Get(key).header->version.store(round + 1);
+  }
+  /*! \return whether the stored value includes rounds [0, rounds) */
+  bool Published(int key, uint64_t rounds) const {
+    return Get(key).header->version.load() >= rounds;
+  }
+  /*! \brief wait until Published(key, rounds) */
+  void Wait(int key, uint64_t rounds) const {
+    Spin([this, key, rounds]() { return Published(key, rounds); });
+  }
+  /*! \brief busy-wait briefly, then yield, then sleep until done() */
+  template<typename Done>
+  static void Spin(Done done) {
+    for (int i = 0; !done(); ++i) {
+      if (i < 1000) {
+        continue;
+      } else if (i < 2000) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    }
+  }
+
+ private:
+  static const size_t kLine = 64;
+  struct Control {
+    std::atomic<uint32_t> ready{0};
+    uint32_t num_workers{0};
+    uint64_t job{0};
+    alignas(kLine) std::atomic<uint64_t> waiting{0};
+    alignas(kLine) std::atomic<uint64_t> generation{0};
+  };
+  /*! \brief cumulative counters of a key, each on its own cache line */
+  struct KeyHeader {
+    uint64_t size{0};
+    alignas(kLine) std::atomic<uint64_t> arrived{0};
+    alignas(kLine) std::atomic<uint64_t> claimed{0};
+    alignas(kLine) std::atomic<uint64_t> reduced{0};
+    alignas(kLine) std::atomic<uint64_t> version{0};
+  };
+  struct Key {
+    std::unique_ptr<ShmSegment> segment;
+    KeyHeader *header = nullptr;
+    float *stored = nullptr, *merged = nullptr, *slots = nullptr;
+  };
+
+  static size_t Stride(size_t size) {
+    const size_t floats_per_line = kLine / sizeof(float);
+    return (size + floats_per_line - 1) / floats_per_line * floats_per_line;
+  }
+  /*! \return bytes of a key's segment; with k, also set its pointers */
+  size_t Layout(size_t size, Key *k) const {
+    const size_t header = (sizeof(KeyHeader) + kLine - 1) / kLine * kLine;
+    const size_t value = Stride(size) * sizeof(float);
+    if (k != nullptr) {
+      char *base = k->segment->addr();
+      k->stored = reinterpret_cast<float*>(base + header);
+      k->merged = reinterpret_cast<float*>(base + header + value);
+      k->slots = reinterpret_cast<float*>(base + header + 2 * value);
+    }
+    return header + (2 + num_workers_) * value;
+  }
+  std::string KeyName(int key) const { return name_ + "." + std::to_string(key); }
+  Control *ControlBlock() const { return reinterpret_cast<Control*>(control_->addr()); }
+  Key &Get(int key) {
+    auto it = keys_.find(key);
+    CHECK(it != keys_.end()) << "Key " << key << " has not been initialized";
+    return it->second;
+  }
+  const Key &Get(int key) const { return const_cast<ShmReducer*>(this)->Get(key); }
+  std::string name_;
+  int rank_;
+  int num_workers_;
+  size_t shard_size_;
+  std::unique_ptr<ShmSegment> control_;
+  std::unordered_map<int, Key> keys_;
+};
+
+}  // namespace kvstore
+}  // namespace mxnet
+
+#endif  // MXNET_SHM_REDUCER_H_
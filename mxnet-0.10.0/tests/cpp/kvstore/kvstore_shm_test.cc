@@ -0,0 +1,192 @@
+/*!
+ * Copyright (c) 2017 by Contributors
+ * \file kvstore_shm_test.cc
+ * \brief multi-process tests of the shared memory kvstore
+ *
+ *  Every test forks its workers; the parent only starts and reaps them, so
+ *  each worker creates its own engine. Rank 0 starts last, after the other
+ *  ranks found the segment a crashed launch left behind.
+ */
+#include <gtest/gtest.h>
+#include <dmlc/logging.h>
+#include <mxnet/kvstore_shm.h>
+#include <mxnet/ndarray.h>
+#include <mxnet/shm_reducer.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+using mxnet::kvstore::ShmReducer;
+
+const int kWorkers = 4;
+const int kRounds = 20;
+const int kKeys[] = {3, 7};
+const size_t kSizes[] = {10007, 77};
+const size_t kShardSize = 1000;
+
+/*! \return a segment name and job id unique to this run */
+std::string UniqueName(const char *test) {
+  return std::string("/mxnet_test_") + test + "_" + std::to_string(getpid());
+}
+
+/*! \brief value rank pushes for element i in round */
+float Pushed(int rank, int round, size_t i) {
+  return static_cast<float>(rank + round + i % 7);
+}
+
+/*! \brief sum of the values all workers push for element i in round */
+float Summed(int round, size_t i) {
+  float sum = 0;
+  for (int rank = 0; rank < kWorkers; ++rank) sum += Pushed(rank, round, i);
+  return sum;
+}
+
+/*! \brief leave a ready control segment of another job, as a crashed launch does */
+void LeaveStaleSegment(const std::string &name, uint64_t job) {
+  const pid_t pid = fork();
+  ASSERT_GE(pid, 0);
+  if (pid == 0) {
+    // never destroyed, so the segment stays
+    new ShmReducer(name, job, 0, kWorkers, kShardSize);
+    _exit(0);
+  }
+  int status;
+  ASSERT_EQ(waitpid(pid, &status, 0), pid);
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/*!
+ * \brief run worker(rank) in kWorkers processes, rank 0 last
+ * \return whether every worker exited with 0
+ */
+bool RunWorkers(const std::function<int(int)> &worker) {
+  std::vector<pid_t> pids;
+  for (int i = 0; i < kWorkers; ++i) {
+    const int rank = (i + 1) % kWorkers;
+    // let the other ranks open the stale segment first
+    if (rank == 0) usleep(200000);
+    const pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) _exit(worker(rank));
+    pids.push_back(pid);
+  }
+  bool ok = true;
+  for (pid_t pid : pids) {
+    int status;
+    ok &= waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+  return ok;
+}
+
+/*! \return whether a shared memory segment exists */
+bool SegmentExists(const std::string &name) {
+  const int fd = shm_open(name.c_str(), O_RDONLY, 0600);
+  if (fd < 0) return false;
+  close(fd);
+  return true;
+}
+
+void ExpectNoSegments(const std::string &name) {
+  EXPECT_FALSE(SegmentExists(name));
+  for (int key : kKeys) EXPECT_FALSE(SegmentExists(name + "." + std::to_string(key)));
+}
+
+}  // namespace
+
+TEST(ShmReducer, SumsAcrossProcesses) {
+  const std::string name = UniqueName("reducer");
+  const uint64_t job = 2;
+  LeaveStaleSegment(name, 1);
+  const bool ok = RunWorkers([&name, job](int rank) {
+      ShmReducer reducer(name, job, rank, kWorkers, kShardSize);
+      std::vector<float> zeros(kSizes[0], 0.0f);
+      for (int k = 0; k < 2; ++k) reducer.InitKey(kKeys[k], kSizes[k], zeros.data());
+      int errors = 0;
+      for (int round = 0; round < kRounds; ++round) {
+        for (int key : kKeys) {
+          float *slot = reducer.Slot(key);
+          const size_t size = reducer.Size(key);
+          for (size_t i = 0; i < size; ++i) slot[i] = Pushed(rank, round, i);
+          reducer.Reduce(key, round);
+          if (rank == 0) {
+            std::memcpy(reducer.MutableStored(key), reducer.Merged(key), size * sizeof(float));
+            reducer.Publish(key, round);
+          }
+          reducer.Wait(key, round + 1);
+          const float *stored = reducer.Stored(key);
+          for (size_t i = 0; i < size; ++i) errors += stored[i] != Summed(round, i);
+        }
+      }
+      reducer.Barrier();
+      return errors == 0 ? 0 : 1;
+    });
+  EXPECT_TRUE(ok);
+  ExpectNoSegments(name);
+}
+
+TEST(KVStoreShm, PushPullWithUpdater) {
+  const std::string name = UniqueName("kvstore");
+  const std::string job = name;
+  LeaveStaleSegment(name, std::hash<std::string>()("stale"));
+  const bool ok = RunWorkers([&name, &job](int rank) {
+      setenv("DMLC_NUM_WORKER", std::to_string(kWorkers).c_str(), 1);
+      setenv("DMLC_WORKER_ID", std::to_string(rank).c_str(), 1);
+      setenv("MXNET_KVSTORE_SHM_NAME", name.c_str(), 1);
+      setenv("MXNET_KVSTORE_SHM_JOB", job.c_str(), 1);
+      setenv("MXNET_KVSTORE_SHM_SHARD_SIZE", std::to_string(kShardSize).c_str(), 1);
+      std::unique_ptr<mxnet::KVStore> kv(mxnet::kvstore::Create("shm"));
+      if (kv->type() != "shm" || kv->get_rank() != rank) return 1;
+
+      std::vector<int> keys(kKeys, kKeys + 2);
+      std::vector<mxnet::NDArray> pushed, pulled;
+      std::vector<mxnet::NDArray*> pulled_ptrs;
+      for (size_t size : kSizes) {
+        mxnet::TShape shape(1);
+        shape[0] = size;
+        pushed.emplace_back(shape, mxnet::Context::CPU());
+        pulled.emplace_back(shape, mxnet::Context::CPU());
+        pushed.back() = 1.0f;
+      }
+      for (mxnet::NDArray &out : pulled) pulled_ptrs.push_back(&out);
+      kv->Init(keys, pushed);
+      // only rank 0 applies it; stored values start at 1 and accumulate
+      kv->set_updater([](int, const mxnet::NDArray &merged, mxnet::NDArray *stored) {
+          *stored += merged;
+        });
+
+      int errors = 0;
+      for (int round = 0; round < kRounds; ++round) {
+        for (int k = 0; k < 2; ++k) {
+          std::vector<float> host(kSizes[k]);
+          for (size_t i = 0; i < host.size(); ++i) host[i] = Pushed(rank, round, i);
+          pushed[k].SyncCopyFromCPU(host.data(), host.size());
+        }
+        kv->Push(keys, pushed, 0);
+        kv->Pull(keys, pulled_ptrs, 0);
+        for (int k = 0; k < 2; ++k) {
+          std::vector<float> host(kSizes[k]);
+          pulled[k].SyncCopyToCPU(host.data(), host.size());
+          for (size_t i = 0; i < host.size(); ++i) {
+            float want = 1.0f;
+            for (int r = 0; r <= round; ++r) want += Summed(r, i);
+            errors += host[i] != want;
+          }
+        }
+      }
+      kv->Barrier();
+      kv.reset();
+      mxnet::Engine::Get()->WaitForAll();
+      return errors == 0 ? 0 : 1;
+    });
+  EXPECT_TRUE(ok);
+  ExpectNoSegments(name);
+}